@@ -53,6 +53,7 @@ size_t cmd_size = 4096;
 static const char* opt_pidfile;
 static const char* opt_socket;
 static bool opt_foreground;
+static bool opt_reconcile;
 static char buf[BUF_SIZE];
 static char *cmd;
 
@@ -116,12 +117,13 @@ int main(int argc, char *argv[]) {
 	{
 		{"socket",  required_argument, 0, 's'},
 		{"pidfile", required_argument, 0, 'p'},
+		{"reconcile", no_argument, 0, 'r'},
 		{0, 0, 0, 0}
 	};
 
 	while (1){
 		int option_index = 0;
-		int c = getopt_long (argc, argv, "s:p:f", long_options, &option_index);
+		int c = getopt_long (argc, argv, "s:p:fr", long_options, &option_index);
 
 		/* Detect the end of the options. */
 		if (c == -1)
@@ -141,6 +143,10 @@ int main(int argc, char *argv[]) {
 			opt_foreground = true;
 			break;
 
+		case 'r':
+			opt_reconcile = true;
+			break;
+
 		case '?':
 			/* getopt_long already printed an error message. */
 			return 1;
@@ -288,6 +294,8 @@ int main(int argc, char *argv[]) {
 		exit_wrapper(5);
 	}
 	daemon_log(LOG_INFO, "Lsctl commands registered");
+	if (opt_reconcile)
+		lsctl_reconcile_next_commit();
 
 	cmd = malloc(cmd_size);
 	if (!cmd) {
@@ -142,8 +142,110 @@ static int resolve_phys_arg(
 	return TCL_OK;
 }
 
-static int settings_common(Tcl_Interp *interp, struct lsdn_settings *settings, const char *name)
+/** Parse the `-qos` argument of `virt` and `settings`.
+ * @return Tcl status. */
+static int parse_qos_mode(Tcl_Interp *interp, const char *arg, enum lsdn_qos_mode *mode)
 {
+	if (strcmp(arg, "default") == 0)
+		*mode = LSDN_QOS_DEFAULT;
+	else if (strcmp(arg, "police") == 0)
+		*mode = LSDN_QOS_POLICE;
+	else if (strcmp(arg, "shape") == 0)
+		*mode = LSDN_QOS_SHAPE;
+	else
+		return tcl_error(interp, "qos mode must be one of: default, police, shape");
+	return TCL_OK;
+}
+
+/** Tunnel interface options of the tunnelling `settings`, as given on the command line. */
+struct tunnel_args {
+	const char *udp_csum;
+	const char *zero_csum6_tx;
+	const char *zero_csum6_rx;
+	const char *df;
+	int ttl;
+	int txqueuelen;
+	int gso_max_size;
+	int gro_max_size;
+};
+
+#define TUNNEL_ARGV(t) \
+	{TCL_ARGV_STRING, "-udpCsum", NULL, &(t).udp_csum}, \
+	{TCL_ARGV_STRING, "-zeroCsum6Tx", NULL, &(t).zero_csum6_tx}, \
+	{TCL_ARGV_STRING, "-zeroCsum6Rx", NULL, &(t).zero_csum6_rx}, \
+	{TCL_ARGV_STRING, "-df", NULL, &(t).df}, \
+	{TCL_ARGV_INT, "-ttl", NULL, &(t).ttl}, \
+	{TCL_ARGV_INT, "-txQueueLen", NULL, &(t).txqueuelen}, \
+	{TCL_ARGV_INT, "-gsoMaxSize", NULL, &(t).gso_max_size}, \
+	{TCL_ARGV_INT, "-groMaxSize", NULL, &(t).gro_max_size}
+
+static int parse_tunnel_flag(Tcl_Interp *interp, const char *arg, enum lsdn_tunnel_flag *flag)
+{
+	if (!arg)
+		*flag = LSDN_TUNNEL_FLAG_DEFAULT;
+	else if (strcmp(arg, "on") == 0)
+		*flag = LSDN_TUNNEL_FLAG_ON;
+	else if (strcmp(arg, "off") == 0)
+		*flag = LSDN_TUNNEL_FLAG_OFF;
+	else
+		return tcl_error(interp, "udpCsum, zeroCsum6Tx and zeroCsum6Rx must be one of: on, off");
+	return TCL_OK;
+}
+
+/** Parse the tunnel interface options of `settings`.
+ * @return Tcl status. */
+static int parse_tunnel_opts(
+	Tcl_Interp *interp, const struct tunnel_args *t, struct lsdn_tunnel_opts *opts)
+{
+	if (parse_tunnel_flag(interp, t->udp_csum, &opts->udp_csum) != TCL_OK)
+		return TCL_ERROR;
+	if (parse_tunnel_flag(interp, t->zero_csum6_tx, &opts->udp_zero_csum6_tx) != TCL_OK)
+		return TCL_ERROR;
+	if (parse_tunnel_flag(interp, t->zero_csum6_rx, &opts->udp_zero_csum6_rx) != TCL_OK)
+		return TCL_ERROR;
+
+	if (!t->df)
+		opts->df = LSDN_TUNNEL_DF_DEFAULT;
+	else if (strcmp(t->df, "set") == 0)
+		opts->df = LSDN_TUNNEL_DF_SET;
+	else if (strcmp(t->df, "unset") == 0)
+		opts->df = LSDN_TUNNEL_DF_UNSET;
+	else if (strcmp(t->df, "inherit") == 0)
+		opts->df = LSDN_TUNNEL_DF_INHERIT;
+	else
+		return tcl_error(interp, "df must be one of: set, unset, inherit");
+
+	if (t->ttl < 0 || t->ttl > 255)
+		return tcl_error(interp, "ttl must be in range 0-255");
+	if (t->txqueuelen < 0 || t->gso_max_size < 0 || t->gro_max_size < 0)
+		return tcl_error(interp, "txQueueLen, gsoMaxSize and groMaxSize must not be negative");
+	opts->ttl = t->ttl;
+	opts->txqueuelen = t->txqueuelen;
+	opts->gso_max_size = t->gso_max_size;
+	opts->gro_max_size = t->gro_max_size;
+	return TCL_OK;
+}
+
+static int settings_common(
+	Tcl_Interp *interp, struct lsdn_settings *settings, const char *name, const char *qos,
+	const struct tunnel_args *tunnel)
+{
+	enum lsdn_qos_mode qos_mode = LSDN_QOS_DEFAULT;
+	if (qos && parse_qos_mode(interp, qos, &qos_mode) != TCL_OK) {
+		lsdn_settings_free(settings);
+		return TCL_ERROR;
+	}
+	lsdn_settings_set_qos_mode(settings, qos_mode);
+
+	if (tunnel) {
+		struct lsdn_tunnel_opts tunnel_opts;
+		if (parse_tunnel_opts(interp, tunnel, &tunnel_opts) != TCL_OK) {
+			lsdn_settings_free(settings);
+			return TCL_ERROR;
+		}
+		lsdn_settings_set_tunnel_opts(settings, &tunnel_opts);
+	}
+
 	lsdn_err_t err = lsdn_settings_set_name(settings, name ? name : "default");
 	if (err != LSDNE_OK) {
 		if (err == LSDNE_DUPLICATE) {
@@ -159,10 +261,12 @@ static int settings_common(Tcl_Interp *interp, struct lsdn_settings *settings, c
 
 CMD(settings_direct)
 {
+	const char *qos = NULL;
 	const char *name = NULL;
 
 	const Tcl_ArgvInfo opts[] = {
 		{TCL_ARGV_STRING, "-name", NULL, &name},
+		{TCL_ARGV_STRING, "-qos", NULL, &qos},
 		{TCL_ARGV_END}
 	};
 	argc--; argv++;
@@ -171,15 +275,17 @@ CMD(settings_direct)
 		return TCL_ERROR;
 
 	struct lsdn_settings * settings = lsdn_settings_new_direct(ctx->lsctx);
-	return settings_common(interp, settings, name);
+	return settings_common(interp, settings, name, qos, NULL);
 }
 
 CMD(settings_vlan)
 {
+	const char *qos = NULL;
 	const char *name = NULL;
 
 	const Tcl_ArgvInfo opts[] = {
 		{TCL_ARGV_STRING, "-name", NULL, &name},
+		{TCL_ARGV_STRING, "-qos", NULL, &qos},
 		{TCL_ARGV_END}
 	};
 	argc--; argv++;
@@ -188,17 +294,21 @@ CMD(settings_vlan)
 		return TCL_ERROR;
 
 	struct lsdn_settings * settings = lsdn_settings_new_vlan(ctx->lsctx);
-	return settings_common(interp, settings, name);
+	return settings_common(interp, settings, name, qos, NULL);
 }
 
 CMD(settings_vxlan_e2e)
 {
+	const char *qos = NULL;
+	struct tunnel_args tunnel = {0};
 	const char *name = NULL;
 	int port = 4789;
 
 	const Tcl_ArgvInfo opts[] = {
 		{TCL_ARGV_INT, "-port", NULL, &port},
 		{TCL_ARGV_STRING, "-name", NULL, &name},
+		{TCL_ARGV_STRING, "-qos", NULL, &qos},
+		TUNNEL_ARGV(tunnel),
 		{TCL_ARGV_END}
 	};
 	argc--; argv++;
@@ -206,11 +316,13 @@ CMD(settings_vxlan_e2e)
 		return TCL_ERROR;
 
 	struct lsdn_settings * settings = lsdn_settings_new_vxlan_e2e(ctx->lsctx, port);
-	return settings_common(interp, settings, name);
+	return settings_common(interp, settings, name, qos, &tunnel);
 }
 
 CMD(settings_vxlan_mcast)
 {
+	const char *qos = NULL;
+	struct tunnel_args tunnel = {0};
 	const char* name = NULL;
 	const char* ip;
 	lsdn_ip_t ip_parsed;
@@ -220,6 +332,8 @@ CMD(settings_vxlan_mcast)
 		{TCL_ARGV_STRING, "-mcastIp", NULL, &ip},
 		{TCL_ARGV_STRING, "-name", NULL, &name},
 		{TCL_ARGV_INT, "-port", NULL, &port},
+		{TCL_ARGV_STRING, "-qos", NULL, &qos},
+		TUNNEL_ARGV(tunnel),
 		{TCL_ARGV_END}
 	};
 	argc--; argv++;
@@ -232,16 +346,20 @@ CMD(settings_vxlan_mcast)
 		return tcl_error(interp, "mcastIp is not a valid ip address");
 
 	struct lsdn_settings * settings = lsdn_settings_new_vxlan_mcast(ctx->lsctx, ip_parsed, port);
-	return settings_common(interp, settings, name);
+	return settings_common(interp, settings, name, qos, &tunnel);
 }
 
 CMD(settings_vxlan_static)
 {
+	const char *qos = NULL;
+	struct tunnel_args tunnel = {0};
 	int port = 4789;
 	const char *name = NULL;
 	const Tcl_ArgvInfo opts[] = {
 		{TCL_ARGV_INT, "-port", NULL, &port},
 		{TCL_ARGV_STRING, "-name", NULL, &name},
+		{TCL_ARGV_STRING, "-qos", NULL, &qos},
+		TUNNEL_ARGV(tunnel),
 		{TCL_ARGV_END}
 	};
 	argc--; argv++;
@@ -250,16 +368,20 @@ CMD(settings_vxlan_static)
 		return TCL_ERROR;
 
 	struct lsdn_settings * settings = lsdn_settings_new_vxlan_static(ctx->lsctx, port);
-	return settings_common(interp, settings, name);
+	return settings_common(interp, settings, name, qos, &tunnel);
 }
 
 CMD(settings_geneve)
 {
+	const char *qos = NULL;
+	struct tunnel_args tunnel = {0};
 	int port = 6081;
 	const char *name = NULL;
 	const Tcl_ArgvInfo opts[] = {
 		{TCL_ARGV_INT, "-port", NULL, &port},
 		{TCL_ARGV_STRING, "-name", NULL, &name},
+		{TCL_ARGV_STRING, "-qos", NULL, &qos},
+		TUNNEL_ARGV(tunnel),
 		{TCL_ARGV_END}
 	};
 	argc--; argv++;
@@ -268,16 +390,20 @@ CMD(settings_geneve)
 		return TCL_ERROR;
 
 	struct lsdn_settings * settings = lsdn_settings_new_geneve(ctx->lsctx, port);
-	return settings_common(interp, settings, name);
+	return settings_common(interp, settings, name, qos, &tunnel);
 }
 
 CMD(settings_geneve_e2e)
 {
+	const char *qos = NULL;
+	struct tunnel_args tunnel = {0};
 	int port = 6081;
 	const char *name = NULL;
 	const Tcl_ArgvInfo opts[] = {
 		{TCL_ARGV_INT, "-port", NULL, &port},
 		{TCL_ARGV_STRING, "-name", NULL, &name},
+		{TCL_ARGV_STRING, "-qos", NULL, &qos},
+		TUNNEL_ARGV(tunnel),
 		{TCL_ARGV_END}
 	};
 	argc--; argv++;
@@ -286,7 +412,7 @@ CMD(settings_geneve_e2e)
 		return TCL_ERROR;
 
 	struct lsdn_settings * settings = lsdn_settings_new_geneve_e2e(ctx->lsctx, port);
-	return settings_common(interp, settings, name);
+	return settings_common(interp, settings, name, qos, &tunnel);
 }
 
 CMD(settings)
@@ -426,25 +552,33 @@ CMD(virt)
 
 	const char *mac = NULL;
 	lsdn_mac_t mac_parsed;
+	const char *ip = NULL;
+	lsdn_ip_t ip_parsed;
 	const char *net = NULL;
 	struct lsdn_net *net_parsed = NULL;
 	const char *phys = NULL;
 	struct lsdn_phys *phys_parsed = NULL;
 	const char *iface = NULL;
 	const char *name = NULL;
+	const char *qos = NULL;
+	enum lsdn_qos_mode qos_mode = LSDN_QOS_DEFAULT;
 	int virt_remove = 0;
 	int mac_clear = 0;
+	int ip_clear = 0;
 	struct lsdn_virt *virt = NULL;
 	Tcl_Obj **pos_args = NULL;
 
 	const Tcl_ArgvInfo opts[] = {
 		{TCL_ARGV_STRING, "-mac", NULL, &mac},
+		{TCL_ARGV_STRING, "-ip", NULL, &ip},
 		{TCL_ARGV_STRING, "-phys", NULL, &phys},
 		{TCL_ARGV_STRING, "-net", NULL, &net},
 		{TCL_ARGV_STRING, "-if", NULL, &iface},
 		{TCL_ARGV_STRING, "-name", NULL, &name},
+		{TCL_ARGV_STRING, "-qos", NULL, &qos},
 		{TCL_ARGV_CONSTANT, "-remove", (void *) 1, &virt_remove},
 		{TCL_ARGV_CONSTANT, "-macClear", (void *) 1, &mac_clear},
+		{TCL_ARGV_CONSTANT, "-ipClear", (void *) 1, &ip_clear},
 		{TCL_ARGV_END}
 	};
 
@@ -467,6 +601,16 @@ CMD(virt)
 		return tcl_error(interp, "can not clear and set MAC address at the same time");
 	}
 
+	if (ip && ip_clear) {
+		ckfree(pos_args);
+		return tcl_error(interp, "can not clear and set IP address at the same time");
+	}
+
+	if (qos && parse_qos_mode(interp, qos, &qos_mode) != TCL_OK) {
+		ckfree(pos_args);
+		return TCL_ERROR;
+	}
+
 	virt = lsdn_virt_by_name(net_parsed, name);
 	if (virt_remove) {
 		if (!virt) {
@@ -499,6 +643,13 @@ CMD(virt)
 		}
 	}
 
+	if (ip) {
+		if(lsdn_parse_ip(&ip_parsed, ip) != LSDNE_OK) {
+			ckfree(pos_args);
+			return tcl_error(interp, "ip address is in invalid format");
+		}
+	}
+
 	if(!net_parsed) {
 		ckfree(pos_args);
 		return tcl_error(interp, "virt must either have -net argument or be in net scope");
@@ -510,6 +661,12 @@ CMD(virt)
 		lsdn_virt_set_mac(virt, mac_parsed);
 	else if (mac_clear)
 		lsdn_virt_clear_mac(virt);
+	if(ip)
+		lsdn_virt_set_ip(virt, ip_parsed);
+	else if (ip_clear)
+		lsdn_virt_clear_ip(virt);
+	if (qos)
+		lsdn_virt_set_qos_mode(virt, qos_mode);
 	if(phys_parsed)
 		lsdn_virt_connect(virt, phys_parsed, iface);
 
@@ -785,8 +942,9 @@ static int parse_units(Tcl_Interp *interp, const char *value, float *out, const
 
 CMD(rate)
 {
-	/* example rate in -avg 0.5mbit -burst 1mb -burstRate 10mb */
-	if (check_scope(interp, ctx, S_VIRT) != TCL_OK)
+	/* example rate in -avg 0.5mbit -burst 1mb -burstRate 10mb
+	 * Inside a net or phys, the rate limits all of its virts together. */
+	if (check_scope(interp, ctx, S_VIRT | S_NET | S_PHYS) != TCL_OK)
 		return TCL_ERROR;
 
 	const char* direction_names[] = {"in", "out"};
@@ -844,16 +1002,46 @@ CMD(rate)
 	}
 
 	bool no_args = !avg && !burst_size && !burst_rate;
-	if (direction == LSDN_IN) {
-		if (no_args)
-			lsdn_virt_clear_rate_in(ctx->virt);
-		else
-			lsdn_virt_set_rate_in(ctx->virt, rate);
-	} else {
-		if (no_args)
-			lsdn_virt_clear_rate_out(ctx->virt);
-		else
-			lsdn_virt_set_rate_out(ctx->virt, rate);
+	switch (get_scope(ctx)) {
+	case S_NET:
+		if (direction == LSDN_IN) {
+			if (no_args)
+				lsdn_net_clear_rate_in(ctx->net);
+			else
+				lsdn_net_set_rate_in(ctx->net, rate);
+		} else {
+			if (no_args)
+				lsdn_net_clear_rate_out(ctx->net);
+			else
+				lsdn_net_set_rate_out(ctx->net, rate);
+		}
+		break;
+	case S_PHYS:
+		if (direction == LSDN_IN) {
+			if (no_args)
+				lsdn_phys_clear_rate_in(ctx->phys);
+			else
+				lsdn_phys_set_rate_in(ctx->phys, rate);
+		} else {
+			if (no_args)
+				lsdn_phys_clear_rate_out(ctx->phys);
+			else
+				lsdn_phys_set_rate_out(ctx->phys, rate);
+		}
+		break;
+	default:
+		if (direction == LSDN_IN) {
+			if (no_args)
+				lsdn_virt_clear_rate_in(ctx->virt);
+			else
+				lsdn_virt_set_rate_in(ctx->virt, rate);
+		} else {
+			if (no_args)
+				lsdn_virt_clear_rate_out(ctx->virt);
+			else
+				lsdn_virt_set_rate_out(ctx->virt, rate);
+		}
+		break;
 	}
 
 	return TCL_OK;
@@ -965,6 +1153,22 @@ CMD(commit)
 	if(check_scope(interp, ctx, S_ROOT))
 		return TCL_ERROR;
 
+	int reconcile = 0;
+	Tcl_Obj **pos_args;
+	const Tcl_ArgvInfo opts[] = {
+		{TCL_ARGV_CONSTANT, "-reconcile", (void *) 1, &reconcile},
+		{TCL_ARGV_END}
+	};
+	if(Tcl_ParseArgsObjv(interp, opts, &argc, argv, &pos_args) != TCL_OK)
+		return TCL_ERROR;
+	ckfree(pos_args);
+	if (argc != 1) {
+		Tcl_WrongNumArgs(interp, 1, argv, "");
+		return TCL_ERROR;
+	}
+
+	if (reconcile)
+		lsdn_context_set_reconcile(ctx->lsctx, true);
 	if(lsdn_commit(ctx->lsctx, lsdn_problem_stderr_handler, NULL) != LSDNE_OK)
 		return tcl_error(interp, "commit error");
 	return TCL_OK;
@@ -1139,20 +1343,79 @@ static int attach_or_detach(
 }
 
 enum dump_format {DF_JSON, DF_TCL};
+
+static void show_stats(struct lsdn_context *lsctx, enum dump_format format)
+{
+	const struct lsdn_commit_stats *s = lsdn_context_get_commit_stats(lsctx);
+	const struct {
+		const char *name;
+		unsigned long long value;
+	} fields[] = {
+		{"validate_us", s->validate_us},
+		{"decommit_us", s->decommit_us},
+		{"commit_us", s->commit_us},
+		{"ack_us", s->ack_us},
+		{"nl_link_msgs", s->nl.link_msgs},
+		{"nl_qdisc_msgs", s->nl.qdisc_msgs},
+		{"nl_filter_msgs", s->nl.filter_msgs},
+		{"nl_fdb_msgs", s->nl.fdb_msgs},
+		{"nl_action_msgs", s->nl.action_msgs},
+		{"nl_other_msgs", s->nl.other_msgs},
+		{"nl_bpf_calls", s->nl.bpf_calls},
+		{"nl_bytes", s->nl.bytes},
+		{"nl_errors", s->nl.errors},
+		{"create_pa", s->ops.create_pa},
+		{"destroy_pa", s->ops.destroy_pa},
+		{"add_virt", s->ops.add_virt},
+		{"remove_virt", s->ops.remove_virt},
+		{"add_remote_pa", s->ops.add_remote_pa},
+		{"remove_remote_pa", s->ops.remove_remote_pa},
+		{"add_remote_virt", s->ops.add_remote_virt},
+		{"remove_remote_virt", s->ops.remove_remote_virt},
+		{"validate_pa", s->ops.validate_pa},
+		{"validate_virt", s->ops.validate_virt}
+	};
+	size_t count = sizeof(fields) / sizeof(fields[0]);
+
+	if (format == DF_JSON)
+		putchar('{');
+	for (size_t i = 0; i < count; i++) {
+		if (format == DF_JSON)
+			printf("%s\"%s\": %llu", i ? ", " : "", fields[i].name, fields[i].value);
+		else
+			printf("%s %llu\n", fields[i].name, fields[i].value);
+	}
+	if (format == DF_JSON)
+		puts("}");
+}
+
 CMD(show)
 {
 	if(check_scope(interp, ctx, S_ROOT) != TCL_OK)
 		return TCL_ERROR;
 
 	enum dump_format format = DF_TCL;
+	Tcl_Obj **pos_args;
 	const Tcl_ArgvInfo opts[] = {
 		{TCL_ARGV_CONSTANT, "-json", (void*) DF_JSON, &format},
 		{TCL_ARGV_CONSTANT, "-tcl", (void*) DF_TCL, &format},
 		{TCL_ARGV_END}
 	};
-	if(Tcl_ParseArgsObjv(interp, opts, &argc, argv, NULL) != TCL_OK)
+	if(Tcl_ParseArgsObjv(interp, opts, &argc, argv, &pos_args) != TCL_OK)
 		return TCL_ERROR;
 
+	if (argc == 2 && strcmp(Tcl_GetString(pos_args[1]), "stats") == 0) {
+		ckfree(pos_args);
+		show_stats(ctx->lsctx, format);
+		return TCL_OK;
+	}
+	if (argc != 1) {
+		Tcl_WrongNumArgs(interp, 1, argv, "?stats?");
+		ckfree(pos_args);
+		return TCL_ERROR;
+	}
+	ckfree(pos_args);
+
 	char * dump = NULL;
 	if (format == DF_TCL)
 		dump = lsdn_dump_context_tcl(ctx->lsctx);
@@ -1166,6 +1429,81 @@ CMD(show)
 	return TCL_OK;
 }
 
+static void show_plan(const struct lsdn_plan *plan, enum dump_format format)
+{
+	const struct {
+		const char *name;
+		unsigned long long value;
+	} counts[] = {
+		{"link_msgs", plan->stats.link_msgs},
+		{"qdisc_msgs", plan->stats.qdisc_msgs},
+		{"filter_msgs", plan->stats.filter_msgs},
+		{"fdb_msgs", plan->stats.fdb_msgs},
+		{"action_msgs", plan->stats.action_msgs},
+		{"other_msgs", plan->stats.other_msgs},
+		{"bpf_calls", plan->stats.bpf_calls},
+		{"bytes", plan->stats.bytes},
+		{"problems", plan->problem_count}
+	};
+	size_t count = sizeof(counts) / sizeof(counts[0]);
+
+	if (format == DF_JSON)
+		printf("{\"ops\": [");
+	for (size_t i = 0; i < plan->count; i++) {
+		const struct lsdn_plan_op *op = &plan->ops[i];
+		const char *type = lsdn_plan_op_type_name(op->type);
+		if (format == DF_JSON)
+			printf("%s{\"type\": \"%s\", \"ifindex\": %u, \"parent\": %u, \"chain\": %u, "
+				"\"prio\": %u, \"handle\": %u, \"summary\": \"%s\"}",
+				i ? ", " : "", type, op->ifindex, op->parent, op->chain,
+				op->prio, op->handle, op->summary);
+		else
+			printf("%s ifindex %u parent %x chain %u prio %u handle %x {%s}\n",
+				type, op->ifindex, op->parent, op->chain, op->prio, op->handle, op->summary);
+	}
+	if (format == DF_JSON)
+		printf("], \"counts\": {");
+	for (size_t i = 0; i < count; i++) {
+		if (format == DF_JSON)
+			printf("%s\"%s\": %llu", i ? ", " : "", counts[i].name, counts[i].value);
+		else
+			printf("%s %llu\n", counts[i].name, counts[i].value);
+	}
+	if (format == DF_JSON)
+		puts("}}");
+}
+
+CMD(plan)
+{
+	if(check_scope(interp, ctx, S_ROOT) != TCL_OK)
+		return TCL_ERROR;
+
+	enum dump_format format = DF_TCL;
+	Tcl_Obj **pos_args;
+	const Tcl_ArgvInfo opts[] = {
+		{TCL_ARGV_CONSTANT, "-json", (void*) DF_JSON, &format},
+		{TCL_ARGV_CONSTANT, "-tcl", (void*) DF_TCL, &format},
+		{TCL_ARGV_END}
+	};
+	if(Tcl_ParseArgsObjv(interp, opts, &argc, argv, &pos_args) != TCL_OK)
+		return TCL_ERROR;
+	ckfree(pos_args);
+	if (argc != 1) {
+		Tcl_WrongNumArgs(interp, 1, argv, "");
+		return TCL_ERROR;
+	}
+
+	struct lsdn_plan *plan;
+	if (lsdn_commit_plan(ctx->lsctx, lsdn_problem_stderr_handler, NULL, &plan) != LSDNE_OK)
+		return tcl_error(interp, "plan error");
+	show_plan(plan, format);
+	lsdn_err_t result = plan->result;
+	lsdn_plan_free(plan);
+	if (result != LSDNE_OK)
+		return tcl_error(interp, "the planned commit would fail");
+	return TCL_OK;
+}
+
 CMD(attach)
 {
 	return attach_or_detach(interp, ctx, argc, argv, lsdn_phys_attach);
@@ -1186,6 +1524,11 @@ static struct tcl_ctx default_ctx;
 
 #define REGISTER(name) Tcl_CreateObjCommand(interp, "lsdn::" #name, (Tcl_ObjCmdProc*) tcl_##name, ctx, NULL)
 
+void lsctl_reconcile_next_commit(void)
+{
+	lsdn_context_set_reconcile(default_ctx.lsctx, true);
+}
+
 int Lsctl_Init(Tcl_Interp *interp)
 {
 	return register_lsdn_tcl(interp);
@@ -1227,6 +1570,7 @@ int register_lsdn_tcl(Tcl_Interp *interp)
 	REGISTER(rule);
 	REGISTER(rate);
 	REGISTER(show);
+	REGISTER(plan);
 
 	if (Tcl_Export(interp, ns, "*", 0) == TCL_ERROR) {
 		return TCL_ERROR;
@@ -6,3 +6,6 @@
 #include <tcl.h>
 
 int register_lsdn_tcl(Tcl_Interp *interp);
+/** Adopt the kernel state left by a previous instance in the next commit.
+ * @see lsdn_context_set_reconcile */
+void lsctl_reconcile_next_commit(void);
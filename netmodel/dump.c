@@ -10,6 +10,75 @@
 #include "include/nettypes.h"
 
 
+/** Names of #lsdn_qos_mode, as used by the `-qos` argument in lsctl. */
+static const char *qos_mode_names[] = {
+	[LSDN_QOS_DEFAULT] = "default",
+	[LSDN_QOS_POLICE] = "police",
+	[LSDN_QOS_SHAPE] = "shape"
+};
+
+/** Names of #lsdn_tunnel_flag and #lsdn_tunnel_df, as used by the tunnel options in lsctl. */
+static const char *tunnel_flag_names[] = {
+	[LSDN_TUNNEL_FLAG_ON] = "on",
+	[LSDN_TUNNEL_FLAG_OFF] = "off"
+};
+
+static const char *tunnel_df_names[] = {
+	[LSDN_TUNNEL_DF_SET] = "set",
+	[LSDN_TUNNEL_DF_UNSET] = "unset",
+	[LSDN_TUNNEL_DF_INHERIT] = "inherit"
+};
+
+/** JSON keys of the tunnel options, the same as the names of lsctl arguments. */
+static const char *tunnel_opts_keys[] = {
+	"udpCsum", "zeroCsum6Tx", "zeroCsum6Rx", "df", "ttl", "txQueueLen", "gsoMaxSize",
+	"groMaxSize"
+};
+
+static int jsonify_tunnel_string(struct json_object *jobj, const char *key, const char *str)
+{
+	struct json_object *jstr = json_object_new_string(str);
+	if (!jstr)
+		return 1;
+	json_object_object_add(jobj, key, jstr);
+	return 0;
+}
+
+static int jsonify_tunnel_int(struct json_object *jobj, const char *key, int64_t val)
+{
+	struct json_object *jint = json_object_new_int64(val);
+	if (!jint)
+		return 1;
+	json_object_object_add(jobj, key, jint);
+	return 0;
+}
+
+/** Add the non-default tunnel options to the settings object. */
+static int jsonify_tunnel_opts(struct json_object *jobj, const struct lsdn_tunnel_opts *o)
+{
+	if (o->udp_csum != LSDN_TUNNEL_FLAG_DEFAULT
+	    && jsonify_tunnel_string(jobj, "udpCsum", tunnel_flag_names[o->udp_csum]))
+		return 1;
+	if (o->udp_zero_csum6_tx != LSDN_TUNNEL_FLAG_DEFAULT
+	    && jsonify_tunnel_string(jobj, "zeroCsum6Tx", tunnel_flag_names[o->udp_zero_csum6_tx]))
+		return 1;
+	if (o->udp_zero_csum6_rx != LSDN_TUNNEL_FLAG_DEFAULT
+	    && jsonify_tunnel_string(jobj, "zeroCsum6Rx", tunnel_flag_names[o->udp_zero_csum6_rx]))
+		return 1;
+	if (o->df != LSDN_TUNNEL_DF_DEFAULT
+	    && jsonify_tunnel_string(jobj, "df", tunnel_df_names[o->df]))
+		return 1;
+	if (o->ttl && jsonify_tunnel_int(jobj, "ttl", o->ttl))
+		return 1;
+	if (o->txqueuelen && jsonify_tunnel_int(jobj, "txQueueLen", o->txqueuelen))
+		return 1;
+	if (o->gso_max_size && jsonify_tunnel_int(jobj, "gsoMaxSize", o->gso_max_size))
+		return 1;
+	if (o->gro_max_size && jsonify_tunnel_int(jobj, "groMaxSize", o->gro_max_size))
+		return 1;
+	return 0;
+}
+
 static struct json_object *jsonify_lsdn_settings(struct lsdn_settings *s)
 {
 	char ip[LSDN_IP_STRING_LEN + 1];
@@ -39,12 +108,40 @@ static struct json_object *jsonify_lsdn_settings(struct lsdn_settings *s)
 			goto err;
 		json_object_object_add(jobj_settings, "ip", jobj_ip);
 	}
+	if (s->qos_mode != LSDN_QOS_POLICE) {
+		if ((jstr = json_object_new_string(qos_mode_names[s->qos_mode])) == NULL)
+			goto err;
+		json_object_object_add(jobj_settings, "qosMode", jstr);
+	}
+	if (jsonify_tunnel_opts(jobj_settings, &s->tunnel_opts))
+		goto err;
 	return jobj_settings;
 err:
 	json_object_put(jobj_settings);
 	return NULL;
 }
 
+static struct json_object *jsonify_lsdn_qos_rate(lsdn_qos_rate_t *qos)
+{
+	struct json_object *jint, *jdouble;
+	struct json_object *jqos = json_object_new_object();
+	if (!jqos)
+		goto err;
+	if ((jdouble = json_object_new_double(qos->avg_rate)) == NULL)
+		goto err;
+	json_object_object_add(jqos, "avgRate", jdouble);
+	if ((jint = json_object_new_int64(qos->burst_size)) == NULL)
+		goto err;
+	json_object_object_add(jqos, "burstSize", jint);
+	if ((jdouble = json_object_new_double(qos->burst_rate)) == NULL)
+		goto err;
+	json_object_object_add(jqos, "burstRate", jdouble);
+	return jqos;
+err:
+	json_object_put(jqos);
+	return NULL;
+}
+
 static struct json_object *jsonify_lsdn_phys(struct lsdn_phys *p)
 {
 	char ip[LSDN_IP_STRING_LEN + 1];
@@ -69,6 +166,18 @@ static struct json_object *jsonify_lsdn_phys(struct lsdn_phys *p)
 			goto err;
 		json_object_object_add(jobj_phys, "iface", jstr);
 	}
+	if (p->attr_rate_in) {
+		struct json_object *jphys_qos_in = jsonify_lsdn_qos_rate(p->attr_rate_in);
+		if (!jphys_qos_in)
+			goto err;
+		json_object_object_add(jobj_phys, "qosIn", jphys_qos_in);
+	}
+	if (p->attr_rate_out) {
+		struct json_object *jphys_qos_out = jsonify_lsdn_qos_rate(p->attr_rate_out);
+		if (!jphys_qos_out)
+			goto err;
+		json_object_object_add(jobj_phys, "qosOut", jphys_qos_out);
+	}
 	struct json_object *jbool = json_object_new_boolean(p->is_local);
 	if (!jbool)
 		goto err;
@@ -194,30 +303,10 @@ err:
 	return NULL;
 }
 
-static struct json_object *jsonify_lsdn_qos_rate(lsdn_qos_rate_t *qos)
-{
-	struct json_object *jint, *jdouble;
-	struct json_object *jqos = json_object_new_object();
-	if (!jqos)
-		goto err;
-	if ((jdouble = json_object_new_double(qos->avg_rate)) == NULL)
-		goto err;
-	json_object_object_add(jqos, "avgRate", jdouble);
-	if ((jint = json_object_new_int64(qos->burst_size)) == NULL)
-		goto err;
-	json_object_object_add(jqos, "burstSize", jint);
-	if ((jdouble = json_object_new_double(qos->burst_rate)) == NULL)
-		goto err;
-	json_object_object_add(jqos, "burstRate", jdouble);
-	return jqos;
-err:
-	json_object_put(jqos);
-	return NULL;
-}
-
 static struct json_object *jsonify_lsdn_virt(struct lsdn_virt *virt)
 {
 	char mac[LSDN_MAC_STRING_LEN + 1];
+	char ip[LSDN_IP_STRING_LEN + 1];
 	struct json_object *jobj_virt = json_object_new_object();
 	if (!jobj_virt)
 		goto err;
@@ -234,6 +323,12 @@ static struct json_object *jsonify_lsdn_virt(struct lsdn_virt *virt)
 			goto err;
 		json_object_object_add(jobj_virt, "attrMac", jstr);
 	}
+	if (virt->attr_ip) {
+		lsdn_ip_to_string(virt->attr_ip, ip);
+		if ((jstr = json_object_new_string(ip)) == NULL)
+			goto err;
+		json_object_object_add(jobj_virt, "attrIp", jstr);
+	}
 	if (virt->connected_through) {
 		if ((jstr = json_object_new_string(virt->connected_through->phys->name.str)) == NULL)
 			goto err;
@@ -244,6 +339,11 @@ static struct json_object *jsonify_lsdn_virt(struct lsdn_virt *virt)
 			goto err;
 		json_object_object_add(jobj_virt, "iface", jstr);
 	}
+	if (virt->attr_qos_mode != LSDN_QOS_DEFAULT) {
+		if ((jstr = json_object_new_string(qos_mode_names[virt->attr_qos_mode])) == NULL)
+			goto err;
+		json_object_object_add(jobj_virt, "qosMode", jstr);
+	}
 
 	struct json_object *jvirt_rules_arr = jsonify_lsdn_virt_rules(virt);
 	if (!jvirt_rules_arr)
@@ -289,6 +389,18 @@ static struct json_object *jsonify_lsdn_net(struct lsdn_net *net)
 	if (!jint)
 		goto err;
 	json_object_object_add(jobj_net, "vnetId", jint);
+	if (net->attr_rate_in) {
+		struct json_object *jnet_qos_in = jsonify_lsdn_qos_rate(net->attr_rate_in);
+		if (!jnet_qos_in)
+			goto err;
+		json_object_object_add(jobj_net, "qosIn", jnet_qos_in);
+	}
+	if (net->attr_rate_out) {
+		struct json_object *jnet_qos_out = jsonify_lsdn_qos_rate(net->attr_rate_out);
+		if (!jnet_qos_out)
+			goto err;
+		json_object_object_add(jobj_net, "qosOut", jnet_qos_out);
+	}
 
 	struct json_object *jarr_phys_list = json_object_new_array();
 	if (!jarr_phys_list)
@@ -516,6 +628,15 @@ static int parse_json_lsdn_settings(struct json_object *jobj, struct dump_ctx *d
 		if (json_object_object_get_ex(jsettings, "ip", &val)) {
 			dump_ctx_append(dctx, "-mcastIp", json_object_get_string(val), NULL);
 		}
+		if (json_object_object_get_ex(jsettings, "qosMode", &val)) {
+			dump_ctx_append(dctx, "-qos", json_object_get_string(val), NULL);
+		}
+		for (size_t i = 0; i < sizeof(tunnel_opts_keys) / sizeof(*tunnel_opts_keys); i++) {
+			if (json_object_object_get_ex(jsettings, tunnel_opts_keys[i], &val)) {
+				dump_ctx_append_str(dctx, "-");
+				dump_ctx_append(dctx, tunnel_opts_keys[i], json_object_get_string(val), NULL);
+			}
+		}
 		dump_ctx_end_line(dctx);
 	}
 	return 0;
@@ -675,6 +796,13 @@ static int parse_json_lsdn_nets(struct json_object *jobj, struct dump_ctx *dctx)
 			}
 		}
 
+		if (json_object_object_get_ex(jnet, "qosIn", &val))
+			if (convert_qos(val, true, dctx))
+				return 1;
+		if (json_object_object_get_ex(jnet, "qosOut", &val))
+			if (convert_qos(val, false, dctx))
+				return 1;
+
 		struct json_object *virt_list;
 		if (json_object_object_get_ex(jnet, "virts", &virt_list)) {
 			assert(json_object_is_type(virt_list, json_type_array));
@@ -695,6 +823,10 @@ static int parse_json_lsdn_nets(struct json_object *jobj, struct dump_ctx *dctx)
 						dump_ctx_append(dctx, "-if", json_object_get_string(pval), NULL);
 					} else if (!strcmp(pkey, "attrMac")) {
 						dump_ctx_append(dctx, "-mac", json_object_get_string(pval), NULL);
+					} else if (!strcmp(pkey, "attrIp")) {
+						dump_ctx_append(dctx, "-ip", json_object_get_string(pval), NULL);
+					} else if (!strcmp(pkey, "qosMode")) {
+						dump_ctx_append(dctx, "-qos", json_object_get_string(pval), NULL);
 					} else if (!strcmp(pkey, "qosIn")) {
 						qos_in = pval;
 					} else if (!strcmp(pkey, "qosOut")) {
@@ -748,6 +880,24 @@ static int parse_json_lsdn_physes(struct json_object *jobj, struct dump_ctx *dct
 			dump_ctx_append(dctx, "-ip", json_object_get_string(val), NULL);
 		if (json_object_object_get_ex(jphys, "iface", &val))
 			dump_ctx_append(dctx, "-if", json_object_get_string(val), NULL);
+		struct json_object *qos_in = NULL;
+		struct json_object *qos_out = NULL;
+		json_object_object_get_ex(jphys, "qosIn", &qos_in);
+		json_object_object_get_ex(jphys, "qosOut", &qos_out);
+		if (qos_in || qos_out) {
+			dump_ctx_append(dctx, "{", NULL);
+			dump_ctx_end_line(dctx);
+			dump_ctx_inc_indent(dctx);
+			if (qos_in)
+				if (convert_qos(qos_in, true, dctx))
+					return 1;
+			if (qos_out)
+				if (convert_qos(qos_out, false, dctx))
+					return 1;
+			dump_ctx_dec_indent(dctx);
+			dump_ctx_start_line(dctx);
+			dump_ctx_append(dctx, "}", NULL);
+		}
 		dump_ctx_end_line(dctx);
 		if (json_object_object_get_ex(jphys, "isLocal", &val) && name) {
 			if (json_object_get_boolean(val)) {
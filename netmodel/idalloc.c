@@ -1,28 +1,145 @@
 /** \file
  * ID allocation routines. */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include "private/idalloc.h"
 
+/** Number of words needed for `bits` bits. */
+static uint64_t words_for(uint64_t bits)
+{
+	return (bits + 63) / 64;
+}
+
+static bool test_bit(struct lsdn_idalloc *idalloc, uint64_t i)
+{
+	return idalloc->levels[0][i / 64] & (1ULL << (i % 64));
+}
+
+/** Mark ID (relative to `min`) as free, on all levels of the bitmap. */
+static void set_bit(struct lsdn_idalloc *idalloc, uint64_t i)
+{
+	for (unsigned int l = 0; l < idalloc->depth; l++) {
+		uint64_t *word = &idalloc->levels[l][i / 64];
+		bool was_empty = *word == 0;
+		*word |= 1ULL << (i % 64);
+		if (!was_empty)
+			break;
+		i /= 64;
+	}
+}
+
+/** Mark ID (relative to `min`) as used, on all levels of the bitmap. */
+static void clear_bit(struct lsdn_idalloc *idalloc, uint64_t i)
+{
+	for (unsigned int l = 0; l < idalloc->depth; l++) {
+		uint64_t *word = &idalloc->levels[l][i / 64];
+		*word &= ~(1ULL << (i % 64));
+		if (*word != 0)
+			break;
+		i /= 64;
+	}
+}
+
+/** Double the capacity of the bitmap.
+ * The upper levels are rebuilt from level 0, which is amortized by the allocations needed
+ * to fill the capacity. */
+static bool grow(struct lsdn_idalloc *idalloc)
+{
+	uint64_t capacity = idalloc->capacity ? idalloc->capacity * 2 : 64;
+	uint64_t *levels[LSDN_IDALLOC_LEVELS] = { NULL };
+	unsigned int depth = 0;
+	uint64_t bits = capacity;
+	do {
+		assert(depth < LSDN_IDALLOC_LEVELS);
+		levels[depth] = calloc(words_for(bits), sizeof(uint64_t));
+		if (!levels[depth]) {
+			for (unsigned int l = 0; l < depth; l++)
+				free(levels[l]);
+			return false;
+		}
+		depth++;
+		bits = words_for(bits);
+	} while (bits > 1);
+
+	if (idalloc->capacity)
+		memcpy(levels[0], idalloc->levels[0], words_for(idalloc->capacity) * sizeof(uint64_t));
+	bits = capacity;
+	for (unsigned int l = 1; l < depth; l++) {
+		uint64_t lower_words = words_for(bits);
+		for (uint64_t w = 0; w < lower_words; w++) {
+			if (levels[l - 1][w])
+				levels[l][w / 64] |= 1ULL << (w % 64);
+		}
+		bits = lower_words;
+	}
+
+	lsdn_idalloc_free(idalloc);
+	memcpy(idalloc->levels, levels, sizeof(levels));
+	idalloc->depth = depth;
+	idalloc->capacity = capacity;
+	return true;
+}
+
 /** Set up an ID allocator. */
 void lsdn_idalloc_init(struct lsdn_idalloc *idalloc, uint32_t min, uint32_t max)
 {
 	idalloc->min = min;
 	idalloc->max = max;
 	idalloc->next = min;
+	idalloc->capacity = 0;
+	idalloc->depth = 0;
+	for (unsigned int l = 0; l < LSDN_IDALLOC_LEVELS; l++)
+		idalloc->levels[l] = NULL;
 }
 
-/** Allocate a new ID. */
+/** Allocate a new ID.
+ * The lowest free ID is returned.
+ * @return `false` if all IDs are used or the allocation of the bitmap failed. */
 bool lsdn_idalloc_get(struct lsdn_idalloc *idalloc, uint32_t *result) {
+	if (idalloc->depth && idalloc->levels[idalloc->depth - 1][0]) {
+		/* Walk down the bitmap to the lowest returned ID */
+		uint64_t i = 0;
+		for (unsigned int l = idalloc->depth; l-- > 0;)
+			i = i * 64 + __builtin_ctzll(idalloc->levels[l][i]);
+		clear_bit(idalloc, i);
+		*result = idalloc->min + i;
+		return true;
+	}
+
 	if (idalloc->max ==  idalloc->next)
 		return false;
+	if (idalloc->next - idalloc->min >= idalloc->capacity && !grow(idalloc))
+		return false;
 	*result = idalloc->next++;
 	return true;
 }
 
+/** Return an ID to the allocator, so that it can be allocated again. */
 void lsdn_idalloc_return(struct lsdn_idalloc *idalloc, uint32_t id) {
-	// TODO
+	assert(id >= idalloc->min && id < idalloc->next);
+	uint64_t i = id - idalloc->min;
+	assert(!test_bit(idalloc, i));
+
+	if (id + 1 != idalloc->next) {
+		set_bit(idalloc, i);
+		return;
+	}
+	/* Returning the highest ID, shrink the allocated range instead, including the free IDs
+	 * right below it. */
+	idalloc->next--;
+	while (idalloc->next > idalloc->min && test_bit(idalloc, idalloc->next - 1 - idalloc->min)) {
+		clear_bit(idalloc, idalloc->next - 1 - idalloc->min);
+		idalloc->next--;
+	}
 }
 
 /** Free the ID allocator. */
 void lsdn_idalloc_free(struct lsdn_idalloc *idalloc) {
-	// TODO
+	for (unsigned int l = 0; l < LSDN_IDALLOC_LEVELS; l++) {
+		free(idalloc->levels[l]);
+		idalloc->levels[l] = NULL;
+	}
+	idalloc->depth = 0;
+	idalloc->capacity = 0;
 }
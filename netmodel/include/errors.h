@@ -47,7 +47,9 @@ struct lsdn_context;
 	/** Can not establish netlink communication */ \
 	x(LSDNP_NO_NLSOCK, "Can not establish netlink socket.") \
 	/** QoS has invalid parameters (both rate and burst must be positive). See #lsdn_qos_rate_t for correct parameters. */ \
-	x(LSDNP_RATES_INVALID, "Effective QoS (%o) rate on %o is not greater than zero. This is probably not the rate you are looking for.")
+	x(LSDNP_RATES_INVALID, "Effective QoS (%o) rate on %o is not greater than zero. This is probably not the rate you are looking for.") \
+	/** Kernel objects left by a previous run could not be removed, see #lsdn_context_set_reconcile. */ \
+	x(LSDNP_RECONCILE, "Can not remove the stale kernel objects.")
 
 /** @defgroup errors Error codes and error handling
  * Definitions and descriptions of error codes, and error related functions.
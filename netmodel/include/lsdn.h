@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "nettypes.h"
 
 /** Attribute generator.
@@ -98,7 +99,7 @@ typedef void (*lsdn_nomem_cb)(void *user);
  * and shutdown, and their custom data. */
 struct lsdn_user_hooks {
 	/** Startup hook.
-	 * Called at commit time for every local phys and every network to which it is attached.
+	 * Called at commit time for every local phys and every network to which it was newly attached.
 	 * @param net network.
 	 * @param phys attached phys.
 	 * @param user receives the value of #lsdn_startup_hook_user. */
@@ -112,6 +113,148 @@ struct lsdn_user_hooks {
 	void *lsdn_shutdown_hook_user;
 };
 
+/** Netlink traffic of a commit.
+ * @ingroup context */
+struct lsdn_nl_stats {
+	/** Requests for network interfaces (creation, deletion, dumps, setting attributes or addresses). */
+	size_t link_msgs;
+	/** Requests for qdiscs and their classes. */
+	size_t qdisc_msgs;
+	/** Requests for tc filters. */
+	size_t filter_msgs;
+	/** Requests for bridge forwarding database entries. */
+	size_t fdb_msgs;
+	/** Requests for the tc actions shared by several filters. */
+	size_t action_msgs;
+	/** Other requests. */
+	size_t other_msgs;
+	/** Calls of the `bpf` system call (creating BPF maps and programs, updating map entries).
+	 * They are not netlink requests and are not included in `bytes`. */
+	size_t bpf_calls;
+	/** Total size of the sent requests, in bytes. */
+	size_t bytes;
+	/** Number of requests rejected by the kernel. Expected failures (e.g. deleting
+	 * a qdisc that does not exist in overwrite mode) are not counted. */
+	size_t errors;
+};
+
+/** Number of objects passed to each of the network type callbacks during a commit.
+ * @ingroup context */
+struct lsdn_ops_stats {
+	size_t create_pa;
+	size_t destroy_pa;
+	size_t add_virt;
+	size_t remove_virt;
+	size_t add_remote_pa;
+	size_t remove_remote_pa;
+	size_t add_remote_virt;
+	size_t remove_remote_virt;
+	size_t validate_pa;
+	size_t validate_virt;
+};
+
+/** Statistics of the last commit.
+ * @ingroup context
+ * Filled in by every #lsdn_commit (and partially by #lsdn_validate) and available through
+ * #lsdn_context_get_commit_stats. The times are wall clock times in microseconds. */
+struct lsdn_commit_stats {
+	/** Time spent validating the model. */
+	uint64_t validate_us;
+	/** Time spent removing the deleted and changed objects from kernel. */
+	uint64_t decommit_us;
+	/** Time spent installing the new and changed objects, including flushing the netlink batch. */
+	uint64_t commit_us;
+	/** Time spent acknowledging the new state of the objects (and freeing the deleted ones). */
+	uint64_t ack_us;
+	/** Netlink traffic, for both validation and commit. */
+	struct lsdn_nl_stats nl;
+	/** Network type callback invocations. */
+	struct lsdn_ops_stats ops;
+};
+
+/** Generator for #lsdn_plan_op_type.
+ * @see LSDN_ENUM */
+#define lsdn_enumgen_plan_op_type(x) \
+	x(LSDN_PLAN_LINK_CREATE, "link_create") \
+	/** Setting link attributes (state, master, MTU...). */ \
+	x(LSDN_PLAN_LINK_CHANGE, "link_change") \
+	x(LSDN_PLAN_LINK_DELETE, "link_delete") \
+	x(LSDN_PLAN_ADDR_ADD, "addr_add") \
+	x(LSDN_PLAN_ADDR_DELETE, "addr_delete") \
+	x(LSDN_PLAN_QDISC_CREATE, "qdisc_create") \
+	x(LSDN_PLAN_QDISC_DELETE, "qdisc_delete") \
+	/** Creating a qdisc class or changing the existing one. */ \
+	x(LSDN_PLAN_CLASS_CREATE, "class_create") \
+	x(LSDN_PLAN_CLASS_DELETE, "class_delete") \
+	/** Creating a filter that must not exist yet. */ \
+	x(LSDN_PLAN_FILTER_CREATE, "filter_create") \
+	/** Creating a filter or replacing the existing one. */ \
+	x(LSDN_PLAN_FILTER_REPLACE, "filter_replace") \
+	x(LSDN_PLAN_FILTER_DELETE, "filter_delete") \
+	x(LSDN_PLAN_FDB_ADD, "fdb_add") \
+	x(LSDN_PLAN_FDB_DELETE, "fdb_delete") \
+	/** Adding a bridge port to a VLAN, possibly mapped to a tunnel ID, or changing the port's
+	 * bridge settings. */ \
+	x(LSDN_PLAN_VLAN_ADD, "vlan_add") \
+	x(LSDN_PLAN_VLAN_DELETE, "vlan_delete") \
+	/** Creating a shared tc action or replacing the existing one. */ \
+	x(LSDN_PLAN_ACTION_CREATE, "action_create") \
+	x(LSDN_PLAN_ACTION_DELETE, "action_delete") \
+	/** Creating a BPF map or loading a BPF program. */ \
+	x(LSDN_PLAN_BPF_CREATE, "bpf_create") \
+	/** Adding or changing a BPF map entry. */ \
+	x(LSDN_PLAN_BPF_UPDATE, "bpf_update") \
+	x(LSDN_PLAN_BPF_DELETE, "bpf_delete") \
+	x(LSDN_PLAN_OTHER, "other")
+
+/** Kind of a kernel operation planned by #lsdn_commit_plan.
+ * @ingroup context */
+LSDN_ENUM(plan_op_type, LSDN_PLAN);
+
+/** Interface index given to the first link created by a plan.
+ * @ingroup context
+ * The links do not exist when the plan is made, so they are numbered from a range the kernel
+ * does not normally use. */
+#define LSDN_PLAN_FIRST_IFINDEX 0x40000000
+/** Size of the #lsdn_plan_op.summary buffer.
+ * @ingroup context */
+#define LSDN_PLAN_SUMMARY_SIZE 96
+
+/** A single netlink request of a planned commit.
+ * @ingroup context
+ * The fields not relevant for the operation type are zero. */
+struct lsdn_plan_op {
+	enum lsdn_plan_op_type type;
+	/** Interface the operation applies to (see #LSDN_PLAN_FIRST_IFINDEX). */
+	unsigned int ifindex;
+	/** Parent of a qdisc, class or filter. */
+	uint32_t parent;
+	/** Filter chain. */
+	uint32_t chain;
+	/** Filter priority. */
+	uint32_t prio;
+	/** Qdisc, class or filter handle, or index of a shared action. */
+	uint32_t handle;
+	/** Human readable description, like `create qdisc ingress parent ffff:fff1 handle ffff:0`. */
+	char summary[LSDN_PLAN_SUMMARY_SIZE];
+};
+
+/** Kernel operations a commit would do, see #lsdn_commit_plan.
+ * @ingroup context */
+struct lsdn_plan {
+	/** Number of operations in #ops. */
+	size_t count;
+	/** Operations in the order they would be sent. */
+	struct lsdn_plan_op *ops;
+	/** Number of operations per category and their total size. Only the requests changing the
+	 * kernel state are counted and `errors` is always zero. */
+	struct lsdn_nl_stats stats;
+	/** Result the commit would have if all the operations succeeded. */
+	lsdn_err_t result;
+	/** Number of problems the commit would report. */
+	size_t problem_count;
+};
+
 /** @defgroup context Context
  * Context, commits and high level network model management.
  *
@@ -139,9 +282,28 @@ void lsdn_context_cleanup(struct lsdn_context *ctx, lsdn_problem_cb cb, void *us
 
 void lsdn_context_set_overwrite(struct lsdn_context *ctx, bool overwrite);
 bool lsdn_context_get_overwrite(struct lsdn_context *ctx);
+void lsdn_context_set_clsact(struct lsdn_context *ctx, bool clsact);
+bool lsdn_context_get_clsact(struct lsdn_context *ctx);
+void lsdn_context_set_versioned_rules(struct lsdn_context *ctx, bool versioned);
+bool lsdn_context_get_versioned_rules(struct lsdn_context *ctx);
+void lsdn_context_set_shared_blocks(struct lsdn_context *ctx, bool shared);
+bool lsdn_context_get_shared_blocks(struct lsdn_context *ctx);
+void lsdn_context_set_bpf_switching(struct lsdn_context *ctx, bool bpf);
+bool lsdn_context_get_bpf_switching(struct lsdn_context *ctx);
+void lsdn_context_set_vlan_bridge(struct lsdn_context *ctx, bool shared);
+bool lsdn_context_get_vlan_bridge(struct lsdn_context *ctx);
+void lsdn_context_set_commit_workers(struct lsdn_context *ctx, unsigned int count);
+unsigned int lsdn_context_get_commit_workers(struct lsdn_context *ctx);
+void lsdn_context_set_reconcile(struct lsdn_context *ctx, bool reconcile);
+bool lsdn_context_get_reconcile(struct lsdn_context *ctx);
+const struct lsdn_commit_stats *lsdn_context_get_commit_stats(struct lsdn_context *ctx);
 
 lsdn_err_t lsdn_validate(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user);
 lsdn_err_t lsdn_commit(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user);
+lsdn_err_t lsdn_commit_plan(
+	struct lsdn_context *ctx, lsdn_problem_cb cb, void *user, struct lsdn_plan **plan);
+void lsdn_plan_free(struct lsdn_plan *plan);
+const char *lsdn_plan_op_type_name(enum lsdn_plan_op_type type);
 /** @} */
 
 
@@ -157,7 +319,8 @@ lsdn_err_t lsdn_commit(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user)
  *
  * The #lsdn_net object represents a network in the sense of "collection of
  * virts". Apart from basic life-cycle and lookup functions, it is only possible
- * to add or remove virts to/from it.
+ * to add or remove virts to/from it and to limit the aggregate bandwidth of all
+ * its virts (`rate_in` and `rate_out`).
  *
  * Configuration of network properties is done through separate #lsdn_settings
  * objects. There is a `lsdn_<kind>_settings_new` function for each kind of
@@ -176,11 +339,58 @@ lsdn_err_t lsdn_commit(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user)
 struct lsdn_net *lsdn_net_new(struct lsdn_settings *settings, uint32_t vnet_id);
 lsdn_err_t lsdn_net_set_name(struct lsdn_net *net, const char *name);
 const char* lsdn_net_get_name(struct lsdn_net *net);
+struct lsdn_settings *lsdn_net_get_settings(struct lsdn_net *net);
 struct lsdn_net* lsdn_net_by_name(struct lsdn_context *ctx, const char *name);
 /* Will automatically delete all child objects */
 void lsdn_net_free(struct lsdn_net *net);
 /** @}*/
 
+/** Tunnel option that is either on or off.
+ * @ingroup network
+ * @see lsdn_tunnel_opts */
+enum lsdn_tunnel_flag {
+	/** Keep the kernel default (off). */
+	LSDN_TUNNEL_FLAG_DEFAULT,
+	LSDN_TUNNEL_FLAG_ON,
+	LSDN_TUNNEL_FLAG_OFF
+};
+
+/** The Don't Fragment flag of the outer IPv4 header.
+ * @ingroup network
+ * @see lsdn_tunnel_opts */
+enum lsdn_tunnel_df {
+	/** Keep the kernel default (not set). */
+	LSDN_TUNNEL_DF_DEFAULT,
+	LSDN_TUNNEL_DF_SET,
+	LSDN_TUNNEL_DF_UNSET,
+	/** Copy the flag from the inner IPv4 header. */
+	LSDN_TUNNEL_DF_INHERIT
+};
+
+/** Tuning of the tunnel interfaces created for a network settings.
+ * @ingroup network
+ * The zero value of every field keeps the kernel default, so a zeroed structure changes
+ * nothing.
+ * @see lsdn_settings_set_tunnel_opts */
+struct lsdn_tunnel_opts {
+	/** Compute the UDP checksum of the outer IPv4 packets. The receiver can then validate it
+	 * in hardware and aggregate the packets by GRO. */
+	enum lsdn_tunnel_flag udp_csum;
+	/** Send the outer IPv6 packets with a zero UDP checksum. */
+	enum lsdn_tunnel_flag udp_zero_csum6_tx;
+	/** Accept the outer IPv6 packets with a zero UDP checksum. */
+	enum lsdn_tunnel_flag udp_zero_csum6_rx;
+	/** TTL (hop limit) of the outer packets. */
+	uint8_t ttl;
+	enum lsdn_tunnel_df df;
+	/** Transmit queue length of the tunnel interface. */
+	uint32_t txqueuelen;
+	/** Largest packet the stack may hand over to the tunnel interface for segmentation. */
+	uint32_t gso_max_size;
+	/** Largest packet GRO may build from the packets received by the tunnel interface. */
+	uint32_t gro_max_size;
+};
+
 /** @name Network settings
  * @{ */
 /** @ingroup network */
@@ -196,6 +406,8 @@ void lsdn_settings_register_user_hooks(struct lsdn_settings *settings, struct ls
 lsdn_err_t lsdn_settings_set_name(struct lsdn_settings *s, const char *name);
 const char* lsdn_settings_get_name(struct lsdn_settings *s);
 struct lsdn_settings *lsdn_settings_by_name(struct lsdn_context *ctx, const char *name);
+void lsdn_settings_set_tunnel_opts(struct lsdn_settings *s, const struct lsdn_tunnel_opts *opts);
+const struct lsdn_tunnel_opts *lsdn_settings_get_tunnel_opts(struct lsdn_settings *s);
 /** @} */
 
 /** @defgroup phys Phys (host machine)
@@ -219,6 +431,10 @@ struct lsdn_settings *lsdn_settings_by_name(struct lsdn_context *ctx, const char
  * This is useful in situations where the host machine has more than one
  * interface connecting to a host network, or if the machine connects to more
  * than one host network.
+ *
+ * The `rate_in` and `rate_out` attributes limit the aggregate bandwidth of all
+ * virts connected through the phys. They apply on top of the limits of the
+ * individual virts and their networks.
  * @{ */
 struct lsdn_phys *lsdn_phys_new(struct lsdn_context *ctx);
 lsdn_err_t lsdn_phys_set_name(struct lsdn_phys *phys, const char *name);
@@ -241,8 +457,9 @@ LSDN_DECLARE_ATTR(interface, phys, iface, const char*, const char*);
  *
  * Virt is a representation of a tenant in the virtual network. By default, it
  * does not need any attributes. However, you can configure its MAC address on
- * the virtual network (required for some network types), and set inbound and
- * outbound QoS rates.
+ * the virtual network (required for some network types), its IP address (used
+ * by the static switch networks to answer ARP requests and IPv6 neighbor
+ * solicitations without flooding them), and set inbound and outbound QoS rates.
  *
  * Virt is created as part of a network, but to participate in the network, it
  * must first be connected, through a phys and a network interface on that phys.
@@ -286,9 +503,42 @@ typedef struct {
 	float burst_rate;
 } lsdn_qos_rate_t;
 
+/** How the inbound bandwidth limit of a virt is enforced.
+ * @ingroup virt
+ * @see lsdn_virt_set_qos_mode
+ * @see lsdn_settings_set_qos_mode */
+enum lsdn_qos_mode {
+	/** Use the mode of the network settings (for a virt), #LSDN_QOS_POLICE by default. */
+	LSDN_QOS_DEFAULT,
+	/** Drop the packets exceeding the rate. */
+	LSDN_QOS_POLICE,
+	/** Queue the packets exceeding the rate in a HTB class with a fq_codel qdisc. TCP flows
+	 * then keep close to the rate instead of backing off after bursts of drops. Only the
+	 * inbound limit (#lsdn_virt_set_rate_in) is shaped, the others are always policed. The
+	 * burst is sent at the speed of the interface, the `burst_rate` of the limit is ignored. */
+	LSDN_QOS_SHAPE
+};
+
 LSDN_DECLARE_ATTR(MAC address, virt, mac, lsdn_mac_t, const lsdn_mac_t*);
+LSDN_DECLARE_ATTR(IP address, virt, ip, lsdn_ip_t, const lsdn_ip_t*);
 LSDN_DECLARE_ATTR(inbound bandwidth limit, virt, rate_in, lsdn_qos_rate_t, const lsdn_qos_rate_t*);
 LSDN_DECLARE_ATTR(outbound bandwidth limit, virt, rate_out, lsdn_qos_rate_t, const lsdn_qos_rate_t*);
+void lsdn_virt_set_qos_mode(struct lsdn_virt *virt, enum lsdn_qos_mode mode);
+enum lsdn_qos_mode lsdn_virt_get_qos_mode(struct lsdn_virt *virt);
+/** @} */
+
+/** @addtogroup network
+ * @{ */
+void lsdn_settings_set_qos_mode(struct lsdn_settings *s, enum lsdn_qos_mode mode);
+enum lsdn_qos_mode lsdn_settings_get_qos_mode(struct lsdn_settings *s);
+LSDN_DECLARE_ATTR(aggregate inbound bandwidth limit, net, rate_in, lsdn_qos_rate_t, const lsdn_qos_rate_t*);
+LSDN_DECLARE_ATTR(aggregate outbound bandwidth limit, net, rate_out, lsdn_qos_rate_t, const lsdn_qos_rate_t*);
+/** @} */
+
+/** @addtogroup phys
+ * @{ */
+LSDN_DECLARE_ATTR(aggregate inbound bandwidth limit, phys, rate_in, lsdn_qos_rate_t, const lsdn_qos_rate_t*);
+LSDN_DECLARE_ATTR(aggregate outbound bandwidth limit, phys, rate_out, lsdn_qos_rate_t, const lsdn_qos_rate_t*);
 /** @} */
 
 /** @defgroup misc Miscellaneous
@@ -34,6 +34,8 @@
 	x(LSDN_MATCH_ENC_KEY_DST_IPV4, "enc_dst_ipv4") \
 	/** Match tunnel source IP address . */ \
 	x(LSDN_MATCH_ENC_KEY_DST_IPV6, "enc_dst_ipv6") \
+	/** Match the interface the packet arrived on (used for shared filter blocks). */ \
+	x(LSDN_MATCH_INDEV, "indev") \
 
 /** Virt rule method generator.
  * For each of the possible virt rule match targets (see #lsdn_rule_target), the shortcuts
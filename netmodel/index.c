@@ -0,0 +1,110 @@
+/** \file
+ * Attribute index routines. */
+#include <stdlib.h>
+#include <string.h>
+#include "private/index.h"
+
+/** Initialize an empty index. */
+void lsdn_index_init(struct lsdn_index *index)
+{
+	index->groups = NULL;
+}
+
+/** Free the index.
+ * Normally all members were already removed and there is nothing left to free. */
+void lsdn_index_free(struct lsdn_index *index)
+{
+	struct lsdn_index_group *group, *tmp;
+	HASH_ITER(hh, index->groups, group, tmp) {
+		HASH_DELETE(hh, index->groups, group);
+		free(group);
+	}
+}
+
+/** Initialize an index membership as not indexed. */
+void lsdn_index_member_init(struct lsdn_index_member *member)
+{
+	member->group = NULL;
+	lsdn_list_init(&member->entry);
+}
+
+/** Find the group of objects with the given key.
+ * @return Group of objects if any object has the key.
+ * @return `NULL` otherwise. */
+struct lsdn_index_group *lsdn_index_find(struct lsdn_index *index, const struct lsdn_index_key *key)
+{
+	struct lsdn_index_group *group;
+	HASH_FIND(hh, index->groups, key->bytes, sizeof(key->bytes), group);
+	return group;
+}
+
+/** Remove the object from the index.
+ * Does nothing if the object is not indexed. */
+void lsdn_index_clear(struct lsdn_index *index, struct lsdn_index_member *member)
+{
+	struct lsdn_index_group *group = member->group;
+	if (!group)
+		return;
+	lsdn_list_remove(&member->entry);
+	member->group = NULL;
+	if (lsdn_is_list_empty(&group->members)) {
+		HASH_DELETE(hh, index->groups, group);
+		free(group);
+	}
+}
+
+/** Index the object under a (new) key.
+ * If the object was indexed under a different key, it is moved.
+ * @retval LSDNE_OK The object is indexed.
+ * @retval LSDNE_NOMEM Failed to allocate the group, the object's old key is kept. */
+lsdn_err_t lsdn_index_set(
+	struct lsdn_index *index, struct lsdn_index_member *member, const struct lsdn_index_key *key)
+{
+	if (member->group && !memcmp(member->group->key.bytes, key->bytes, sizeof(key->bytes)))
+		return LSDNE_OK;
+
+	struct lsdn_index_group *group = lsdn_index_find(index, key);
+	if (!group) {
+		group = malloc(sizeof(*group));
+		if (!group)
+			return LSDNE_NOMEM;
+		group->key = *key;
+		lsdn_list_init(&group->members);
+		HASH_ADD(hh, index->groups, key.bytes, sizeof(group->key.bytes), group);
+	}
+
+	lsdn_index_clear(index, member);
+	lsdn_list_add(&group->members, &member->entry);
+	member->group = group;
+	return LSDNE_OK;
+}
+
+/** Make an index key from a MAC address. */
+void lsdn_index_key_mac(struct lsdn_index_key *key, lsdn_mac_t mac)
+{
+	memset(key, 0, sizeof(*key));
+	memcpy(key->bytes, mac.bytes, sizeof(mac.bytes));
+}
+
+/** Make an index key from an IP address.
+ * Addresses of different versions never share a key. */
+void lsdn_index_key_ip(struct lsdn_index_key *key, lsdn_ip_t ip)
+{
+	memset(key, 0, sizeof(*key));
+	key->bytes[0] = ip.v;
+	if (ip.v == LSDN_IPv4)
+		memcpy(key->bytes + 1, ip.v4.bytes, sizeof(ip.v4.bytes));
+	else
+		memcpy(key->bytes + 1, ip.v6.bytes, sizeof(ip.v6.bytes));
+}
+
+/** Make an index key from a number.
+ * @param kind Distinguishes numbers from different namespaces (e.g. vnet IDs of different
+ * network types).
+ * @param value The number. */
+void lsdn_index_key_u32(struct lsdn_index_key *key, uint8_t kind, uint32_t value)
+{
+	memset(key, 0, sizeof(*key));
+	key->bytes[0] = kind;
+	memcpy(key->bytes + 1, &value, sizeof(value));
+}
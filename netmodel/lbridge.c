@@ -5,14 +5,13 @@
 #include "private/errors.h"
 #include "include/lsdn.h"
 
-/** Set up a Linux Bridge and associate it with a context. */
-lsdn_err_t lsdn_lbridge_init(struct lsdn_context *ctx, struct lsdn_lbridge *br)
+static lsdn_err_t lbridge_init(struct lsdn_context *ctx, struct lsdn_lbridge *br, bool vlan_filtering)
 {
 	struct lsdn_if bridge_if;
 	lsdn_if_init(&bridge_if);
 
 	lsdn_err_t err = lsdn_link_bridge_create(
-		ctx->nlsock, &bridge_if, lsdn_mk_iface_name(ctx), ctx->overwrite);
+		ctx->nlsock, &bridge_if, lsdn_mk_iface_name(ctx), vlan_filtering, ctx->overwrite);
 	if(err != LSDNE_OK) {
 		lsdn_if_free(&bridge_if);
 		return err;
@@ -31,6 +30,12 @@ lsdn_err_t lsdn_lbridge_init(struct lsdn_context *ctx, struct lsdn_lbridge *br)
 	return LSDNE_OK;
 }
 
+/** Set up a Linux Bridge and associate it with a context. */
+lsdn_err_t lsdn_lbridge_init(struct lsdn_context *ctx, struct lsdn_lbridge *br)
+{
+	return lbridge_init(ctx, br, false);
+}
+
 /** Free the #lsdn_lbridge structure. */
 lsdn_err_t lsdn_lbridge_free(struct lsdn_lbridge *br)
 {
@@ -97,6 +102,166 @@ lsdn_err_t lsdn_lbridge_create_pa(struct lsdn_phys_attachment *a)
 
 }
 
+/** Prepare the shared bridge of a phys, it is created by the first PA using it. */
+void lsdn_vlan_bridge_init(struct lsdn_vlan_bridge *vb)
+{
+	vb->users = 0;
+	/* VLAN 0 means no VLAN and 4095 is reserved */
+	lsdn_idalloc_init(&vb->vlan_ids, 1, 4095);
+	lsdn_list_init(&vb->tunnel_list);
+}
+
+/** Free the shared bridge of a phys, it must not be used by any PAs. */
+void lsdn_vlan_bridge_free(struct lsdn_vlan_bridge *vb)
+{
+	assert(vb->users == 0);
+	lsdn_idalloc_free(&vb->vlan_ids);
+}
+
+static lsdn_err_t vlan_bridge_use(struct lsdn_context *ctx, struct lsdn_vlan_bridge *vb)
+{
+	if (vb->users == 0) {
+		lsdn_err_t err = lbridge_init(ctx, &vb->lbridge, true);
+		if (err != LSDNE_OK)
+			return err;
+	}
+	vb->users++;
+	return LSDNE_OK;
+}
+
+static lsdn_err_t vlan_bridge_release(struct lsdn_vlan_bridge *vb)
+{
+	if (--vb->users == 0)
+		return lsdn_lbridge_free(&vb->lbridge);
+	return LSDNE_OK;
+}
+
+/** Find the tunnel for the PA's UDP port and address family on the shared bridge, or create it.
+ * The tunnel port maps the VLANs to VNIs and back. */
+static lsdn_err_t vlan_tunnel_use(
+	struct lsdn_phys_attachment *a, enum lsdn_ipv ipv, lsdn_vlan_tunnel_create_cb create_tunnel,
+	struct lsdn_vlan_tunnel **result)
+{
+	struct lsdn_context *ctx = a->net->ctx;
+	struct lsdn_vlan_bridge *vb = &a->phys->vlan_bridge;
+	struct lsdn_settings *s = a->net->settings;
+	uint16_t port = s->ops->get_port(s);
+	lsdn_foreach(vb->tunnel_list, tunnel_entry, struct lsdn_vlan_tunnel, t) {
+		if (t->port == port && t->ipv == ipv) {
+			t->users++;
+			*result = t;
+			return LSDNE_OK;
+		}
+	}
+
+	struct lsdn_vlan_tunnel *t = malloc(sizeof(*t));
+	if (!t)
+		return LSDNE_NOMEM;
+	lsdn_if_init(&t->tunnel_if);
+	lsdn_err_t err = create_tunnel(a, &t->tunnel_if);
+	if (err != LSDNE_OK)
+		goto cleanup_alloc;
+	err = lsdn_lbridge_add(&vb->lbridge, &t->lbridge_if, &t->tunnel_if);
+	if (err != LSDNE_OK)
+		goto cleanup_if;
+	err = lsdn_bridge_port_reset_vlans(ctx->nlsock, t->tunnel_if.ifindex);
+	if (err != LSDNE_OK)
+		goto cleanup_lbridge;
+	err = lsdn_bridge_port_set_vlan_tunnel(ctx->nlsock, t->tunnel_if.ifindex);
+	if (err != LSDNE_OK)
+		goto cleanup_lbridge;
+
+	t->port = port;
+	t->ipv = ipv;
+	t->users = 1;
+	lsdn_list_init_add(&vb->tunnel_list, &t->tunnel_entry);
+	*result = t;
+	return LSDNE_OK;
+
+	cleanup_lbridge:
+	acc_inconsistent(&err, lsdn_lbridge_remove(&t->lbridge_if));
+	cleanup_if:
+	acc_inconsistent(&err, lsdn_link_delete(ctx->nlsock, &t->tunnel_if));
+	lsdn_if_free(&t->tunnel_if);
+	cleanup_alloc:
+	free(t);
+	return err;
+}
+
+static lsdn_err_t vlan_tunnel_release(struct lsdn_context *ctx, struct lsdn_vlan_tunnel *t)
+{
+	lsdn_err_t err = LSDNE_OK;
+	if (--t->users > 0)
+		return err;
+	acc_inconsistent(&err, lsdn_lbridge_remove(&t->lbridge_if));
+	if (!ctx->disable_decommit)
+		acc_inconsistent(&err, lsdn_link_delete(ctx->nlsock, &t->tunnel_if));
+	lsdn_if_free(&t->tunnel_if);
+	lsdn_list_remove(&t->tunnel_entry);
+	free(t);
+	return err;
+}
+
+/** Connect the PA to the shared VLAN-aware bridge of its phys.
+ * Not used as a callback directly, but called from implementations of
+ * #lsdn_net_ops.create_pa instead of #lsdn_lbridge_create_pa, if
+ * #lsdn_context_set_vlan_bridge is enabled.
+ *
+ * Creates the bridge and the tunnel for the settings' UDP port, if this is their first user,
+ * and maps a new VLAN of the bridge to the network's VNI.
+ * @param ipv Address family of the tunnel.
+ * @param create_tunnel Creates the metadata tunnel interface. */
+lsdn_err_t lsdn_vlan_bridge_create_pa(
+	struct lsdn_phys_attachment *a, enum lsdn_ipv ipv, lsdn_vlan_tunnel_create_cb create_tunnel)
+{
+	struct lsdn_context *ctx = a->net->ctx;
+	struct lsdn_vlan_bridge *vb = &a->phys->vlan_bridge;
+	uint32_t vid;
+	if (!lsdn_idalloc_get(&vb->vlan_ids, &vid))
+		return LSDNE_NOMEM;
+
+	struct lsdn_vlan_tunnel *t;
+	lsdn_err_t err = vlan_bridge_use(ctx, vb);
+	if (err != LSDNE_OK)
+		goto cleanup_vid;
+	err = vlan_tunnel_use(a, ipv, create_tunnel, &t);
+	if (err != LSDNE_OK)
+		goto cleanup_bridge;
+	err = lsdn_bridge_vlan_add(ctx->nlsock, t->tunnel_if.ifindex, vid, false, a->net->vnet_id);
+	if (err != LSDNE_OK)
+		goto cleanup_tunnel;
+
+	a->vlan_tunnel = t;
+	a->vlan_id = vid;
+	return LSDNE_OK;
+
+	cleanup_tunnel:
+	acc_inconsistent(&err, vlan_tunnel_release(ctx, t));
+	cleanup_bridge:
+	acc_inconsistent(&err, vlan_bridge_release(vb));
+	cleanup_vid:
+	lsdn_idalloc_return(&vb->vlan_ids, vid);
+	return err;
+}
+
+/** Disconnect the PA from the shared bridge of its phys.
+ * The tunnel and the bridge are removed with their last user. */
+static lsdn_err_t vlan_bridge_destroy_pa(struct lsdn_phys_attachment *a)
+{
+	struct lsdn_context *ctx = a->net->ctx;
+	struct lsdn_vlan_bridge *vb = &a->phys->vlan_bridge;
+	struct lsdn_vlan_tunnel *t = a->vlan_tunnel;
+	lsdn_err_t err = LSDNE_OK;
+	if (!ctx->disable_decommit)
+		acc_inconsistent(&err, lsdn_bridge_vlan_delete(
+			ctx->nlsock, t->tunnel_if.ifindex, a->vlan_id, a->net->vnet_id));
+	lsdn_idalloc_return(&vb->vlan_ids, a->vlan_id);
+	acc_inconsistent(&err, vlan_tunnel_release(ctx, t));
+	acc_inconsistent(&err, vlan_bridge_release(vb));
+	a->vlan_tunnel = NULL;
+	return err;
+}
+
 /** Destroy a local bridge.
  * Implements #lsdn_net_ops.destroy_pa.
  *
@@ -104,6 +269,9 @@ lsdn_err_t lsdn_lbridge_create_pa(struct lsdn_phys_attachment *a)
  * Potentially also removes PA's TC rules. */
 lsdn_err_t lsdn_lbridge_destroy_pa(struct lsdn_phys_attachment *a)
 {
+	if (a->vlan_tunnel)
+		return vlan_bridge_destroy_pa(a);
+
 	lsdn_err_t err = LSDNE_OK;
 	acc_inconsistent(&err, lsdn_lbridge_remove(&a->lbridge_if));
 	acc_inconsistent(&err, lsdn_lbridge_free(&a->lbridge));
@@ -123,14 +291,29 @@ lsdn_err_t lsdn_lbridge_add_virt(struct lsdn_virt *v)
 	if (err != LSDNE_OK)
 		return err;
 
-	err = lsdn_lbridge_add(&a->lbridge, &v->lbridge_if, &v->committed_if);
-	if (err != LSDNE_OK) {
-		if (lsdn_cleanup_rulesets(v->network->ctx, &v->committed_if, &v->rules_in, &v->rules_out) != LSDNE_OK)
-			return LSDNE_INCONSISTENT;
-		return err;
+	struct lsdn_lbridge *br = a->vlan_tunnel ? &a->phys->vlan_bridge.lbridge : &a->lbridge;
+	err = lsdn_lbridge_add(br, &v->lbridge_if, &v->committed_if);
+	if (err != LSDNE_OK)
+		goto cleanup_rulesets;
+
+	/* The kernel drops the VLAN when the port leaves the bridge, no need to remove it */
+	if (a->vlan_tunnel) {
+		struct lsdn_nl *sock = v->network->ctx->nlsock;
+		err = lsdn_bridge_port_reset_vlans(sock, v->committed_if.ifindex);
+		if (err != LSDNE_OK)
+			goto cleanup_lbridge;
+		err = lsdn_bridge_vlan_add(sock, v->committed_if.ifindex, a->vlan_id, true, 0);
+		if (err != LSDNE_OK)
+			goto cleanup_lbridge;
 	}
 
 	return LSDNE_OK;
+
+	cleanup_lbridge:
+	acc_inconsistent(&err, lsdn_lbridge_remove(&v->lbridge_if));
+	cleanup_rulesets:
+	acc_inconsistent(&err, lsdn_cleanup_rulesets(v->network->ctx, &v->committed_if, &v->rules_in, &v->rules_out));
+	return err;
 }
 
 /** Disconnect a local virt from the Linux Bridge.
@@ -185,7 +368,7 @@ lsdn_err_t lsdn_lbridge_add_route(struct lsdn_lbridge *br, struct lsdn_lbridge_r
 	}
 
 	/* Filter rule */
-	struct lsdn_filter *f = lsdn_filter_fw_init(
+	struct lsdn_filter *f = lsdn_filter_fw_init(ctx->nlsock,
 		route->ruleset.iface->ifindex, 1,
 		route->ruleset.parent_handle, route->ruleset.chain, route->ruleset.prio_start + LBRIDGE_FILTER);
 	if (!f)
@@ -262,4 +445,31 @@ lsdn_err_t lsdn_lbridge_remove_route(struct lsdn_lbridge_route *route)
 	return err;
 }
 
+/** Forward the frames for `mac` only to the given route, instead of flooding them.
+ * Does nothing if the virt has no MAC address, it is then learned as usual. */
+lsdn_err_t lsdn_lbridge_add_route_mac(
+	struct lsdn_lbridge_route *route, struct lsdn_lbridge_mac *entry, const lsdn_mac_t *mac)
+{
+	entry->installed = false;
+	if (!mac)
+		return LSDNE_OK;
+	struct lsdn_context *ctx = route->lbridge_if.br->ctx;
+	lsdn_err_t err = lsdn_fdb_add_master_entry(ctx->nlsock, route->dummy_if.ifindex, *mac);
+	if (err != LSDNE_OK)
+		return err;
+	entry->installed = true;
+	entry->mac = *mac;
+	return LSDNE_OK;
+}
+
+/** Remove the entry added by #lsdn_lbridge_add_route_mac. */
+lsdn_err_t lsdn_lbridge_remove_route_mac(struct lsdn_lbridge_route *route, struct lsdn_lbridge_mac *entry)
+{
+	struct lsdn_context *ctx = route->lbridge_if.br->ctx;
+	if (!entry->installed || ctx->disable_decommit)
+		return LSDNE_OK;
+	entry->installed = false;
+	return lsdn_fdb_remove_master_entry(ctx->nlsock, route->dummy_if.ifindex, entry->mac);
+}
+
 /** @} */
@@ -2,11 +2,16 @@
  * Main library file. */
 #include "include/lsdn.h"
 #include "private/nl.h"
+#include "private/nlmock.h"
+#include "private/nlrecord.h"
 #include "private/net.h"
 #include "private/log.h"
 #include "include/util.h"
 #include "private/errors.h"
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 static void settings_do_free(struct lsdn_settings *settings);
 static void net_do_free(struct lsdn_net *net);
@@ -32,6 +37,79 @@ static void propagate(enum lsdn_state *from, enum lsdn_state *to) {
 		*to = LSDN_STATE_RENEW;
 }
 
+/** @name Dirty lists.
+ * @private
+ * An object is added to a dirty list of its context when it is created, changed or freed, and
+ * stays there until it is successfully committed. The lists are ordered by the time of the first
+ * change. */
+/** @{ */
+static void mark_dirty(struct lsdn_list_entry *list, struct lsdn_list_entry *entry)
+{
+	if (lsdn_is_list_empty(entry))
+		lsdn_list_add(list->previous, entry);
+}
+
+static bool is_dirty(struct lsdn_list_entry *entry)
+{
+	return !lsdn_is_list_empty(entry);
+}
+
+static void clear_dirty(struct lsdn_list_entry *entry)
+{
+	if (is_dirty(entry))
+		lsdn_list_remove(entry);
+}
+
+void lsdn_settings_mark_dirty(struct lsdn_settings *s)
+{
+	mark_dirty(&s->ctx->dirty_settings_list, &s->dirty_entry);
+}
+
+static void net_mark_dirty(struct lsdn_net *net)
+{
+	mark_dirty(&net->ctx->dirty_net_list, &net->dirty_entry);
+}
+
+static void phys_mark_dirty(struct lsdn_phys *phys)
+{
+	mark_dirty(&phys->ctx->dirty_phys_list, &phys->dirty_entry);
+}
+
+/** Also marks the network, since the cross-network validation depends on its attachments. */
+void lsdn_pa_mark_dirty(struct lsdn_phys_attachment *pa)
+{
+	mark_dirty(&pa->net->ctx->dirty_pa_list, &pa->dirty_entry);
+	net_mark_dirty(pa->net);
+}
+
+void lsdn_virt_mark_dirty(struct lsdn_virt *v)
+{
+	mark_dirty(&v->network->ctx->dirty_virt_list, &v->dirty_entry);
+}
+
+static void renew_phys(struct lsdn_phys *phys)
+{
+	renew(&phys->state);
+	phys_mark_dirty(phys);
+}
+
+static void renew_virt(struct lsdn_virt *virt)
+{
+	renew(&virt->state);
+	lsdn_virt_mark_dirty(virt);
+}
+
+/** Move all objects that were committed successfully out of the dirty list. */
+#define ack_dirty_list(list, type) \
+	do { \
+		lsdn_foreach(list, dirty_entry, type, obj) { \
+			ack_state(&obj->state); \
+			if (obj->state == LSDN_STATE_OK) \
+				lsdn_list_remove(&obj->dirty_entry); \
+		} \
+	} while(0)
+/** @} */
+
 /** Generate unique name for an object.
  * @ingroup misc
  * The name is based on the context name, type of the object (net, phys, virt, etc.) and
@@ -46,7 +124,7 @@ static void propagate(enum lsdn_state *from, enum lsdn_state *to) {
  * @return pointer to a buffer with a generated unique name. */
 const char *lsdn_mk_name(struct lsdn_context *ctx, const char *type)
 {
-	snprintf(ctx->namebuf, sizeof(ctx->namebuf), "%s-%s-%d", ctx->name, type, ++ctx->obj_count);
+	snprintf(ctx->namebuf, LSDN_NAMEBUF_SIZE, "%s-%s-%d", ctx->name, type, ++ctx->obj_count);
 	return ctx->namebuf;
 }
 
@@ -73,14 +151,43 @@ struct lsdn_context *lsdn_context_new(const char* name)
 	}
 
 	ctx->nlsock = NULL;
+	ctx->mock = NULL;
 	ctx->overwrite = true;
+	ctx->clsact = false;
+	ctx->versioned_rules = false;
+	ctx->shared_blocks = false;
+	/* The filter blocks have their own index space in the network namespace, the context takes
+	 * the same range of it as of the shared actions */
+	uint32_t range_first = lsdn_action_range_first(ctx->name);
+	uint32_t range_last = range_first + ((UINT32_C(1) << LSDN_ACTION_RANGE_BITS) - 1);
+	lsdn_idalloc_init(&ctx->block_ids, range_first, range_last);
+	lsdn_idalloc_init(&ctx->action_ids, range_first, range_last);
+	ctx->bpf_switching = false;
+	ctx->vlan_bridge = false;
+	ctx->filter_pool = true;
+	ctx->reconcile = false;
+	ctx->commit_workers = 0;
+	ctx->worker_socks = NULL;
+	pthread_mutex_init(&ctx->commit_lock, NULL);
 	ctx->obj_count = 0;
+	ctx->namebuf = ctx->own_namebuf;
 	lsdn_names_init(&ctx->phys_names);
 	lsdn_names_init(&ctx->net_names);
 	lsdn_names_init(&ctx->setting_names);
 	lsdn_list_init(&ctx->networks_list);
 	lsdn_list_init(&ctx->settings_list);
 	lsdn_list_init(&ctx->phys_list);
+	lsdn_list_init(&ctx->dirty_settings_list);
+	lsdn_list_init(&ctx->dirty_net_list);
+	lsdn_list_init(&ctx->dirty_phys_list);
+	lsdn_list_init(&ctx->dirty_pa_list);
+	lsdn_list_init(&ctx->dirty_virt_list);
+	lsdn_list_init(&ctx->pending_fl_list);
+	lsdn_list_init(&ctx->pending_rs_list);
+	lsdn_list_init(&ctx->pending_action_list);
+	lsdn_index_init(&ctx->phys_ip_index);
+	lsdn_index_init(&ctx->vnet_id_index);
+	lsdn_index_init(&ctx->vxlan_port_index);
 	return ctx;
 }
 
@@ -89,6 +196,10 @@ struct lsdn_context *lsdn_context_new(const char* name)
  * This is to ensure that rules created by previous crashed instances do not cause problems.
  * Set this flag to `false` to prevent overwriting existing rules.
  *
+ * The shared actions (tunnel keys and policers referenced by the filters) are never overwritten,
+ * their index may be used by another context in the same network namespace. The actions left by
+ * a crashed instance are adopted by a commit in reconcile mode (#lsdn_context_set_reconcile).
+ *
  * @param ctx LSDN context.
  * @param overwrite `true` if LSDN should overwrite existing kernel objects.
  *	`false` if it should fail if the kernel object already exists. */
@@ -97,6 +208,166 @@ void lsdn_context_set_overwrite(struct lsdn_context *ctx, bool overwrite)
 	ctx->overwrite = overwrite;
 }
 
+/** Configure the qdiscs used for the rules on virt and tunnel interfaces.
+ * By default, the ingress rules are attached to an ingress qdisc and the egress rules to a
+ * `prio` qdisc, which replaces the root qdisc of the interface (and with it the default
+ * multiqueue setup). In clsact mode, both are attached to the hooks of a single `clsact` qdisc
+ * and the root qdisc is left alone.
+ *
+ * Set this before the first commit. Interfaces that are already committed keep their
+ * qdiscs until they are decommitted.
+ *
+ * @param ctx LSDN context.
+ * @param clsact `true` to use the clsact qdisc. */
+void lsdn_context_set_clsact(struct lsdn_context *ctx, bool clsact)
+{
+	ctx->clsact = clsact;
+}
+
+/** Query if LSDN uses the clsact qdisc.
+ * @return value of clsact flag.
+ * @see lsdn_context_set_clsact */
+bool lsdn_context_get_clsact(struct lsdn_context *ctx)
+{
+	return ctx->clsact;
+}
+
+/** Configure hitless updates of the rules on virt and tunnel interfaces.
+ * By default, when the rules of an interface change (virt rules, forwarding to a new virt), the
+ * filters are created, replaced and deleted one by one, so for a moment the traffic sees a
+ * mixture of the old and new rules. With versioned rules, the rules live in one of two chains and
+ * the first chain only contains a single filter jumping to the active one. A changed ruleset is
+ * built complete in the other chain, the traffic is switched to it by replacing the jump and
+ * only then is the old chain flushed.
+ *
+ * The price is that every change sends the whole ruleset of the interface again. The broadcast
+ * filters of the static bridge have their own chains and are still updated in place.
+ *
+ * Set this before the first commit. Interfaces that are already committed keep their
+ * rules in the old layout until they are decommitted.
+ *
+ * @param ctx LSDN context.
+ * @param versioned `true` to use versioned rules. */
+void lsdn_context_set_versioned_rules(struct lsdn_context *ctx, bool versioned)
+{
+	ctx->versioned_rules = versioned;
+}
+
+/** Query if LSDN uses versioned rules.
+ * @see lsdn_context_set_versioned_rules */
+bool lsdn_context_get_versioned_rules(struct lsdn_context *ctx)
+{
+	return ctx->versioned_rules;
+}
+
+/** Configure sharing of tc filter blocks in the networks with static bridges (VXLAN with static
+ * tunnels and Geneve).
+ * By default, every local virt has its own qdisc with the rules classifying the traffic coming
+ * from the virt. With shared blocks, the ingress hooks of the clsact qdiscs of all local virts of
+ * a network are bound to a single kernel filter block. The fallback rule forwarding the unicast
+ * traffic to the bridge is then installed only once, instead of once for every virt, and the
+ * per-virt rules are told apart by their input interface.
+ *
+ * Only the virts without their own rules on that side (outbound virt rules and outbound rate
+ * limits) share the block, the rest keep their private qdiscs. A virt that gets such rules is
+ * moved out of the block by the commit, but it is moved back only when it is recommitted for
+ * some other reason.
+ *
+ * The blocks are numbered per network namespace, the context takes their indices from a range
+ * chosen by its name, like the shared actions (see #lsdn_action_range_first). Another application
+ * in the namespace must not bind its qdiscs to the blocks in that range.
+ *
+ * Set this before the first commit. The kernel must support shared blocks (Linux 4.16 and
+ * newer).
+ *
+ * @param ctx LSDN context.
+ * @param shared `true` to use shared blocks. */
+void lsdn_context_set_shared_blocks(struct lsdn_context *ctx, bool shared)
+{
+	ctx->shared_blocks = shared;
+}
+
+/** Query if LSDN shares tc blocks among virts.
+ * @see lsdn_context_set_shared_blocks */
+bool lsdn_context_get_shared_blocks(struct lsdn_context *ctx)
+{
+	return ctx->shared_blocks;
+}
+
+/** Switch the unicast traffic of static bridges by a BPF program.
+ *
+ * Normally, the static bridge of a VXLAN-static or Geneve network has a flower filter for every
+ * MAC address in the network, so adding, removing or migrating a virt means a filter request and
+ * the packets are matched against a filter list. With BPF switching, a single cls_bpf program on
+ * the bridge looks the destination MAC address up in a BPF hash map and the virt changes are
+ * just updates of the map entries. The broadcasts and the ARP responder still use flower filters.
+ *
+ * The program can not set the source address of the tunnel, it is chosen by the routing
+ * table of the physical host.
+ *
+ * Set this before the first commit, the bridges already created keep their mode. The kernel must
+ * support BPF direct actions and setting the tunnel metadata from BPF (Linux 4.5 and newer) and
+ * LSDN needs the `CAP_BPF` or `CAP_SYS_ADMIN` capability.
+ *
+ * @param ctx LSDN context.
+ * @param bpf `true` to use the BPF program. */
+void lsdn_context_set_bpf_switching(struct lsdn_context *ctx, bool bpf)
+{
+	ctx->bpf_switching = bpf;
+}
+
+/** Query if LSDN switches the unicast traffic by a BPF program.
+ * @see lsdn_context_set_bpf_switching */
+bool lsdn_context_get_bpf_switching(struct lsdn_context *ctx)
+{
+	return ctx->bpf_switching;
+}
+
+/** Connect the learning VXLAN networks of a phys to a single VLAN-aware bridge.
+ *
+ * Normally, every VXLAN-e2e and VXLAN-multicast network gets its own Linux bridge and its own
+ * VXLAN interface on each local phys, so a host with many networks has twice as many
+ * interfaces. With this option, the phys has a single bridge with VLAN filtering and, for each
+ * network settings, a single VXLAN interface in metadata mode. Each network is given a VLAN of
+ * the bridge, its virts are the untagged members of the VLAN and the VLAN is mapped to the
+ * network's VNI on the tunnel port. Adding a network then costs a few VLAN and forwarding
+ * entries instead of two interfaces.
+ *
+ * A bridge has at most 4094 VLANs, so this is also the limit of the networks on a phys. The
+ * VLAN networks are not affected, because their bridge would have to take over the phys
+ * interface, and neither are the Geneve and static networks, which do not use the Linux bridge.
+ *
+ * Set this before the first commit, the networks already committed keep their bridges. The
+ * kernel must support VLAN tunnel mappings (Linux 4.11 and newer).
+ *
+ * @param ctx LSDN context.
+ * @param shared `true` to share the bridge. */
+void lsdn_context_set_vlan_bridge(struct lsdn_context *ctx, bool shared)
+{
+	ctx->vlan_bridge = shared;
+}
+
+/** Query if LSDN connects the learning networks of a phys to a single bridge.
+ * @see lsdn_context_set_vlan_bridge */
+bool lsdn_context_get_vlan_bridge(struct lsdn_context *ctx)
+{
+	return ctx->vlan_bridge;
+}
+
+/** Configure the reuse of the netlink buffers of the tc filters.
+ * By default, the buffers of the filters sent to the kernel are kept in a small pool on each
+ * netlink socket and reused by the next filters. Without the pool, every filter allocates its
+ * own buffer, which is only useful to measure what the pool saves.
+ *
+ * Takes effect for the netlink sockets opened later, set it before the first commit.
+ *
+ * @param ctx LSDN context.
+ * @param pool `true` to reuse the buffers. */
+void lsdn_context_set_filter_pool(struct lsdn_context *ctx, bool pool)
+{
+	ctx->filter_pool = pool;
+}
+
 /** Query if LSDN should overwrite any of the interfaces or rules.
  * @return value of overwrite flag.
  * @see lsdn_context_set_overwrite */
@@ -105,17 +376,191 @@ bool lsdn_context_get_overwrite(struct lsdn_context *ctx)
 	return ctx->overwrite;
 }
 
+/** Get the statistics of the last commit.
+ * If only #lsdn_validate was called since the last commit, only the validation part is filled in.
+ * @return statistics, valid until the context is freed. They are overwritten by the next
+ * validation or commit. */
+const struct lsdn_commit_stats *lsdn_context_get_commit_stats(struct lsdn_context *ctx)
+{
+	return &ctx->stats;
+}
+
+static void free_worker_sockets(struct lsdn_context *ctx)
+{
+	if (!ctx->worker_socks)
+		return;
+	for (unsigned int i = 0; i < ctx->commit_workers; i++)
+		lsdn_socket_free(ctx->worker_socks[i]);
+	free(ctx->worker_socks);
+	ctx->worker_socks = NULL;
+}
+
+/** Configure parallel commit.
+ * By default, the whole commit runs in the calling thread. With two or more workers, the local
+ * attachments of the networks (with their virts and the remote attachments and virts they can
+ * see) are committed by a pool of threads, each with its own netlink socket. Networks that share
+ * kernel objects (the VXLAN and Geneve networks with end-to-end tunnels share a tunnel per
+ * settings) are committed by the same worker.
+ *
+ * The model is still not thread-safe: the workers run the model code one at a time and only wait
+ * for the kernel in parallel. The problem callback may be called from the worker threads, but
+ * never concurrently. The decommit phase is always sequential.
+ *
+ * @param ctx LSDN context.
+ * @param count Number of worker threads, 0 or 1 to disable the parallel commit. */
+void lsdn_context_set_commit_workers(struct lsdn_context *ctx, unsigned int count)
+{
+	free_worker_sockets(ctx);
+	ctx->commit_workers = count;
+}
+
+/** Query the number of commit workers.
+ * @see lsdn_context_set_commit_workers */
+unsigned int lsdn_context_get_commit_workers(struct lsdn_context *ctx)
+{
+	return ctx->commit_workers;
+}
+
+/** Reconcile the kernel state in the next commit.
+ * Normally, LSDN expects that the kernel objects it creates do not exist yet and, if they do,
+ * deletes them first (see #lsdn_context_set_overwrite). This tears down the traffic while the
+ * model is committed again, for example after a restart of `lsctld`. In reconcile mode, the next
+ * commit adopts the interfaces, qdiscs, filters and FDB entries left by a previous run with the
+ * same context name:
+ * * Interfaces with the name LSDN would create are kept if they have the same kind and parameters,
+ *   otherwise they are deleted and created again.
+ * * Qdiscs of the right kind are kept, filters are replaced in place.
+ * * Afterwards, the filters and tunnel FDB entries not belonging to the new model are removed
+ *   from the adopted qdiscs and interfaces, and so are the interfaces named by LSDN
+ *   (`<context name>-iface-*`) that were not adopted.
+ *
+ * The objects of the previous run on interfaces that are no longer part of the model (like
+ * the qdiscs on a removed virt) are not found and are left alone. The flag is cleared by the
+ * commit once it reaches the kernel. A commit failing before that (the model does not validate
+ * or the netlink socket can not be opened) does not change the kernel and keeps the flag, so the
+ * commit of the corrected model still reconciles. The parallel commit
+ * (#lsdn_context_set_commit_workers) is not used when reconciling.
+ *
+ * @param ctx LSDN context.
+ * @param reconcile `true` to reconcile in the next commit. */
+void lsdn_context_set_reconcile(struct lsdn_context *ctx, bool reconcile)
+{
+	ctx->reconcile = reconcile;
+}
+
+/** Query if the next commit reconciles the kernel state.
+ * @see lsdn_context_set_reconcile */
+bool lsdn_context_get_reconcile(struct lsdn_context *ctx)
+{
+	return ctx->reconcile;
+}
+
+/** Use an emulated kernel instead of the real one.
+ * All netlink requests are processed by an in-process emulation of the kernel tables, so the
+ * commits do not need any privileges and do not change the system. The emulated kernel starts
+ * without any interfaces, the interfaces expected to exist (phys interfaces, virts) can be created
+ * using #lsdn_context_mock_add_link. Useful for testing and benchmarking large models.
+ *
+ * Must be called before the first validation or commit of the context.
+ * @retval LSDNE_OK The emulated kernel is used (or was already in use).
+ * @retval LSDNE_NOMEM */
+lsdn_err_t lsdn_context_use_mock_kernel(struct lsdn_context *ctx)
+{
+	if (ctx->mock)
+		return LSDNE_OK;
+	assert(!ctx->nlsock);
+	ctx->mock = lsdn_mock_kernel_new();
+	if (!ctx->mock)
+		ret_err(ctx, LSDNE_NOMEM);
+	return LSDNE_OK;
+}
+
+/** Use the emulated kernel of another context.
+ * Allows simulating a restart of the application: the kernel state stays when the other context
+ * is freed by #lsdn_context_free. Must be called before the first validation or commit.
+ * @param ctx LSDN context.
+ * @param other LSDN context using the emulated kernel (see #lsdn_context_use_mock_kernel).
+ * @retval LSDNE_OK */
+lsdn_err_t lsdn_context_share_mock_kernel(struct lsdn_context *ctx, struct lsdn_context *other)
+{
+	assert(other->mock && !ctx->mock && !ctx->nlsock);
+	ctx->mock = lsdn_mock_kernel_ref(other->mock);
+	return LSDNE_OK;
+}
+
+/** Create an interface in the emulated kernel.
+ * @param ctx LSDN context using the emulated kernel (see #lsdn_context_use_mock_kernel).
+ * @param name Interface name.
+ * @retval LSDNE_OK The interface was created.
+ * @retval LSDNE_DUPLICATE An interface with this name already exists.
+ * @retval LSDNE_PARSE The name is too long.
+ * @retval LSDNE_NOMEM */
+lsdn_err_t lsdn_context_mock_add_link(struct lsdn_context *ctx, const char *name)
+{
+	assert(ctx->mock);
+	ret_err(ctx, lsdn_mock_kernel_add_link(ctx->mock, name));
+}
+
+/** Count the objects installed in the emulated kernel.
+ * @param ctx LSDN context using the emulated kernel (see #lsdn_context_use_mock_kernel).
+ * @param state Receives the counts. */
+void lsdn_context_mock_get_state(struct lsdn_context *ctx, struct lsdn_mock_state *state)
+{
+	assert(ctx->mock);
+	lsdn_mock_kernel_get_state(ctx->mock, state);
+}
+
+static struct lsdn_nl_transport *open_transport(struct lsdn_context *ctx)
+{
+	if (ctx->mock)
+		return lsdn_mock_transport_new(ctx->mock);
+	else
+		return lsdn_nl_transport_mnl_new();
+}
+
+static struct lsdn_nl *init_socket(struct lsdn_context *ctx, struct lsdn_nl_transport *transport)
+{
+	struct lsdn_nl *nl = transport ? lsdn_socket_init_transport(transport) : NULL;
+	if (nl && !ctx->filter_pool)
+		lsdn_nl_set_filter_pool(nl, 0);
+	return nl;
+}
+
+static struct lsdn_nl *open_socket(struct lsdn_context *ctx)
+{
+	return init_socket(ctx, open_transport(ctx));
+}
+
 static lsdn_err_t lsdn_context_ensure_socket(struct lsdn_context *ctx)
 {
 	if (ctx->nlsock)
 		return LSDNE_OK;
-	ctx->nlsock = lsdn_socket_init();
+	ctx->nlsock = open_socket(ctx);
 	if(!ctx->nlsock)
 		return LSDNE_NETLINK;
 
 	return LSDNE_OK;
 }
 
+/* Open the sockets of the commit workers, they use the link cache of the main socket. */
+static bool ensure_worker_sockets(struct lsdn_context *ctx)
+{
+	if (ctx->worker_socks)
+		return true;
+	ctx->worker_socks = calloc(ctx->commit_workers, sizeof(*ctx->worker_socks));
+	if (!ctx->worker_socks)
+		return false;
+	for (unsigned int i = 0; i < ctx->commit_workers; i++) {
+		ctx->worker_socks[i] = open_socket(ctx);
+		if (!ctx->worker_socks[i]) {
+			free_worker_sockets(ctx);
+			return false;
+		}
+		lsdn_nl_share_link_cache(ctx->worker_socks[i], ctx->nlsock);
+	}
+	return true;
+}
+
 /** Problem handler that aborts when a problem is found.
  * Used in #lsdn_context_free. When freeing a context, we can't handle errors
  * meaningfully and we don't expect any errors to happen anyway. Any reported problem
@@ -157,7 +602,18 @@ void lsdn_context_cleanup(struct lsdn_context *ctx, lsdn_problem_cb cb, void *us
 		lsdn_settings_free(s);
 	}
 	lsdn_commit(ctx, cb, user);
+	free_worker_sockets(ctx);
 	lsdn_socket_free(ctx->nlsock);
+	lsdn_mock_kernel_free(ctx->mock);
+	pthread_mutex_destroy(&ctx->commit_lock);
+	lsdn_index_free(&ctx->phys_ip_index);
+	lsdn_index_free(&ctx->vnet_id_index);
+	lsdn_index_free(&ctx->vxlan_port_index);
+	lsdn_idalloc_free(&ctx->block_ids);
+	lsdn_idalloc_free(&ctx->action_ids);
+	lsdn_names_free(&ctx->phys_names);
+	lsdn_names_free(&ctx->net_names);
+	lsdn_names_free(&ctx->setting_names);
 	free(ctx->name);
 	free(ctx);
 }
@@ -219,6 +675,51 @@ lsdn_err_t lsdn_settings_set_name(struct lsdn_settings *s, const char *name)
 	ret_err(s->ctx, lsdn_name_set(&s->name, &s->ctx->setting_names, name));
 }
 
+/** Set how the virts enforce their inbound bandwidth limits.
+ * Applies to the virts of the networks using these settings, unless the virt has its own mode
+ * (#lsdn_virt_set_qos_mode). #LSDN_QOS_DEFAULT means #LSDN_QOS_POLICE. */
+void lsdn_settings_set_qos_mode(struct lsdn_settings *s, enum lsdn_qos_mode mode)
+{
+	if (mode == LSDN_QOS_DEFAULT)
+		mode = LSDN_QOS_POLICE;
+	if (s->qos_mode == mode)
+		return;
+	s->qos_mode = mode;
+	lsdn_foreach(s->setting_users_list, settings_users_entry, struct lsdn_net, net) {
+		lsdn_foreach(net->virt_list, virt_entry, struct lsdn_virt, v) {
+			if (v->attr_rate_in && v->attr_qos_mode == LSDN_QOS_DEFAULT
+			    && v->state != LSDN_STATE_DELETE)
+				renew_virt(v);
+		}
+	}
+}
+
+/** Get the mode set by #lsdn_settings_set_qos_mode. */
+enum lsdn_qos_mode lsdn_settings_get_qos_mode(struct lsdn_settings *s)
+{
+	return s->qos_mode;
+}
+
+/** Tune the tunnel interfaces of the networks using these settings.
+ * The options are given to the kernel when the VXLAN or Geneve interfaces are created, the
+ * other network types have no tunnel interfaces and ignore them. The interfaces already in the
+ * kernel keep their options until they are created again. When reconciling, an interface
+ * with different UDP checksum, TTL or DF options is not adopted, but replaced. This includes
+ * an option set back to its default, the default is compared as the value the kernel uses.
+ *
+ * @param s Network settings.
+ * @param opts The options, copied to the settings. */
+void lsdn_settings_set_tunnel_opts(struct lsdn_settings *s, const struct lsdn_tunnel_opts *opts)
+{
+	s->tunnel_opts = *opts;
+}
+
+/** Get the options set by #lsdn_settings_set_tunnel_opts. */
+const struct lsdn_tunnel_opts *lsdn_settings_get_tunnel_opts(struct lsdn_settings *s)
+{
+	return &s->tunnel_opts;
+}
+
 /** Get settings name.
  * @return name of the settings struct. */
 const char* lsdn_settings_get_name(struct lsdn_settings *s)
@@ -249,6 +750,7 @@ struct lsdn_settings* lsdn_settings_by_name(struct lsdn_context *ctx, const char
 static void settings_do_free(struct lsdn_settings *settings)
 {
 	lsdn_list_remove(&settings->settings_entry);
+	clear_dirty(&settings->dirty_entry);
 	lsdn_name_free(&settings->name);
 	assert(lsdn_is_list_empty(&settings->setting_users_list));
 	free(settings);
@@ -261,6 +763,7 @@ void lsdn_settings_free(struct lsdn_settings *settings)
 	lsdn_foreach(settings->setting_users_list, settings_users_entry, struct lsdn_net, net) {
 		lsdn_net_free(net);
 	}
+	lsdn_settings_mark_dirty(settings);
 	free_helper(settings, settings_do_free);
 }
 
@@ -282,13 +785,42 @@ struct lsdn_net *lsdn_net_new(struct lsdn_settings *s, uint32_t vnet_id)
 	net->pending_free = false;
 	net->settings = s;
 	net->vnet_id = vnet_id;
+	net->ipv4_pa_count = 0;
+	net->ipv6_pa_count = 0;
+	net->attr_rate_in = NULL;
+	net->attr_rate_out = NULL;
+	net->aggregate_rate_in.created = false;
+	net->aggregate_rate_in.users = 0;
+	net->aggregate_rate_out.created = false;
+	net->aggregate_rate_out.users = 0;
+
+	struct lsdn_index_key key;
+	lsdn_index_member_init(&net->vnet_id_index_entry);
+	lsdn_index_member_init(&net->vxlan_port_index_entry);
+	lsdn_index_key_u32(&key, s->nettype, vnet_id);
+	if (lsdn_index_set(&s->ctx->vnet_id_index, &net->vnet_id_index_entry, &key) != LSDNE_OK) {
+		free(net);
+		ret_ptr(s->ctx, NULL);
+	}
+	if (s->nettype == LSDN_NET_VXLAN) {
+		lsdn_index_key_u32(&key, s->switch_type == LSDN_STATIC_E2E, s->vxlan.port);
+		if (lsdn_index_set(&s->ctx->vxlan_port_index, &net->vxlan_port_index_entry, &key) != LSDNE_OK) {
+			lsdn_index_clear(&s->ctx->vnet_id_index, &net->vnet_id_index_entry);
+			free(net);
+			ret_ptr(s->ctx, NULL);
+		}
+	}
 
 	lsdn_name_init(&net->name);
+	lsdn_index_init(&net->mac_index);
+	lsdn_index_init(&net->ip_index);
 	lsdn_names_init(&net->virt_names);
 	lsdn_list_init_add(&s->setting_users_list, &net->settings_users_entry);
 	lsdn_list_init_add(&s->ctx->networks_list, &net->networks_entry);
 	lsdn_list_init(&net->attached_list);
 	lsdn_list_init(&net->virt_list);
+	lsdn_list_init(&net->dirty_entry);
+	net_mark_dirty(net);
 	ret_ptr(s->ctx, net);
 }
 
@@ -301,8 +833,15 @@ static void net_do_free(struct lsdn_net *net)
 	assert(lsdn_is_list_empty(&net->virt_list));
 	lsdn_list_remove(&net->networks_entry);
 	lsdn_list_remove(&net->settings_users_entry);
+	clear_dirty(&net->dirty_entry);
+	lsdn_index_clear(&net->ctx->vnet_id_index, &net->vnet_id_index_entry);
+	lsdn_index_clear(&net->ctx->vxlan_port_index, &net->vxlan_port_index_entry);
+	lsdn_index_free(&net->mac_index);
+	lsdn_index_free(&net->ip_index);
 	lsdn_name_free(&net->name);
 	lsdn_names_free(&net->virt_names);
+	free(net->attr_rate_in);
+	free(net->attr_rate_out);
 	free(net);
 }
 
@@ -316,6 +855,7 @@ void lsdn_net_free(struct lsdn_net *net)
 	lsdn_foreach(net->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
 		phys_detach_by_pa(pa);
 	}
+	net_mark_dirty(net);
 	free_helper(net, net_do_free);
 }
 
@@ -331,6 +871,12 @@ const char* lsdn_net_get_name(struct lsdn_net *net)
 	return net->name.str;
 }
 
+/** Get the settings the network was created with. */
+struct lsdn_settings *lsdn_net_get_settings(struct lsdn_net *net)
+{
+	return net->settings;
+}
+
 /** Find a network by name.
  * @return #lsdn_net structure if a network with this name exists.
  * @return `NULL` otherwise. */
@@ -345,6 +891,71 @@ struct lsdn_net* lsdn_net_by_name(struct lsdn_context *ctx, const char *name)
 	return net;
 }
 
+/** Renew the virts using the aggregate policers of a network, their policing rules change. */
+static void renew_net_virts(struct lsdn_net *net)
+{
+	lsdn_foreach(net->virt_list, virt_entry, struct lsdn_virt, v) {
+		if (v->state != LSDN_STATE_DELETE)
+			renew_virt(v);
+	}
+}
+
+/* Changing a rate that is already set only replaces the shared policer during the commit, the
+ * virts are renewed only if the policer is added or removed. */
+lsdn_err_t lsdn_net_set_rate_in(struct lsdn_net *net, lsdn_qos_rate_t rate)
+{
+	lsdn_qos_rate_t *rate_dup = malloc(sizeof(*rate_dup));
+	if (rate_dup == NULL)
+		ret_err(net->ctx, LSDNE_NOMEM);
+	*rate_dup = rate;
+	if (!net->attr_rate_in)
+		renew_net_virts(net);
+	free(net->attr_rate_in);
+	net->attr_rate_in = rate_dup;
+	net_mark_dirty(net);
+	ret_err(net->ctx, LSDNE_OK);
+}
+
+void lsdn_net_clear_rate_in(struct lsdn_net *net)
+{
+	if (net->attr_rate_in)
+		renew_net_virts(net);
+	free(net->attr_rate_in);
+	net->attr_rate_in = NULL;
+}
+
+const lsdn_qos_rate_t *lsdn_net_get_rate_in(struct lsdn_net *net)
+{
+	return net->attr_rate_in;
+}
+
+lsdn_err_t lsdn_net_set_rate_out(struct lsdn_net *net, lsdn_qos_rate_t rate)
+{
+	lsdn_qos_rate_t *rate_dup = malloc(sizeof(*rate_dup));
+	if (rate_dup == NULL)
+		ret_err(net->ctx, LSDNE_NOMEM);
+	*rate_dup = rate;
+	if (!net->attr_rate_out)
+		renew_net_virts(net);
+	free(net->attr_rate_out);
+	net->attr_rate_out = rate_dup;
+	net_mark_dirty(net);
+	ret_err(net->ctx, LSDNE_OK);
+}
+
+void lsdn_net_clear_rate_out(struct lsdn_net *net)
+{
+	if (net->attr_rate_out)
+		renew_net_virts(net);
+	free(net->attr_rate_out);
+	net->attr_rate_out = NULL;
+}
+
+const lsdn_qos_rate_t *lsdn_net_get_rate_out(struct lsdn_net *net)
+{
+	return net->attr_rate_out;
+}
+
 /** Create a new phys.
  * Allocates and initializes a #lsdn_phys structure.
  *
@@ -361,17 +972,28 @@ struct lsdn_phys *lsdn_phys_new(struct lsdn_context *ctx)
 	phys->pending_free = false;
 	phys->attr_iface = NULL;
 	phys->attr_ip = NULL;
+	phys->attr_rate_in = NULL;
+	phys->attr_rate_out = NULL;
+	phys->aggregate_rate_in.created = false;
+	phys->aggregate_rate_in.users = 0;
+	phys->aggregate_rate_out.created = false;
+	phys->aggregate_rate_out.users = 0;
+	lsdn_vlan_bridge_init(&phys->vlan_bridge);
 	phys->is_local = false;
 	phys->committed_as_local = false;
 	lsdn_name_init(&phys->name);
 	lsdn_err_t err = lsdn_name_set(&phys->name, &ctx->phys_names, lsdn_mk_phys_name(ctx));
 	assert(err != LSDNE_DUPLICATE);
 	if (err == LSDNE_NOMEM) {
+		lsdn_vlan_bridge_free(&phys->vlan_bridge);
 		free(phys);
 		ret_ptr(ctx, NULL);
 	}
 	lsdn_list_init_add(&ctx->phys_list, &phys->phys_entry);
 	lsdn_list_init(&phys->attached_to_list);
+	lsdn_list_init(&phys->dirty_entry);
+	lsdn_index_member_init(&phys->ip_index_entry);
+	phys_mark_dirty(phys);
 	ret_ptr(ctx, phys);
 }
 
@@ -381,9 +1003,14 @@ struct lsdn_phys *lsdn_phys_new(struct lsdn_context *ctx)
 static void phys_do_free(struct lsdn_phys *phys)
 {
 	lsdn_list_remove(&phys->phys_entry);
+	clear_dirty(&phys->dirty_entry);
+	lsdn_index_clear(&phys->ctx->phys_ip_index, &phys->ip_index_entry);
 	lsdn_name_free(&phys->name);
 	free(phys->attr_iface);
 	free(phys->attr_ip);
+	free(phys->attr_rate_in);
+	free(phys->attr_rate_out);
+	lsdn_vlan_bridge_free(&phys->vlan_bridge);
 	free(phys);
 }
 
@@ -398,6 +1025,7 @@ void lsdn_phys_free(struct lsdn_phys *phys)
 		}
 		phys_detach_by_pa(pa);
 	}
+	phys_mark_dirty(phys);
 	free_helper(phys, phys_do_free);
 }
 
@@ -435,6 +1063,18 @@ struct lsdn_phys* lsdn_phys_by_name(struct lsdn_context *ctx, const char *name)
 	return p;
 }
 
+/* Track the IP versions of the physes attached to the network, see validate_dirty_pa */
+static void count_pa_ipv(struct lsdn_phys_attachment *a, const lsdn_ip_t *ip, bool add)
+{
+	if (!ip)
+		return;
+	size_t *count = (ip->v == LSDN_IPv4) ? &a->net->ipv4_pa_count : &a->net->ipv6_pa_count;
+	if (add)
+		(*count)++;
+	else
+		(*count)--;
+}
+
 static struct lsdn_phys_attachment* find_or_create_attachement(
 	struct lsdn_phys *phys, struct lsdn_net* net)
 {
@@ -457,7 +1097,12 @@ static struct lsdn_phys_attachment* find_or_create_attachement(
 	lsdn_list_init(&a->connected_virt_list);
 	lsdn_list_init(&a->remote_pa_list);
 	lsdn_list_init(&a->pa_view_list);
+	lsdn_list_init(&a->dirty_entry);
+	lsdn_list_init(&a->commit_group_entry);
 	a->explicitly_attached = false;
+	a->vlan_tunnel = NULL;
+	count_pa_ipv(a, phys->attr_ip, true);
+	lsdn_pa_mark_dirty(a);
 	return a;
 }
 
@@ -478,8 +1123,10 @@ lsdn_err_t lsdn_phys_attach(struct lsdn_phys *phys, struct lsdn_net* net)
 	if(!a)
 		ret_err(net->ctx, LSDNE_NOMEM);
 
-	if (!a->explicitly_attached)
-		renew(&phys->state);
+	if (!a->explicitly_attached) {
+		renew_phys(phys);
+		lsdn_pa_mark_dirty(a);
+	}
 
 	a->explicitly_attached = true;
 	ret_err(net->ctx, LSDNE_OK);
@@ -489,8 +1136,10 @@ static void pa_do_free(struct lsdn_phys_attachment *a)
 {
 	assert(lsdn_is_list_empty(&a->connected_virt_list));
 	assert(!a->explicitly_attached);
+	count_pa_ipv(a, a->phys->attr_ip, false);
 	lsdn_list_remove(&a->attached_entry);
 	lsdn_list_remove(&a->attached_to_entry);
+	clear_dirty(&a->dirty_entry);
 	free(a);
 }
 
@@ -502,12 +1151,16 @@ static void free_pa_if_possible(struct lsdn_phys_attachment *a)
 	 * the phys if the PA is not explicitly attached.
 	 */
 	if (lsdn_is_list_empty(&a->connected_virt_list) && !a->explicitly_attached) {
+		lsdn_pa_mark_dirty(a);
 		free_helper(a, pa_do_free);
 	}
 }
 
 static void phys_detach_by_pa(struct lsdn_phys_attachment *a)
 {
+	/* Virts still connected through the PA must be reported by the validation */
+	if (a->explicitly_attached)
+		lsdn_pa_mark_dirty(a);
 	a->explicitly_attached = false;
 	free_pa_if_possible(a);
 }
@@ -537,7 +1190,7 @@ lsdn_err_t lsdn_phys_set_iface(struct lsdn_phys *phys, const char *iface){
 		ret_err(phys->ctx, LSDNE_NOMEM);
 
 	if (!phys->attr_iface || strcmp(iface, phys->attr_iface))
-		renew(&phys->state);
+		renew_phys(phys);
 
 	free(phys->attr_iface);
 	phys->attr_iface = iface_dup;
@@ -547,7 +1200,7 @@ lsdn_err_t lsdn_phys_set_iface(struct lsdn_phys *phys, const char *iface){
 void lsdn_phys_clear_iface(struct lsdn_phys *phys)
 {
 	if (phys->attr_iface)
-		renew(&phys->state);
+		renew_phys(phys);
 	free(phys->attr_iface);
 	phys->attr_iface = NULL;
 }
@@ -564,9 +1217,20 @@ lsdn_err_t lsdn_phys_set_ip(struct lsdn_phys *phys, lsdn_ip_t ip)
 		ret_err(phys->ctx, LSDNE_NOMEM);
 	*ip_dup = ip;
 
+	struct lsdn_index_key key;
+	lsdn_index_key_ip(&key, ip);
+	if (lsdn_index_set(&phys->ctx->phys_ip_index, &phys->ip_index_entry, &key) != LSDNE_OK) {
+		free(ip_dup);
+		ret_err(phys->ctx, LSDNE_NOMEM);
+	}
+
 	if (!phys->attr_ip || !lsdn_ip_eq(ip, *phys->attr_ip))
-		renew(&phys->state);
+		renew_phys(phys);
 
+	lsdn_foreach(phys->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, a) {
+		count_pa_ipv(a, phys->attr_ip, false);
+		count_pa_ipv(a, ip_dup, true);
+	}
 	free(phys->attr_ip);
 	phys->attr_ip = ip_dup;
 	ret_err(phys->ctx, LSDNE_OK);
@@ -575,8 +1239,12 @@ lsdn_err_t lsdn_phys_set_ip(struct lsdn_phys *phys, lsdn_ip_t ip)
 void lsdn_phys_clear_ip(struct lsdn_phys *phys)
 {
 	if (phys->attr_ip)
-		renew(&phys->state);
+		renew_phys(phys);
 
+	lsdn_index_clear(&phys->ctx->phys_ip_index, &phys->ip_index_entry);
+	lsdn_foreach(phys->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, a) {
+		count_pa_ipv(a, phys->attr_ip, false);
+	}
 	free(phys->attr_ip);
 	phys->attr_ip = NULL;
 }
@@ -585,6 +1253,72 @@ const lsdn_ip_t *lsdn_phys_get_ip(struct lsdn_phys *phys) {
 	return phys->attr_ip;
 }
 
+/** Renew the virts using the aggregate policers of a phys, their policing rules change. */
+static void renew_phys_virts(struct lsdn_phys *phys)
+{
+	lsdn_foreach(phys->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, pa) {
+		lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
+			if (v->state != LSDN_STATE_DELETE)
+				renew_virt(v);
+		}
+	}
+}
+
+/* See lsdn_net_set_rate_in */
+lsdn_err_t lsdn_phys_set_rate_in(struct lsdn_phys *phys, lsdn_qos_rate_t rate)
+{
+	lsdn_qos_rate_t *rate_dup = malloc(sizeof(*rate_dup));
+	if (rate_dup == NULL)
+		ret_err(phys->ctx, LSDNE_NOMEM);
+	*rate_dup = rate;
+	if (!phys->attr_rate_in)
+		renew_phys_virts(phys);
+	free(phys->attr_rate_in);
+	phys->attr_rate_in = rate_dup;
+	phys_mark_dirty(phys);
+	ret_err(phys->ctx, LSDNE_OK);
+}
+
+void lsdn_phys_clear_rate_in(struct lsdn_phys *phys)
+{
+	if (phys->attr_rate_in)
+		renew_phys_virts(phys);
+	free(phys->attr_rate_in);
+	phys->attr_rate_in = NULL;
+}
+
+const lsdn_qos_rate_t *lsdn_phys_get_rate_in(struct lsdn_phys *phys)
+{
+	return phys->attr_rate_in;
+}
+
+lsdn_err_t lsdn_phys_set_rate_out(struct lsdn_phys *phys, lsdn_qos_rate_t rate)
+{
+	lsdn_qos_rate_t *rate_dup = malloc(sizeof(*rate_dup));
+	if (rate_dup == NULL)
+		ret_err(phys->ctx, LSDNE_NOMEM);
+	*rate_dup = rate;
+	if (!phys->attr_rate_out)
+		renew_phys_virts(phys);
+	free(phys->attr_rate_out);
+	phys->attr_rate_out = rate_dup;
+	phys_mark_dirty(phys);
+	ret_err(phys->ctx, LSDNE_OK);
+}
+
+void lsdn_phys_clear_rate_out(struct lsdn_phys *phys)
+{
+	if (phys->attr_rate_out)
+		renew_phys_virts(phys);
+	free(phys->attr_rate_out);
+	phys->attr_rate_out = NULL;
+}
+
+const lsdn_qos_rate_t *lsdn_phys_get_rate_out(struct lsdn_phys *phys)
+{
+	return phys->attr_rate_out;
+}
+
 /** Assign a local phys.
  * All participants in a LSDN network must share a compatible memory model.
  * That means that every host's model contains all the physes in the network.
@@ -593,7 +1327,7 @@ const lsdn_ip_t *lsdn_phys_get_ip(struct lsdn_phys *phys) {
 lsdn_err_t lsdn_phys_claim_local(struct lsdn_phys *phys)
 {
 	if (!phys->is_local) {
-		renew(&phys->state);
+		renew_phys(phys);
 		phys->is_local = true;
 	}
 
@@ -605,7 +1339,7 @@ lsdn_err_t lsdn_phys_claim_local(struct lsdn_phys *phys)
 lsdn_err_t lsdn_phys_unclaim_local(struct lsdn_phys *phys)
 {
 	if (phys->is_local) {
-		renew(&phys->state);
+		renew_phys(phys);
 		phys->is_local = false;
 	}
 	return LSDNE_OK;
@@ -625,17 +1359,26 @@ struct lsdn_virt *lsdn_virt_new(struct lsdn_net *net){
 	virt->attr_mac = NULL;
 	virt->attr_rate_in = NULL;
 	virt->attr_rate_out = NULL;
+	virt->attr_ip = NULL;
+	virt->attr_qos_mode = LSDN_QOS_DEFAULT;
 	virt->connected_through = NULL;
 	virt->committed_to = NULL;
 	virt->ht_in_rules = NULL;
 	virt->ht_out_rules = NULL;
-	virt->commited_policing_in = NULL;
-	virt->commited_policing_out = NULL;
+	virt->commited_policing_in.prio = NULL;
+	virt->commited_policing_out.prio = NULL;
+	virt->commited_shaping_parent = 0;
+	virt->shared_block = false;
 	lsdn_if_init(&virt->connected_if);
 	lsdn_if_init(&virt->committed_if);
 	lsdn_name_init(&virt->name);
 	lsdn_list_init_add(&net->virt_list, &virt->virt_entry);
 	lsdn_list_init(&virt->virt_view_list);
+	lsdn_list_init(&virt->dirty_entry);
+	lsdn_list_init(&virt->commit_group_entry);
+	lsdn_index_member_init(&virt->mac_index_entry);
+	lsdn_index_member_init(&virt->ip_index_entry);
+	lsdn_virt_mark_dirty(virt);
 	ret_ptr(net->ctx, virt);
 }
 
@@ -659,12 +1402,16 @@ static void virt_do_free(struct lsdn_virt *virt)
 		virt->connected_through = NULL;
 	}
 	lsdn_list_remove(&virt->virt_entry);
+	clear_dirty(&virt->dirty_entry);
+	lsdn_index_clear(&virt->network->mac_index, &virt->mac_index_entry);
+	lsdn_index_clear(&virt->network->ip_index, &virt->ip_index_entry);
 	lsdn_name_free(&virt->name);
 	lsdn_if_free(&virt->connected_if);
 	lsdn_if_free(&virt->committed_if);
 	free(virt->attr_mac);
 	free(virt->attr_rate_in);
 	free(virt->attr_rate_out);
+	free(virt->attr_ip);
 	free(virt);
 }
 
@@ -672,6 +1419,7 @@ static void virt_do_free(struct lsdn_virt *virt)
 void lsdn_virt_free(struct lsdn_virt *virt)
 {
 	lsdn_vrs_free_all(virt);
+	lsdn_virt_mark_dirty(virt);
 	free_helper(virt, virt_do_free);
 }
 
@@ -722,7 +1470,7 @@ lsdn_err_t lsdn_virt_connect(
 
 	lsdn_virt_disconnect(virt);
 	virt->connected_through = a;
-	renew(&virt->state);
+	renew_virt(virt);
 	lsdn_list_init_add(&a->connected_virt_list, &virt->connected_virt_entry);
 
 	ret_err(phys->ctx, LSDNE_OK);
@@ -736,7 +1484,7 @@ void lsdn_virt_disconnect(struct lsdn_virt *virt){
 
 	lsdn_list_remove(&virt->connected_virt_entry);
 	virt->connected_through = NULL;
-	renew(&virt->state);
+	renew_virt(virt);
 }
 
 lsdn_err_t lsdn_virt_set_mac(struct lsdn_virt *virt, lsdn_mac_t mac)
@@ -749,16 +1497,24 @@ lsdn_err_t lsdn_virt_set_mac(struct lsdn_virt *virt, lsdn_mac_t mac)
 		ret_err(virt->network->ctx, LSDNE_NOMEM);
 	*mac_dup = mac;
 
+	struct lsdn_index_key key;
+	lsdn_index_key_mac(&key, mac);
+	if (lsdn_index_set(&virt->network->mac_index, &virt->mac_index_entry, &key) != LSDNE_OK) {
+		free(mac_dup);
+		ret_err(virt->network->ctx, LSDNE_NOMEM);
+	}
+
 	free(virt->attr_mac);
 	virt->attr_mac = mac_dup;
-	renew(&virt->state);
+	renew_virt(virt);
 	ret_err(virt->network->ctx, LSDNE_OK);
 }
 
 void lsdn_virt_clear_mac(struct lsdn_virt *virt)
 {
 	if (virt->attr_mac)
-		renew(&virt->state);
+		renew_virt(virt);
+	lsdn_index_clear(&virt->network->mac_index, &virt->mac_index_entry);
 	free(virt->attr_mac);
 	virt->attr_mac = NULL;
 }
@@ -768,6 +1524,43 @@ const lsdn_mac_t *lsdn_virt_get_mac(struct lsdn_virt *virt)
 	return virt->attr_mac;
 }
 
+lsdn_err_t lsdn_virt_set_ip(struct lsdn_virt *virt, lsdn_ip_t ip)
+{
+	if (virt->attr_ip && lsdn_ip_eq(*virt->attr_ip, ip))
+		ret_err(virt->network->ctx, LSDNE_OK);
+
+	lsdn_ip_t *ip_dup = malloc(sizeof(*ip_dup));
+	if (ip_dup == NULL)
+		ret_err(virt->network->ctx, LSDNE_NOMEM);
+	*ip_dup = ip;
+
+	struct lsdn_index_key key;
+	lsdn_index_key_ip(&key, ip);
+	if (lsdn_index_set(&virt->network->ip_index, &virt->ip_index_entry, &key) != LSDNE_OK) {
+		free(ip_dup);
+		ret_err(virt->network->ctx, LSDNE_NOMEM);
+	}
+
+	free(virt->attr_ip);
+	virt->attr_ip = ip_dup;
+	renew_virt(virt);
+	ret_err(virt->network->ctx, LSDNE_OK);
+}
+
+void lsdn_virt_clear_ip(struct lsdn_virt *virt)
+{
+	if (virt->attr_ip)
+		renew_virt(virt);
+	lsdn_index_clear(&virt->network->ip_index, &virt->ip_index_entry);
+	free(virt->attr_ip);
+	virt->attr_ip = NULL;
+}
+
+const lsdn_ip_t *lsdn_virt_get_ip(struct lsdn_virt *virt)
+{
+	return virt->attr_ip;
+}
+
 /** Get recommended MTU for a given virt.
  * Calculates the appropriate MTU value, taking into account the network's tunneling 
  * method overhead.
@@ -794,7 +1587,7 @@ lsdn_err_t lsdn_virt_get_recommended_mtu(struct lsdn_virt *virt, unsigned int *m
 
 	if (phys && phys->attr_iface) {
 		phys_if.ifname = phys->attr_iface;
-		ret = lsdn_if_resolve(&phys_if);
+		ret = lsdn_if_resolve(ctx->nlsock, &phys_if);
 		if (ret != LSDNE_OK)
 			ret_err(ctx, ret);
 		ret = lsdn_link_get_mtu(ctx->nlsock, phys_if.ifindex, mtu);
@@ -815,14 +1608,14 @@ lsdn_err_t lsdn_virt_set_rate_in(struct lsdn_virt *virt, lsdn_qos_rate_t rate)
 	*rate_dup = rate;
 	free(virt->attr_rate_in);
 	virt->attr_rate_in = rate_dup;
-	renew(&virt->state);
+	renew_virt(virt);
 	ret_err(virt->network->ctx, LSDNE_OK);
 }
 
 void lsdn_virt_clear_rate_in(struct lsdn_virt *virt)
 {
 	if (virt->attr_rate_in)
-		renew(&virt->state);
+		renew_virt(virt);
 	free(virt->attr_rate_in);
 	virt->attr_rate_in = NULL;
 }
@@ -840,14 +1633,14 @@ lsdn_err_t lsdn_virt_set_rate_out(struct lsdn_virt *virt, lsdn_qos_rate_t rate)
 	*rate_dup = rate;
 	free(virt->attr_rate_out);
 	virt->attr_rate_out = rate_dup;
-	renew(&virt->state);
+	renew_virt(virt);
 	ret_err(virt->network->ctx, LSDNE_OK);
 }
 
 void lsdn_virt_clear_rate_out(struct lsdn_virt *virt)
 {
 	if (virt->attr_rate_out)
-		renew(&virt->state);
+		renew_virt(virt);
 	free(virt->attr_rate_out);
 	virt->attr_rate_out = NULL;
 }
@@ -857,6 +1650,28 @@ const lsdn_qos_rate_t *lsdn_virt_get_rate_out(struct lsdn_virt *virt)
 	return virt->attr_rate_out;
 }
 
+/** Set how the virt enforces its inbound bandwidth limit.
+ * #LSDN_QOS_DEFAULT uses the mode of the network settings (#lsdn_settings_set_qos_mode). */
+void lsdn_virt_set_qos_mode(struct lsdn_virt *virt, enum lsdn_qos_mode mode)
+{
+	if (virt->attr_qos_mode != mode && virt->attr_rate_in)
+		renew_virt(virt);
+	virt->attr_qos_mode = mode;
+}
+
+enum lsdn_qos_mode lsdn_virt_get_qos_mode(struct lsdn_virt *virt)
+{
+	return virt->attr_qos_mode;
+}
+
+/** The mode the virt's inbound limit is enforced in, after applying the settings default. */
+static enum lsdn_qos_mode effective_qos_mode(struct lsdn_virt *virt)
+{
+	if (virt->attr_qos_mode != LSDN_QOS_DEFAULT)
+		return virt->attr_qos_mode;
+	return virt->network->settings->qos_mode;
+}
+
 static bool should_be_validated(enum lsdn_state state) {
 	return state == LSDN_STATE_NEW || state == LSDN_STATE_RENEW;
 }
@@ -866,47 +1681,17 @@ static bool will_be_deleted(enum lsdn_state state)
 	return state == LSDN_STATE_DELETE;
 }
 
-static void report_virts(struct lsdn_phys_attachment *pa)
-{
-	lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v)
-	{
-		if(!should_be_validated(v->state))
-			continue;
-		lsdn_problem_report(pa->net->ctx, LSDNP_PHYS_NOT_ATTACHED,
-			LSDNS_VIRT, v,
-			LSDNS_NET, pa->net,
-			LSDNS_PHYS, pa->phys,
-			LSDNS_END);
-	}
-}
-
-static void validate_rate(struct lsdn_virt *v, const char *attr_name, const lsdn_qos_rate_t *rate)
+/** Check a rate attribute of a virt, network or phys (given by `subj_type` and `subj`). */
+static void validate_rate(
+	struct lsdn_context *ctx, enum lsdn_problem_ref_type subj_type, void *subj,
+	const char *attr_name, const lsdn_qos_rate_t *rate)
 {
 	if (!rate)
 		return;
 	if (rate->avg_rate <= 1e-5 || rate->burst_size == 0 || rate->burst_rate <= -1e-5)
-		lsdn_problem_report(v->network->ctx, LSDNP_RATES_INVALID,
+		lsdn_problem_report(ctx, LSDNP_RATES_INVALID,
 			LSDNS_ATTR, attr_name,
-			LSDNS_VIRT, v, LSDNS_END);
-}
-
-static void validate_virts_pa(struct lsdn_phys_attachment *pa)
-{
-	lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v){
-		if(!should_be_validated(v->state))
-			continue;
-		if(pa->explicitly_attached && pa->phys->is_local)
-		{
-			lsdn_err_t err = lsdn_if_resolve(&v->connected_if);
-			if(err != LSDNE_OK)
-				lsdn_problem_report(
-					v->network->ctx, LSDNP_VIRT_NOIF,
-					LSDNS_IF, &v->connected_if,
-					LSDNS_VIRT, v, LSDNS_END);
-		}	
-		if(pa->net->settings->ops->validate_virt)
-			pa->net->settings->ops->validate_virt(v);
-	}
+			subj_type, subj, LSDNS_END);
 }
 
 static void validate_rules(struct lsdn_virt *virt, struct vr_prio *ht_prio)
@@ -1015,57 +1800,166 @@ static void decommit_rules(struct lsdn_virt *virt, struct vr_prio *ht_prio, enum
 			propagate(&virt->state, &r->state);
 			if (ack_decommit(&r->state))
 				decommit_vr(virt, prio, r, dir);
+			ack_delete(r, lsdn_vr_do_free);
 		}
 	}
 }
 
-static void rates_action(struct lsdn_filter *f, uint16_t order, struct lsdn_virt *v, const lsdn_qos_rate_t *rate)
+/* The user is the #lsdn_virt_policing, the policers are chained: the virt's own first, then the
+ * aggregates. A packet is dropped by the first policer it exceeds. */
+static void rates_action(struct lsdn_filter *f, uint16_t order, void *user)
+{
+	struct lsdn_virt_policing *policing = user;
+	if (policing->has_own)
+		lsdn_mkaction_shared(f, order++, &policing->own);
+	for (size_t i = 0; i < policing->aggregate_count; i++)
+		lsdn_mkaction_shared(f, order++, &policing->aggregates[i]->police);
+	lsdn_action_continue(f, order);
+}
+
+static lsdn_err_t police_init(
+	struct lsdn_shared_action *police, struct lsdn_context *ctx, const lsdn_qos_rate_t *rate)
 {
 	unsigned int mtu = 0xFFFF;
-	lsdn_action_police(f,
-		order, rate->avg_rate, rate->burst_size, rate->burst_rate, mtu,
+	return lsdn_shared_police_init(police, ctx,
+		rate->avg_rate, rate->burst_size, rate->burst_rate, mtu,
 		TC_ACT_PIPE, TC_ACT_SHOT);
-	lsdn_action_continue(f, order+1);
 }
 
-static void rates_action_out(struct lsdn_filter *f, uint16_t order, void *user)
+/** Start using an aggregate policer, creating it for the first user. */
+static lsdn_err_t aggregate_acquire(
+	struct lsdn_aggregate_rate *aggr, struct lsdn_context *ctx, const lsdn_qos_rate_t *rate)
 {
-	struct lsdn_virt *v = user;
-	const lsdn_qos_rate_t *rate = v->attr_rate_out;
-	rates_action(f, order, v, rate);
+	if (!aggr->created) {
+		lsdn_err_t err = police_init(&aggr->police, ctx, rate);
+		if (err != LSDNE_OK)
+			return err;
+		aggr->created = true;
+		aggr->committed_rate = *rate;
+	}
+	aggr->users++;
+	return LSDNE_OK;
 }
 
-static void rates_action_in(struct lsdn_filter *f, uint16_t order, void *user)
+/** Free an aggregate policer that is not used by any virt. */
+static void aggregate_sweep(struct lsdn_aggregate_rate *aggr)
 {
-	struct lsdn_virt *v = user;
-	const lsdn_qos_rate_t *rate = v->attr_rate_in;
-	rates_action(f, order, v, rate);
+	if (aggr->created && aggr->users == 0) {
+		lsdn_shared_action_free(&aggr->police);
+		aggr->created = false;
+	}
+}
+
+/* The unused aggregate policers are swept at the end of the commit, the network and phys are
+ * marked dirty so that they are visited. */
+static void release_policers(
+	struct lsdn_virt *v, struct lsdn_phys *phys, struct lsdn_virt_policing *policing)
+{
+	if (policing->has_own)
+		lsdn_shared_action_free(&policing->own);
+	for (size_t i = 0; i < policing->aggregate_count; i++) {
+		assert(policing->aggregates[i]->users > 0);
+		policing->aggregates[i]->users--;
+	}
+	if (policing->aggregate_count > 0) {
+		net_mark_dirty(v->network);
+		phys_mark_dirty(phys);
+	}
 }
 
+/** Commit the policing of one direction of a virt.
+ * The aggregate rates are given in the same order as `aggregates`, `NULL` if not set. */
 static lsdn_err_t commit_rates_inout(
 	struct lsdn_virt *v,
-	struct lsdn_ruleset_prio **commited_policing_prio,
-	struct lsdn_rule *comitted_policing_rule,
+	struct lsdn_phys *phys,
+	struct lsdn_virt_policing *policing,
 	struct lsdn_ruleset *rules,
-	lsdn_mkaction_fn action)
-{
-	lsdn_err_t err;
+	const lsdn_qos_rate_t *rate,
+	struct lsdn_aggregate_rate *aggregates[2],
+	const lsdn_qos_rate_t *aggregate_rates[2])
+{
+	lsdn_err_t err = LSDNE_OK;
+	struct lsdn_context *ctx = v->network->ctx;
+
+	policing->prio = NULL;
+	policing->has_own = false;
+	policing->aggregate_count = 0;
+	if (rate) {
+		err = police_init(&policing->own, ctx, rate);
+		if (err != LSDNE_OK)
+			return err;
+		policing->has_own = true;
+	}
+	for (size_t i = 0; i < 2; i++) {
+		if (!aggregate_rates[i])
+			continue;
+		err = aggregate_acquire(aggregates[i], ctx, aggregate_rates[i]);
+		if (err != LSDNE_OK) {
+			release_policers(v, phys, policing);
+			return err;
+		}
+		policing->aggregates[policing->aggregate_count++] = aggregates[i];
+	}
+	if (!policing->has_own && policing->aggregate_count == 0)
+		return LSDNE_OK;
 
-	*commited_policing_prio =
-		lsdn_ruleset_define_prio(rules, LSDN_IF_PRIO_POLICING);
-	if (!*commited_policing_prio)
+	policing->prio = lsdn_ruleset_define_prio(rules, LSDN_IF_PRIO_POLICING);
+	if (!policing->prio) {
+		release_policers(v, phys, policing);
 		return LSDNE_NOMEM;
-	comitted_policing_rule->subprio = 0;
-	lsdn_action_init(&comitted_policing_rule->action, 2, action, v);
-	err = lsdn_ruleset_add(*commited_policing_prio, comitted_policing_rule);
+	}
+	policing->rule.subprio = 0;
+	lsdn_action_init(&policing->rule.action,
+		policing->has_own + policing->aggregate_count + 1, rates_action, policing);
+	err = lsdn_ruleset_add(policing->prio, &policing->rule);
 	if (err != LSDNE_OK) {
-		err = lsdn_ruleset_remove_prio(*commited_policing_prio);
-		if (err != LSDNE_OK) {
-			v->network->ctx->inconsistent = true;
+		release_policers(v, phys, policing);
+		if (lsdn_ruleset_remove_prio(policing->prio) != LSDNE_OK) {
+			ctx->inconsistent = true;
 			return LSDNE_INCONSISTENT;
 		}
-		*commited_policing_prio = NULL;
+		policing->prio = NULL;
+	}
+	return err;
+}
+
+/** Check if the virt needs rules on its egress (our ingress), so it can not share a block.
+ * The outbound rules count until they are decommitted. */
+bool lsdn_virt_has_ingress_rules(struct lsdn_virt *v)
+{
+	if (v->attr_rate_out || v->network->attr_rate_out)
+		return true;
+	if (v->connected_through && v->connected_through->phys->attr_rate_out)
+		return true;
+	struct vr_prio *prio, *tmp;
+	HASH_ITER(hh, v->ht_out_rules, prio, tmp) {
+		lsdn_foreach(prio->rules_list, rules_entry, struct lsdn_vr, r) {
+			if (r->state != LSDN_STATE_DELETE)
+				return true;
+		}
 	}
+	return false;
+}
+
+/** The shaper is the root qdisc if it is free (clsact mode), otherwise it is nested in the band
+ * of the root prio qdisc carrying all the traffic. */
+static uint32_t shaping_parent(struct lsdn_virt *virt)
+{
+	if (virt->rules_out.parent_handle == LSDN_CLSACT_EGRESS_PARENT)
+		return TC_H_ROOT;
+	return LSDN_ROOT_BAND;
+}
+
+static lsdn_err_t commit_shaping(struct lsdn_virt *virt)
+{
+	struct lsdn_context *ctx = virt->network->ctx;
+	const lsdn_qos_rate_t *rate = virt->attr_rate_in;
+	uint32_t parent = shaping_parent(virt);
+	lsdn_err_t err = lsdn_qdisc_shaping_create(ctx->nlsock, virt->committed_if.ifindex, parent,
+		rate->avg_rate, rate->burst_size);
+	if (err != LSDNE_OK)
+		return err;
+	virt->commited_shaping_parent = parent;
 	return LSDNE_OK;
 }
 
@@ -1075,112 +1969,443 @@ static lsdn_err_t commit_rates(struct lsdn_virt *virt)
 	/* If you think the ins/outs are reversed here, please see comments at virt->rules_out and
 	 * virt->attr_rate_out.*/
 	lsdn_err_t err;
-	if (virt->attr_rate_in) {
-		err = commit_rates_inout(
-			virt, &virt->commited_policing_in, &virt->commited_policing_rule_in,
-			&virt->rules_out, rates_action_in);
-		if (err != LSDNE_OK)
-			return err;
-	}
-
+	struct lsdn_context *ctx = virt->network->ctx;
+	struct lsdn_net *net = virt->network;
+	struct lsdn_phys *phys = virt->committed_to->phys;
+	bool shape = virt->attr_rate_in && effective_qos_mode(virt) == LSDN_QOS_SHAPE;
+
+	/* A shaper left by a previous run is not found by the reconciliation */
+	if (!shape && ctx->reconcile)
+		lsdn_qdisc_shaping_delete(ctx->nlsock, virt->committed_if.ifindex, shaping_parent(virt));
+
+	struct lsdn_aggregate_rate *aggregates_in[2] = {&net->aggregate_rate_in, &phys->aggregate_rate_in};
+	const lsdn_qos_rate_t *rates_in[2] = {net->attr_rate_in, phys->attr_rate_in};
+	err = commit_rates_inout(
+		virt, phys, &virt->commited_policing_in, &virt->rules_out,
+		shape ? NULL : virt->attr_rate_in, aggregates_in, rates_in);
+	if (err != LSDNE_OK)
+		return err;
 
-	if (virt->attr_rate_out) {
-		err = commit_rates_inout(
-			virt, &virt->commited_policing_out, &virt->commited_policing_rule_out,
-			&virt->rules_in, rates_action_out);
+	if (shape) {
+		err = commit_shaping(virt);
 		if (err != LSDNE_OK) {
 			decommit_rates(virt);
 			return err;
 		}
 	}
+
+	struct lsdn_aggregate_rate *aggregates_out[2] = {&net->aggregate_rate_out, &phys->aggregate_rate_out};
+	const lsdn_qos_rate_t *rates_out[2] = {net->attr_rate_out, phys->attr_rate_out};
+	err = commit_rates_inout(
+		virt, phys, &virt->commited_policing_out, &virt->rules_in, virt->attr_rate_out,
+		aggregates_out, rates_out);
+	if (err != LSDNE_OK) {
+		decommit_rates(virt);
+		return err;
+	}
 	return LSDNE_OK;
 }
 
+static void decommit_rates_inout(struct lsdn_virt *virt, struct lsdn_virt_policing *policing)
+{
+	struct lsdn_context *ctx = virt->network->ctx;
+	if (!policing->prio)
+		return;
+	mark_commit_err(ctx, &virt->state, LSDNS_VIRT, virt, true,
+		lsdn_ruleset_remove(&policing->rule));
+	mark_commit_err(ctx, &virt->state, LSDNS_VIRT, virt, true,
+		lsdn_ruleset_remove_prio(policing->prio));
+	release_policers(virt, virt->committed_to->phys, policing);
+	policing->prio = NULL;
+}
+
 static void decommit_rates(struct lsdn_virt *virt)
 {
 	struct lsdn_context *ctx = virt->network->ctx;
-	if (virt->commited_policing_in) {
-		mark_commit_err(ctx, &virt->state, LSDNS_VIRT, virt, true,
-			lsdn_ruleset_remove(&virt->commited_policing_rule_in));
-		mark_commit_err(ctx, &virt->state, LSDNS_VIRT, virt, true,
-			lsdn_ruleset_remove_prio(virt->commited_policing_in));
-		virt->commited_policing_in = NULL;
+	decommit_rates_inout(virt, &virt->commited_policing_in);
+	decommit_rates_inout(virt, &virt->commited_policing_out);
+	if (virt->commited_shaping_parent) {
+		if (!ctx->disable_decommit)
+			mark_commit_err(ctx, &virt->state, LSDNS_VIRT, virt, true,
+				lsdn_qdisc_shaping_delete(ctx->nlsock, virt->committed_if.ifindex,
+					virt->commited_shaping_parent));
+		virt->commited_shaping_parent = 0;
 	}
-	if (virt->commited_policing_out) {
-		mark_commit_err(ctx, &virt->state, LSDNS_VIRT, virt, true,
-			lsdn_ruleset_remove(&virt->commited_policing_rule_out));
-		mark_commit_err(ctx, &virt->state, LSDNS_VIRT, virt, true,
-			lsdn_ruleset_remove_prio(virt->commited_policing_out));
-		virt->commited_policing_out = NULL;
+}
+
+/** Free the aggregate policer if unused, or replace it in place if its rate has changed since
+ * it was created. The filters referencing it are not touched. */
+static void commit_aggregate_rate(
+	struct lsdn_context *ctx, struct lsdn_aggregate_rate *aggr, const lsdn_qos_rate_t *rate)
+{
+	aggregate_sweep(aggr);
+	if (!aggr->created)
+		return;
+	if (memcmp(&aggr->committed_rate, rate, sizeof(*rate)) == 0)
+		return;
+	lsdn_err_t err = lsdn_action_police_create(ctx->nlsock, aggr->police.index, true,
+		rate->avg_rate, rate->burst_size, rate->burst_rate, 0xFFFF,
+		TC_ACT_PIPE, TC_ACT_SHOT, NULL, NULL);
+	if (err != LSDNE_OK) {
+		ctx->inconsistent = true;
+		return;
 	}
+	aggr->committed_rate = *rate;
 }
 
-static void validate_virts_net(struct lsdn_net *net)
+/* Validate a changed virt. Attributes shared with other virts are checked against the virts with
+ * the same value, a conflict is reported from both sides, as if the other virt was changed too. */
+static void validate_dirty_virt(struct lsdn_virt *v1)
 {
-	lsdn_foreach(net->virt_list, virt_entry, struct lsdn_virt, v1) {
-		validate_rules(v1, v1->ht_in_rules);
-		validate_rules(v1, v1->ht_out_rules);
-		validate_rate(v1, "rate_in", v1->attr_rate_in);
-		validate_rate(v1, "rate_out", v1->attr_rate_out);
+	struct lsdn_net *net = v1->network;
+	struct lsdn_phys_attachment *pa = v1->connected_through;
+	if (will_be_deleted(net->state))
+		return;
 
-		if (!should_be_validated(v1->state) || !v1->attr_mac)
-			continue;
-		lsdn_foreach(net->virt_list, virt_entry, struct lsdn_virt, v2) {
-			if (v1 == v2 || !should_be_validated(v2->state) || !v2->attr_mac)
+	validate_rules(v1, v1->ht_in_rules);
+	validate_rules(v1, v1->ht_out_rules);
+	validate_rate(net->ctx, LSDNS_VIRT, v1, "rate_in", v1->attr_rate_in);
+	validate_rate(net->ctx, LSDNS_VIRT, v1, "rate_out", v1->attr_rate_out);
+
+	if (!should_be_validated(v1->state))
+		return;
+
+	if (v1->attr_mac) {
+		struct lsdn_index_group *same_mac = v1->mac_index_entry.group;
+		lsdn_foreach(same_mac->members, entry, struct lsdn_index_member, m) {
+			struct lsdn_virt *v2 = lsdn_container_of(m, struct lsdn_virt, mac_index_entry);
+			if (v1 == v2 || will_be_deleted(v2->state))
 				continue;
-			if (lsdn_mac_eq(*v1->attr_mac, *v2->attr_mac))
+			lsdn_problem_report(
+				net->ctx, LSDNP_VIRT_DUPATTR,
+				LSDNS_ATTR, "mac",
+				LSDNS_VIRT, v1,
+				LSDNS_VIRT, v2,
+				LSDNS_NET, net,
+				LSDNS_END);
+			if (!is_dirty(&v2->dirty_entry))
 				lsdn_problem_report(
 					net->ctx, LSDNP_VIRT_DUPATTR,
 					LSDNS_ATTR, "mac",
+					LSDNS_VIRT, v2,
 					LSDNS_VIRT, v1,
+					LSDNS_NET, net,
+					LSDNS_END);
+		}
+	}
+
+	if (v1->attr_ip) {
+		struct lsdn_index_group *same_ip = v1->ip_index_entry.group;
+		lsdn_foreach(same_ip->members, entry, struct lsdn_index_member, m) {
+			struct lsdn_virt *v2 = lsdn_container_of(m, struct lsdn_virt, ip_index_entry);
+			if (v1 == v2 || will_be_deleted(v2->state))
+				continue;
+			lsdn_problem_report(
+				net->ctx, LSDNP_VIRT_DUPATTR,
+				LSDNS_ATTR, "ip",
+				LSDNS_VIRT, v1,
+				LSDNS_VIRT, v2,
+				LSDNS_NET, net,
+				LSDNS_END);
+			if (!is_dirty(&v2->dirty_entry))
+				lsdn_problem_report(
+					net->ctx, LSDNP_VIRT_DUPATTR,
+					LSDNS_ATTR, "ip",
 					LSDNS_VIRT, v2,
+					LSDNS_VIRT, v1,
 					LSDNS_NET, net,
 					LSDNS_END);
 		}
 	}
+
+	if (!pa || will_be_deleted(pa->phys->state))
+		return;
+	if (!pa->explicitly_attached) {
+		lsdn_problem_report(net->ctx, LSDNP_PHYS_NOT_ATTACHED,
+			LSDNS_VIRT, v1,
+			LSDNS_NET, net,
+			LSDNS_PHYS, pa->phys,
+			LSDNS_END);
+		return;
+	}
+	if (pa->phys->is_local) {
+		lsdn_err_t err = lsdn_if_resolve(net->ctx->nlsock, &v1->connected_if);
+		if (err != LSDNE_OK)
+			lsdn_problem_report(
+				net->ctx, LSDNP_VIRT_NOIF,
+				LSDNS_IF, &v1->connected_if,
+				LSDNS_VIRT, v1, LSDNS_END);
+	}
+	if (net->settings->ops->validate_virt) {
+		net->ctx->stats.ops.validate_virt++;
+		net->settings->ops->validate_virt(v1);
+	}
 }
 
-static void cross_validate_networks(struct lsdn_net *net1, struct lsdn_net *net2)
+static void validate_dirty_pa(struct lsdn_phys_attachment *a)
 {
-	struct lsdn_settings *s1 = net1->settings;
-	struct lsdn_settings *s2 = net2->settings;
+	struct lsdn_context *ctx = a->net->ctx;
+	struct lsdn_phys *p = a->phys;
+	if (will_be_deleted(p->state))
+		return;
+
+	if (a->explicitly_attached) {
+		if (p->is_local && !p->attr_iface)
+			lsdn_problem_report(
+				ctx, LSDNP_PHYS_NOATTR,
+				LSDNS_ATTR, "iface",
+				LSDNS_PHYS, p,
+				LSDNS_NET, a->net,
+				LSDNS_END);
+
+		if(should_be_validated(a->state) && a->net->settings->ops->validate_pa) {
+			ctx->stats.ops.validate_pa++;
+			a->net->settings->ops->validate_pa(a);
+		}
+	}
+
+	if (!p->attr_ip)
+		return;
+	/* The attachments only need to be walked if some of them has a different IP version */
+	if ((p->attr_ip->v == LSDN_IPv4 ? a->net->ipv6_pa_count : a->net->ipv4_pa_count) == 0)
+		return;
+	lsdn_foreach(a->net->attached_list, attached_entry, struct lsdn_phys_attachment, a_other) {
+		if (a == a_other)
+			continue;
+		if (!a_other->phys->attr_ip || will_be_deleted(a_other->phys->state))
+			continue;
+		if (!lsdn_ipv_eq(*p->attr_ip, *a_other->phys->attr_ip)) {
+			lsdn_problem_report(
+				ctx, LSDNP_PHYS_INCOMPATIBLE_IPV,
+				LSDNS_PHYS, p,
+				LSDNS_PHYS, a_other->phys,
+				LSDNS_NET, a->net,
+				LSDNS_END);
+			/* Report from both sides, as if the other was changed too */
+			if (!is_dirty(&a_other->dirty_entry))
+				lsdn_problem_report(
+					ctx, LSDNP_PHYS_INCOMPATIBLE_IPV,
+					LSDNS_PHYS, a_other->phys,
+					LSDNS_PHYS, p,
+					LSDNS_NET, a->net,
+					LSDNS_END);
+		}
+	}
+}
+
+static void validate_dirty_phys(struct lsdn_phys *p)
+{
+	struct lsdn_context *ctx = p->ctx;
+	if (will_be_deleted(p->state))
+		return;
+
+	validate_rate(ctx, LSDNS_PHYS, p, "rate_in", p->attr_rate_in);
+	validate_rate(ctx, LSDNS_PHYS, p, "rate_out", p->attr_rate_out);
+	if (!p->attr_ip)
+		return;
 
-	if (s1->nettype == s2->nettype && net1->vnet_id == net2->vnet_id)
+	struct lsdn_index_group *same_ip = p->ip_index_entry.group;
+	lsdn_foreach(same_ip->members, entry, struct lsdn_index_member, m) {
+		struct lsdn_phys *p_other = lsdn_container_of(m, struct lsdn_phys, ip_index_entry);
+		if (p == p_other || will_be_deleted(p_other->state))
+			continue;
 		lsdn_problem_report(
-			s1->ctx, LSDNP_NET_DUPID,
-			LSDNS_NET, net1,
-			LSDNS_NET, net2,
-			LSDNS_NETID, net1->vnet_id,
+			ctx, LSDNP_PHYS_DUPATTR,
+			LSDNS_ATTR, "ip",
+			LSDNS_PHYS, p,
+			LSDNS_PHYS, p_other,
 			LSDNS_END);
+		if (!is_dirty(&p_other->dirty_entry))
+			lsdn_problem_report(
+				ctx, LSDNP_PHYS_DUPATTR,
+				LSDNS_ATTR, "ip",
+				LSDNS_PHYS, p_other,
+				LSDNS_PHYS, p,
+				LSDNS_END);
+	}
+}
+
+static bool has_local_pa(struct lsdn_net *net)
+{
+	lsdn_foreach(net->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
+		if (pa->phys->is_local)
+			return true;
+	}
+	return false;
+}
+
+static void report_dupid(struct lsdn_net *net1, struct lsdn_net *net2)
+{
+	lsdn_problem_report(
+		net1->ctx, LSDNP_NET_DUPID,
+		LSDNS_NET, net1,
+		LSDNS_NET, net2,
+		LSDNS_NETID, net1->vnet_id,
+		LSDNS_END);
+}
 
-	bool check_nettypes = false;
-	lsdn_foreach(net1->attached_list, attached_entry, struct lsdn_phys_attachment, pa1) {
-		if (!pa1->phys->is_local)
+static void report_bad_nettype(struct lsdn_net *static_net, struct lsdn_net *other_net)
+{
+	lsdn_problem_report(
+		static_net->ctx, LSDNP_NET_BAD_NETTYPE,
+		LSDNS_NET, static_net,
+		LSDNS_NET, other_net,
+		LSDNS_END);
+}
+
+static bool tunnel_opts_eq(const struct lsdn_tunnel_opts *a, const struct lsdn_tunnel_opts *b)
+{
+	return a->udp_csum == b->udp_csum
+		&& a->udp_zero_csum6_tx == b->udp_zero_csum6_tx
+		&& a->udp_zero_csum6_rx == b->udp_zero_csum6_rx
+		&& a->ttl == b->ttl
+		&& a->df == b->df
+		&& a->txqueuelen == b->txqueuelen
+		&& a->gso_max_size == b->gso_max_size
+		&& a->gro_max_size == b->gro_max_size;
+}
+
+/* Address family of the metadata tunnel of a learning VXLAN network on the VLAN bridge, as chosen
+ * by its create_pa. Unknown if the local phys has no IP address yet. */
+static bool vlan_tunnel_ipv(struct lsdn_net *net, enum lsdn_ipv *ipv)
+{
+	if (net->settings->switch_type == LSDN_LEARNING) {
+		*ipv = net->settings->vxlan.mcast.mcast_ip.v;
+		return true;
+	}
+	lsdn_foreach(net->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
+		if (pa->phys->is_local && pa->phys->attr_ip) {
+			*ipv = pa->phys->attr_ip->v;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* The learning VXLAN networks with the same port and address family share the metadata tunnel
+ * of the VLAN bridge, it is created with the settings of its first user. */
+static bool vlan_tunnel_conflict(struct lsdn_net *net1, struct lsdn_net *net2)
+{
+	struct lsdn_settings *s1 = net1->settings;
+	struct lsdn_settings *s2 = net2->settings;
+	enum lsdn_ipv ipv1, ipv2;
+	if (s1 == s2 || !vlan_tunnel_ipv(net1, &ipv1) || !vlan_tunnel_ipv(net2, &ipv2) || ipv1 != ipv2)
+		return false;
+	/* The multicast tunnel joins its group */
+	if (s1->switch_type != s2->switch_type)
+		return true;
+	if (s1->switch_type == LSDN_LEARNING
+	    && !lsdn_ip_eq(s1->vxlan.mcast.mcast_ip, s2->vxlan.mcast.mcast_ip))
+		return true;
+	return !tunnel_opts_eq(&s1->tunnel_opts, &s2->tunnel_opts);
+}
+
+/* Check a changed network against the other networks. Both sides of a conflict are reported,
+ * as if the other network was changed too. */
+static void validate_dirty_net(struct lsdn_net *net1)
+{
+	struct lsdn_context *ctx = net1->ctx;
+	struct lsdn_settings *s1 = net1->settings;
+	if (will_be_deleted(net1->state))
+		return;
+
+	validate_rate(ctx, LSDNS_NET, net1, "rate_in", net1->attr_rate_in);
+	validate_rate(ctx, LSDNS_NET, net1, "rate_out", net1->attr_rate_out);
+
+	struct lsdn_index_group *same_id = net1->vnet_id_index_entry.group;
+	lsdn_foreach(same_id->members, entry, struct lsdn_index_member, m) {
+		struct lsdn_net *net2 = lsdn_container_of(m, struct lsdn_net, vnet_id_index_entry);
+		if (net1 == net2 || will_be_deleted(net2->state))
 			continue;
-		lsdn_foreach(net2->attached_list, attached_entry, struct lsdn_phys_attachment, pa2) {
-			if (!pa2->phys->is_local)
+		report_dupid(net1, net2);
+		if (!is_dirty(&net2->dirty_entry))
+			report_dupid(net2, net1);
+	}
+
+	/* A static VXLAN network can not share the UDP port with a non-static VXLAN network,
+	 * if both of them are present on the local phys. With the VLAN bridge, the same holds for
+	 * learning networks of incompatible settings. */
+	if (s1->nettype != LSDN_NET_VXLAN || !has_local_pa(net1))
+		return;
+	bool is_static = s1->switch_type == LSDN_STATIC_E2E;
+	if (ctx->vlan_bridge && !is_static) {
+		struct lsdn_index_group *same_port = net1->vxlan_port_index_entry.group;
+		lsdn_foreach(same_port->members, entry, struct lsdn_index_member, m) {
+			struct lsdn_net *net2 =
+				lsdn_container_of(m, struct lsdn_net, vxlan_port_index_entry);
+			if (will_be_deleted(net2->state) || !has_local_pa(net2))
 				continue;
-			check_nettypes = true;
+			if (!vlan_tunnel_conflict(net1, net2))
+				continue;
+			report_bad_nettype(net1, net2);
+			if (!is_dirty(&net2->dirty_entry))
+				report_bad_nettype(net2, net1);
 		}
 	}
 
-	if (check_nettypes) {
-		if (s1->nettype == LSDN_NET_VXLAN && s2->nettype == LSDN_NET_VXLAN) {
-			if (s1->switch_type == LSDN_STATIC_E2E && s2->switch_type != LSDN_STATIC_E2E) {
-				if (s1->vxlan.port == s2->vxlan.port) {
-					lsdn_problem_report(
-						s1->ctx, LSDNP_NET_BAD_NETTYPE,
-						LSDNS_NET, net1,
-						LSDNS_NET, net2,
-						LSDNS_END);
-				}
-			}
-		}
+	struct lsdn_index_key key;
+	lsdn_index_key_u32(&key, !is_static, s1->vxlan.port);
+	struct lsdn_index_group *conflicting = lsdn_index_find(&ctx->vxlan_port_index, &key);
+	if (!conflicting)
+		return;
+	lsdn_foreach(conflicting->members, entry, struct lsdn_index_member, m) {
+		struct lsdn_net *net2 = lsdn_container_of(m, struct lsdn_net, vxlan_port_index_entry);
+		if (will_be_deleted(net2->state) || !has_local_pa(net2))
+			continue;
+		if (is_static)
+			report_bad_nettype(net1, net2);
+		else if (!is_dirty(&net2->dirty_entry))
+			report_bad_nettype(net2, net1);
+	}
+}
+
+/* Monotonic time in microseconds, for the commit statistics. */
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_nl_stats(struct lsdn_nl_stats *dst, const struct lsdn_nl_stats *src)
+{
+	dst->link_msgs += src->link_msgs;
+	dst->qdisc_msgs += src->qdisc_msgs;
+	dst->filter_msgs += src->filter_msgs;
+	dst->fdb_msgs += src->fdb_msgs;
+	dst->action_msgs += src->action_msgs;
+	dst->other_msgs += src->other_msgs;
+	dst->bpf_calls += src->bpf_calls;
+	dst->bytes += src->bytes;
+	dst->errors += src->errors;
+}
+
+/* Copy the netlink traffic counted since the start of the validation (on the main socket and
+ * the sockets of the commit workers) to the commit statistics. */
+static void sync_nl_stats(struct lsdn_context *ctx)
+{
+	if (!ctx->nlsock)
+		return;
+	ctx->stats.nl = ctx->nlsock->stats;
+	if (ctx->worker_socks) {
+		for (unsigned int i = 0; i < ctx->commit_workers; i++)
+			add_nl_stats(&ctx->stats.nl, &ctx->worker_socks[i]->stats);
+	}
+}
+
+static void clear_nl_stats(struct lsdn_context *ctx)
+{
+	if (ctx->nlsock)
+		memset(&ctx->nlsock->stats, 0, sizeof(ctx->nlsock->stats));
+	if (ctx->worker_socks) {
+		for (unsigned int i = 0; i < ctx->commit_workers; i++)
+			memset(&ctx->worker_socks[i]->stats, 0, sizeof(ctx->worker_socks[i]->stats));
 	}
 }
 
 /** Validate network model.
- * Walks the currently configured in-memory network model and checks for problems.
+ * Walks the parts of the in-memory network model changed since the last commit and checks
+ * for problems.
  * If problems are found, an error code is returned. Problem callback is also invoked
  * for every problem encountered.
  *
@@ -1191,173 +2416,280 @@ static void cross_validate_networks(struct lsdn_net *net1, struct lsdn_net *net2
  * @retval #LSDNE_VALIDATE Some problems detected. */
 lsdn_err_t lsdn_validate(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user)
 {
+	uint64_t start = now_us();
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	clear_nl_stats(ctx);
+
 	ctx->problem_cb = cb;
 	ctx->problem_cb_user = user;
 	ctx->problem_count = 0;
 	ctx->inconsistent = false;
 
+	/* Only the objects on the dirty lists need to be validated (and committed), the rest of the
+	 * model was validated by an earlier commit. */
+
 	/********* Propagate states (some will be propagated later) *********/
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p) {
+	lsdn_foreach(ctx->dirty_phys_list, dirty_entry, struct lsdn_phys, p) {
+		if (p->state != LSDN_STATE_RENEW)
+			continue;
 		lsdn_foreach(p->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, pa) {
 			propagate(&p->state, &pa->state);
+			lsdn_pa_mark_dirty(pa);
 		}
 	}
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n){
+	lsdn_foreach(ctx->dirty_net_list, dirty_entry, struct lsdn_net, n){
+		if (n->state != LSDN_STATE_RENEW)
+			continue;
 		lsdn_foreach(n->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
 			propagate(&n->state, &pa->state);
+			lsdn_pa_mark_dirty(pa);
 		}
 	}
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n){
-		lsdn_foreach(n->virt_list, virt_entry, struct lsdn_virt, v) {
-			/* Does not matter if we use committed_through or connected_through, if they
-			 * have changed, the virt must be renewed anyway */
-			if (v->connected_through)
-				propagate(&v->connected_through->state, &v->state);
+	lsdn_foreach(ctx->dirty_pa_list, dirty_entry, struct lsdn_phys_attachment, pa){
+		if (pa->state != LSDN_STATE_RENEW)
+			continue;
+		/* Does not matter if we use committed_through or connected_through, if they
+		 * have changed, the virt must be renewed anyway */
+		lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
+			propagate(&pa->state, &v->state);
+			lsdn_virt_mark_dirty(v);
 		}
 	}
 
+	/* Interfaces are resolved through the link cache, update it once for the whole validation.
+	 * Without a netlink socket, the interfaces are resolved one by one. */
+	if (lsdn_context_ensure_socket(ctx) == LSDNE_OK)
+		lsdn_link_cache_sync(ctx->nlsock);
+
 	/******* Do the validation ********/
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, net1) {
-		if (will_be_deleted(net1->state))
-			continue;
-		validate_virts_net(net1);
-		lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, net2) {
-			if (net1 != net2 && !will_be_deleted(net2->state))
-				cross_validate_networks(net1, net2);
-		}
+	lsdn_foreach(ctx->dirty_net_list, dirty_entry, struct lsdn_net, net) {
+		validate_dirty_net(net);
 	}
 
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p){
-		if (will_be_deleted(p->state))
-			continue;
-		lsdn_foreach(p->attached_to_list, attached_to_entry, struct lsdn_phys_attachment, a)
-		{
-			if(!a->explicitly_attached){
-				report_virts(a);
-			}else{
-				if (p->is_local && !p->attr_iface)
-					lsdn_problem_report(
-						ctx, LSDNP_PHYS_NOATTR,
-						LSDNS_ATTR, "iface",
-						LSDNS_PHYS, p,
-						LSDNS_NET, a->net,
-						LSDNS_END);
+	lsdn_foreach(ctx->dirty_phys_list, dirty_entry, struct lsdn_phys, p) {
+		validate_dirty_phys(p);
+	}
 
-				if(should_be_validated(a->state) && a->net->settings->ops->validate_pa)
-					a->net->settings->ops->validate_pa(a);
-				validate_virts_pa(a);
-			}
-		}
-		lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p_other) {
-			if (p == p_other || will_be_deleted(p_other->state))
-				continue;
-			if (p->attr_ip && p_other->attr_ip)
-				if (lsdn_ip_eq(*p->attr_ip, *p_other->attr_ip))
-					lsdn_problem_report(
-						ctx, LSDNP_PHYS_DUPATTR,
-						LSDNS_ATTR, "ip",
-						LSDNS_PHYS, p,
-						LSDNS_PHYS, p_other,
-						LSDNS_END);
-		}
+	lsdn_foreach(ctx->dirty_pa_list, dirty_entry, struct lsdn_phys_attachment, pa) {
+		validate_dirty_pa(pa);
 	}
 
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n) {
-		lsdn_foreach(
-			n->attached_list, attached_entry,
-			struct lsdn_phys_attachment, a) {
-			if (!a->phys->attr_ip || will_be_deleted(a->phys->state))
-				continue;
-			lsdn_foreach(
-				n->attached_list, attached_entry,
-				struct lsdn_phys_attachment, a_other) {
-				if (a == a_other)
-					continue;
-				if (!a_other->phys->attr_ip || will_be_deleted(a_other->phys->state))
-					continue;
-				if (!lsdn_ipv_eq(*a->phys->attr_ip, *a_other->phys->attr_ip))
-					lsdn_problem_report(
-						ctx, LSDNP_PHYS_INCOMPATIBLE_IPV,
-						LSDNS_PHYS, a->phys,
-						LSDNS_PHYS, a_other->phys,
-						LSDNS_NET, n,
-						LSDNS_END);
-			}
-		}
+	lsdn_foreach(ctx->dirty_virt_list, dirty_entry, struct lsdn_virt, v) {
+		validate_dirty_virt(v);
 	}
 
+	ctx->stats.validate_us = now_us() - start;
+	sync_nl_stats(ctx);
 	return (ctx->problem_count == 0) ? LSDNE_OK : LSDNE_VALIDATE;
 }
 
 static void decommit_pa(struct lsdn_phys_attachment *pa);
 static void decommit_virt(struct lsdn_virt *v);
 
+/** @name Attribution of batched netlink errors.
+ * The filter and FDB requests are sent in batches during commit and their errors arrive only
+ * after the net_ops callback has returned. These callbacks mark the object that was being
+ * committed when the request was queued, the same way mark_commit_err would do it. */
+/** @{ */
+static void nl_err_virt(lsdn_err_t err, void *user)
+{
+	struct lsdn_virt *v = user;
+	mark_commit_err(v->network->ctx, &v->state, LSDNS_VIRT, v, false, err);
+}
+
+static void nl_err_virt_fatal(lsdn_err_t err, void *user)
+{
+	struct lsdn_virt *v = user;
+	mark_commit_err(v->network->ctx, &v->state, LSDNS_VIRT, v, true, err);
+}
+
+static void nl_err_pa(lsdn_err_t err, void *user)
+{
+	struct lsdn_phys_attachment *pa = user;
+	mark_commit_err(pa->net->ctx, &pa->state, LSDNS_PA, pa, false, err);
+}
+
+static void nl_err_pa_fatal(lsdn_err_t err, void *user)
+{
+	struct lsdn_phys_attachment *pa = user;
+	mark_commit_err(pa->net->ctx, &pa->state, LSDNS_PA, pa, true, err);
+}
+
+static struct lsdn_nl_owner set_nl_owner(struct lsdn_context *ctx, lsdn_nl_err_cb cb, void *user)
+{
+	struct lsdn_nl_owner owner = {cb, user};
+	return lsdn_nl_set_owner(ctx->nlsock, owner);
+}
+/** @} */
+
+/* Add a virt connected through a local PA (if it is new) and its rules. */
+static void add_local_virt(struct lsdn_phys_attachment *pa, struct lsdn_virt *v)
+{
+	struct lsdn_net_ops *ops = pa->net->settings->ops;
+	struct lsdn_context *ctx = pa->net->ctx;
+	struct lsdn_if if2;
+	struct lsdn_phys_attachment *old_commited_to = v->committed_to;
+	lsdn_if_init(&if2);
+	if (lsdn_if_copy(&if2, &v->connected_if) != LSDNE_OK) {
+		v->state = LSDN_STATE_ERR;
+		lsdn_problem_report(ctx, LSDNP_COMMIT_NOMEM, LSDNS_VIRT, v, LSDNS_END);
+		return;
+	}
+	v->committed_to = pa;
+	lsdn_if_swap(&if2, &v->committed_if);
+
+	if (ops->add_virt) {
+		ctx->stats.ops.add_virt++;
+		lsdn_log(LSDNL_NETOPS, "add_virt(net = %s (%p), phys = %s (%p), pa = %p, virt = %s (%p)\n",
+			 lsdn_nullable(pa->net->name.str), pa->net,
+			 lsdn_nullable(pa->phys->name.str), pa->phys,
+			 pa,
+			 v->connected_if.ifname, v);
+		if (mark_commit_err(ctx, &v->state, LSDNS_VIRT, v, false,
+			ops->add_virt(v))) {
+			// roll back commitment properties
+			lsdn_if_swap(&if2, &v->committed_if);
+			lsdn_if_free(&if2);
+			v->committed_to = old_commited_to;
+			return;
+		}
+	}
+
+	if (mark_commit_err(ctx, &v->state, LSDNS_VIRT, v, false,
+		commit_rates(v))) {
+		if (v->state == LSDN_STATE_ERR) {
+			// roll back everything
+			ctx->stats.ops.remove_virt++;
+			if (ops->remove_virt(v) != LSDNE_OK) {
+				v->state = LSDN_STATE_FAIL;
+				v->network->ctx->inconsistent = true;
+				return;
+			}
+			lsdn_if_swap(&if2, &v->committed_if);
+			lsdn_if_free(&if2);
+			v->committed_to = old_commited_to;
+		}
+		return;
+	}
+	lsdn_if_free(&if2);
+}
+
+static void commit_local_virt(struct lsdn_phys_attachment *pa, struct lsdn_virt *v)
+{
+	struct lsdn_context *ctx = pa->net->ctx;
+	struct lsdn_nl_owner old_owner = set_nl_owner(ctx, nl_err_virt, v);
+	if (v->state == LSDN_STATE_NEW)
+		add_local_virt(pa, v);
+	if (state_ok(v->state)) {
+		commit_rules(v, v->ht_in_rules, LSDN_IN);
+		commit_rules(v, v->ht_out_rules, LSDN_OUT);
+	}
+	lsdn_nl_set_owner(ctx->nlsock, old_owner);
+}
+
+/* Make the remote PA visible from the local PA. */
+static void commit_remote_pa(struct lsdn_phys_attachment *pa, struct lsdn_phys_attachment *remote)
+{
+	struct lsdn_net_ops *ops = pa->net->settings->ops;
+	struct lsdn_context *ctx = pa->net->ctx;
+
+	struct lsdn_remote_pa *rpa = malloc(sizeof(*rpa));
+	if (!rpa) {
+		lsdn_problem_report(ctx, LSDNP_COMMIT_NOMEM, LSDNS_PA, pa, LSDNS_END);
+		pa->state = LSDN_STATE_ERR;
+		lsdn_pa_mark_dirty(pa);
+		decommit_pa(remote);
+		return;
+	}
+
+	rpa->local = pa;
+	rpa->remote = remote;
+	lsdn_list_init_add(&remote->pa_view_list, &rpa->pa_view_entry);
+	lsdn_list_init_add(&pa->remote_pa_list, &rpa->remote_pa_entry);
+	lsdn_list_init(&rpa->remote_virt_list);
+	struct lsdn_nl_owner old_owner = set_nl_owner(ctx, nl_err_pa, remote);
+	if (ops->add_remote_pa) {
+		ctx->stats.ops.add_remote_pa++;
+		lsdn_log(LSDNL_NETOPS, "add_remote_pa("
+			 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
+			 "local_pa = %p, remote_pa = %p, remote_pa_view = %p)\n",
+			 lsdn_nullable(pa->net->name.str), pa->net,
+			 lsdn_nullable(pa->phys->name.str), pa->phys,
+			 lsdn_nullable(remote->phys->name.str), remote->phys,
+			 pa, remote, rpa);
+		if (mark_commit_err(ctx, &remote->state, LSDNS_PA, remote, false,
+			ops->add_remote_pa(rpa)))
+		{
+			lsdn_list_remove(&rpa->pa_view_entry);
+			lsdn_list_remove(&rpa->remote_pa_entry);
+			free(rpa);
+			decommit_pa(remote);
+		}
+	}
+	lsdn_nl_set_owner(ctx->nlsock, old_owner);
+}
+
+/* Make the virt connected through the remote PA visible from the local PA. */
+static void commit_remote_virt(struct lsdn_remote_pa *remote, struct lsdn_virt *v)
+{
+	struct lsdn_phys_attachment *pa = remote->local;
+	struct lsdn_net_ops *ops = pa->net->settings->ops;
+	struct lsdn_context *ctx = pa->net->ctx;
+
+	struct lsdn_remote_virt *rvirt = malloc(sizeof(*rvirt));
+	if(!rvirt) {
+		lsdn_problem_report(ctx, LSDNP_COMMIT_NOMEM, LSDNS_VIRT, v, LSDNS_END);
+		pa->state = LSDN_STATE_ERR;
+		lsdn_pa_mark_dirty(pa);
+		decommit_virt(v);
+		return;
+	}
+	rvirt->pa = remote;
+	rvirt->virt = v;
+	lsdn_list_init_add(&v->virt_view_list, &rvirt->virt_view_entry);
+	lsdn_list_init_add(&remote->remote_virt_list, &rvirt->remote_virt_entry);
+	struct lsdn_nl_owner old_owner = set_nl_owner(ctx, nl_err_virt, v);
+	if (ops->add_remote_virt) {
+		ctx->stats.ops.add_remote_virt++;
+		lsdn_log(LSDNL_NETOPS, "add_remote_virt("
+			 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
+			 "local_pa = %p, remote_pa = %p, remote_pa_view = %p, virt = %p)\n",
+			 lsdn_nullable(pa->net->name.str), pa->net,
+			 lsdn_nullable(pa->phys->name.str), pa->phys,
+			 lsdn_nullable(remote->remote->phys->name.str), remote->remote->phys,
+			 pa, remote->remote, remote, v);
+		if (mark_commit_err(ctx, &v->state, LSDNS_VIRT,v, false,
+			ops->add_remote_virt(rvirt)))
+		{
+			decommit_virt(v);
+		}
+	}
+	lsdn_nl_set_owner(ctx->nlsock, old_owner);
+}
+
+/* Commit a local PA as a whole: the PA itself, its virts, the remote PAs it can see and their virts.
+ * For a PA that is already committed, only the new parts are added. */
 static void commit_pa(struct lsdn_phys_attachment *pa)
 {
 	struct lsdn_net_ops *ops = pa->net->settings->ops;
 	struct lsdn_context *ctx = pa->net->ctx;
 	if (pa->state == LSDN_STATE_NEW) {
+		struct lsdn_nl_owner old_owner = set_nl_owner(ctx, nl_err_pa, pa);
+		ctx->stats.ops.create_pa++;
 		lsdn_log(LSDNL_NETOPS, "create_pa(net = %s (%p), phys = %s (%p), pa = %p)\n",
 			 lsdn_nullable(pa->net->name.str), pa->net,
 			 lsdn_nullable(pa->phys->name.str), pa->phys,
 			 pa);
 		mark_commit_err(ctx, &pa->state, LSDNS_PA, pa, false,
 			ops->create_pa(pa));
+		lsdn_nl_set_owner(ctx->nlsock, old_owner);
 	}
 
 	if (!state_ok(pa->state))
 		return;
 
 	lsdn_foreach(pa->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
-		if (v->state == LSDN_STATE_NEW) {
-			struct lsdn_if if2;
-			struct lsdn_phys_attachment *old_commited_to = v->committed_to;
-			lsdn_if_init(&if2);
-			if (lsdn_if_copy(&if2, &v->connected_if) != LSDNE_OK) {
-				v->state = LSDN_STATE_ERR;
-				lsdn_problem_report(ctx, LSDNP_COMMIT_NOMEM, LSDNS_VIRT, v, LSDNS_END);
-				continue;
-			}
-			v->committed_to = pa;
-			lsdn_if_swap(&if2, &v->committed_if);
-
-			if (ops->add_virt) {
-				lsdn_log(LSDNL_NETOPS, "add_virt(net = %s (%p), phys = %s (%p), pa = %p, virt = %s (%p)\n",
-					 lsdn_nullable(pa->net->name.str), pa->net,
-					 lsdn_nullable(pa->phys->name.str), pa->phys,
-					 pa,
-					 v->connected_if.ifname, v);
-				if (mark_commit_err(ctx, &v->state, LSDNS_VIRT, v, false,
-					ops->add_virt(v))) {
-					// roll back commitment properties
-					lsdn_if_swap(&if2, &v->committed_if);
-					lsdn_if_free(&if2);
-					v->committed_to = old_commited_to;
-					continue;
-				}
-			}
-
-			if (mark_commit_err(ctx, &v->state, LSDNS_VIRT, v, false,
-				commit_rates(v))) {
-				if (v->state == LSDN_STATE_ERR) {
-					// roll back everything
-					if (ops->remove_virt(v) != LSDNE_OK) {
-						v->state = LSDN_STATE_FAIL;
-						v->network->ctx->inconsistent = true;
-						continue;
-					}
-					lsdn_if_swap(&if2, &v->committed_if);
-					lsdn_if_free(&if2);
-					v->committed_to = old_commited_to;
-				}
-				continue;
-			}
-			lsdn_if_free(&if2);
-		}
-		if (state_ok(v->state)) {
-			commit_rules(v, v->ht_in_rules, LSDN_IN);
-			commit_rules(v, v->ht_out_rules, LSDN_OUT);
-		}
+		commit_local_virt(pa, v);
 	}
 
 	lsdn_foreach(pa->net->attached_list, attached_entry, struct lsdn_phys_attachment, remote) {
@@ -1365,69 +2697,14 @@ static void commit_pa(struct lsdn_phys_attachment *pa)
 			continue;
 		if (pa->state != LSDN_STATE_NEW && remote->state != LSDN_STATE_NEW)
 			continue;
-
-		struct lsdn_remote_pa *rpa = malloc(sizeof(*rpa));
-		if (!rpa) {
-			lsdn_problem_report(ctx, LSDNP_COMMIT_NOMEM, LSDNS_PA, pa, LSDNS_END);
-			pa->state = LSDN_STATE_ERR;
-			decommit_pa(remote);
-			continue;
-		}
-
-		rpa->local = pa;
-		rpa->remote = remote;
-		lsdn_list_init_add(&remote->pa_view_list, &rpa->pa_view_entry);
-		lsdn_list_init_add(&pa->remote_pa_list, &rpa->remote_pa_entry);
-		lsdn_list_init(&rpa->remote_virt_list);
-		if (ops->add_remote_pa) {
-			lsdn_log(LSDNL_NETOPS, "add_remote_pa("
-				 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
-				 "local_pa = %p, remote_pa = %p, remote_pa_view = %p)\n",
-				 lsdn_nullable(pa->net->name.str), pa->net,
-				 lsdn_nullable(pa->phys->name.str), pa->phys,
-				 lsdn_nullable(remote->phys->name.str), remote->phys,
-				 pa, remote, rpa);
-			if (mark_commit_err(ctx, &remote->state, LSDNS_PA, remote, false,
-				ops->add_remote_pa(rpa)))
-			{
-				lsdn_list_remove(&rpa->pa_view_entry);
-				lsdn_list_remove(&rpa->remote_pa_entry);
-				free(rpa);
-				decommit_pa(remote);
-				continue;
-			}
-		}
+		commit_remote_pa(pa, remote);
 	}
 
 	lsdn_foreach(pa->remote_pa_list, remote_pa_entry, struct lsdn_remote_pa, remote) {
 		lsdn_foreach(remote->remote->connected_virt_list, connected_virt_entry, struct lsdn_virt, v) {
 			if (pa->state != LSDN_STATE_NEW && v->state != LSDN_STATE_NEW)
 				continue;
-			struct lsdn_remote_virt *rvirt = malloc(sizeof(*rvirt));
-			if(!rvirt) {
-				lsdn_problem_report(ctx, LSDNP_COMMIT_NOMEM, LSDNS_VIRT, v, LSDNS_END);
-				pa->state = LSDN_STATE_ERR;
-				decommit_virt(v);
-				continue;
-			}
-			rvirt->pa = remote;
-			rvirt->virt = v;
-			lsdn_list_init_add(&v->virt_view_list, &rvirt->virt_view_entry);
-			lsdn_list_init_add(&remote->remote_virt_list, &rvirt->remote_virt_entry);
-			if (ops->add_remote_virt) {
-				lsdn_log(LSDNL_NETOPS, "add_remote_virt("
-					 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
-					 "local_pa = %p, remote_pa = %p, remote_pa_view = %p, virt = %p)\n",
-					 lsdn_nullable(pa->net->name.str), pa->net,
-					 lsdn_nullable(pa->phys->name.str), pa->phys,
-					 lsdn_nullable(remote->remote->phys->name.str), remote->remote->phys,
-					 pa, remote->remote, remote, v);
-				if (mark_commit_err(ctx, &v->state, LSDNS_VIRT,v, false,
-					ops->add_remote_virt(rvirt)))
-				{
-					decommit_virt(v);
-				}
-			}
+			commit_remote_virt(remote, v);
 		}
 	}
 }
@@ -1436,7 +2713,9 @@ static void decommit_remote_virt(struct lsdn_remote_virt *rv)
 {
 	struct lsdn_net_ops *ops = rv->virt->network->settings->ops;
 	struct lsdn_context *ctx = rv->pa->local->net->ctx;
+	struct lsdn_nl_owner old_owner = set_nl_owner(ctx, nl_err_virt_fatal, rv->virt);
 	if (ops->remove_remote_virt) {
+		ctx->stats.ops.remove_remote_virt++;
 		lsdn_log(LSDNL_NETOPS, "remove_remote_virt("
 				"net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
 				"local_pa = %p, remote_pa = %p, remote_pa_view = %p, virt = %p)\n",
@@ -1447,6 +2726,7 @@ static void decommit_remote_virt(struct lsdn_remote_virt *rv)
 		mark_commit_err(ctx, &rv->virt->state, LSDNS_VIRT, rv->virt, true,
 				ops->remove_remote_virt(rv));
 	}
+	lsdn_nl_set_owner(ctx->nlsock, old_owner);
 	lsdn_list_remove(&rv->remote_virt_entry);
 	lsdn_list_remove(&rv->virt_view_entry);
 	free(rv);
@@ -1456,6 +2736,7 @@ static void decommit_virt(struct lsdn_virt *v)
 {
 	struct lsdn_net_ops *ops = v->network->settings->ops;
 	struct lsdn_phys_attachment *pa = v->committed_to;
+	struct lsdn_nl_owner old_owner = set_nl_owner(v->network->ctx, nl_err_virt_fatal, v);
 
 	decommit_rates(v);
 	decommit_rules(v, v->ht_in_rules, LSDN_IN);
@@ -1467,6 +2748,7 @@ static void decommit_virt(struct lsdn_virt *v)
 
 	if (pa) {
 		if (ops->remove_virt) {
+			v->network->ctx->stats.ops.remove_virt++;
 			lsdn_log(LSDNL_NETOPS, "remove_virt(net = %s (%p), phys = %s (%p), pa = %p, virt = %s (%p)\n",
 				 lsdn_nullable(pa->net->name.str), pa->net,
 				 lsdn_nullable(pa->phys->name.str), pa->phys,
@@ -1477,6 +2759,15 @@ static void decommit_virt(struct lsdn_virt *v)
 		v->committed_to = NULL;
 		lsdn_if_reset(&v->committed_if);
 	}
+	lsdn_nl_set_owner(v->network->ctx->nlsock, old_owner);
+}
+
+static void decommit_freed_rules(struct lsdn_virt *v)
+{
+	struct lsdn_nl_owner old_owner = set_nl_owner(v->network->ctx, nl_err_virt_fatal, v);
+	decommit_rules(v, v->ht_in_rules, LSDN_IN);
+	decommit_rules(v, v->ht_out_rules, LSDN_OUT);
+	lsdn_nl_set_owner(v->network->ctx->nlsock, old_owner);
 }
 
 static void decommit_remote_pa(struct lsdn_remote_pa *rpa)
@@ -1490,7 +2781,9 @@ static void decommit_remote_pa(struct lsdn_remote_pa *rpa)
 		decommit_remote_virt(rv);
 	}
 
+	struct lsdn_nl_owner old_owner = set_nl_owner(ctx, nl_err_pa_fatal, remote);
 	if (ops->remove_remote_pa) {
+		ctx->stats.ops.remove_remote_pa++;
 		lsdn_log(LSDNL_NETOPS, "remove_remote_pa("
 			 "net = %s (%p), local_phys = %s (%p), remote_phys = %s (%p), "
 			 "local_pa = %p, remote_pa = %p, remote_pa_view = %p)\n",
@@ -1500,6 +2793,7 @@ static void decommit_remote_pa(struct lsdn_remote_pa *rpa)
 			 local, remote, rpa);
 		mark_commit_err(ctx, &remote->state, LSDNS_PA, remote, true, ops->remove_remote_pa(rpa));
 	}
+	lsdn_nl_set_owner(ctx->nlsock, old_owner);
 	lsdn_list_remove(&rpa->pa_view_entry);
 	lsdn_list_remove(&rpa->remote_pa_entry);
 	assert(lsdn_is_list_empty(&rpa->remote_virt_list));
@@ -1520,31 +2814,255 @@ static void decommit_pa(struct lsdn_phys_attachment *pa)
 	}
 
 	if (pa->phys->committed_as_local) {
+		struct lsdn_nl_owner old_owner = set_nl_owner(ctx, nl_err_pa_fatal, pa);
 		if (ops->destroy_pa) {
+			ctx->stats.ops.destroy_pa++;
 			lsdn_log(LSDNL_NETOPS, "destroy_pa(net = %s (%p), phys = %s (%p), pa = %p)\n",
 				 lsdn_nullable(pa->net->name.str), pa->net,
 				 lsdn_nullable(pa->phys->name.str), pa->phys,
 				 pa);
 			mark_commit_err(ctx, &pa->state, LSDNS_PA, pa, true, ops->destroy_pa(pa));
 		}
+		lsdn_nl_set_owner(ctx->nlsock, old_owner);
 	}
 }
 
-static void trigger_startup_hooks(struct lsdn_context *ctx)
+/** @name Recommit steps.
+ * Done for all the changed PAs and virts (or all of them in a commit group), in this order. */
+/** @{ */
+/* First create new physical attachments for local physes and populate them with virts, remote
+ * PAs and remote virts */
+static void commit_new_pa(struct lsdn_phys_attachment *pa)
 {
-	// TODO: only do for new PAs
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p) {
-		if (p->is_local) {
-			lsdn_foreach(
-				p->attached_to_list, attached_to_entry,
-				struct lsdn_phys_attachment, a)
-			{
-				struct lsdn_settings *s = a->net->settings;
-				if (s->user_hooks && s->user_hooks->lsdn_startup_hook)
-					s->user_hooks->lsdn_startup_hook(
-						a->net, p, s->user_hooks->lsdn_startup_hook_user);
-			}
+	if (pa->phys->is_local && pa->state == LSDN_STATE_NEW)
+		commit_pa(pa);
+}
+
+/* then show the new PAs to the local PAs that are already committed */
+static void show_new_pa(struct lsdn_phys_attachment *remote)
+{
+	if (remote->state != LSDN_STATE_NEW)
+		return;
+	lsdn_foreach(remote->net->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
+		if (pa != remote && pa->phys->is_local && pa->state == LSDN_STATE_OK)
+			commit_remote_pa(pa, remote);
+	}
+}
+
+/* and finally add the changed virts to the local PAs that are already committed, either directly
+ * or as remote virts */
+static void commit_dirty_virt(struct lsdn_virt *v)
+{
+	struct lsdn_phys_attachment *pa = v->connected_through;
+	if (!pa)
+		return;
+	if (pa->phys->is_local && pa->state == LSDN_STATE_OK)
+		commit_local_virt(pa, v);
+	if (v->state != LSDN_STATE_NEW)
+		return;
+	lsdn_foreach(pa->pa_view_list, pa_view_entry, struct lsdn_remote_pa, rpa) {
+		if (rpa->local->state == LSDN_STATE_OK)
+			commit_remote_virt(rpa, v);
+	}
+}
+/** @} */
+
+/** @name Parallel commit.
+ * The changed PAs and virts are split into groups that share no kernel objects and the groups
+ * are committed by worker threads, each with its own netlink socket.
+ *
+ * The model code is not thread-safe, so it only runs under the commit lock. The workers release
+ * the lock while they wait for the kernel (see #lsdn_nl_io_hooks) and the worker holding it
+ * installs its socket and name buffer to the context, so the network types use them without
+ * knowing about the workers. */
+/** @{ */
+
+/** PAs and virts committed by a single worker. */
+struct commit_group {
+	/** The network, or the settings if the networks share a tunnel. */
+	void *key;
+	struct lsdn_list_entry pa_list;
+	struct lsdn_list_entry virt_list;
+	UT_hash_handle hh;
+};
+
+struct commit_worker {
+	struct lsdn_context *ctx;
+	struct lsdn_nl *nlsock;
+	char namebuf[LSDN_NAMEBUF_SIZE];
+	/** The next group to commit, shared by all the workers. */
+	struct commit_group **next_group;
+	pthread_t thread;
+};
+
+static void *commit_group_key(struct lsdn_net *net)
+{
+	/* The learning VXLAN networks share the bridge of the phys */
+	if (net->ctx->vlan_bridge && net->settings->nettype == LSDN_NET_VXLAN
+	    && net->settings->switch_type != LSDN_STATIC_E2E)
+		return net->ctx;
+	/* The end-to-end network types share the tunnel and its bridge by all the networks with
+	 * the same settings */
+	if (net->settings->switch_type != LSDN_LEARNING)
+		return net->settings;
+	return net;
+}
+
+static struct commit_group *get_commit_group(struct commit_group **groups, struct lsdn_net *net)
+{
+	struct commit_group *g;
+	void *key = commit_group_key(net);
+	HASH_FIND_PTR(*groups, &key, g);
+	if (g)
+		return g;
+	g = malloc(sizeof(*g));
+	if (!g)
+		return NULL;
+	g->key = key;
+	lsdn_list_init(&g->pa_list);
+	lsdn_list_init(&g->virt_list);
+	HASH_ADD_PTR(*groups, key, g);
+	return g;
+}
+
+static void free_commit_groups(struct commit_group **groups)
+{
+	struct commit_group *g, *tmp;
+	HASH_ITER(hh, *groups, g, tmp) {
+		lsdn_foreach(g->pa_list, commit_group_entry, struct lsdn_phys_attachment, pa) {
+			lsdn_list_remove(&pa->commit_group_entry);
 		}
+		lsdn_foreach(g->virt_list, commit_group_entry, struct lsdn_virt, v) {
+			lsdn_list_remove(&v->commit_group_entry);
+		}
+		HASH_DEL(*groups, g);
+		free(g);
+	}
+}
+
+/* Split the changed PAs and virts to groups, keeping their order. */
+static bool make_commit_groups(struct lsdn_context *ctx, struct commit_group **groups)
+{
+	lsdn_foreach(ctx->dirty_pa_list, dirty_entry, struct lsdn_phys_attachment, pa) {
+		struct commit_group *g = get_commit_group(groups, pa->net);
+		if (!g)
+			return false;
+		lsdn_list_add(g->pa_list.previous, &pa->commit_group_entry);
+	}
+	lsdn_foreach(ctx->dirty_virt_list, dirty_entry, struct lsdn_virt, v) {
+		if (!v->connected_through)
+			continue;
+		struct commit_group *g = get_commit_group(groups, v->connected_through->net);
+		if (!g)
+			return false;
+		lsdn_list_add(g->virt_list.previous, &v->commit_group_entry);
+	}
+	return true;
+}
+
+static void commit_group(struct commit_group *g)
+{
+	lsdn_foreach(g->pa_list, commit_group_entry, struct lsdn_phys_attachment, pa) {
+		commit_new_pa(pa);
+	}
+	lsdn_foreach(g->pa_list, commit_group_entry, struct lsdn_phys_attachment, pa) {
+		show_new_pa(pa);
+	}
+	lsdn_foreach(g->virt_list, commit_group_entry, struct lsdn_virt, v) {
+		commit_dirty_virt(v);
+	}
+}
+
+static void commit_worker_lock(void *user)
+{
+	struct commit_worker *w = user;
+	pthread_mutex_lock(&w->ctx->commit_lock);
+	w->ctx->nlsock = w->nlsock;
+	w->ctx->namebuf = w->namebuf;
+}
+
+static void commit_worker_unlock(void *user)
+{
+	struct commit_worker *w = user;
+	pthread_mutex_unlock(&w->ctx->commit_lock);
+}
+
+static void *commit_worker_run(void *user)
+{
+	struct commit_worker *w = user;
+	struct lsdn_nl_io_hooks hooks = {commit_worker_unlock, commit_worker_lock, w};
+	struct lsdn_nl_io_hooks no_hooks = {NULL, NULL, NULL};
+	lsdn_nl_set_io_hooks(w->nlsock, hooks);
+
+	commit_worker_lock(w);
+	lsdn_nl_batch_begin(w->nlsock);
+	struct commit_group *g;
+	while ((g = *w->next_group)) {
+		*w->next_group = g->hh.next;
+		commit_group(g);
+	}
+	if (lsdn_nl_batch_end(w->nlsock) != LSDNE_OK)
+		w->ctx->inconsistent = true;
+	commit_worker_unlock(w);
+
+	lsdn_nl_set_io_hooks(w->nlsock, no_hooks);
+	return NULL;
+}
+
+/* Do the recommit steps in the worker threads. Returns false if the parallel commit is disabled
+ * or could not be started, the steps must be done by the caller then. */
+static bool commit_parallel(struct lsdn_context *ctx)
+{
+	struct commit_group *groups = NULL;
+	struct commit_worker *workers = NULL;
+	unsigned int started = 0;
+	/* The objects adopted while reconciling are tracked by the main socket */
+	if (ctx->commit_workers < 2 || ctx->reconcile)
+		return false;
+	if (!make_commit_groups(ctx, &groups) || HASH_COUNT(groups) < 2)
+		goto out;
+	if (!ensure_worker_sockets(ctx))
+		goto out;
+	workers = calloc(ctx->commit_workers, sizeof(*workers));
+	if (!workers)
+		goto out;
+
+	/* The requests of the decommit phase must be processed first */
+	lsdn_nl_batch_flush(ctx->nlsock);
+
+	struct lsdn_nl *nlsock = ctx->nlsock;
+	struct commit_group *next_group = groups;
+	for (unsigned int i = 0; i < ctx->commit_workers; i++) {
+		workers[i].ctx = ctx;
+		workers[i].nlsock = ctx->worker_socks[i];
+		workers[i].next_group = &next_group;
+		/* The running workers take over the groups of the ones that could not be started */
+		if (pthread_create(&workers[i].thread, NULL, commit_worker_run, &workers[i]))
+			break;
+		started++;
+	}
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	ctx->nlsock = nlsock;
+	ctx->namebuf = ctx->own_namebuf;
+
+out:
+	free(workers);
+	free_commit_groups(&groups);
+	return started > 0;
+}
+/** @} */
+
+static void trigger_startup_hooks(struct lsdn_context *ctx)
+{
+	/* Only new attachments of local physes, the hook may create virts etc. for them */
+	lsdn_foreach(ctx->dirty_pa_list, dirty_entry, struct lsdn_phys_attachment, a) {
+		if (!a->phys->is_local || a->state != LSDN_STATE_NEW)
+			continue;
+		struct lsdn_settings *s = a->net->settings;
+		if (s->user_hooks && s->user_hooks->lsdn_startup_hook)
+			s->user_hooks->lsdn_startup_hook(
+				a->net, a->phys, s->user_hooks->lsdn_startup_hook_user);
 	}
 }
 
@@ -1592,6 +3110,7 @@ lsdn_err_t lsdn_commit(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user)
 	 */
 	trigger_startup_hooks(ctx);
 
+	/* Nothing was sent to the kernel yet, so a pending reconcile stays for the next commit */
 	lsdn_err_t err = lsdn_validate(ctx, cb, user);
 	if(err != LSDNE_OK)
 		return err;
@@ -1607,69 +3126,126 @@ lsdn_err_t lsdn_commit(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user)
 	 * Settings, networks and attachments do not need to be committed in any way, but we must keep them
 	 * alive until PAs and virts are deleted. */
 
+	/* Filter and FDB updates are sent to kernel in batches. The objects must stay alive until
+	 * their batched requests are acknowledged, so the batch is flushed before any of them is
+	 * freed. */
+	lsdn_nl_batch_begin(ctx->nlsock);
+	if (ctx->reconcile)
+		lsdn_nl_reconcile_begin(ctx->nlsock);
+
+	/* Only the objects on the dirty lists (and the objects reachable from them) are processed,
+	 * the rest of the model is already committed. */
+
 	/********* Decommit phase **********/
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n) {
-		lsdn_foreach(n->virt_list, virt_entry, struct lsdn_virt, v) {
-			if (ack_decommit(&v->state)) {
-				decommit_virt(v);
-				ack_delete(v, virt_do_free);
-			}
+	uint64_t phase_start = now_us();
+	lsdn_foreach(ctx->dirty_virt_list, dirty_entry, struct lsdn_virt, v) {
+		/* A batched request failed after the virt was committed, remove what was committed
+		 * before adding it again */
+		if (v->state == LSDN_STATE_NEW && v->committed_to)
+			v->state = LSDN_STATE_RENEW;
+		/* The new rules do not fit in the shared block, move the virt to its own qdisc */
+		if (v->shared_block && v->state == LSDN_STATE_OK && lsdn_virt_has_ingress_rules(v))
+			renew(&v->state);
+		if (ack_decommit(&v->state)) {
+			decommit_virt(v);
+			if (v->pending_free)
+				lsdn_nl_batch_flush(ctx->nlsock);
+			ack_delete(v, virt_do_free);
+		} else if (v->committed_to) {
+			/* The virt stays, but some of its rules were freed */
+			decommit_freed_rules(v);
 		}
-		lsdn_foreach(n->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
-			if (ack_decommit(&pa->state)) {
-				decommit_pa(pa);
-				ack_delete(pa, pa_do_free);
-			}
+	}
+
+	lsdn_foreach(ctx->dirty_pa_list, dirty_entry, struct lsdn_phys_attachment, pa) {
+		if (ack_decommit(&pa->state)) {
+			decommit_pa(pa);
+			if (pa->pending_free)
+				lsdn_nl_batch_flush(ctx->nlsock);
+			ack_delete(pa, pa_do_free);
 		}
-		if (ack_decommit(&n->state))
+	}
+
+	lsdn_foreach(ctx->dirty_net_list, dirty_entry, struct lsdn_net, n) {
+		if (ack_decommit(&n->state)) {
+			aggregate_sweep(&n->aggregate_rate_in);
+			aggregate_sweep(&n->aggregate_rate_out);
 			ack_delete(n, net_do_free);
+		}
 	}
 
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p){
-		if (ack_decommit(&p->state))
+	lsdn_foreach(ctx->dirty_phys_list, dirty_entry, struct lsdn_phys, p){
+		if (ack_decommit(&p->state)) {
+			aggregate_sweep(&p->aggregate_rate_in);
+			aggregate_sweep(&p->aggregate_rate_out);
 			ack_delete(p, phys_do_free);
+		}
 	}
 
-	lsdn_foreach(ctx->settings_list, settings_entry, struct lsdn_settings, s) {
+	lsdn_foreach(ctx->dirty_settings_list, dirty_entry, struct lsdn_settings, s) {
 		if (ack_decommit(&s->state))
 			ack_delete(s, settings_do_free);
 	}
 
 	/********* (Re)commit phase **********/
-	/* first create physical attachments for local physes and populate
-	 * them with virts, remote PAs and remote virts */
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p){
-		if (p->is_local) {
+	uint64_t now = now_us();
+	ctx->stats.decommit_us = now - phase_start;
+	phase_start = now;
+	lsdn_foreach(ctx->dirty_phys_list, dirty_entry, struct lsdn_phys, p){
+		if (p->is_local)
 			p->committed_as_local = p->is_local;
-			lsdn_foreach(
-				p->attached_to_list, attached_to_entry,
-				struct lsdn_phys_attachment, pa)
-			{
-				commit_pa(pa);
-			}
-		}
 	}
 
-	/********* Ack phase **********/
-	lsdn_foreach(ctx->settings_list, settings_entry, struct lsdn_settings, s) {
-		ack_state(&s->state);
+	if (!commit_parallel(ctx)) {
+		lsdn_foreach(ctx->dirty_pa_list, dirty_entry, struct lsdn_phys_attachment, pa) {
+			commit_new_pa(pa);
+		}
+		lsdn_foreach(ctx->dirty_pa_list, dirty_entry, struct lsdn_phys_attachment, pa) {
+			show_new_pa(pa);
+		}
+		lsdn_foreach(ctx->dirty_virt_list, dirty_entry, struct lsdn_virt, v) {
+			commit_dirty_virt(v);
+		}
 	}
 
-	lsdn_foreach(ctx->phys_list, phys_entry, struct lsdn_phys, p){
-		ack_state(&p->state);
+	/* The virts were committed with the current aggregate rates, update the policers that were
+	 * already in use and free the unused ones */
+	lsdn_foreach(ctx->dirty_net_list, dirty_entry, struct lsdn_net, n) {
+		commit_aggregate_rate(ctx, &n->aggregate_rate_in, n->attr_rate_in);
+		commit_aggregate_rate(ctx, &n->aggregate_rate_out, n->attr_rate_out);
+	}
+	lsdn_foreach(ctx->dirty_phys_list, dirty_entry, struct lsdn_phys, p) {
+		commit_aggregate_rate(ctx, &p->aggregate_rate_in, p->attr_rate_in);
+		commit_aggregate_rate(ctx, &p->aggregate_rate_out, p->attr_rate_out);
 	}
 
-	lsdn_foreach(ctx->networks_list, networks_entry, struct lsdn_net, n){
-		ack_state(&n->state);
+	/* The flower filters were only updated in memory so far, send each changed one just once.
+	 * A ruleset may be shared by the commit groups (a phys interface or a block serves several
+	 * networks), so the filters are sent from the main socket even after a parallel commit. */
+	lsdn_rulesets_flush(ctx);
+
+	if (ctx->reconcile) {
+		char prefix[LSDN_NAMEBUF_SIZE];
+		snprintf(prefix, sizeof(prefix), "%s-iface-", ctx->name);
+		if (lsdn_nl_reconcile_end(ctx->nlsock, prefix, lsdn_action_range_first(ctx->name)) != LSDNE_OK)
+			lsdn_problem_report(ctx, LSDNP_RECONCILE, LSDNS_END);
+		ctx->reconcile = false;
+	}
 
-		lsdn_foreach(n->attached_list, attached_entry, struct lsdn_phys_attachment, pa) {
-			ack_state(&pa->state);
-		}
+	if (lsdn_nl_batch_end(ctx->nlsock) != LSDNE_OK)
+		ctx->inconsistent = true;
 
-		lsdn_foreach(n->virt_list, virt_entry, struct lsdn_virt, v) {
-			ack_state(&v->state);
-		}
-	}
+	/********* Ack phase **********/
+	now = now_us();
+	ctx->stats.commit_us = now - phase_start;
+	phase_start = now;
+	ack_dirty_list(ctx->dirty_settings_list, struct lsdn_settings);
+	ack_dirty_list(ctx->dirty_phys_list, struct lsdn_phys);
+	ack_dirty_list(ctx->dirty_net_list, struct lsdn_net);
+	ack_dirty_list(ctx->dirty_pa_list, struct lsdn_phys_attachment);
+	ack_dirty_list(ctx->dirty_virt_list, struct lsdn_virt);
+	ctx->stats.ack_us = now_us() - phase_start;
+	sync_nl_stats(ctx);
 
 	if (ctx->inconsistent)
 		return LSDNE_INCONSISTENT;
@@ -1678,3 +3254,161 @@ lsdn_err_t lsdn_commit(struct lsdn_context *ctx, lsdn_problem_cb cb, void *user)
 	else
 		return LSDNE_OK;
 }
+
+LSDN_ENUM_NAMES(plan_op_type);
+
+/** Get the name of a planned operation type, like `filter_create`. */
+const char *lsdn_plan_op_type_name(enum lsdn_plan_op_type type)
+{
+	assert(type < LSDN_PLAN_COUNT);
+	return plan_op_type_names[type];
+}
+
+/** Result of the planning commit, sent by the planning process before the operations. */
+struct plan_header {
+	lsdn_err_t result;
+	size_t problem_count;
+	struct lsdn_nl_stats stats;
+	size_t count;
+};
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t ret = write(fd, p, len);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t ret = read(fd, p, len);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/* Runs in the planning process: commit through a recording socket and send the plan to fd. */
+static void plan_commit(struct lsdn_context *ctx, int fd)
+{
+	struct lsdn_plan plan;
+	memset(&plan, 0, sizeof(plan));
+	struct plan_header h;
+	memset(&h, 0, sizeof(h));
+	h.result = LSDNE_NOMEM;
+
+	/* The sockets of the context are shared with the parent process, leave them alone. The
+	 * commit is not parallel, so that the operations are in a deterministic order. */
+	ctx->worker_socks = NULL;
+	ctx->commit_workers = 0;
+	struct lsdn_nl_transport *transport = open_transport(ctx);
+	if (transport)
+		transport = lsdn_record_transport_new(transport, &plan);
+	ctx->nlsock = init_socket(ctx, transport);
+	if (ctx->nlsock) {
+		h.result = lsdn_commit(ctx, NULL, NULL);
+		h.problem_count = ctx->problem_count;
+	}
+
+	h.stats = plan.stats;
+	h.count = plan.count;
+	if (write_all(fd, &h, sizeof(h)))
+		write_all(fd, plan.ops, plan.count * sizeof(*plan.ops));
+	_exit(0);
+}
+
+/** Find out what a commit would do, without changing the kernel or the model.
+ * Validates the model (the same way #lsdn_validate does) and then runs the commit in a forked
+ * process, through a netlink socket that records the requests changing the kernel state instead
+ * of sending them. Every recorded request is assumed to succeed. Kernel state is still read, for
+ * example to resolve the interfaces or to find stale objects when reconciling (see
+ * #lsdn_context_set_reconcile).
+ *
+ * The startup hooks (see #lsdn_user_hooks) run in the forked process only, so changes they do
+ * to the model are planned, but not kept. The problems found by the planned commit are only
+ * counted, see #lsdn_plan.problem_count.
+ *
+ * @param ctx LSDN context.
+ * @param cb Problem callback for the validation.
+ * @param user User data for the problem callback.
+ * @param plan Receives the plan, free it using #lsdn_plan_free.
+ *
+ * @retval LSDNE_OK The plan was made, the result of the planned commit is in #lsdn_plan.result.
+ * @retval LSDNE_VALIDATE Model validation found problems.
+ * @retval LSDNE_NOMEM The plan could not be made because of lack of memory or processes.
+ * @retval LSDNE_COMMIT The planning process has failed. */
+lsdn_err_t lsdn_commit_plan(
+	struct lsdn_context *ctx, lsdn_problem_cb cb, void *user, struct lsdn_plan **plan)
+{
+	*plan = NULL;
+	lsdn_err_t err = lsdn_validate(ctx, cb, user);
+	if (err != LSDNE_OK)
+		return err;
+
+	struct lsdn_plan *p = calloc(1, sizeof(*p));
+	if (!p)
+		ret_err(ctx, LSDNE_NOMEM);
+	int fds[2];
+	if (pipe(fds) == -1) {
+		free(p);
+		ret_err(ctx, LSDNE_NOMEM);
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		plan_commit(ctx, fds[1]);
+	}
+	close(fds[1]);
+	if (pid == -1) {
+		close(fds[0]);
+		free(p);
+		ret_err(ctx, LSDNE_NOMEM);
+	}
+
+	struct plan_header h;
+	err = LSDNE_COMMIT;
+	if (read_all(fds[0], &h, sizeof(h))) {
+		p->ops = malloc(h.count * sizeof(*p->ops) + 1);
+		if (!p->ops)
+			err = LSDNE_NOMEM;
+		else if (read_all(fds[0], p->ops, h.count * sizeof(*p->ops)))
+			err = LSDNE_OK;
+	}
+	close(fds[0]);
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+		;
+
+	if (err != LSDNE_OK) {
+		lsdn_plan_free(p);
+		ret_err(ctx, err);
+	}
+	p->count = h.count;
+	p->stats = h.stats;
+	p->result = h.result;
+	p->problem_count = h.problem_count;
+	*plan = p;
+	return LSDNE_OK;
+}
+
+void lsdn_plan_free(struct lsdn_plan *plan)
+{
+	if (!plan)
+		return;
+	free(plan->ops);
+	free(plan);
+}
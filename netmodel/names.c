@@ -1,23 +1,26 @@
 /** \file
  * Name-related function definitions. */
 #include "private/names.h"
-#include "include/util.h"
 #include <string.h>
 #include <stdlib.h>
 
-/** Set up a list of names.
+/** Set up a table of names.
  * Intended to be called on a member variable of another struct.
- * @param tab The list variable to initialize. */
+ * @param tab The table variable to initialize. */
 void lsdn_names_init(struct lsdn_names *tab)
 {
-	lsdn_list_init(&tab->head);
+	tab->ht = NULL;
 }
 
-/** Free a list of names.
- * Doesn't actually do anything. */
+/** Free a table of names.
+ * Names still registered in the table are removed from it (but keep their strings). */
 void lsdn_names_free(struct lsdn_names *tab)
 {
-	LSDN_UNUSED(tab);
+	struct lsdn_name *name, *tmp;
+	HASH_ITER(hh, tab->ht, name, tmp) {
+		HASH_DELETE(hh, tab->ht, name);
+		name->table = NULL;
+	}
 }
 
 /** Update an existing name.
@@ -30,7 +33,7 @@ void lsdn_names_free(struct lsdn_names *tab)
  * reuses a fixed buffer in the current context.
  *
  * @param name Name struct.
- * @param[in] table List of names.
+ * @param[in] table Table of names.
  * @param[in] str New name.
  * @retval LSDNE_OK if the update was successful. 
  * @retval LSDNE_DUPLICATE if the name already exists in `table`. 
@@ -56,7 +59,8 @@ lsdn_err_t lsdn_name_set(struct lsdn_name *name, struct lsdn_names *table, const
 	lsdn_name_free(name);
 
 	name->str = namedup;
-	lsdn_list_add(&table->head, &name->entry);
+	name->table = table;
+	HASH_ADD_KEYPTR(hh, table->ht, name->str, strlen(name->str), name);
 
 	return LSDNE_OK;
 }
@@ -65,24 +69,25 @@ lsdn_err_t lsdn_name_set(struct lsdn_name *name, struct lsdn_names *table, const
  * @param name Pointer to a name struct. */
 void lsdn_name_init(struct lsdn_name *name)
 {
-	lsdn_list_init(&name->entry);
 	name->str = NULL;
+	name->table = NULL;
 }
 
 /** Free a name.
- * Frees the associated string and removes the name from the list.
+ * Frees the associated string and removes the name from its table.
  * @param name Pointer to a name struct. */
 void lsdn_name_free(struct lsdn_name *name)
 {
+	if (name->table) {
+		HASH_DELETE(hh, name->table->ht, name);
+		name->table = NULL;
+	}
 	free(name->str);
 	name->str = NULL;
-	if (!lsdn_is_list_empty(&name->entry))
-		lsdn_list_remove(&name->entry);
 }
 
 /** Find a name struct corresponding to a given string.
- * Walks the list of names and checks whether the string exists in it.
- * @param[in] table List of names.
+ * @param[in] table Table of names.
  * @param[in] key Search string.
  * @return Name struct corresponding to `key`, if found.
  * @return `NULL` if the name is not found in the list. */
@@ -90,10 +95,7 @@ struct lsdn_name *lsdn_names_search(struct lsdn_names *table, const char* key)
 {
 	if (!key)
 		return NULL;
-	lsdn_foreach(table->head, entry, struct lsdn_name, name)
-	{
-		if(strcmp(name->str, key) == 0)
-			return name;
-	}
-	return NULL;
+	struct lsdn_name *name;
+	HASH_FIND(hh, table->ht, key, strlen(key), name);
+	return name;
 }
@@ -13,17 +13,46 @@ lsdn_err_t lsdn_settings_init_common(struct lsdn_settings *settings, struct lsdn
 	settings->state = LSDN_STATE_NEW;
 	lsdn_list_init(&settings->setting_users_list);
 	settings->user_hooks = NULL;
+	settings->qos_mode = LSDN_QOS_POLICE;
+	memset(&settings->tunnel_opts, 0, sizeof(settings->tunnel_opts));
 	lsdn_list_init_add(&ctx->settings_list, &settings->settings_entry);
+	lsdn_list_init(&settings->dirty_entry);
 	settings->ctx = ctx;
+	lsdn_settings_mark_dirty(settings);
 	return LSDNE_OK;
 }
 
-/** Initialize ruleset engine. */
+/* Both rulesets hang on a single clsact qdisc */
+static lsdn_err_t prepare_rulesets_clsact(
+	struct lsdn_context *ctx, struct lsdn_if *iface,
+	struct lsdn_ruleset* in, struct lsdn_ruleset* out)
+{
+	lsdn_err_t err = lsdn_qdisc_clsact_create(ctx->nlsock, iface->ifindex, ctx->overwrite);
+	if (err != LSDNE_OK)
+		return err;
+	if (out)
+		lsdn_ruleset_init(
+			out, ctx, iface,
+			LSDN_CLSACT_EGRESS_PARENT, LSDN_DEFAULT_CHAIN, 1, UINT32_MAX);
+	if (in)
+		lsdn_ruleset_init(
+			in, ctx, iface,
+			LSDN_CLSACT_INGRESS_PARENT, LSDN_DEFAULT_CHAIN, 1, UINT32_MAX);
+	return LSDNE_OK;
+}
+
+/** Initialize ruleset engine.
+ * Creates the qdiscs for the rulesets, either an ingress and a root prio qdisc, or a single
+ * clsact qdisc (see #lsdn_context_set_clsact), and sets up the rulesets with the matching
+ * parent handles. */
 lsdn_err_t lsdn_prepare_rulesets(
 	struct lsdn_context *ctx, struct lsdn_if *iface,
 	struct lsdn_ruleset* in, struct lsdn_ruleset* out)
 {
 	lsdn_err_t err;
+	if (ctx->clsact)
+		return prepare_rulesets_clsact(ctx, iface, in, out);
+
 	if (out) {
 		err = lsdn_qdisc_egress_create(ctx->nlsock, iface->ifindex, ctx->overwrite);
 		if (err != LSDNE_OK)
@@ -45,11 +74,38 @@ lsdn_err_t lsdn_prepare_rulesets(
 	return LSDNE_OK;
 }
 
+/** Create the shared tunnel key of a remote PA and set up the route action using it.
+ * All rules sending packets to the remote PA then refer to a single kernel action.
+ * Free it by #lsdn_shared_action_free after the route is removed. */
+lsdn_err_t lsdn_remote_pa_tunnel_key_init(struct lsdn_remote_pa *pa, struct lsdn_action_desc *action)
+{
+	lsdn_err_t err = lsdn_shared_tunnel_key_init(
+		&pa->tunnel_key, pa->local->net->ctx, pa->local->net->vnet_id,
+		pa->local->phys->attr_ip, pa->remote->phys->attr_ip);
+	if (err != LSDNE_OK)
+		return err;
+	lsdn_action_init(action, 1, lsdn_mkaction_shared, &pa->tunnel_key);
+	return LSDNE_OK;
+}
+
 lsdn_err_t lsdn_cleanup_rulesets(
 	struct lsdn_context *ctx, struct lsdn_if *iface,
 	struct lsdn_ruleset* in, struct lsdn_ruleset* out)
 {
 	lsdn_err_t err = LSDNE_OK;
+	/* The mode the rulesets were prepared in, the context setting might have changed since */
+	bool clsact = (in && in->parent_handle == LSDN_CLSACT_INGRESS_PARENT)
+		|| (out && out->parent_handle == LSDN_CLSACT_EGRESS_PARENT);
+	if (clsact) {
+		if (out)
+			lsdn_ruleset_free(out);
+		if (in)
+			lsdn_ruleset_free(in);
+		if (!ctx->disable_decommit)
+			acc_inconsistent(&err, lsdn_qdisc_ingress_delete(ctx->nlsock, iface->ifindex));
+		return err;
+	}
+
 	if (out) {
 		lsdn_ruleset_free(out);
 		if (!ctx->disable_decommit)
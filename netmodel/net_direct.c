@@ -17,7 +17,7 @@ static lsdn_err_t direct_create_pa(struct lsdn_phys_attachment *a)
 	err = lsdn_if_set_name(&a->tunnel_if, a->phys->attr_iface);
 	if (err != LSDNE_OK)
 		return err;
-	err = lsdn_if_resolve(&a->tunnel_if);
+	err = lsdn_if_resolve(a->net->ctx->nlsock, &a->tunnel_if);
 	if (err != LSDNE_OK) {
 		lsdn_if_free(&a->tunnel_if);
 		return err;
@@ -31,6 +31,20 @@ static lsdn_err_t direct_create_pa(struct lsdn_phys_attachment *a)
 	return LSDNE_OK;
 }
 
+/** Remove a machine from direct network.
+ * Implements #lsdn_net_ops.destroy_pa.
+ *
+ * Unlike #lsdn_lbridge_destroy_pa, the tunnel interface is left alone, since it is the phys
+ * interface and was not created by LSDN. */
+static lsdn_err_t direct_destroy_pa(struct lsdn_phys_attachment *a)
+{
+	lsdn_err_t err = LSDNE_OK;
+	acc_inconsistent(&err, lsdn_lbridge_remove(&a->lbridge_if));
+	acc_inconsistent(&err, lsdn_lbridge_free(&a->lbridge));
+	lsdn_if_free(&a->tunnel_if);
+	return err;
+}
+
 static unsigned int direct_tunneling_overhead(struct lsdn_phys_attachment *pa)
 {
 	LSDN_UNUSED(pa);
@@ -45,7 +59,7 @@ static struct lsdn_net_ops lsdn_net_direct_ops = {
 	.create_pa = direct_create_pa,
 	.add_virt = lsdn_lbridge_add_virt,
 	.remove_virt = lsdn_lbridge_remove_virt,
-	.destroy_pa = lsdn_lbridge_destroy_pa,
+	.destroy_pa = direct_destroy_pa,
 	.compute_tunneling_overhead = direct_tunneling_overhead
 };
 
@@ -17,7 +17,7 @@ static lsdn_err_t geneve_use_stunnel(struct lsdn_phys_attachment *a)
 	if (s->geneve.refcount == 0) {
 		err = lsdn_link_geneve_create(
 			ctx->nlsock, tunnel, lsdn_mk_iface_name(ctx), s->geneve.port,
-			true, ctx->overwrite);
+			true, &s->tunnel_opts, ctx->overwrite);
 		if (err != LSDNE_OK) {
 			return err;
 		}
@@ -134,33 +134,30 @@ static lsdn_err_t geneve_remove_virt(struct lsdn_virt *virt)
 	return lsdn_sbridge_remove_virt(virt);
 }
 
-static void set_geneve_metadata(struct lsdn_filter *f, uint16_t order, void *user)
-{
-	struct lsdn_remote_pa *pa = user;
-	lsdn_action_set_tunnel_key(f, order,
-		pa->local->net->vnet_id,
-		pa->local->phys->attr_ip,
-		pa->remote->phys->attr_ip);
-
-}
-
 static lsdn_err_t geneve_add_remote_pa (struct lsdn_remote_pa *pa)
 {
-	struct lsdn_action_desc *bra = &pa->sbridge_route.tunnel_action;
-	bra->actions_count = 1;
-	bra->fn = set_geneve_metadata;
-	bra->user = pa;
-	return lsdn_sbridge_add_route(&pa->local->sbridge_if, &pa->sbridge_route);
+	lsdn_err_t err = lsdn_remote_pa_tunnel_key_init(pa, &pa->sbridge_route.tunnel_action);
+	if (err != LSDNE_OK)
+		return err;
+	pa->sbridge_route.tunnel_vni = pa->local->net->vnet_id;
+	pa->sbridge_route.tunnel_dst = pa->remote->phys->attr_ip;
+	err = lsdn_sbridge_add_route(&pa->local->sbridge_if, &pa->sbridge_route);
+	if (err != LSDNE_OK)
+		lsdn_shared_action_free(&pa->tunnel_key);
+	return err;
 }
 
 static lsdn_err_t geneve_remove_remote_pa (struct lsdn_remote_pa *pa)
 {
-	return lsdn_sbridge_remove_route(&pa->sbridge_route);
+	lsdn_err_t err = lsdn_sbridge_remove_route(&pa->sbridge_route);
+	lsdn_shared_action_free(&pa->tunnel_key);
+	return err;
 }
 
 static lsdn_err_t geneve_add_remote_virt(struct lsdn_remote_virt *virt)
 {
-	return lsdn_sbridge_add_mac(&virt->pa->sbridge_route, &virt->sbridge_mac, *virt->virt->attr_mac);
+	return lsdn_sbridge_add_mac(
+		&virt->pa->sbridge_route, &virt->sbridge_mac, *virt->virt->attr_mac, virt->virt->attr_ip);
 }
 
 static lsdn_err_t geneve_remove_remote_virt(struct lsdn_remote_virt *virt)
@@ -270,10 +267,9 @@ static lsdn_err_t geneve_e2e_remove_virt(struct lsdn_virt *virt)
 
 static lsdn_err_t geneve_e2e_add_remote_pa (struct lsdn_remote_pa *pa)
 {
-	struct lsdn_action_desc *bra = &pa->lbridge_route.tunnel_action;
-	bra->actions_count = 1;
-	bra->fn = set_geneve_metadata;
-	bra->user = pa;
+	lsdn_err_t err = lsdn_remote_pa_tunnel_key_init(pa, &pa->lbridge_route.tunnel_action);
+	if (err != LSDNE_OK)
+		return err;
 	pa->lbridge_route.phys_if = &pa->local->net->settings->geneve.tunnel_sbridge;
 	pa->lbridge_route.vid_match = LSDN_MATCH_ENC_KEY_ID;
 	pa->lbridge_route.vid_matchdata.enc_key_id = pa->local->net->vnet_id;
@@ -284,12 +280,27 @@ static lsdn_err_t geneve_e2e_add_remote_pa (struct lsdn_remote_pa *pa)
 		pa->lbridge_route.source_match = LSDN_MATCH_ENC_KEY_SRC_IPV6;
 		pa->lbridge_route.source_matchdata.ipv6 = pa->remote->phys->attr_ip->v6;
 	}
-	return lsdn_lbridge_add_route(&pa->local->lbridge, &pa->lbridge_route, pa->local->net->vnet_id);
+	err = lsdn_lbridge_add_route(&pa->local->lbridge, &pa->lbridge_route, pa->local->net->vnet_id);
+	if (err != LSDNE_OK)
+		lsdn_shared_action_free(&pa->tunnel_key);
+	return err;
 }
 
 static lsdn_err_t geneve_e2e_remove_remote_pa (struct lsdn_remote_pa *pa)
 {
-	return lsdn_lbridge_remove_route(&pa->lbridge_route);
+	lsdn_err_t err = lsdn_lbridge_remove_route(&pa->lbridge_route);
+	lsdn_shared_action_free(&pa->tunnel_key);
+	return err;
+}
+
+static lsdn_err_t geneve_e2e_add_remote_virt(struct lsdn_remote_virt *virt)
+{
+	return lsdn_lbridge_add_route_mac(&virt->pa->lbridge_route, &virt->lbridge_mac, virt->virt->attr_mac);
+}
+
+static lsdn_err_t geneve_e2e_remove_remote_virt(struct lsdn_remote_virt *virt)
+{
+	return lsdn_lbridge_remove_route_mac(&virt->pa->lbridge_route, &virt->lbridge_mac);
 }
 
 struct lsdn_net_ops lsdn_net_geneve_e2e_ops = {
@@ -301,6 +312,8 @@ struct lsdn_net_ops lsdn_net_geneve_e2e_ops = {
 	.remove_virt = geneve_e2e_remove_virt,
 	.add_remote_pa = geneve_e2e_add_remote_pa,
 	.remove_remote_pa = geneve_e2e_remove_remote_pa,
+	.add_remote_virt = geneve_e2e_add_remote_virt,
+	.remove_remote_virt = geneve_e2e_remove_remote_virt,
 	.validate_net = geneve_validate_net,
 	.validate_pa = geneve_validate_pa,
 	.compute_tunneling_overhead = geneve_tunneling_overhead
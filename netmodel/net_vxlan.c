@@ -43,10 +43,64 @@ static lsdn_ip_t vxlan_mcast_get_ip(struct lsdn_settings *s)
 	return s->vxlan.mcast.mcast_ip;
 }
 
+/** Get the tunnel interface of a local PA.
+ * If the PA is connected to the shared bridge of its phys, the tunnel is shared by the networks
+ * and its forwarding entries must carry the network's VNI, returned in `vni`. Otherwise, `vni`
+ * is zero. */
+static unsigned int vxlan_pa_tunnel(struct lsdn_phys_attachment *a, uint32_t *vni)
+{
+	if (a->vlan_tunnel) {
+		*vni = a->net->vnet_id;
+		return a->vlan_tunnel->tunnel_if.ifindex;
+	}
+	*vni = 0;
+	return a->tunnel_if.ifindex;
+}
+
 /** \name Multicast VXLAN network.
  * This should describe what is mcast TODO. */
 /** @{ */
 
+/** Create the metadata tunnel of VXLAN-multicast networks on the shared bridge.
+ * Implements #lsdn_vlan_tunnel_create_cb. */
+static lsdn_err_t vxlan_mcast_create_vlan_tunnel(struct lsdn_phys_attachment *a, struct lsdn_if *tunnel_if)
+{
+	struct lsdn_settings *s = a->net->settings;
+	return lsdn_link_vxlan_create(
+		a->net->ctx->nlsock,
+		tunnel_if,
+		a->phys->attr_iface,
+		lsdn_mk_iface_name(a->net->ctx),
+		&s->vxlan.mcast.mcast_ip,
+		0,
+		s->vxlan.port,
+		true,
+		true,
+		s->vxlan.mcast.mcast_ip.v,
+		&s->tunnel_opts,
+		a->net->ctx->overwrite);
+}
+
+/** Add a machine to VXLAN-multicast network on the shared bridge of the phys.
+ * The metadata tunnel has no VNI of its own, so the network's VNI is pointed to the multicast
+ * group by a forwarding entry. */
+static lsdn_err_t vxlan_mcast_create_vlan_pa(struct lsdn_phys_attachment *a)
+{
+	struct lsdn_settings *s = a->net->settings;
+	lsdn_err_t err = lsdn_vlan_bridge_create_pa(
+		a, s->vxlan.mcast.mcast_ip.v, vxlan_mcast_create_vlan_tunnel);
+	if (err != LSDNE_OK)
+		return err;
+
+	uint32_t vni;
+	unsigned int ifindex = vxlan_pa_tunnel(a, &vni);
+	err = lsdn_fdb_add_entry(
+		a->net->ctx->nlsock, ifindex, lsdn_all_zeroes_mac, s->vxlan.mcast.mcast_ip, vni);
+	if (err != LSDNE_OK)
+		acc_inconsistent(&err, lsdn_lbridge_destroy_pa(a));
+	return err;
+}
+
 /** Add a machine to VXLAN-multicast network.
  * Implements #lsdn_net_ops.create_pa.
  *
@@ -54,6 +108,9 @@ static lsdn_ip_t vxlan_mcast_get_ip(struct lsdn_settings *s)
 static lsdn_err_t vxlan_mcast_create_pa(struct lsdn_phys_attachment *a)
 {
 	struct lsdn_settings *s = a->net->settings;
+	if (a->net->ctx->vlan_bridge)
+		return vxlan_mcast_create_vlan_pa(a);
+
 	lsdn_if_init(&a->tunnel_if);
 	lsdn_err_t err = lsdn_link_vxlan_create(
 		a->net->ctx->nlsock,
@@ -66,6 +123,7 @@ static lsdn_err_t vxlan_mcast_create_pa(struct lsdn_phys_attachment *a)
 		true,
 		false,
 		s->vxlan.mcast.mcast_ip.v,
+		&s->tunnel_opts,
 		a->net->ctx->overwrite);
 	if (err != LSDNE_OK) {
 		lsdn_if_free(&a->tunnel_if);
@@ -82,6 +140,25 @@ static lsdn_err_t vxlan_mcast_create_pa(struct lsdn_phys_attachment *a)
 	return LSDNE_OK;
 }
 
+/** Remove a machine from VXLAN-multicast network.
+ * Implements #lsdn_net_ops.destroy_pa.
+ *
+ * Drops the multicast forwarding entry of the shared tunnel, if the PA uses it, and tears
+ * down the bridge. */
+static lsdn_err_t vxlan_mcast_destroy_pa(struct lsdn_phys_attachment *a)
+{
+	lsdn_err_t err = LSDNE_OK;
+	if (a->vlan_tunnel && !a->net->ctx->disable_decommit) {
+		uint32_t vni;
+		unsigned int ifindex = vxlan_pa_tunnel(a, &vni);
+		acc_inconsistent(&err, lsdn_fdb_remove_entry(
+			a->net->ctx->nlsock, ifindex, lsdn_all_zeroes_mac,
+			a->net->settings->vxlan.mcast.mcast_ip, vni));
+	}
+	acc_inconsistent(&err, lsdn_lbridge_destroy_pa(a));
+	return err;
+}
+
 /** Calculate tunneling overhead for VXLAN-multicast network.
  * Implements #lsdn_net_ops.compute_tunneling_overhead. */
 static unsigned int vxlan_mcast_tunneling_overhead(struct lsdn_phys_attachment *pa)
@@ -98,7 +175,7 @@ struct lsdn_net_ops lsdn_net_vxlan_mcast_ops = {
 	.get_port = vxlan_get_port,
 	.get_ip = vxlan_mcast_get_ip,
 	.create_pa = vxlan_mcast_create_pa,
-	.destroy_pa = lsdn_lbridge_destroy_pa,
+	.destroy_pa = vxlan_mcast_destroy_pa,
 	.add_virt = lsdn_lbridge_add_virt,
 	.remove_virt = lsdn_lbridge_remove_virt,
 	.validate_net = vxlan_validate_net,
@@ -141,12 +218,35 @@ struct lsdn_settings *lsdn_settings_new_vxlan_mcast(
  * TODO this should explain e2e */
 /** @{ */
 
+/** Create the metadata tunnel of VXLAN-e2e networks on the shared bridge.
+ * Implements #lsdn_vlan_tunnel_create_cb. */
+static lsdn_err_t vxlan_e2e_create_vlan_tunnel(struct lsdn_phys_attachment *a, struct lsdn_if *tunnel_if)
+{
+	return lsdn_link_vxlan_create(
+		a->net->ctx->nlsock,
+		tunnel_if,
+		a->phys->attr_iface,
+		lsdn_mk_iface_name(a->net->ctx),
+		NULL,
+		0,
+		a->net->settings->vxlan.port,
+		true,
+		true,
+		a->phys->attr_ip->v,
+		&a->net->settings->tunnel_opts,
+		a->net->ctx->overwrite);
+}
+
 /** Add a local machine to VXLAN-e2e network.
  * Implements #lsdn_net_ops.create_pa.
  *
- * Sets up a VXLAN tunnel and connects it to a Linux Bridge. */
+ * Sets up a VXLAN tunnel and connects it to a Linux Bridge, or maps a VLAN of the shared
+ * bridge to the network's VNI. */
 static lsdn_err_t vxlan_e2e_create_pa(struct lsdn_phys_attachment *a)
 {
+	if (a->net->ctx->vlan_bridge)
+		return lsdn_vlan_bridge_create_pa(a, a->phys->attr_ip->v, vxlan_e2e_create_vlan_tunnel);
+
 	lsdn_err_t err = lsdn_link_vxlan_create(
 		a->net->ctx->nlsock,
 		&a->tunnel_if,
@@ -158,6 +258,7 @@ static lsdn_err_t vxlan_e2e_create_pa(struct lsdn_phys_attachment *a)
 		true,
 		false,
 		a->phys->attr_ip->v,
+		&a->net->settings->tunnel_opts,
 		a->net->ctx->overwrite);
 	if (err != LSDNE_OK)
 		return err;
@@ -178,10 +279,12 @@ static lsdn_err_t vxlan_e2e_add_remote_pa(struct lsdn_remote_pa *remote)
 {
 	/* Redirect broadcast packets to all remote PAs */
 	struct lsdn_phys_attachment *local = remote->local;
+	uint32_t vni;
+	unsigned int ifindex = vxlan_pa_tunnel(local, &vni);
 	return lsdn_fdb_add_entry(
-		local->net->ctx->nlsock, local->tunnel_if.ifindex,
+		local->net->ctx->nlsock, ifindex,
 		lsdn_all_zeroes_mac,
-		*remote->remote->phys->attr_ip);
+		*remote->remote->phys->attr_ip, vni);
 }
 
 /** Remove a remote machine from VXLAN-e2e network.
@@ -194,10 +297,56 @@ static lsdn_err_t vxlan_e2e_remove_remote_pa(struct lsdn_remote_pa *remote)
 		return LSDNE_OK;
 
 	struct lsdn_phys_attachment *local = remote->local;
+	uint32_t vni;
+	unsigned int ifindex = vxlan_pa_tunnel(local, &vni);
 	return lsdn_fdb_remove_entry(
-		local->net->ctx->nlsock, local->tunnel_if.ifindex,
+		local->net->ctx->nlsock, ifindex,
 		lsdn_all_zeroes_mac,
-		*remote->remote->phys->attr_ip);
+		*remote->remote->phys->attr_ip, vni);
+}
+
+/** Add a remote virt to VXLAN-e2e network.
+ * Implements #lsdn_net_ops.add_remote_virt.
+ *
+ * Points the virt's MAC address to its phys, so that only broadcasts and the traffic for virts
+ * without a known MAC address are sent to all the remote physes. */
+static lsdn_err_t vxlan_e2e_add_remote_virt(struct lsdn_remote_virt *virt)
+{
+	struct lsdn_lbridge_mac *entry = &virt->lbridge_mac;
+	struct lsdn_phys_attachment *local = virt->pa->local;
+	entry->installed = false;
+	if (!virt->virt->attr_mac)
+		return LSDNE_OK;
+	uint32_t vni;
+	unsigned int ifindex = vxlan_pa_tunnel(local, &vni);
+	lsdn_err_t err = lsdn_fdb_add_entry(
+		local->net->ctx->nlsock, ifindex,
+		*virt->virt->attr_mac,
+		*virt->pa->remote->phys->attr_ip, vni);
+	if (err != LSDNE_OK)
+		return err;
+	entry->installed = true;
+	entry->mac = *virt->virt->attr_mac;
+	return LSDNE_OK;
+}
+
+/** Remove a remote virt from VXLAN-e2e network.
+ * Implements #lsdn_net_ops.remove_remote_virt.
+ *
+ * Drops the entry for the virt's MAC address. */
+static lsdn_err_t vxlan_e2e_remove_remote_virt(struct lsdn_remote_virt *virt)
+{
+	struct lsdn_lbridge_mac *entry = &virt->lbridge_mac;
+	struct lsdn_phys_attachment *local = virt->pa->local;
+	if (!entry->installed || local->net->ctx->disable_decommit)
+		return LSDNE_OK;
+	entry->installed = false;
+	uint32_t vni;
+	unsigned int ifindex = vxlan_pa_tunnel(local, &vni);
+	return lsdn_fdb_remove_entry(
+		local->net->ctx->nlsock, ifindex,
+		entry->mac,
+		*virt->pa->remote->phys->attr_ip, vni);
 }
 
 /** Validate a phys attachment for use in VXLAN-e2e network.
@@ -225,7 +374,7 @@ static unsigned int vxlan_e2e_tunneling_overhead(struct lsdn_phys_attachment *pa
 
 /** Callbacks for VXLAN-e2e network.
  * Reuses network functions from `lbridge.c` for adding and removing virts
- * and for tearing down the network. Adding remote physes is implemented
+ * and for tearing down the network. Adding remote physes and virts is implemented
  * specifically for VXLAN-e2e. */
 struct lsdn_net_ops lsdn_net_vxlan_e2e_ops = {
 	.type = "vxlan/e2e",
@@ -236,6 +385,8 @@ struct lsdn_net_ops lsdn_net_vxlan_e2e_ops = {
 	.remove_virt = lsdn_lbridge_remove_virt,
 	.add_remote_pa = vxlan_e2e_add_remote_pa,
 	.remove_remote_pa = vxlan_e2e_remove_remote_pa,
+	.add_remote_virt = vxlan_e2e_add_remote_virt,
+	.remove_remote_virt = vxlan_e2e_remove_remote_virt,
 	.validate_net = vxlan_validate_net,
 	.validate_pa = vxlan_e2e_validate_pa,
 	.compute_tunneling_overhead = vxlan_e2e_tunneling_overhead
@@ -293,9 +444,10 @@ static lsdn_err_t vxlan_use_stunnel(struct lsdn_phys_attachment *a)
 			false,
 			true,
 			a->phys->attr_ip->v,
+			&s->tunnel_opts,
 			ctx->overwrite);
 		if (err != LSDNE_OK)
-			goto cleanup_link;
+			return err;
 
 		err = lsdn_link_set(ctx->nlsock, tunnel->ifindex, true);
 		if (err != LSDNE_OK)
@@ -399,28 +551,21 @@ static lsdn_err_t vxlan_static_remove_virt(struct lsdn_virt *virt)
 	return lsdn_sbridge_remove_virt(virt);
 }
 
-/** TODO */
-static void set_vxlan_metadata(struct lsdn_filter *f, uint16_t order, void *user)
-{
-	struct lsdn_remote_pa *pa = user;
-	lsdn_action_set_tunnel_key(f, order,
-		pa->local->net->vnet_id,
-		pa->local->phys->attr_ip,
-		pa->remote->phys->attr_ip);
-
-}
-
 /** Add a remote phys to VXLAN-static network.
  * Implements #lsdn_net_ops.add_remote_pa.
  *
  * Inserts an appropriate route into the static bridge. */
 static lsdn_err_t vxlan_static_add_remote_pa (struct lsdn_remote_pa *pa)
 {
-	struct lsdn_action_desc *bra = &pa->sbridge_route.tunnel_action;
-	bra->actions_count = 1;
-	bra->fn = set_vxlan_metadata;
-	bra->user = pa;
-	return lsdn_sbridge_add_route(&pa->local->sbridge_if, &pa->sbridge_route);
+	lsdn_err_t err = lsdn_remote_pa_tunnel_key_init(pa, &pa->sbridge_route.tunnel_action);
+	if (err != LSDNE_OK)
+		return err;
+	pa->sbridge_route.tunnel_vni = pa->local->net->vnet_id;
+	pa->sbridge_route.tunnel_dst = pa->remote->phys->attr_ip;
+	err = lsdn_sbridge_add_route(&pa->local->sbridge_if, &pa->sbridge_route);
+	if (err != LSDNE_OK)
+		lsdn_shared_action_free(&pa->tunnel_key);
+	return err;
 }
 
 /** Remove a remote phys from VXLAN-static network.
@@ -429,7 +574,9 @@ static lsdn_err_t vxlan_static_add_remote_pa (struct lsdn_remote_pa *pa)
  * Removes the appropriate route from the static bridge. */
 static lsdn_err_t vxlan_static_remove_remote_pa (struct lsdn_remote_pa *pa)
 {
-	return lsdn_sbridge_remove_route(&pa->sbridge_route);
+	lsdn_err_t err = lsdn_sbridge_remove_route(&pa->sbridge_route);
+	lsdn_shared_action_free(&pa->tunnel_key);
+	return err;
 }
 
 /** Add a remote virt to VXLAN-static network.
@@ -438,7 +585,8 @@ static lsdn_err_t vxlan_static_remove_remote_pa (struct lsdn_remote_pa *pa)
  * Adds a MAC-based rule into the static bridge. */
 static lsdn_err_t vxlan_static_add_remote_virt(struct lsdn_remote_virt *virt)
 {
-	return lsdn_sbridge_add_mac(&virt->pa->sbridge_route, &virt->sbridge_mac, *virt->virt->attr_mac);
+	return lsdn_sbridge_add_mac(
+		&virt->pa->sbridge_route, &virt->sbridge_mac, *virt->virt->attr_mac, virt->virt->attr_ip);
 }
 
 /** Remove a remote virt from VXLAN-static network.
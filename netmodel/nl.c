@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* recvmmsg */
 #include "private/nl.h"
 #include "private/log.h"
 #include "include/util.h"
@@ -7,19 +8,34 @@
 #include <linux/tc_act/tc_gact.h>
 #include <linux/tc_act/tc_tunnel_key.h>
 #include <linux/tc_act/tc_skbedit.h>
+#include <linux/tc_act/tc_pedit.h>
 #include <linux/veth.h>
+#include <linux/if_bridge.h>
+#include <linux/version.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
 #include <errno.h>
 
-#ifdef NDEBUG
+/* Tunnel link attributes newer than the oldest supported kernel headers. They are enums, so the
+ * header version tells if they are defined. The values are a part of the kernel ABI, older
+ * kernels ignore the attributes. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+#define IFLA_VXLAN_DF 29
+#define IFLA_GENEVE_DF 13
+#define VXLAN_DF_UNSET 0
+#define VXLAN_DF_SET 1
+#define VXLAN_DF_INHERIT 2
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+#define IFLA_GRO_MAX_SIZE 58
+#endif
+
+/* The buffer does not need to be cleared, mnl_nlmsg_put_header and mnl_nlmsg_put_extra_header
+ * clear the headers and everything else is written explicitly. */
 #define nl_buf(buf) \
 	char buf[MNL_SOCKET_BUFFER_SIZE];
-#else
-#define nl_buf(buf) \
-	char buf[MNL_SOCKET_BUFFER_SIZE]; \
-	bzero(buf, sizeof(buf))
-#endif
 
 void lsdn_if_init(struct lsdn_if *lsdn_if)
 {
@@ -73,11 +89,21 @@ lsdn_err_t lsdn_if_set_name(struct lsdn_if *lsdn_if, const char* ifname)
 	return LSDNE_OK;
 }
 
-lsdn_err_t lsdn_if_resolve(struct lsdn_if *lsdn_if)
+lsdn_err_t lsdn_if_resolve(struct lsdn_nl *sock, struct lsdn_if *lsdn_if)
 {
 	if (lsdn_if->ifindex != 0)
 		return LSDNE_OK;
 
+	if (sock) {
+		const struct lsdn_link_info *info = lsdn_link_lookup_name(sock, lsdn_if->ifname);
+		if (info) {
+			lsdn_if->ifindex = info->ifindex;
+			return LSDNE_OK;
+		}
+		if (sock->link_cache->links_valid)
+			return LSDNE_NOIF;
+	}
+
 	int ifindex = if_nametoindex(lsdn_if->ifname);
 	if(ifindex == 0){
 		assert(errno == ENXIO || errno == ENODEV);
@@ -89,17 +115,34 @@ lsdn_err_t lsdn_if_resolve(struct lsdn_if *lsdn_if)
 	return LSDNE_OK;
 }
 
-struct mnl_socket *lsdn_socket_init()
+/** Transport talking to the real kernel through libmnl sockets, one socket per channel. */
+struct mnl_transport {
+	struct lsdn_nl_transport t;
+	struct mnl_socket *socks[LSDN_NL_CHANNEL_COUNT];
+};
+
+static int mnl_transport_open(struct lsdn_nl_transport *t, enum lsdn_nl_channel ch)
 {
+	struct mnl_transport *mt = (struct mnl_transport *) t;
 	int err;
 	struct mnl_socket *sock = mnl_socket_open(NETLINK_ROUTE);
 	if (!sock)
-		return NULL;
+		return -1;
+
+	if (ch == LSDN_NL_LINKS) {
+		err = mnl_socket_bind(sock, RTMGRP_LINK, MNL_SOCKET_AUTOPID);
+		if (err) {
+			mnl_socket_close(sock);
+			return -1;
+		}
+		mt->socks[ch] = sock;
+		return 0;
+	}
 
 	err = mnl_socket_bind(sock, 0, MNL_SOCKET_AUTOPID);
 	if (err) {
 		mnl_socket_close(sock);
-		return NULL;
+		return -1;
 	}
 
 	/* This requests extended errorr messages (an error text). */
@@ -115,12 +158,271 @@ struct mnl_socket *lsdn_socket_init()
 		lsdn_log(LSDN_NLERR, "CAP_ACK not available %d\n", err);
 	}
 
-	return sock;
+	mt->socks[ch] = sock;
+	return 0;
+}
+
+static ssize_t mnl_transport_send(
+	struct lsdn_nl_transport *t, enum lsdn_nl_channel ch, const void *buf, size_t len)
+{
+	struct mnl_transport *mt = (struct mnl_transport *) t;
+	return mnl_socket_sendto(mt->socks[ch], buf, len);
+}
+
+static ssize_t mnl_transport_recv(
+	struct lsdn_nl_transport *t, enum lsdn_nl_channel ch, void *buf, size_t len, bool wait)
+{
+	struct mnl_transport *mt = (struct mnl_transport *) t;
+	if (wait)
+		return mnl_socket_recvfrom(mt->socks[ch], buf, len);
+	return recv(mnl_socket_get_fd(mt->socks[ch]), buf, len, MSG_DONTWAIT);
+}
+
+static int mnl_transport_recv_many(
+	struct lsdn_nl_transport *t, struct mmsghdr *msgs, unsigned int count)
+{
+	struct mnl_transport *mt = (struct mnl_transport *) t;
+	int fd = mnl_socket_get_fd(mt->socks[LSDN_NL_REQUESTS]);
+	return recvmmsg(fd, msgs, count, MSG_WAITFORONE, NULL);
+}
+
+static int mnl_transport_bpf(
+	struct lsdn_nl_transport *t, int cmd, union bpf_attr *attr, unsigned int size)
+{
+	LSDN_UNUSED(t);
+	return syscall(__NR_bpf, cmd, attr, size);
+}
+
+static void mnl_transport_close_fd(struct lsdn_nl_transport *t, int fd)
+{
+	LSDN_UNUSED(t);
+	close(fd);
+}
+
+static void mnl_transport_free(struct lsdn_nl_transport *t)
+{
+	struct mnl_transport *mt = (struct mnl_transport *) t;
+	for (int ch = 0; ch < LSDN_NL_CHANNEL_COUNT; ch++) {
+		if (mt->socks[ch])
+			mnl_socket_close(mt->socks[ch]);
+	}
+	free(mt);
+}
+
+static const struct lsdn_nl_transport_ops mnl_transport_ops = {
+	.open = mnl_transport_open,
+	.send = mnl_transport_send,
+	.recv = mnl_transport_recv,
+	.recv_many = mnl_transport_recv_many,
+	.bpf = mnl_transport_bpf,
+	.close_fd = mnl_transport_close_fd,
+	.free = mnl_transport_free
+};
+
+/** Create a transport using netlink sockets.
+ * The channels are opened by #lsdn_socket_init_transport and #lsdn_link_cache_sync. */
+struct lsdn_nl_transport *lsdn_nl_transport_mnl_new(void)
+{
+	struct mnl_transport *mt = malloc(sizeof(*mt));
+	if (!mt)
+		return NULL;
+	mt->t.ops = &mnl_transport_ops;
+	for (int ch = 0; ch < LSDN_NL_CHANNEL_COUNT; ch++)
+		mt->socks[ch] = NULL;
+	return &mt->t;
+}
+
+/** Open a netlink socket talking to the kernel. */
+struct lsdn_nl *lsdn_socket_init()
+{
+	struct lsdn_nl_transport *transport = lsdn_nl_transport_mnl_new();
+	if (!transport)
+		return NULL;
+	return lsdn_socket_init_transport(transport);
+}
+
+/** Open a netlink socket using the given transport.
+ * The socket takes the ownership of the transport, it is freed even if the socket can not be
+ * opened. */
+struct lsdn_nl *lsdn_socket_init_transport(struct lsdn_nl_transport *transport)
+{
+	struct lsdn_nl *nl = malloc(sizeof(*nl));
+	if (!nl) {
+		transport->ops->free(transport);
+		return NULL;
+	}
+
+	nl->transport = transport;
+	nl->seq = 0;
+	nl->batching = false;
+	nl->owner.cb = NULL;
+	nl->owner.user = NULL;
+	nl->batch_len = 0;
+	nl->pending_count = 0;
+	nl->orphan_errors = 0;
+	memset(&nl->stats, 0, sizeof(nl->stats));
+	nl->filter_pool = NULL;
+	nl->filter_pool_count = 0;
+	nl->filter_pool_max = LSDN_NL_FILTER_POOL;
+	nl->links_open = false;
+	nl->links_valid = false;
+	nl->links_by_name = NULL;
+	nl->links_by_index = NULL;
+	nl->link_cache = nl;
+	nl->io_hooks.before = NULL;
+	nl->io_hooks.after = NULL;
+	nl->io_hooks.user = NULL;
+	nl->reconcile = false;
+	nl->touched_lost = false;
+	nl->touched = NULL;
+	nl->batch_buf = malloc(LSDN_NL_BATCH_SIZE);
+	nl->ack_buf = malloc(LSDN_NL_BATCH_MSGS * LSDN_NL_ACK_SIZE);
+	if (!nl->batch_buf || !nl->ack_buf)
+		goto err_free;
+
+	if (transport->ops->open(transport, LSDN_NL_REQUESTS))
+		goto err_free;
+
+	return nl;
+
+err_free:
+	transport->ops->free(transport);
+	free(nl->batch_buf);
+	free(nl->ack_buf);
+	free(nl);
+	return NULL;
+}
+
+static void link_cache_remove(struct lsdn_nl *nl, struct lsdn_link_info *info)
+{
+	HASH_DELETE(hh_name, nl->links_by_name, info);
+	HASH_DELETE(hh_index, nl->links_by_index, info);
+	free(info);
+}
+
+static void link_cache_clear(struct lsdn_nl *nl)
+{
+	struct lsdn_link_info *info, *tmp;
+	HASH_ITER(hh_index, nl->links_by_index, info, tmp) {
+		link_cache_remove(nl, info);
+	}
+	nl->links_valid = false;
+}
+
+/** Kind of an object recorded while reconciling. */
+enum touched_type {
+	TOUCHED_LINK,
+	/** Parent of filters (a qdisc or a clsact hook). */
+	TOUCHED_PARENT,
+	TOUCHED_FILTER,
+	TOUCHED_FDB,
+	/** A shared action, the kind is in `parent` and the index in `handle`. */
+	TOUCHED_ACTION
+};
+
+/** Identifies a kernel object. Keys are compared as memory, they must be zeroed before filling. */
+struct touched_key {
+	uint32_t type;
+	uint32_t ifindex;
+	uint32_t parent;
+	uint32_t chain;
+	uint32_t prio;
+	uint32_t handle;
+	uint8_t mac[LSDN_MAC_LEN];
+	uint8_t dst_len;
+	uint8_t dst[LSDN_IPv6_LEN];
+};
+
+struct lsdn_nl_touched {
+	struct touched_key key;
+	UT_hash_handle hh;
+};
+
+static void touched_clear(struct lsdn_nl *nl)
+{
+	struct lsdn_nl_touched *t, *tmp;
+	HASH_ITER(hh, nl->touched, t, tmp) {
+		HASH_DELETE(hh, nl->touched, t);
+		free(t);
+	}
+	nl->touched_lost = false;
+}
+
+static void touched_init(struct touched_key *key, enum touched_type type, unsigned int ifindex)
+{
+	memset(key, 0, sizeof(*key));
+	key->type = type;
+	key->ifindex = ifindex;
+}
+
+static void touched_filter_init(struct touched_key *key, unsigned int ifindex,
+	uint32_t parent, uint32_t chain, uint32_t prio, uint32_t handle)
+{
+	touched_init(key, TOUCHED_FILTER, ifindex);
+	key->parent = parent;
+	key->chain = chain;
+	key->prio = prio;
+	key->handle = handle;
 }
 
-void lsdn_socket_free(struct mnl_socket *s)
+/* The VNI of an entry on a metadata tunnel is kept in the handle */
+static void touched_fdb_init(struct touched_key *key, unsigned int ifindex,
+	const uint8_t *mac, const uint8_t *dst, uint8_t dst_len, uint32_t vni)
 {
-	mnl_socket_close(s);
+	touched_init(key, TOUCHED_FDB, ifindex);
+	key->handle = vni;
+	memcpy(key->mac, mac, LSDN_MAC_LEN);
+	if (dst_len)
+		memcpy(key->dst, dst, dst_len);
+	key->dst_len = dst_len;
+}
+
+static bool was_touched(struct lsdn_nl *nl, const struct touched_key *key)
+{
+	struct lsdn_nl_touched *t;
+	HASH_FIND(hh, nl->touched, key, sizeof(*key), t);
+	return t != NULL;
+}
+
+/* Record an object created or adopted while reconciling. */
+static void touch(struct lsdn_nl *nl, const struct touched_key *key)
+{
+	if (!nl->reconcile || was_touched(nl, key))
+		return;
+	struct lsdn_nl_touched *t = malloc(sizeof(*t));
+	if (!t) {
+		nl->touched_lost = true;
+		return;
+	}
+	t->key = *key;
+	HASH_ADD(hh, nl->touched, key, sizeof(t->key), t);
+}
+
+static void touch_simple(struct lsdn_nl *nl, enum touched_type type, unsigned int ifindex, uint32_t parent)
+{
+	struct touched_key key;
+	touched_init(&key, type, ifindex);
+	key.parent = parent;
+	touch(nl, &key);
+}
+
+void lsdn_socket_free(struct lsdn_nl *s)
+{
+	if (!s)
+		return;
+	lsdn_nl_batch_end(s);
+	while (s->filter_pool) {
+		struct lsdn_filter *f = s->filter_pool;
+		s->filter_pool = f->next_free;
+		free(f->nlh);
+		free(f);
+	}
+	touched_clear(s);
+	link_cache_clear(s);
+	s->transport->ops->free(s->transport);
+	free(s->batch_buf);
+	free(s->ack_buf);
+	free(s);
 }
 
 /* This functions is intentionally separate to provide a convinient place for placing breakpoints */
@@ -168,20 +470,786 @@ static lsdn_err_t process_response(struct nlmsghdr *nlh, bool ignore_err)
 	return ret;
 }
 
+/* Account a request in the socket statistics. */
+static void count_request(struct lsdn_nl *nl, const struct nlmsghdr *nlh)
+{
+	switch (nlh->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+	case RTM_GETLINK:
+	case RTM_SETLINK:
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		nl->stats.link_msgs++;
+		break;
+	case RTM_NEWQDISC:
+	case RTM_DELQDISC:
+	case RTM_NEWTCLASS:
+	case RTM_DELTCLASS:
+		nl->stats.qdisc_msgs++;
+		break;
+	case RTM_NEWTFILTER:
+	case RTM_DELTFILTER:
+		nl->stats.filter_msgs++;
+		break;
+	case RTM_NEWNEIGH:
+	case RTM_DELNEIGH:
+		nl->stats.fdb_msgs++;
+		break;
+	case RTM_NEWACTION:
+	case RTM_DELACTION:
+		nl->stats.action_msgs++;
+		break;
+	default:
+		nl->stats.other_msgs++;
+	}
+	nl->stats.bytes += nlh->nlmsg_len;
+}
+
+void lsdn_nl_set_io_hooks(struct lsdn_nl *nl, struct lsdn_nl_io_hooks hooks)
+{
+	nl->io_hooks = hooks;
+}
+
+/* The blocking calls on the request channel, wrapped in the IO hooks. */
+static void io_before(struct lsdn_nl *nl)
+{
+	if (nl->io_hooks.before)
+		nl->io_hooks.before(nl->io_hooks.user);
+}
+
+static void io_after(struct lsdn_nl *nl)
+{
+	int saved_errno = errno;
+	if (nl->io_hooks.after)
+		nl->io_hooks.after(nl->io_hooks.user);
+	errno = saved_errno;
+}
+
+static ssize_t request_send(struct lsdn_nl *nl, const void *buf, size_t len)
+{
+	io_before(nl);
+	ssize_t ret = nl->transport->ops->send(nl->transport, LSDN_NL_REQUESTS, buf, len);
+	io_after(nl);
+	return ret;
+}
+
+static ssize_t request_recv(struct lsdn_nl *nl, void *buf, size_t len)
+{
+	io_before(nl);
+	ssize_t ret = nl->transport->ops->recv(nl->transport, LSDN_NL_REQUESTS, buf, len, true);
+	io_after(nl);
+	return ret;
+}
+
+static int request_recv_many(struct lsdn_nl *nl, struct mmsghdr *msgs, unsigned int count)
+{
+	io_before(nl);
+	int ret = nl->transport->ops->recv_many(nl->transport, msgs, count);
+	io_after(nl);
+	return ret;
+}
+
+static uint32_t next_seq(struct lsdn_nl *nl)
+{
+	/* Requests in a batch must have consecutive sequence numbers, let it wrap around freely */
+	return ++nl->seq;
+}
+
+/* Receive a response for the given request. Responses with other sequence numbers
+ * (left over from earlier requests) are skipped. */
+static int recv_response(struct lsdn_nl *nl, uint32_t seq, void *buf, size_t size)
+{
+	int ret;
+	do {
+		ret = request_recv(nl, buf, size);
+		if (ret == -1)
+			return ret;
+	} while (((struct nlmsghdr *) buf)->nlmsg_seq != seq);
+	return ret;
+}
+
+static void batch_report(struct lsdn_nl *nl, struct lsdn_nl_owner *owner, lsdn_err_t err)
+{
+	if (owner->cb)
+		owner->cb(err, owner->user);
+	else
+		nl->orphan_errors++;
+}
+
+/* Match the ACK to a pending request. Returns false for messages not belonging to the batch. */
+static bool batch_process_ack(struct lsdn_nl *nl, struct nlmsghdr *nlh, size_t len)
+{
+	if (len < sizeof(*nlh) + sizeof(struct nlmsgerr) || nlh->nlmsg_type != NLMSG_ERROR)
+		return false;
+	/* The ACK may have been truncated if the kernel message is very long, but the error code
+	 * is always in the fixed part */
+	if (nlh->nlmsg_len > len)
+		nlh->nlmsg_len = len;
+
+	uint32_t index = nlh->nlmsg_seq - nl->pending[0].seq;
+	if (index >= nl->pending_count)
+		return false;
+	struct lsdn_nl_pending *p = &nl->pending[index];
+	if (p->acked)
+		return false;
+	p->acked = true;
+
+	lsdn_err_t err = process_response(nlh, false);
+	if (err != LSDNE_OK) {
+		nl->stats.errors++;
+		batch_report(nl, &p->owner, err);
+	}
+	if (p->done)
+		p->done(err, p->done_user);
+	return true;
+}
+
+lsdn_err_t lsdn_nl_batch_flush(struct lsdn_nl *nl)
+{
+	size_t count = nl->pending_count;
+	size_t acked = 0;
+	lsdn_err_t ret = LSDNE_OK;
+	if (count == 0)
+		return LSDNE_OK;
+
+	lsdn_log(LSDNL_NL, "nl_batch_flush(count = %zu, bytes = %zu)\n", count, nl->batch_len);
+
+	if (request_send(nl, nl->batch_buf, nl->batch_len) == -1) {
+		ret = LSDNE_NETLINK;
+		goto fail_rest;
+	}
+
+	/* Each request was sent with NLM_F_ACK, so we get exactly one ACK for each, in order. The kernel
+	 * continues processing the batch even if one of the requests fails. */
+	struct mmsghdr msgs[LSDN_NL_BATCH_MSGS];
+	struct iovec iovs[LSDN_NL_BATCH_MSGS];
+	while (acked < count) {
+		size_t want = count - acked;
+		for (size_t i = 0; i < want; i++) {
+			iovs[i].iov_base = nl->ack_buf + i * LSDN_NL_ACK_SIZE;
+			iovs[i].iov_len = LSDN_NL_ACK_SIZE;
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int n = request_recv_many(nl, msgs, want);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			ret = LSDNE_NETLINK;
+			goto fail_rest;
+		}
+		for (int i = 0; i < n; i++) {
+			if (batch_process_ack(nl, iovs[i].iov_base, msgs[i].msg_len))
+				acked++;
+		}
+	}
+
+	nl->pending_count = 0;
+	nl->batch_len = 0;
+	return ret;
+
+fail_rest:
+	for (size_t i = 0; i < count; i++) {
+		struct lsdn_nl_pending *p = &nl->pending[i];
+		if (p->acked)
+			continue;
+		batch_report(nl, &p->owner, ret);
+		if (p->done)
+			p->done(ret, p->done_user);
+	}
+	nl->pending_count = 0;
+	nl->batch_len = 0;
+	return ret;
+}
+
+void lsdn_nl_batch_begin(struct lsdn_nl *nl)
+{
+	nl->batching = true;
+	nl->orphan_errors = 0;
+}
+
+lsdn_err_t lsdn_nl_batch_end(struct lsdn_nl *nl)
+{
+	lsdn_nl_batch_flush(nl);
+	nl->batching = false;
+	nl->owner.cb = NULL;
+	nl->owner.user = NULL;
+	return nl->orphan_errors ? LSDNE_NETLINK : LSDNE_OK;
+}
+
+struct lsdn_nl_owner lsdn_nl_set_owner(struct lsdn_nl *nl, struct lsdn_nl_owner owner)
+{
+	struct lsdn_nl_owner old = nl->owner;
+	nl->owner = owner;
+	return old;
+}
+
 static lsdn_err_t send_await_response(
-	struct mnl_socket *sock, struct nlmsghdr *nlh, bool ignore_err)
+	struct lsdn_nl *sock, struct nlmsghdr *nlh, bool ignore_err)
 {
 	int ret;
 
-	ret = mnl_socket_sendto(sock, (void *) nlh, nlh->nlmsg_len);
+	/* Keep the ordering of requests, the batched ones might be prerequisites for this one. */
+	lsdn_nl_batch_flush(sock);
+
+	uint32_t seq = next_seq(sock);
+	nlh->nlmsg_seq = seq;
+	count_request(sock, nlh);
+	ret = request_send(sock, nlh, nlh->nlmsg_len);
 	if (ret == -1)
 		return LSDNE_NETLINK;
 
-	ret = mnl_socket_recvfrom(sock, (void *) nlh, MNL_SOCKET_BUFFER_SIZE);
+	ret = recv_response(sock, seq, (void *) nlh, MNL_SOCKET_BUFFER_SIZE);
 	if (ret == -1)
 		return LSDNE_NETLINK;
 
-	return process_response(nlh, ignore_err);
+	lsdn_err_t err = process_response(nlh, ignore_err);
+	if (err != LSDNE_OK && !ignore_err)
+		sock->stats.errors++;
+	return err;
+}
+
+/**
+ * Send a request that does not need to be acknowledged immediately.
+ *
+ * If batching is enabled, the request is only queued and the errors are reported to the current
+ * owner when the batch is flushed. Otherwise it is sent synchronously.
+ */
+static lsdn_err_t send_batched_done(
+	struct lsdn_nl *sock, struct nlmsghdr *nlh, lsdn_nl_err_cb done, void *done_user)
+{
+	if (!sock->batching) {
+		lsdn_err_t err = send_await_response(sock, nlh, false);
+		if (done)
+			done(err, done_user);
+		return err;
+	}
+
+	size_t len = NLMSG_ALIGN(nlh->nlmsg_len);
+	if (sock->pending_count == LSDN_NL_BATCH_MSGS
+	    || sock->batch_len + len > LSDN_NL_BATCH_SIZE)
+		lsdn_nl_batch_flush(sock);
+
+	nlh->nlmsg_seq = next_seq(sock);
+	count_request(sock, nlh);
+	memcpy(sock->batch_buf + sock->batch_len, nlh, nlh->nlmsg_len);
+	sock->batch_len += len;
+
+	struct lsdn_nl_pending *p = &sock->pending[sock->pending_count++];
+	p->seq = nlh->nlmsg_seq;
+	p->acked = false;
+	p->owner = sock->owner;
+	p->done = done;
+	p->done_user = done_user;
+	return LSDNE_OK;
+}
+
+static lsdn_err_t send_batched(struct lsdn_nl *sock, struct nlmsghdr *nlh)
+{
+	return send_batched_done(sock, nlh, NULL, NULL);
+}
+
+static struct lsdn_link_info *link_cache_find_index(struct lsdn_nl *nl, unsigned int ifindex)
+{
+	struct lsdn_link_info *info;
+	HASH_FIND(hh_index, nl->links_by_index, &ifindex, sizeof(ifindex), info);
+	return info;
+}
+
+static struct lsdn_link_info *link_cache_find_name(struct lsdn_nl *nl, const char *name)
+{
+	struct lsdn_link_info *info;
+	HASH_FIND(hh_name, nl->links_by_name, name, strlen(name), info);
+	return info;
+}
+
+/* Apply a RTM_NEWLINK or RTM_DELLINK message (from a dump or a notification) to the cache. */
+static void link_cache_update(struct lsdn_nl *nl, const struct nlmsghdr *nlh)
+{
+	if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK)
+		return;
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+		return;
+
+	struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	/* Bridge port notifications use the same message types, but do not describe the link itself */
+	if (ifm->ifi_family == AF_BRIDGE)
+		return;
+
+	struct lsdn_link_info *info = link_cache_find_index(nl, ifm->ifi_index);
+	if (nlh->nlmsg_type == RTM_DELLINK) {
+		if (info)
+			link_cache_remove(nl, info);
+		return;
+	}
+
+	const char *name = NULL;
+	unsigned int mtu = info ? info->mtu : 0;
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(*ifm)) {
+		switch (mnl_attr_get_type(attr)) {
+		case IFLA_IFNAME:
+			if (mnl_attr_validate(attr, MNL_TYPE_STRING) >= 0)
+				name = mnl_attr_get_str(attr);
+			break;
+		case IFLA_MTU:
+			if (mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+				mtu = mnl_attr_get_u32(attr);
+			break;
+		}
+	}
+
+	if (!info) {
+		if (!name)
+			return;
+		info = malloc(sizeof(*info));
+		if (!info) {
+			/* The cache is incomplete, rebuild it next time */
+			nl->links_valid = false;
+			return;
+		}
+		info->ifindex = ifm->ifi_index;
+		info->name[0] = 0;
+		HASH_ADD(hh_index, nl->links_by_index, ifindex, sizeof(info->ifindex), info);
+	} else if (name && strcmp(info->name, name) != 0) {
+		HASH_DELETE(hh_name, nl->links_by_name, info);
+		info->name[0] = 0;
+	}
+
+	if (info->name[0] == 0) {
+		strncpy(info->name, name, sizeof(info->name) - 1);
+		info->name[sizeof(info->name) - 1] = 0;
+		HASH_ADD_KEYPTR(hh_name, nl->links_by_name, info->name, strlen(info->name), info);
+	}
+	info->mtu = mtu;
+}
+
+/* Apply all link messages in the buffer to the cache. Returns 1 if the dump with the given
+ * sequence number is finished, -1 if it failed or was interrupted and 0 otherwise. */
+static int link_cache_process(struct lsdn_nl *nl, void *buf, size_t len, uint32_t dump_seq)
+{
+	struct nlmsghdr *nlh = buf;
+	int left = len;
+	while (mnl_nlmsg_ok(nlh, left)) {
+		if (dump_seq && nlh->nlmsg_seq == dump_seq) {
+			if (nlh->nlmsg_flags & NLM_F_DUMP_INTR)
+				return -1;
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 1;
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+				return -1;
+		}
+		link_cache_update(nl, nlh);
+		nlh = mnl_nlmsg_next(nlh, &left);
+	}
+	return 0;
+}
+
+/* Fill the cache from scratch. The link socket is already subscribed, so no change made during
+ * the dump is lost. */
+static lsdn_err_t link_cache_dump(struct lsdn_nl *nl)
+{
+	char *buf = malloc(LSDN_NL_DUMP_SIZE);
+	if (!buf)
+		return LSDNE_NOMEM;
+
+	for (int attempt = 0; attempt < LSDN_NL_DUMP_RETRIES; attempt++) {
+		link_cache_clear(nl);
+		/* Reset by link_cache_update if a link can not be stored */
+		nl->links_valid = true;
+		lsdn_log(LSDNL_NL, "link_cache_dump(attempt = %d)\n", attempt);
+
+		struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+		nlh->nlmsg_type = RTM_GETLINK;
+		nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+		/* Notifications have sequence number 0 */
+		nlh->nlmsg_seq = next_seq(nl);
+		if (nlh->nlmsg_seq == 0)
+			nlh->nlmsg_seq = next_seq(nl);
+		uint32_t seq = nlh->nlmsg_seq;
+
+		struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+		ifm->ifi_family = AF_UNSPEC;
+
+		count_request(nl, nlh);
+		if (nl->transport->ops->send(nl->transport, LSDN_NL_LINKS, nlh, nlh->nlmsg_len) == -1)
+			break;
+
+		int state = 0;
+		while (state == 0) {
+			ssize_t len = nl->transport->ops->recv(
+				nl->transport, LSDN_NL_LINKS, buf, LSDN_NL_DUMP_SIZE, true);
+			if (len == -1) {
+				if (errno == EINTR)
+					continue;
+				/* ENOBUFS means we have lost some messages, start over */
+				state = -1;
+				break;
+			}
+			state = link_cache_process(nl, buf, len, seq);
+		}
+		if (state == 1 && nl->links_valid) {
+			free(buf);
+			return LSDNE_OK;
+		}
+	}
+
+	link_cache_clear(nl);
+	free(buf);
+	return LSDNE_NETLINK;
+}
+
+/* Apply the pending notifications, without blocking. */
+static lsdn_err_t link_cache_drain(struct lsdn_nl *nl)
+{
+	char buf[LSDN_NL_DUMP_SIZE];
+	while (true) {
+		ssize_t len = nl->transport->ops->recv(
+			nl->transport, LSDN_NL_LINKS, buf, sizeof(buf), false);
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			/* Typically ENOBUFS, some notifications were dropped */
+			return link_cache_dump(nl);
+		}
+		link_cache_process(nl, buf, len, 0);
+		if (!nl->links_valid)
+			return link_cache_dump(nl);
+	}
+	return LSDNE_OK;
+}
+
+void lsdn_nl_share_link_cache(struct lsdn_nl *nl, struct lsdn_nl *cache)
+{
+	nl->link_cache = cache->link_cache;
+}
+
+void lsdn_nl_set_filter_pool(struct lsdn_nl *nl, size_t max)
+{
+	nl->filter_pool_max = max;
+	while (nl->filter_pool_count > max) {
+		struct lsdn_filter *f = nl->filter_pool;
+		nl->filter_pool = f->next_free;
+		nl->filter_pool_count--;
+		free(f->nlh);
+		free(f);
+	}
+}
+
+lsdn_err_t lsdn_link_cache_sync(struct lsdn_nl *nl)
+{
+	nl = nl->link_cache;
+	if (!nl->links_open) {
+		if (nl->transport->ops->open(nl->transport, LSDN_NL_LINKS))
+			return LSDNE_NETLINK;
+		nl->links_open = true;
+	}
+
+	if (!nl->links_valid)
+		return link_cache_dump(nl);
+	return link_cache_drain(nl);
+}
+
+const struct lsdn_link_info *lsdn_link_lookup_name(struct lsdn_nl *nl, const char *name)
+{
+	nl = nl->link_cache;
+	struct lsdn_link_info *info = nl->links_valid ? link_cache_find_name(nl, name) : NULL;
+	if (!info && lsdn_link_cache_sync(nl) == LSDNE_OK)
+		info = link_cache_find_name(nl, name);
+	return info;
+}
+
+const struct lsdn_link_info *lsdn_link_lookup_index(struct lsdn_nl *nl, unsigned int ifindex)
+{
+	nl = nl->link_cache;
+	struct lsdn_link_info *info = nl->links_valid ? link_cache_find_index(nl, ifindex) : NULL;
+	if (!info && lsdn_link_cache_sync(nl) == LSDNE_OK)
+		info = link_cache_find_index(nl, ifindex);
+	return info;
+}
+
+void lsdn_nl_reconcile_begin(struct lsdn_nl *nl)
+{
+	touched_clear(nl);
+	nl->reconcile = true;
+}
+
+typedef void (*dump_cb)(struct lsdn_nl *nl, const struct nlmsghdr *nlh, void *user);
+
+/* Dump kernel objects on the request channel, the callback is called for each of them. */
+static lsdn_err_t request_dump(struct lsdn_nl *nl, struct nlmsghdr *req, dump_cb cb, void *user)
+{
+	lsdn_nl_batch_flush(nl);
+	char *buf = malloc(LSDN_NL_DUMP_SIZE);
+	if (!buf)
+		return LSDNE_NOMEM;
+
+	req->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	uint32_t seq = next_seq(nl);
+	req->nlmsg_seq = seq;
+	count_request(nl, req);
+	lsdn_err_t ret = LSDNE_NETLINK;
+	if (request_send(nl, req, req->nlmsg_len) == -1)
+		goto out;
+
+	while (true) {
+		ssize_t len = request_recv(nl, buf, LSDN_NL_DUMP_SIZE);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+		struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+		int left = len;
+		while (mnl_nlmsg_ok(nlh, left)) {
+			if (nlh->nlmsg_seq == seq) {
+				/* An interrupted dump may have skipped some objects */
+				if (nlh->nlmsg_type == NLMSG_ERROR || (nlh->nlmsg_flags & NLM_F_DUMP_INTR))
+					goto out;
+				if (nlh->nlmsg_type == NLMSG_DONE) {
+					ret = LSDNE_OK;
+					goto out;
+				}
+				cb(nl, nlh, user);
+			}
+			nlh = mnl_nlmsg_next(nlh, &left);
+		}
+	}
+
+out:
+	free(buf);
+	return ret;
+}
+
+/** Stale objects found by a dump, removed when the dump is finished. */
+struct stale_list {
+	struct touched_key *keys;
+	size_t count;
+	size_t size;
+	bool nomem;
+	/** Parent of the dumped filters, the kernel reports the parent of the filter chain. */
+	uint32_t parent;
+	/** First index of the range of the dumped shared actions, see #LSDN_ACTION_RANGE_BITS. */
+	uint32_t action_first;
+};
+
+static void stale_add(struct stale_list *l, const struct touched_key *key)
+{
+	if (l->count == l->size) {
+		size_t size = l->size ? 2 * l->size : 16;
+		struct touched_key *keys = realloc(l->keys, size * sizeof(*keys));
+		if (!keys) {
+			l->nomem = true;
+			return;
+		}
+		l->keys = keys;
+		l->size = size;
+	}
+	l->keys[l->count++] = *key;
+}
+
+static void stale_filter_cb(struct lsdn_nl *nl, const struct nlmsghdr *nlh, void *user)
+{
+	struct stale_list *l = user;
+	if (nlh->nlmsg_type != RTM_NEWTFILTER || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct tcmsg)))
+		return;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	/* The kernel also reports each priority without a handle */
+	if (!tcm->tcm_handle)
+		return;
+	uint32_t chain = 0;
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(*tcm)) {
+		if (mnl_attr_get_type(attr) == TCA_CHAIN && mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+			chain = mnl_attr_get_u32(attr);
+	}
+	struct touched_key key;
+	touched_filter_init(&key, tcm->tcm_ifindex, l->parent, chain,
+		TC_H_MAJ(tcm->tcm_info) >> 16, tcm->tcm_handle);
+	if (!was_touched(nl, &key))
+		stale_add(l, &key);
+}
+
+static void stale_fdb_cb(struct lsdn_nl *nl, const struct nlmsghdr *nlh, void *user)
+{
+	struct stale_list *l = user;
+	if (nlh->nlmsg_type != RTM_NEWNEIGH || nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct ndmsg)))
+		return;
+	const struct ndmsg *nd = mnl_nlmsg_get_payload(nlh);
+	/* Only the entries we could have created: permanent tunnel entries and static bridge
+	 * entries on our links */
+	if (nd->ndm_family != PF_BRIDGE)
+		return;
+	bool master = nd->ndm_flags & NTF_MASTER;
+	if (master ? nd->ndm_state != NUD_NOARP
+		   : !(nd->ndm_flags & NTF_SELF) || !(nd->ndm_state & NUD_PERMANENT))
+		return;
+	struct touched_key link;
+	touched_init(&link, TOUCHED_LINK, nd->ndm_ifindex);
+	if (!was_touched(nl, &link))
+		return;
+
+	const void *mac = NULL, *dst = NULL;
+	uint16_t dst_len = 0;
+	uint32_t vni = 0;
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(*nd)) {
+		uint16_t len = mnl_attr_get_payload_len(attr);
+		switch (mnl_attr_get_type(attr)) {
+		case NDA_LLADDR:
+			if (len == LSDN_MAC_LEN)
+				mac = mnl_attr_get_payload(attr);
+			break;
+		case NDA_DST:
+			if (len == LSDN_IPv4_LEN || len == LSDN_IPv6_LEN) {
+				dst = mnl_attr_get_payload(attr);
+				dst_len = len;
+			}
+			break;
+		case NDA_SRC_VNI:
+			if (mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+				vni = mnl_attr_get_u32(attr);
+			break;
+		}
+	}
+	if (!mac || !dst == !master)
+		return;
+	struct touched_key key;
+	touched_fdb_init(&key, nd->ndm_ifindex, mac, dst, dst_len, vni);
+	if (!was_touched(nl, &key))
+		stale_add(l, &key);
+}
+
+/* Remove the filters not touched from a filter parent. */
+static lsdn_err_t sweep_filters(struct lsdn_nl *nl, const struct touched_key *parent)
+{
+	struct stale_list l = {NULL, 0, 0, false, parent->parent};
+	nl_buf(buf);
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETTFILTER;
+	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
+	tcm->tcm_family = AF_UNSPEC;
+	tcm->tcm_ifindex = parent->ifindex;
+	tcm->tcm_parent = parent->parent;
+
+	lsdn_err_t err = request_dump(nl, nlh, stale_filter_cb, &l);
+	if (err == LSDNE_OK && !l.nomem) {
+		for (size_t i = 0; i < l.count; i++) {
+			struct touched_key *k = &l.keys[i];
+			lsdn_log(LSDNL_NL, "sweep_filter(ifindex = %u, parent = 0x%x, chain = %u, "
+				"prio = %u, handle = 0x%x)\n", k->ifindex, k->parent, k->chain, k->prio, k->handle);
+			lsdn_filter_delete(nl, k->ifindex, k->handle, k->parent, k->chain, k->prio);
+		}
+	}
+	free(l.keys);
+	return l.nomem ? LSDNE_NOMEM : err;
+}
+
+static lsdn_err_t sweep_fdb(struct lsdn_nl *nl)
+{
+	struct stale_list l = {NULL, 0, 0, false, 0};
+	nl_buf(buf);
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETNEIGH;
+	struct ndmsg *nd = mnl_nlmsg_put_extra_header(nlh, sizeof(*nd));
+	nd->ndm_family = PF_BRIDGE;
+
+	lsdn_err_t err = request_dump(nl, nlh, stale_fdb_cb, &l);
+	if (err == LSDNE_OK && !l.nomem) {
+		for (size_t i = 0; i < l.count; i++) {
+			struct touched_key *k = &l.keys[i];
+			lsdn_mac_t mac;
+			lsdn_ip_t ip;
+			memcpy(mac.bytes, k->mac, sizeof(mac.bytes));
+			lsdn_log(LSDNL_NL, "sweep_fdb(ifindex = %u)\n", k->ifindex);
+			if (k->dst_len == 0) {
+				lsdn_fdb_remove_master_entry(nl, k->ifindex, mac);
+				continue;
+			}
+			if (k->dst_len == LSDN_IPv4_LEN) {
+				ip.v = LSDN_IPv4;
+				memcpy(ip.v4.bytes, k->dst, LSDN_IPv4_LEN);
+			} else {
+				ip.v = LSDN_IPv6;
+				memcpy(ip.v6.bytes, k->dst, LSDN_IPv6_LEN);
+			}
+			lsdn_fdb_remove_entry(nl, k->ifindex, mac, ip, k->handle);
+		}
+	}
+	free(l.keys);
+	return l.nomem ? LSDNE_NOMEM : err;
+}
+
+/* Remove our links that were neither created nor adopted. */
+static lsdn_err_t sweep_links(struct lsdn_nl *nl, const char *prefix)
+{
+	lsdn_err_t err = lsdn_link_cache_sync(nl);
+	if (err != LSDNE_OK)
+		return err;
+
+	struct stale_list l = {NULL, 0, 0, false, 0};
+	struct lsdn_link_info *info, *tmp;
+	HASH_ITER(hh_index, nl->link_cache->links_by_index, info, tmp) {
+		struct touched_key key;
+		touched_init(&key, TOUCHED_LINK, info->ifindex);
+		if (strncmp(info->name, prefix, strlen(prefix)) == 0 && !was_touched(nl, &key))
+			stale_add(&l, &key);
+	}
+	if (l.nomem) {
+		free(l.keys);
+		return LSDNE_NOMEM;
+	}
+	/* The cache entries are removed as the links are deleted */
+	for (size_t i = 0; i < l.count; i++) {
+		struct lsdn_if iface;
+		iface.ifname = NULL;
+		iface.ifindex = l.keys[i].ifindex;
+		lsdn_log(LSDNL_NL, "sweep_link(ifindex = %u)\n", iface.ifindex);
+		lsdn_link_delete(nl, &iface);
+	}
+	free(l.keys);
+	return LSDNE_OK;
+}
+
+static lsdn_err_t sweep_actions(struct lsdn_nl *nl, uint32_t first);
+
+lsdn_err_t lsdn_nl_reconcile_end(struct lsdn_nl *nl, const char *link_prefix, uint32_t action_first)
+{
+	lsdn_err_t ret = LSDNE_OK;
+	nl->reconcile = false;
+	if (nl->touched_lost) {
+		/* We do not know what is stale */
+		touched_clear(nl);
+		return LSDNE_NOMEM;
+	}
+
+	/* Filters and FDB entries only from the recorded parents and links, which all stay */
+	struct lsdn_nl_touched *t, *tmp;
+	HASH_ITER(hh, nl->touched, t, tmp) {
+		if (t->key.type != TOUCHED_PARENT)
+			continue;
+		lsdn_err_t err = sweep_filters(nl, &t->key);
+		if (err != LSDNE_OK)
+			ret = err;
+	}
+	lsdn_err_t err = sweep_fdb(nl);
+	if (err != LSDNE_OK)
+		ret = err;
+	/* The actions are dumped after the stale filters using them are deleted */
+	err = sweep_actions(nl, action_first);
+	if (err != LSDNE_OK)
+		ret = err;
+	lsdn_nl_batch_flush(nl);
+
+	err = sweep_links(nl, link_prefix);
+	if (err != LSDNE_OK)
+		ret = err;
+	touched_clear(nl);
+	return ret;
 }
 
 /**
@@ -190,14 +1258,15 @@ static lsdn_err_t send_await_response(
  * Normally, we would use `NLM_F_REPLACE`, but kernel does not support that during link creation.
  * Just delete the old link manualyl if it exists.
  */
-static lsdn_err_t cleanup_link(struct mnl_socket *sock, const char *linkname, bool overwrite)
+static lsdn_err_t cleanup_link(struct lsdn_nl *sock, const char *linkname, bool overwrite)
 {
-	if (overwrite) {
+	/* When reconciling, the link is only deleted if it can not be adopted (see link_adopt) */
+	if (overwrite && !sock->reconcile) {
 		struct lsdn_if oldif;
 		/* hand-craft the oldif so that we don't have to deallocate it */
 		oldif.ifname = (char*) linkname;
 		oldif.ifindex = 0;
-		int err = lsdn_if_resolve(&oldif);
+		int err = lsdn_if_resolve(sock, &oldif);
 		if (err == LSDNE_NOIF)
 			return LSDNE_OK;
 		else if (err != LSDNE_OK)
@@ -209,16 +1278,148 @@ static lsdn_err_t cleanup_link(struct mnl_socket *sock, const char *linkname, bo
 
 }
 
+/* Get the ifindex of an interface by name, or 0 if it does not exist. */
+static unsigned int resolve_name(struct lsdn_nl *sock, const char *name)
+{
+	struct lsdn_if iface;
+	iface.ifname = (char*) name;
+	iface.ifindex = 0;
+	lsdn_if_resolve(sock, &iface);
+	return iface.ifindex;
+}
+
+/** Parts of a link description compared when adopting a link. */
+struct link_desc {
+	const char *kind;
+	const struct nlattr *data;
+	bool has_link;
+	uint32_t link;
+};
+
+static void parse_link_desc(const struct nlmsghdr *nlh, struct link_desc *d)
+{
+	struct nlattr *attr, *info;
+	memset(d, 0, sizeof(*d));
+	mnl_attr_for_each(attr, nlh, sizeof(struct ifinfomsg)) {
+		switch (mnl_attr_get_type(attr)) {
+		case IFLA_LINK:
+			if (mnl_attr_validate(attr, MNL_TYPE_U32) >= 0) {
+				d->has_link = true;
+				d->link = mnl_attr_get_u32(attr);
+			}
+			break;
+		case IFLA_LINKINFO:
+			mnl_attr_for_each_nested(info, attr) {
+				uint16_t type = mnl_attr_get_type(info);
+				if (type == IFLA_INFO_KIND && mnl_attr_validate(info, MNL_TYPE_STRING) >= 0)
+					d->kind = mnl_attr_get_str(info);
+				else if (type == IFLA_INFO_DATA)
+					d->data = info;
+			}
+			break;
+		}
+	}
+}
+
+static bool is_zero(const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < len; i++) {
+		if (bytes[i])
+			return false;
+	}
+	return true;
+}
+
+/* Check if the kind specific attributes of the request are the same in the existing link.
+ * The kernel does not report some of the attributes with their default (zero) value. */
+static bool link_data_matches(const struct nlattr *req, const struct nlattr *existing)
+{
+	const struct nlattr *a, *b;
+	if (!req)
+		return true;
+	mnl_attr_for_each_nested(a, req) {
+		bool found = false;
+		uint16_t len = mnl_attr_get_payload_len(a);
+		if (existing) {
+			mnl_attr_for_each_nested(b, existing) {
+				if (mnl_attr_get_type(b) != mnl_attr_get_type(a))
+					continue;
+				found = true;
+				if (mnl_attr_get_payload_len(b) != len
+				    || memcmp(mnl_attr_get_payload(a), mnl_attr_get_payload(b), len))
+					return false;
+			}
+		}
+		if (!found && (len == 0 || !is_zero(mnl_attr_get_payload(a), len)))
+			return false;
+	}
+	return true;
+}
+
+/* Check if the link described by the kernel was created by the request (or an equivalent one). */
+static bool link_matches(const struct nlmsghdr *req, const struct nlmsghdr *existing)
+{
+	struct link_desc r, e;
+	parse_link_desc(req, &r);
+	parse_link_desc(existing, &e);
+	if (!r.kind || !e.kind || strcmp(r.kind, e.kind) != 0)
+		return false;
+	/* Some link kinds (like VXLAN) report no lower device, they have it in the data */
+	if (r.has_link && e.has_link && r.link != e.link)
+		return false;
+	return link_data_matches(r.data, e.data);
+}
+
+/**
+ * Try to adopt an existing link instead of creating it by the request.
+ *
+ * The existing link is kept if it matches the request, otherwise it is deleted so that the
+ * request can create it again.
+ * @return true if the link was adopted and the request does not need to be sent.
+ */
+static bool link_adopt(struct lsdn_nl *sock, struct nlmsghdr *req, const char *if_name)
+{
+	const struct lsdn_link_info *info = lsdn_link_lookup_name(sock, if_name);
+	if (!info)
+		return false;
+	unsigned int ifindex = info->ifindex;
+
+	nl_buf(buf);
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_GETLINK;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+	ifm->ifi_family = AF_UNSPEC;
+	ifm->ifi_index = ifindex;
+
+	lsdn_nl_batch_flush(sock);
+	uint32_t seq = next_seq(sock);
+	nlh->nlmsg_seq = seq;
+	count_request(sock, nlh);
+	if (request_send(sock, nlh, nlh->nlmsg_len) != -1
+	    && recv_response(sock, seq, buf, sizeof(buf)) > 0
+	    && nlh->nlmsg_type == RTM_NEWLINK
+	    && link_matches(req, nlh)) {
+		lsdn_log(LSDNL_NL, "link_adopt(name = %s, ifindex = %u)\n", if_name, ifindex);
+		return true;
+	}
+
+	struct lsdn_if oldif;
+	oldif.ifname = (char *) if_name;
+	oldif.ifindex = ifindex;
+	lsdn_link_delete(sock, &oldif);
+	return false;
+}
+
 static void link_create_header(
 		struct nlmsghdr* nlh, struct nlattr** linkinfo,
 		const char *if_name, const char *if_type)
 {
 	assert(if_name != NULL);
-	unsigned int seq = 0;
 
 	nlh->nlmsg_type = RTM_NEWLINK;
 	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK | NLM_F_EXCL;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
@@ -232,7 +1433,7 @@ static void link_create_header(
 }
 
 static lsdn_err_t link_create_send(
-		struct mnl_socket *sock, char* buf, struct nlmsghdr *nlh,
+		struct lsdn_nl *sock, char* buf, struct nlmsghdr *nlh,
 		struct nlattr* linkinfo,
 		const char *if_name, struct lsdn_if* dst_if)
 {
@@ -240,9 +1441,11 @@ static lsdn_err_t link_create_send(
 
 	mnl_attr_nest_end(nlh, linkinfo);
 
-	err = send_await_response(sock, nlh, false);
-	if (err != LSDNE_OK)
-		return err;
+	if (!sock->reconcile || !link_adopt(sock, nlh, if_name)) {
+		err = send_await_response(sock, nlh, false);
+		if (err != LSDNE_OK)
+			return err;
+	}
 
 	lsdn_if_init(dst_if);
 
@@ -250,14 +1453,16 @@ static lsdn_err_t link_create_send(
 	if (err != LSDNE_OK)
 		return err;
 
-	err = lsdn_if_resolve(dst_if);
+	err = lsdn_if_resolve(sock, dst_if);
+	if (err == LSDNE_OK)
+		touch_simple(sock, TOUCHED_LINK, dst_if->ifindex, 0);
 
 	return err;
 }
 
 // ip link add name <if_name> type dummy
 lsdn_err_t lsdn_link_dummy_create(
-	struct mnl_socket *sock, struct lsdn_if* dst_if, const char *if_name, bool overwrite)
+	struct lsdn_nl *sock, struct lsdn_if* dst_if, const char *if_name, bool overwrite)
 {
 	nl_buf(buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
@@ -271,15 +1476,14 @@ lsdn_err_t lsdn_link_dummy_create(
 }
 
 //ip link add link <if_name> name <vlan_name> type vlan id <vlanid>
-lsdn_err_t lsdn_link_vlan_create(struct mnl_socket *sock, struct lsdn_if* dst_if, const char *if_name,
+lsdn_err_t lsdn_link_vlan_create(struct lsdn_nl *sock, struct lsdn_if* dst_if, const char *if_name,
 		const char *vlan_name, uint16_t vlanid, bool overwrite)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	struct nlattr *linkinfo;
 
-	unsigned int ifindex = if_nametoindex(if_name);
+	unsigned int ifindex = resolve_name(sock, if_name);
 
 	lsdn_err_t err = cleanup_link(sock, vlan_name, overwrite);
 	if (err != LSDNE_OK)
@@ -287,7 +1491,6 @@ lsdn_err_t lsdn_link_vlan_create(struct mnl_socket *sock, struct lsdn_if* dst_if
 
 	nlh->nlmsg_type = RTM_NEWLINK;
 	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK | NLM_F_EXCL;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
@@ -314,22 +1517,83 @@ static const lsdn_ip_t dummy_ipv6_mcast =
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
 
+/* Put the generic link attributes of the tunnel options, they are not compared when adopting */
+static void tunnel_opts_put_link(struct nlmsghdr *nlh, const struct lsdn_tunnel_opts *opts)
+{
+	if (opts->txqueuelen)
+		mnl_attr_put_u32(nlh, IFLA_TXQLEN, opts->txqueuelen);
+	if (opts->gso_max_size)
+		mnl_attr_put_u32(nlh, IFLA_GSO_MAX_SIZE, opts->gso_max_size);
+	if (opts->gro_max_size)
+		mnl_attr_put_u32(nlh, IFLA_GRO_MAX_SIZE, opts->gro_max_size);
+}
+
+/* The tunnel kinds have the same options, but their own attribute numbers */
+struct tunnel_opts_attrs {
+	uint16_t udp_csum;
+	uint16_t udp_zero_csum6_tx;
+	uint16_t udp_zero_csum6_rx;
+	uint16_t ttl;
+	uint16_t df;
+};
+
+static const struct tunnel_opts_attrs vxlan_opts_attrs = {
+	IFLA_VXLAN_UDP_CSUM, IFLA_VXLAN_UDP_ZERO_CSUM6_TX, IFLA_VXLAN_UDP_ZERO_CSUM6_RX,
+	IFLA_VXLAN_TTL, IFLA_VXLAN_DF
+};
+
+static const struct tunnel_opts_attrs geneve_opts_attrs = {
+	IFLA_GENEVE_UDP_CSUM, IFLA_GENEVE_UDP_ZERO_CSUM6_TX, IFLA_GENEVE_UDP_ZERO_CSUM6_RX,
+	IFLA_GENEVE_TTL, IFLA_GENEVE_DF
+};
+
+/* The default of all the flags is off, in both VXLAN and Geneve */
+static void tunnel_flag_put(struct nlmsghdr *nlh, uint16_t type, enum lsdn_tunnel_flag flag)
+{
+	mnl_attr_put_u8(nlh, type, flag == LSDN_TUNNEL_FLAG_ON);
+}
+
+/* Put the kind specific attributes of the tunnel options into IFLA_INFO_DATA.
+ * The kernel defaults are put explicitly, so that a tunnel with a tuned option does not match
+ * a request that keeps the default when adopting. They are zero, so they still match a kernel
+ * that does not know the attribute. */
+static void tunnel_opts_put_data(
+	struct nlmsghdr *nlh, const struct lsdn_tunnel_opts *opts, const struct tunnel_opts_attrs *attrs)
+{
+	tunnel_flag_put(nlh, attrs->udp_csum, opts->udp_csum);
+	tunnel_flag_put(nlh, attrs->udp_zero_csum6_tx, opts->udp_zero_csum6_tx);
+	tunnel_flag_put(nlh, attrs->udp_zero_csum6_rx, opts->udp_zero_csum6_rx);
+	mnl_attr_put_u8(nlh, attrs->ttl, opts->ttl);
+	/* VXLAN_DF_* and GENEVE_DF_* have the same values */
+	switch (opts->df) {
+	case LSDN_TUNNEL_DF_DEFAULT:
+	case LSDN_TUNNEL_DF_UNSET:
+		mnl_attr_put_u8(nlh, attrs->df, VXLAN_DF_UNSET);
+		break;
+	case LSDN_TUNNEL_DF_SET:
+		mnl_attr_put_u8(nlh, attrs->df, VXLAN_DF_SET);
+		break;
+	case LSDN_TUNNEL_DF_INHERIT:
+		mnl_attr_put_u8(nlh, attrs->df, VXLAN_DF_INHERIT);
+		break;
+	}
+}
+
 //ip link add <vxlan_name> type vxlan id <vxlanid> [group <mcast_group>] dstport <port> dev <if_name>
 lsdn_err_t lsdn_link_vxlan_create(
-	struct mnl_socket *sock, struct lsdn_if* dst_if,
+	struct lsdn_nl *sock, struct lsdn_if* dst_if,
 	const char *if_name, const char *vxlan_name,
 	lsdn_ip_t *mcast_group, uint32_t vxlanid, uint16_t port,
 	bool learning, bool collect_metadata, enum lsdn_ipv ipv,
-	bool overwrite)
+	const struct lsdn_tunnel_opts *opts, bool overwrite)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	struct nlattr *linkinfo;
 
 	unsigned int ifindex = 0;
 	if (if_name)
-		ifindex = if_nametoindex(if_name);
+		ifindex = resolve_name(sock, if_name);
 
 	lsdn_err_t err = cleanup_link(sock, vxlan_name, overwrite);
 	if (err != LSDNE_OK)
@@ -337,7 +1601,6 @@ lsdn_err_t lsdn_link_vxlan_create(
 
 	nlh->nlmsg_type = RTM_NEWLINK;
 	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK | NLM_F_EXCL;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
@@ -346,6 +1609,7 @@ lsdn_err_t lsdn_link_vxlan_create(
 	if (if_name)
 		mnl_attr_put_u32(nlh, IFLA_LINK, ifindex);
 	mnl_attr_put_strz(nlh, IFLA_IFNAME, vxlan_name);
+	tunnel_opts_put_link(nlh, opts);
 
 	linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
 	mnl_attr_put_strz(nlh, IFLA_INFO_KIND, "vxlan");
@@ -369,6 +1633,7 @@ lsdn_err_t lsdn_link_vxlan_create(
 		 */
 		mnl_attr_put(nlh, IFLA_VXLAN_GROUP6, sizeof(dummy_ipv6_mcast.v6.bytes), dummy_ipv6_mcast.v6.bytes);
 	}
+	tunnel_opts_put_data(nlh, opts, &vxlan_opts_attrs);
 
 	mnl_attr_nest_end(nlh, vxlanid_linkinfo);
 	mnl_attr_nest_end(nlh, linkinfo);
@@ -377,10 +1642,10 @@ lsdn_err_t lsdn_link_vxlan_create(
 }
 
 lsdn_err_t lsdn_link_geneve_create(
-	struct mnl_socket *sock, struct lsdn_if* dst_if,
-	const char *new_if, uint16_t port, bool collect_metadata, bool overwrite)
+	struct lsdn_nl *sock, struct lsdn_if* dst_if,
+	const char *new_if, uint16_t port, bool collect_metadata,
+	const struct lsdn_tunnel_opts *opts, bool overwrite)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	struct nlattr *linkinfo, *geneve_linkinfo;
@@ -391,13 +1656,13 @@ lsdn_err_t lsdn_link_geneve_create(
 
 	nlh->nlmsg_type = RTM_NEWLINK;
 	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK | NLM_F_EXCL;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
 	ifm->ifi_change = 0;
 	ifm->ifi_flags = 0;
 	mnl_attr_put_strz(nlh, IFLA_IFNAME, new_if);
+	tunnel_opts_put_link(nlh, opts);
 
 	linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
 	mnl_attr_put_strz(nlh, IFLA_INFO_KIND, "geneve");
@@ -407,15 +1672,17 @@ lsdn_err_t lsdn_link_geneve_create(
 		mnl_attr_put_u16(nlh, IFLA_GENEVE_PORT, htons(port));
 	if (collect_metadata)
 		mnl_attr_put(nlh, IFLA_GENEVE_COLLECT_METADATA, 0, NULL);
+	tunnel_opts_put_data(nlh, opts, &geneve_opts_attrs);
 	mnl_attr_nest_end(nlh, geneve_linkinfo);
 	mnl_attr_nest_end(nlh, linkinfo);
 
 	return link_create_send(sock, buf, nlh, linkinfo, new_if, dst_if);
 }
 
+// ip link add name <if_name> type bridge [vlan_filtering 1 vlan_default_pvid 0]
 lsdn_err_t lsdn_link_bridge_create(
-	struct mnl_socket *sock, struct lsdn_if* dst_if, const char *if_name,
-	bool overwrite)
+	struct lsdn_nl *sock, struct lsdn_if* dst_if, const char *if_name,
+	bool vlan_filtering, bool overwrite)
 {
 	nl_buf(buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
@@ -426,19 +1693,25 @@ lsdn_err_t lsdn_link_bridge_create(
 		return err;
 
 	link_create_header(nlh, &linkinfo, if_name, "bridge");
+	if (vlan_filtering) {
+		/* The ports are in no VLAN until they are given one */
+		struct nlattr *data = mnl_attr_nest_start(nlh, IFLA_INFO_DATA);
+		mnl_attr_put_u8(nlh, IFLA_BR_VLAN_FILTERING, 1);
+		mnl_attr_put_u16(nlh, IFLA_BR_VLAN_DEFAULT_PVID, 0);
+		mnl_attr_nest_end(nlh, data);
+	}
 	return link_create_send(sock, buf, nlh, linkinfo, if_name, dst_if);
 }
 
-lsdn_err_t lsdn_link_set_master(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_set_master(struct lsdn_nl *sock,
 		unsigned int master, unsigned int slave)
 {
-	unsigned int seq = 0, change = 0;
+	unsigned int change = 0;
 	nl_buf(buf);
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWLINK;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
@@ -451,7 +1724,101 @@ lsdn_err_t lsdn_link_set_master(struct mnl_socket *sock,
 	return send_await_response(sock, nlh, false);
 }
 
-static void fdb_set_keys(struct nlmsghdr *nlh, lsdn_mac_t mac, lsdn_ip_t ip)
+static struct nlmsghdr *bridge_msg_start(char *buf, uint16_t type, unsigned int ifindex)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+
+	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+	ifm->ifi_family = PF_BRIDGE;
+	ifm->ifi_index = ifindex;
+	return nlh;
+}
+
+// bridge link set dev <ifindex> vlan_tunnel on
+lsdn_err_t lsdn_bridge_port_set_vlan_tunnel(struct lsdn_nl *sock, unsigned int ifindex)
+{
+	nl_buf(buf);
+	struct nlmsghdr *nlh = bridge_msg_start(buf, RTM_SETLINK, ifindex);
+	struct nlattr *protinfo = mnl_attr_nest_start(nlh, IFLA_PROTINFO);
+	mnl_attr_put_u8(nlh, IFLA_BRPORT_VLAN_TUNNEL, 1);
+	mnl_attr_nest_end(nlh, protinfo);
+	return send_await_response(sock, nlh, false);
+}
+
+/* Put the VLAN and its tunnel mapping. The kernel processes them in order, the mapping must
+ * come after the VLAN is added and before it is removed. */
+static void bridge_vlan_put(struct nlmsghdr *nlh, uint16_t vid, uint16_t flags, uint32_t tunnel_id, bool add)
+{
+	struct nlattr *afspec = mnl_attr_nest_start(nlh, IFLA_AF_SPEC);
+	struct bridge_vlan_info vinfo;
+	bzero(&vinfo, sizeof(vinfo));
+	vinfo.vid = vid;
+	vinfo.flags = flags;
+	if (add)
+		mnl_attr_put(nlh, IFLA_BRIDGE_VLAN_INFO, sizeof(vinfo), &vinfo);
+	if (tunnel_id) {
+		struct nlattr *tinfo = mnl_attr_nest_start(nlh, IFLA_BRIDGE_VLAN_TUNNEL_INFO);
+		mnl_attr_put_u32(nlh, IFLA_BRIDGE_VLAN_TUNNEL_ID, tunnel_id);
+		mnl_attr_put_u16(nlh, IFLA_BRIDGE_VLAN_TUNNEL_VID, vid);
+		mnl_attr_put_u16(nlh, IFLA_BRIDGE_VLAN_TUNNEL_FLAGS, 0);
+		mnl_attr_nest_end(nlh, tinfo);
+	}
+	if (!add)
+		mnl_attr_put(nlh, IFLA_BRIDGE_VLAN_INFO, sizeof(vinfo), &vinfo);
+	mnl_attr_nest_end(nlh, afspec);
+}
+
+/** Add the bridge port `ifindex` to a VLAN.
+ * @param access Make it the port's untagged VLAN (PVID), for the ports of the virts.
+ * @param tunnel_id If non-zero, the frames of the VLAN are sent with this tunnel ID (VNI) by a
+ * metadata tunnel port and the frames received with it are put into the VLAN. */
+lsdn_err_t lsdn_bridge_vlan_add(struct lsdn_nl *sock, unsigned int ifindex, uint16_t vid,
+	bool access, uint32_t tunnel_id)
+{
+	nl_buf(buf);
+	struct nlmsghdr *nlh = bridge_msg_start(buf, RTM_SETLINK, ifindex);
+	bridge_vlan_put(nlh, vid, access ? BRIDGE_VLAN_INFO_PVID | BRIDGE_VLAN_INFO_UNTAGGED : 0,
+		tunnel_id, true);
+	return send_batched(sock, nlh);
+}
+
+/** Remove the bridge port `ifindex` from all VLANs, if reconciling.
+ * A port adopted from the previous run may still be in its VLANs, which may now belong to other
+ * networks, or have their tunnel IDs mapped differently. Does nothing otherwise, a new port is
+ * in no VLAN. */
+lsdn_err_t lsdn_bridge_port_reset_vlans(struct lsdn_nl *sock, unsigned int ifindex)
+{
+	if (!sock->reconcile)
+		return LSDNE_OK;
+	nl_buf(buf);
+	struct nlmsghdr *nlh = bridge_msg_start(buf, RTM_DELLINK, ifindex);
+	struct nlattr *afspec = mnl_attr_nest_start(nlh, IFLA_AF_SPEC);
+	struct bridge_vlan_info vinfo;
+	bzero(&vinfo, sizeof(vinfo));
+	/* The kernel skips the VLANs the port is not in */
+	vinfo.vid = 1;
+	vinfo.flags = BRIDGE_VLAN_INFO_RANGE_BEGIN;
+	mnl_attr_put(nlh, IFLA_BRIDGE_VLAN_INFO, sizeof(vinfo), &vinfo);
+	vinfo.vid = 4094;
+	vinfo.flags = BRIDGE_VLAN_INFO_RANGE_END;
+	mnl_attr_put(nlh, IFLA_BRIDGE_VLAN_INFO, sizeof(vinfo), &vinfo);
+	mnl_attr_nest_end(nlh, afspec);
+	return send_await_response(sock, nlh, false);
+}
+
+/** Remove the bridge port `ifindex` from a VLAN, together with its tunnel mapping. */
+lsdn_err_t lsdn_bridge_vlan_delete(struct lsdn_nl *sock, unsigned int ifindex, uint16_t vid,
+	uint32_t tunnel_id)
+{
+	nl_buf(buf);
+	struct nlmsghdr *nlh = bridge_msg_start(buf, RTM_DELLINK, ifindex);
+	bridge_vlan_put(nlh, vid, 0, tunnel_id, false);
+	return send_batched(sock, nlh);
+}
+
+static void fdb_set_keys(struct nlmsghdr *nlh, lsdn_mac_t mac, lsdn_ip_t ip, uint32_t vni)
 {
 	mnl_attr_put(nlh, NDA_LLADDR, sizeof(mac.bytes), mac.bytes);
 
@@ -459,18 +1826,27 @@ static void fdb_set_keys(struct nlmsghdr *nlh, lsdn_mac_t mac, lsdn_ip_t ip)
 		mnl_attr_put(nlh, NDA_DST, sizeof(ip.v4.bytes), ip.v4.bytes);
 	else
 		mnl_attr_put(nlh, NDA_DST, sizeof(ip.v6.bytes), ip.v6.bytes);
+	if (vni)
+		mnl_attr_put_u32(nlh, NDA_SRC_VNI, vni);
 }
 
-lsdn_err_t lsdn_fdb_add_entry(struct mnl_socket *sock, unsigned int ifindex,
-		lsdn_mac_t mac, lsdn_ip_t ip)
+/** Add a destination for `mac` to the forwarding database of a tunnel.
+ * @param vni The VNI the entry applies to on a metadata tunnel, 0 on a tunnel with a single
+ * VNI. */
+lsdn_err_t lsdn_fdb_add_entry(struct lsdn_nl *sock, unsigned int ifindex,
+		lsdn_mac_t mac, lsdn_ip_t ip, uint32_t vni)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWNEIGH;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_APPEND | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
+	/* The default (all-zeroes) and multicast entries collect all their destinations, a unicast
+	 * entry has a single one and it overrides whatever the tunnel has learned for the address */
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK;
+	if (lsdn_mac_eq(mac, lsdn_all_zeroes_mac) || (mac.bytes[0] & 1))
+		nlh->nlmsg_flags |= NLM_F_APPEND;
+	else
+		nlh->nlmsg_flags |= NLM_F_REPLACE;
 
 	struct ndmsg *nd = mnl_nlmsg_put_extra_header(nlh, sizeof(*nd));
 	nd->ndm_family = PF_BRIDGE;
@@ -478,21 +1854,28 @@ lsdn_err_t lsdn_fdb_add_entry(struct mnl_socket *sock, unsigned int ifindex,
 	nd->ndm_ifindex = ifindex;
 	nd->ndm_flags = NTF_SELF;
 
-	fdb_set_keys(nlh, mac, ip);
+	fdb_set_keys(nlh, mac, ip, vni);
 
-	return send_await_response(sock, nlh, false);
+	if (sock->reconcile) {
+		struct touched_key key;
+		if (ip.v == LSDN_IPv4)
+			touched_fdb_init(&key, ifindex, mac.bytes, ip.v4.bytes, sizeof(ip.v4.bytes), vni);
+		else
+			touched_fdb_init(&key, ifindex, mac.bytes, ip.v6.bytes, sizeof(ip.v6.bytes), vni);
+		touch(sock, &key);
+	}
+
+	return send_batched(sock, nlh);
 }
 
-lsdn_err_t lsdn_fdb_remove_entry(struct mnl_socket *sock, unsigned int ifindex,
-			  lsdn_mac_t mac, lsdn_ip_t ip)
+lsdn_err_t lsdn_fdb_remove_entry(struct lsdn_nl *sock, unsigned int ifindex,
+			  lsdn_mac_t mac, lsdn_ip_t ip, uint32_t vni)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_DELNEIGH;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ndmsg *nd = mnl_nlmsg_put_extra_header(nlh, sizeof(*nd));
 	nd->ndm_family = PF_BRIDGE;
@@ -500,23 +1883,60 @@ lsdn_err_t lsdn_fdb_remove_entry(struct mnl_socket *sock, unsigned int ifindex,
 	nd->ndm_ifindex = ifindex;
 	nd->ndm_flags = NTF_SELF;
 
-	fdb_set_keys(nlh, mac, ip);
+	fdb_set_keys(nlh, mac, ip, vni);
 
-	return send_await_response(sock, nlh, false);
+	return send_batched(sock, nlh);
+}
+
+/* Build a static entry of the bridge the port `ifindex` is enslaved to. */
+static struct nlmsghdr *fdb_master_msg(char *buf, uint16_t type, unsigned int ifindex, lsdn_mac_t mac)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+
+	struct ndmsg *nd = mnl_nlmsg_put_extra_header(nlh, sizeof(*nd));
+	nd->ndm_family = PF_BRIDGE;
+	/* NUD_PERMANENT would make it a local entry, delivering the frames to the bridge itself */
+	nd->ndm_state = NUD_NOARP;
+	nd->ndm_ifindex = ifindex;
+	nd->ndm_flags = NTF_MASTER;
+
+	mnl_attr_put(nlh, NDA_LLADDR, sizeof(mac.bytes), mac.bytes);
+	return nlh;
+}
+
+lsdn_err_t lsdn_fdb_add_master_entry(struct lsdn_nl *sock, unsigned int ifindex, lsdn_mac_t mac)
+{
+	nl_buf(buf);
+	struct nlmsghdr *nlh = fdb_master_msg(buf, RTM_NEWNEIGH, ifindex, mac);
+	nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+
+	if (sock->reconcile) {
+		struct touched_key key;
+		touched_fdb_init(&key, ifindex, mac.bytes, NULL, 0, 0);
+		touch(sock, &key);
+	}
+
+	return send_batched(sock, nlh);
+}
+
+lsdn_err_t lsdn_fdb_remove_master_entry(struct lsdn_nl *sock, unsigned int ifindex, lsdn_mac_t mac)
+{
+	nl_buf(buf);
+	return send_batched(sock, fdb_master_msg(buf, RTM_DELNEIGH, ifindex, mac));
 }
 
-lsdn_err_t lsdn_link_set_ip(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_set_ip(struct lsdn_nl *sock,
 		const char *iface, lsdn_ip_t ip)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
 
-	int ifindex = if_nametoindex(iface);
+	int ifindex = resolve_name(sock, iface);
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWADDR;
 	nlh->nlmsg_flags = NLM_F_REPLACE | NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ifaddrmsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	if (ip.v == LSDN_IPv4)
@@ -537,7 +1957,7 @@ lsdn_err_t lsdn_link_set_ip(struct mnl_socket *sock,
 }
 
 lsdn_err_t lsdn_link_veth_create(
-		struct mnl_socket *sock,
+		struct lsdn_nl *sock,
 		struct lsdn_if* if1, const char *if_name1,
 		struct lsdn_if* if2, const char *if_name2)
 {
@@ -574,21 +1994,19 @@ lsdn_err_t lsdn_link_veth_create(
 	if (err == LSDNE_OK) {
 		err = lsdn_if_set_name(if2, if_name2);
 		if (err == LSDNE_OK)
-			err = lsdn_if_resolve(if2);
+			err = lsdn_if_resolve(sock, if2);
 	}
 
 	return err;
 }
 
-lsdn_err_t lsdn_link_delete(struct mnl_socket *sock, struct lsdn_if *iface)
+lsdn_err_t lsdn_link_delete(struct lsdn_nl *sock, struct lsdn_if *iface)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 
 	nlh->nlmsg_type = RTM_DELLINK;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
@@ -596,29 +2014,47 @@ lsdn_err_t lsdn_link_delete(struct mnl_socket *sock, struct lsdn_if *iface)
 	ifm->ifi_flags = 0;
 	ifm->ifi_index = iface->ifindex;
 
-	return send_await_response(sock, nlh, true);
+	lsdn_err_t err = send_await_response(sock, nlh, true);
+	if (err == LSDNE_OK) {
+		/* Do not wait for the notification, the name may be reused right away */
+		struct lsdn_link_info *info = link_cache_find_index(sock->link_cache, iface->ifindex);
+		if (info)
+			link_cache_remove(sock->link_cache, info);
+	}
+	return err;
 }
 
-lsdn_err_t lsdn_link_get_mtu(struct mnl_socket *sock, unsigned int ifindex,
+lsdn_err_t lsdn_link_get_mtu(struct lsdn_nl *sock, unsigned int ifindex,
 	unsigned int *mtu)
 {
-	unsigned int seq = 0;
+	/* The MTU might have been changed since the last lookup, apply the notifications first */
+	if (lsdn_link_cache_sync(sock) == LSDNE_OK) {
+		const struct lsdn_link_info *info = link_cache_find_index(sock->link_cache, ifindex);
+		if (!info)
+			return LSDNE_NOIF;
+		*mtu = info->mtu;
+		return LSDNE_OK;
+	}
+
 	nl_buf(buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 
 	nlh->nlmsg_type = RTM_GETLINK;
 	nlh->nlmsg_flags = NLM_F_REQUEST;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_PACKET;
 	ifm->ifi_index = ifindex;
 
-	int ret = mnl_socket_sendto(sock, (void *) nlh, nlh->nlmsg_len);
+	lsdn_nl_batch_flush(sock);
+	uint32_t seq = next_seq(sock);
+	nlh->nlmsg_seq = seq;
+	count_request(sock, nlh);
+	int ret = request_send(sock, nlh, nlh->nlmsg_len);
 	if (ret == -1)
 		return LSDNE_NETLINK;
 
-	ret = mnl_socket_recvfrom(sock, (void *) nlh, MNL_SOCKET_BUFFER_SIZE);
+	ret = recv_response(sock, seq, (void *) nlh, MNL_SOCKET_BUFFER_SIZE);
 	if (ret <= 0)
 		return LSDNE_NETLINK;
 
@@ -639,9 +2075,9 @@ lsdn_err_t lsdn_link_get_mtu(struct mnl_socket *sock, unsigned int ifindex,
 	return LSDNE_NOIF;
 }
 
-lsdn_err_t lsdn_link_set(struct mnl_socket *sock, unsigned int ifindex, bool up)
+lsdn_err_t lsdn_link_set(struct lsdn_nl *sock, unsigned int ifindex, bool up)
 {
-	unsigned int seq = 0, change = IFF_UP, flags = 0;
+	unsigned int change = IFF_UP, flags = 0;
 	nl_buf(buf);
 
 	if (up)
@@ -650,7 +2086,6 @@ lsdn_err_t lsdn_link_set(struct mnl_socket *sock, unsigned int ifindex, bool up)
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWLINK;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
 	ifm->ifi_family = AF_UNSPEC;
@@ -661,21 +2096,36 @@ lsdn_err_t lsdn_link_set(struct mnl_socket *sock, unsigned int ifindex, bool up)
 	return send_await_response(sock, nlh, false);
 }
 
-lsdn_err_t lsdn_qdisc_ingress_create(
-	struct mnl_socket *sock, unsigned int ifindex, bool overwrite)
+/* Send a qdisc creation request. When reconciling, an existing qdisc of the same kind is kept and
+ * a different one is only deleted if it could not be changed. */
+static lsdn_err_t qdisc_create_send(struct lsdn_nl *sock, struct nlmsghdr *nlh, bool overwrite,
+	lsdn_err_t (*delete)(struct lsdn_nl *sock, unsigned int ifindex))
 {
-	unsigned int seq = 0;
-	nl_buf(buf);
+	struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	unsigned int ifindex = tcm->tcm_ifindex;
+	if (sock->reconcile) {
+		/* The request buffer is overwritten by the response */
+		nl_buf(copy);
+		memcpy(copy, nlh, nlh->nlmsg_len);
+		if (send_await_response(sock, (struct nlmsghdr *) copy, true) == LSDNE_OK)
+			return LSDNE_OK;
+		overwrite = true;
+	}
 	if (overwrite) {
-		lsdn_err_t err = lsdn_qdisc_ingress_delete(sock, ifindex);
+		lsdn_err_t err = delete(sock, ifindex);
 		if (err != LSDNE_OK)
 			return err;
 	}
+	return send_await_response(sock, nlh, false);
+}
 
+lsdn_err_t lsdn_qdisc_ingress_create(
+	struct lsdn_nl *sock, unsigned int ifindex, bool overwrite)
+{
+	nl_buf(buf);
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWQDISC;
 	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
 	tcm->tcm_family = AF_UNSPEC;
@@ -685,24 +2135,19 @@ lsdn_err_t lsdn_qdisc_ingress_create(
 
 	mnl_attr_put_strz(nlh, TCA_KIND, "ingress");
 
-	return send_await_response(sock, nlh, false);
+	lsdn_err_t err = qdisc_create_send(sock, nlh, overwrite, lsdn_qdisc_ingress_delete);
+	if (err == LSDNE_OK)
+		touch_simple(sock, TOUCHED_PARENT, ifindex, LSDN_INGRESS_HANDLE);
+	return err;
 }
 
 lsdn_err_t lsdn_qdisc_egress_create(
-	struct mnl_socket *sock, unsigned int ifindex, bool overwrite)
+	struct lsdn_nl *sock, unsigned int ifindex, bool overwrite)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
-	if (overwrite) {
-		lsdn_err_t err = lsdn_qdisc_egress_delete(sock, ifindex);
-		if (err != LSDNE_OK)
-			return err;
-	}
-
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_NEWQDISC;
 	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
 	tcm->tcm_family = AF_UNSPEC;
@@ -717,18 +2162,69 @@ lsdn_err_t lsdn_qdisc_egress_create(
 	bzero(qopt.priomap, sizeof(qopt.priomap));
 	mnl_attr_put(nlh, TCA_OPTIONS, sizeof(qopt), &qopt);
 
-	return send_await_response(sock, nlh, false);
+	lsdn_err_t err = qdisc_create_send(sock, nlh, overwrite, lsdn_qdisc_egress_delete);
+	if (err == LSDNE_OK)
+		touch_simple(sock, TOUCHED_PARENT, ifindex, LSDN_ROOT_HANDLE);
+	return err;
+}
+
+static lsdn_err_t clsact_create(
+	struct lsdn_nl *sock, unsigned int ifindex, uint32_t ingress_block, bool overwrite)
+{
+	nl_buf(buf);
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = RTM_NEWQDISC;
+	nlh->nlmsg_flags = NLM_F_CREATE | NLM_F_REQUEST | NLM_F_ACK;
+
+	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
+	tcm->tcm_family = AF_UNSPEC;
+	tcm->tcm_ifindex = ifindex;
+	tcm->tcm_handle = LSDN_INGRESS_HANDLE;
+	tcm->tcm_parent = TC_H_CLSACT;
+
+	mnl_attr_put_strz(nlh, TCA_KIND, "clsact");
+	if (ingress_block)
+		mnl_attr_put_u32(nlh, TCA_INGRESS_BLOCK, ingress_block);
+
+	lsdn_err_t err = qdisc_create_send(sock, nlh, overwrite, lsdn_qdisc_ingress_delete);
+	if (err == LSDNE_OK) {
+		if (ingress_block)
+			touch_simple(sock, TOUCHED_PARENT, LSDN_BLOCK_IFINDEX, ingress_block);
+		else
+			touch_simple(sock, TOUCHED_PARENT, ifindex, LSDN_CLSACT_INGRESS_PARENT);
+		touch_simple(sock, TOUCHED_PARENT, ifindex, LSDN_CLSACT_EGRESS_PARENT);
+	}
+	return err;
+}
+
+/** Create a clsact qdisc, providing both the ingress and egress filter hooks.
+ * Unlike the prio qdisc created by #lsdn_qdisc_egress_create, the root qdisc of the interface
+ * is kept. The qdisc is deleted by #lsdn_qdisc_ingress_delete. */
+lsdn_err_t lsdn_qdisc_clsact_create(
+	struct lsdn_nl *sock, unsigned int ifindex, bool overwrite)
+{
+	return clsact_create(sock, ifindex, 0, overwrite);
 }
 
-lsdn_err_t lsdn_qdisc_egress_delete(struct mnl_socket *sock, unsigned int ifindex)
+/** Create a clsact qdisc whose ingress hook is bound to the shared filter block `block`.
+ * The ingress filters are then addressed through #LSDN_BLOCK_IFINDEX and the block index, and
+ * they are shared by all interfaces bound to the block. The block is created by the kernel when
+ * first bound and destroyed with its filters when the last qdisc bound to it is deleted.
+ * Changing the block of an existing qdisc is not supported by the kernel. */
+lsdn_err_t lsdn_qdisc_clsact_create_block(
+	struct lsdn_nl *sock, unsigned int ifindex, uint32_t block, bool overwrite)
+{
+	assert(block != 0);
+	return clsact_create(sock, ifindex, block, overwrite);
+}
+
+lsdn_err_t lsdn_qdisc_egress_delete(struct lsdn_nl *sock, unsigned int ifindex)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_DELQDISC;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
 	tcm->tcm_family = AF_UNSPEC;
@@ -739,15 +2235,13 @@ lsdn_err_t lsdn_qdisc_egress_delete(struct mnl_socket *sock, unsigned int ifinde
 	return LSDNE_OK;
 }
 
-lsdn_err_t lsdn_qdisc_ingress_delete(struct mnl_socket *sock, unsigned int ifindex)
+lsdn_err_t lsdn_qdisc_ingress_delete(struct lsdn_nl *sock, unsigned int ifindex)
 {
-	unsigned int seq = 0;
 	nl_buf(buf);
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_DELQDISC;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
 	tcm->tcm_family = AF_UNSPEC;
@@ -760,6 +2254,7 @@ lsdn_err_t lsdn_qdisc_ingress_delete(struct mnl_socket *sock, unsigned int ifind
 
 /**
  * @brief lsdn_filter_init
+ * @param sock Netlink socket, the filter buffer is taken from its pool.
  * @param kind Type of filter (e.g. "flower" or "u32")
  * @param if_index Interface index.
  * @param handle Identification of the filter. Assigned by kernel when handle = 0
@@ -768,18 +2263,30 @@ lsdn_err_t lsdn_qdisc_ingress_delete(struct mnl_socket *sock, unsigned int ifind
  * @param protocol Ethertype of the filter.
  * @return Pre-prepared nl message headers and options that can be further modified.
  */
-static struct lsdn_filter *filter_init(const char *kind, uint32_t if_index, uint32_t handle,
+static struct lsdn_filter *filter_init(struct lsdn_nl *sock,
+		const char *kind, uint32_t if_index, uint32_t handle,
 		uint32_t parent, uint32_t chain, uint16_t priority)
 {
-	struct lsdn_filter *f = malloc(sizeof(*f));
-	if (!f)
-		return NULL;
-	f->update = false;
-	char *buf = calloc(MNL_SOCKET_BUFFER_SIZE, sizeof(char));
-	if (!buf) {
-		free(f);
-		return NULL;
+	struct lsdn_filter *f = sock->filter_pool;
+	char *buf;
+	if (f) {
+		sock->filter_pool = f->next_free;
+		sock->filter_pool_count--;
+		buf = (char *) f->nlh;
+	} else {
+		f = malloc(sizeof(*f));
+		if (!f)
+			return NULL;
+		buf = malloc(MNL_SOCKET_BUFFER_SIZE);
+		if (!buf) {
+			free(f);
+			return NULL;
+		}
 	}
+	f->update = false;
+	f->chain = chain;
+	f->pool = sock;
+	f->next_free = NULL;
 
 	f->nlh = mnl_nlmsg_put_header(buf);
 
@@ -798,21 +2305,42 @@ static struct lsdn_filter *filter_init(const char *kind, uint32_t if_index, uint
 	return f;
 }
 
-struct lsdn_filter *lsdn_filter_flower_init(uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio)
+struct lsdn_filter *lsdn_filter_flower_init(struct lsdn_nl *sock,
+		uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio)
+{
+	return filter_init(sock, "flower", if_index, handle, parent, chain, prio);
+}
+
+struct lsdn_filter *lsdn_filter_fw_init(struct lsdn_nl *sock,
+		uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio)
 {
-	return filter_init("flower", if_index, handle, parent, chain, prio);
+	return filter_init(sock, "fw", if_index, handle, parent, chain, prio);
 }
 
-struct lsdn_filter *lsdn_filter_fw_init(
+struct lsdn_filter *lsdn_filter_bpf_init(struct lsdn_nl *sock,
 		uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio)
 {
-	return filter_init("fw", if_index, handle, parent, chain, prio);
+	return filter_init(sock, "bpf", if_index, handle, parent, chain, prio);
+}
+
+void lsdn_bpf_set_prog(struct lsdn_filter *f, int fd, const char *name)
+{
+	mnl_attr_put_u32(f->nlh, TCA_BPF_FD, fd);
+	mnl_attr_put_strz(f->nlh, TCA_BPF_NAME, name);
+	mnl_attr_put_u32(f->nlh, TCA_BPF_FLAGS, TCA_BPF_FLAG_ACT_DIRECT);
 }
 
 void lsdn_filter_free(struct lsdn_filter *f)
 {
-	free(f->nlh);
-	free(f);
+	struct lsdn_nl *pool = f->pool;
+	if (pool->filter_pool_count < pool->filter_pool_max) {
+		f->next_free = pool->filter_pool;
+		pool->filter_pool = f;
+		pool->filter_pool_count++;
+	} else {
+		free(f->nlh);
+		free(f);
+	}
 }
 
 static void filter_actions_start(struct lsdn_filter *f, uint16_t type)
@@ -889,33 +2417,34 @@ void lsdn_action_mirror_egress_add(
 	action_mirred_add(f, order, TC_ACT_PIPE, TCA_EGRESS_REDIR, ifindex);
 }
 
-void lsdn_action_set_tunnel_key(
-		struct lsdn_filter *f, uint16_t order,
-		uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip)
+/* Write a shared tunnel_key action setting the tunnel metadata */
+static void put_tunnel_key(struct nlmsghdr *nlh, uint16_t order, uint32_t index,
+		uint32_t vni, const lsdn_ip_t *src_ip, const lsdn_ip_t *dst_ip)
 {
-	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
-	mnl_attr_put_strz(f->nlh, TCA_ACT_KIND, "tunnel_key");
+	struct nlattr* nested_attr = mnl_attr_nest_start(nlh, order);
+	mnl_attr_put_strz(nlh, TCA_ACT_KIND, "tunnel_key");
 
-	struct nlattr* nested_attr2 = mnl_attr_nest_start(f->nlh, TCA_ACT_OPTIONS);
+	struct nlattr* nested_attr2 = mnl_attr_nest_start(nlh, TCA_ACT_OPTIONS);
 
 	struct tc_tunnel_key tunnel_key;
 	bzero(&tunnel_key, sizeof(tunnel_key));
+	tunnel_key.index = index;
 	tunnel_key.action = TC_ACT_PIPE;
 	tunnel_key.t_action = TCA_TUNNEL_KEY_ACT_SET;
 
-	mnl_attr_put_u32(f->nlh, TCA_TUNNEL_KEY_ENC_KEY_ID, htonl(vni));
+	mnl_attr_put_u32(nlh, TCA_TUNNEL_KEY_ENC_KEY_ID, htonl(vni));
 	if (src_ip->v == LSDN_IPv4 && dst_ip->v == LSDN_IPv4) {
-		mnl_attr_put_u32(f->nlh, TCA_TUNNEL_KEY_ENC_IPV4_SRC, htonl(lsdn_ip4_u32(&src_ip->v4)));
-		mnl_attr_put_u32(f->nlh, TCA_TUNNEL_KEY_ENC_IPV4_DST, htonl(lsdn_ip4_u32(&dst_ip->v4)));
+		mnl_attr_put_u32(nlh, TCA_TUNNEL_KEY_ENC_IPV4_SRC, htonl(lsdn_ip4_u32(&src_ip->v4)));
+		mnl_attr_put_u32(nlh, TCA_TUNNEL_KEY_ENC_IPV4_DST, htonl(lsdn_ip4_u32(&dst_ip->v4)));
 	} else {
-		mnl_attr_put(f->nlh, TCA_TUNNEL_KEY_ENC_IPV6_SRC, sizeof(src_ip->v6.bytes), src_ip->v6.bytes);
-		mnl_attr_put(f->nlh, TCA_TUNNEL_KEY_ENC_IPV6_DST, sizeof(dst_ip->v6.bytes), dst_ip->v6.bytes);
+		mnl_attr_put(nlh, TCA_TUNNEL_KEY_ENC_IPV6_SRC, sizeof(src_ip->v6.bytes), src_ip->v6.bytes);
+		mnl_attr_put(nlh, TCA_TUNNEL_KEY_ENC_IPV6_DST, sizeof(dst_ip->v6.bytes), dst_ip->v6.bytes);
 	}
 
-	mnl_attr_put(f->nlh, TCA_TUNNEL_KEY_PARMS, sizeof(tunnel_key), &tunnel_key);
+	mnl_attr_put(nlh, TCA_TUNNEL_KEY_PARMS, sizeof(tunnel_key), &tunnel_key);
 
-	mnl_attr_nest_end(f->nlh, nested_attr2);
-	mnl_attr_nest_end(f->nlh, nested_attr);
+	mnl_attr_nest_end(nlh, nested_attr2);
+	mnl_attr_nest_end(nlh, nested_attr);
 }
 
 const static uint32_t vestigial_rtab[TC_RTAB_SIZE / sizeof(uint32_t)];
@@ -978,14 +2507,15 @@ static uint32_t xmittime(uint32_t rate, uint32_t size)
 	return tick_per_sec*time;
 }
 
-void lsdn_action_police(struct lsdn_filter *f, uint16_t order,
+/* Write a shared police action */
+static void put_police(struct nlmsghdr *nlh, uint16_t order, uint32_t index,
 	uint32_t avg_rate, uint32_t burst, uint32_t peakrate, uint32_t mtu,
 	int gact_conforming, int gact_overlimit)
 {
 	tc_core_init_once();
-	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
-	mnl_attr_put_strz(f->nlh, TCA_ACT_KIND, "police");
-	struct nlattr *nested_attr2 = mnl_attr_nest_start(f->nlh, TCA_ACT_OPTIONS);
+	struct nlattr* nested_attr = mnl_attr_nest_start(nlh, order);
+	mnl_attr_put_strz(nlh, TCA_ACT_KIND, "police");
+	struct nlattr *nested_attr2 = mnl_attr_nest_start(nlh, TCA_ACT_OPTIONS);
 
 	struct tc_police p;
 	bzero(&p, sizeof(p));
@@ -1000,16 +2530,295 @@ void lsdn_action_police(struct lsdn_filter *f, uint16_t order,
 
 	p.mtu = mtu;
 	p.action = gact_overlimit;
-	p.index = 0;
-	mnl_attr_put(f->nlh, TCA_POLICE_TBF, sizeof(p), &p);
-	mnl_attr_put_u32(f->nlh, TCA_POLICE_RESULT, gact_conforming);
-	mnl_attr_put(f->nlh, TCA_POLICE_RATE, sizeof(vestigial_rtab), vestigial_rtab);
+	p.index = index;
+	mnl_attr_put(nlh, TCA_POLICE_TBF, sizeof(p), &p);
+	mnl_attr_put_u32(nlh, TCA_POLICE_RESULT, gact_conforming);
+	mnl_attr_put(nlh, TCA_POLICE_RATE, sizeof(vestigial_rtab), vestigial_rtab);
 	if (peakrate)
-		mnl_attr_put(f->nlh, TCA_POLICE_PEAKRATE, sizeof(vestigial_rtab), vestigial_rtab);
+		mnl_attr_put(nlh, TCA_POLICE_PEAKRATE, sizeof(vestigial_rtab), vestigial_rtab);
+	mnl_attr_nest_end(nlh, nested_attr2);
+	mnl_attr_nest_end(nlh, nested_attr);
+}
+
+static struct nlmsghdr *shaping_msg_start(
+	char *buf, uint16_t type, uint16_t flags, unsigned int ifindex, uint32_t parent, uint32_t handle,
+	const char *kind)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+
+	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
+	tcm->tcm_family = AF_UNSPEC;
+	tcm->tcm_ifindex = ifindex;
+	tcm->tcm_handle = handle;
+	tcm->tcm_parent = parent;
+	if (kind)
+		mnl_attr_put_strz(nlh, TCA_KIND, kind);
+	return nlh;
+}
+
+/** Create a shaper on the egress of an interface.
+ * An HTB qdisc (#LSDN_SHAPING_HANDLE) with a single default class limited to `avg_rate` and a
+ * fq_codel qdisc in the class, so that the packets over the limit are queued fairly instead of
+ * being dropped. Up to `burst` bytes saved while the traffic was below the rate are sent at the
+ * speed of the interface. The class has no parent to borrow from, so its ceil is the rate, a
+ * peak rate can not be enforced. An existing shaper is updated in place.
+ * @param parent `TC_H_ROOT` or a class of the root qdisc. */
+lsdn_err_t lsdn_qdisc_shaping_create(struct lsdn_nl *sock, unsigned int ifindex, uint32_t parent,
+	uint32_t avg_rate, uint32_t burst)
+{
+	tc_core_init_once();
+	nl_buf(buf);
+	struct nlmsghdr *nlh = shaping_msg_start(
+		buf, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE, ifindex, parent, LSDN_SHAPING_HANDLE, "htb");
+	struct nlattr *opts = mnl_attr_nest_start(nlh, TCA_OPTIONS);
+	struct tc_htb_glob glob;
+	bzero(&glob, sizeof(glob));
+	glob.version = 3;
+	glob.rate2quantum = 10;
+	glob.defcls = TC_H_MIN(LSDN_SHAPING_CLASS);
+	mnl_attr_put(nlh, TCA_HTB_INIT, sizeof(glob), &glob);
+	mnl_attr_nest_end(nlh, opts);
+	lsdn_err_t err = send_await_response(sock, nlh, false);
+	if (err != LSDNE_OK)
+		return err;
+
+	/* Without the NLM_F_EXCL flag, an existing class is changed */
+	nlh = shaping_msg_start(
+		buf, RTM_NEWTCLASS, NLM_F_CREATE, ifindex, LSDN_SHAPING_HANDLE, LSDN_SHAPING_CLASS, "htb");
+	opts = mnl_attr_nest_start(nlh, TCA_OPTIONS);
+	struct tc_htb_opt opt;
+	bzero(&opt, sizeof(opt));
+	opt.rate.rate = avg_rate;
+	finish_rate(&opt.rate, 0xFFFF);
+	opt.ceil.rate = avg_rate;
+	finish_rate(&opt.ceil, 0xFFFF);
+	opt.buffer = xmittime(opt.rate.rate, burst);
+	opt.cbuffer = xmittime(opt.ceil.rate, burst);
+	mnl_attr_put(nlh, TCA_HTB_PARMS, sizeof(opt), &opt);
+	mnl_attr_put(nlh, TCA_HTB_RTAB, sizeof(vestigial_rtab), vestigial_rtab);
+	mnl_attr_put(nlh, TCA_HTB_CTAB, sizeof(vestigial_rtab), vestigial_rtab);
+	mnl_attr_nest_end(nlh, opts);
+	err = send_await_response(sock, nlh, false);
+	if (err != LSDNE_OK)
+		return err;
+
+	nlh = shaping_msg_start(
+		buf, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_REPLACE,
+		ifindex, LSDN_SHAPING_CLASS, LSDN_SHAPING_LEAF_HANDLE, "fq_codel");
+	return send_await_response(sock, nlh, false);
+}
+
+/** Delete the shaper created by #lsdn_qdisc_shaping_create, together with its class and leaf.
+ * A missing shaper is not an error. */
+lsdn_err_t lsdn_qdisc_shaping_delete(struct lsdn_nl *sock, unsigned int ifindex, uint32_t parent)
+{
+	nl_buf(buf);
+	struct nlmsghdr *nlh = shaping_msg_start(
+		buf, RTM_DELQDISC, 0, ifindex, parent, LSDN_SHAPING_HANDLE, NULL);
+	send_await_response(sock, nlh, true);
+	return LSDNE_OK;
+}
+
+/** Kernel names of #lsdn_action_kind and the attributes with their parameters. All the parameter
+ * structures start with the `tc_gen` fields, the index first. */
+static const struct {
+	const char *name;
+	uint16_t parms_attr;
+	size_t parms_size;
+} action_kinds[] = {
+	[LSDN_ACTION_TUNNEL_KEY] = {"tunnel_key", TCA_TUNNEL_KEY_PARMS, sizeof(struct tc_tunnel_key)},
+	[LSDN_ACTION_POLICE] = {"police", TCA_POLICE_TBF, sizeof(struct tc_police)}
+};
+
+/** First index of the shared action range of a context, the context takes the same range of the
+ * filter block indices.
+ * The range is chosen by a hash of the context name, so that a restarted application finds its
+ * actions again when reconciling. Contexts in the same network namespace must have different
+ * names (their interface names would clash otherwise), with 3072 ranges to choose from, their
+ * ranges are unlikely to be the same.
+ * @param ctx_name Name of the context.
+ * @return First index, the range has `1 << LSDN_ACTION_RANGE_BITS` indices. */
+uint32_t lsdn_action_range_first(const char *ctx_name)
+{
+	const uint32_t ranges =
+		(uint32_t) (((UINT64_C(1) << 32) - LSDN_ACTION_FIRST_INDEX) >> LSDN_ACTION_RANGE_BITS);
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+	for (const char *c = ctx_name; *c; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+	return LSDN_ACTION_FIRST_INDEX + ((hash % ranges) << LSDN_ACTION_RANGE_BITS);
+}
+
+static void touch_action(struct lsdn_nl *sock, enum lsdn_action_kind kind, uint32_t index)
+{
+	if (sock->reconcile) {
+		struct touched_key key;
+		touched_init(&key, TOUCHED_ACTION, 0);
+		key.parent = kind;
+		key.handle = index;
+		touch(sock, &key);
+	}
+}
+
+/* Flags of a request creating a shared action. A new action is created exclusively, an action
+ * with the same index may belong to another context whose range collides with ours. Existing
+ * actions are only replaced when changed in place or adopted from a previous run. */
+static uint16_t action_create_flags(struct lsdn_nl *sock, bool replace)
+{
+	if (replace || sock->reconcile)
+		return NLM_F_CREATE | NLM_F_REPLACE;
+	return NLM_F_CREATE | NLM_F_EXCL;
+}
+
+/* Start a request for the shared actions, the actions are put into the returned nest */
+static struct nlattr *action_msg_start(struct nlmsghdr **nlhp, char *buf, uint16_t type, uint16_t flags)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	struct tcamsg *tca = mnl_nlmsg_put_extra_header(nlh, sizeof(*tca));
+	tca->tca_family = AF_UNSPEC;
+	*nlhp = nlh;
+	return mnl_attr_nest_start(nlh, TCA_ACT_TAB);
+}
+
+lsdn_err_t lsdn_action_tunnel_key_create(struct lsdn_nl *sock, uint32_t index, bool replace,
+	uint32_t vni, const lsdn_ip_t *src_ip, const lsdn_ip_t *dst_ip,
+	lsdn_nl_err_cb done, void *user)
+{
+	nl_buf(buf);
+	struct nlmsghdr *nlh;
+	struct nlattr *tab = action_msg_start(
+		&nlh, buf, RTM_NEWACTION, action_create_flags(sock, replace));
+	put_tunnel_key(nlh, 1, index, vni, src_ip, dst_ip);
+	mnl_attr_nest_end(nlh, tab);
+	touch_action(sock, LSDN_ACTION_TUNNEL_KEY, index);
+	return send_batched_done(sock, nlh, done, user);
+}
+
+lsdn_err_t lsdn_action_police_create(struct lsdn_nl *sock, uint32_t index, bool replace,
+	uint32_t avg_rate, uint32_t burst, uint32_t peakrate, uint32_t mtu,
+	int gact_conforming, int gact_overlimit, lsdn_nl_err_cb done, void *user)
+{
+	nl_buf(buf);
+	struct nlmsghdr *nlh;
+	struct nlattr *tab = action_msg_start(
+		&nlh, buf, RTM_NEWACTION, action_create_flags(sock, replace));
+	put_police(nlh, 1, index, avg_rate, burst, peakrate, mtu, gact_conforming, gact_overlimit);
+	mnl_attr_nest_end(nlh, tab);
+	touch_action(sock, LSDN_ACTION_POLICE, index);
+	return send_batched_done(sock, nlh, done, user);
+}
+
+lsdn_err_t lsdn_action_delete(struct lsdn_nl *sock, enum lsdn_action_kind kind, uint32_t index)
+{
+	nl_buf(buf);
+	struct nlmsghdr *nlh;
+	struct nlattr *tab = action_msg_start(&nlh, buf, RTM_DELACTION, 0);
+	struct nlattr *act = mnl_attr_nest_start(nlh, 1);
+	mnl_attr_put_strz(nlh, TCA_ACT_KIND, action_kinds[kind].name);
+	mnl_attr_put_u32(nlh, TCA_ACT_INDEX, index);
+	mnl_attr_nest_end(nlh, act);
+	mnl_attr_nest_end(nlh, tab);
+	return send_batched(sock, nlh);
+}
+
+void lsdn_action_ref(struct lsdn_filter *f, uint16_t order, enum lsdn_action_kind kind, uint32_t index)
+{
+	/* The kernel binds to the existing action and ignores the rest of the parameters */
+	char parms[sizeof(struct tc_police)];
+	assert(action_kinds[kind].parms_size <= sizeof(parms));
+	bzero(parms, sizeof(parms));
+	memcpy(parms, &index, sizeof(index));
+
+	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
+	mnl_attr_put_strz(f->nlh, TCA_ACT_KIND, action_kinds[kind].name);
+	struct nlattr *nested_attr2 = mnl_attr_nest_start(f->nlh, TCA_ACT_OPTIONS);
+	mnl_attr_put(f->nlh, action_kinds[kind].parms_attr, action_kinds[kind].parms_size, parms);
 	mnl_attr_nest_end(f->nlh, nested_attr2);
 	mnl_attr_nest_end(f->nlh, nested_attr);
 }
 
+/* The index of a dumped action, 0 if it can not be found */
+static uint32_t dumped_action_index(const struct nlattr *act, enum lsdn_action_kind kind)
+{
+	const struct nlattr *attr, *opt;
+	mnl_attr_for_each_nested(attr, act) {
+		if (mnl_attr_get_type(attr) == TCA_ACT_INDEX && mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+			return mnl_attr_get_u32(attr);
+		if (mnl_attr_get_type(attr) != TCA_ACT_OPTIONS)
+			continue;
+		mnl_attr_for_each_nested(opt, attr) {
+			if (mnl_attr_get_type(opt) == action_kinds[kind].parms_attr
+			    && mnl_attr_get_payload_len(opt) >= sizeof(uint32_t))
+				return *(const uint32_t *) mnl_attr_get_payload(opt);
+		}
+	}
+	return 0;
+}
+
+static void stale_action_cb(struct lsdn_nl *nl, const struct nlmsghdr *nlh, void *user)
+{
+	struct stale_list *l = user;
+	/* The kind is passed in the parent, like for the touched key */
+	enum lsdn_action_kind kind = l->parent;
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct tcamsg)))
+		return;
+	const struct nlattr *tab, *act;
+	mnl_attr_for_each(tab, nlh, sizeof(struct tcamsg)) {
+		if (mnl_attr_get_type(tab) != TCA_ACT_TAB)
+			continue;
+		mnl_attr_for_each_nested(act, tab) {
+			uint32_t index = dumped_action_index(act, kind);
+			/* Outside of our range, the action belongs to someone else */
+			if (index - l->action_first >= (UINT32_C(1) << LSDN_ACTION_RANGE_BITS))
+				continue;
+			struct touched_key key;
+			touched_init(&key, TOUCHED_ACTION, 0);
+			key.parent = kind;
+			key.handle = index;
+			if (!was_touched(nl, &key))
+				stale_add(l, &key);
+		}
+	}
+}
+
+/* Remove the shared actions from our range that were not touched. They are not used by any
+ * filter, the stale filters are already removed. */
+static lsdn_err_t sweep_actions(struct lsdn_nl *nl, uint32_t first)
+{
+	lsdn_err_t ret = LSDNE_OK;
+	for (int kind = 0; kind < LSDN_ACTION_KIND_COUNT; kind++) {
+		struct stale_list l = {NULL, 0, 0, false, kind, first};
+		nl_buf(buf);
+		struct nlmsghdr *nlh;
+		struct nlattr *tab = action_msg_start(&nlh, buf, RTM_GETACTION, 0);
+		struct nlattr *act = mnl_attr_nest_start(nlh, 1);
+		mnl_attr_put_strz(nlh, TCA_ACT_KIND, action_kinds[kind].name);
+		mnl_attr_nest_end(nlh, act);
+		mnl_attr_nest_end(nlh, tab);
+
+		lsdn_err_t err = request_dump(nl, nlh, stale_action_cb, &l);
+		if (err == LSDNE_OK && !l.nomem) {
+			for (size_t i = 0; i < l.count; i++) {
+				lsdn_log(LSDNL_NL, "sweep_action(kind = %s, index = 0x%x)\n",
+					action_kinds[kind].name, l.keys[i].handle);
+				lsdn_action_delete(nl, kind, l.keys[i].handle);
+			}
+		}
+		free(l.keys);
+		if (l.nomem)
+			err = LSDNE_NOMEM;
+		if (err != LSDNE_OK)
+			ret = err;
+	}
+	return ret;
+}
+
 void lsdn_action_drop(struct lsdn_filter *f, uint16_t order)
 {
 	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
@@ -1075,6 +2884,61 @@ void lsdn_action_skbmark(struct lsdn_filter *f, uint16_t order, uint32_t mark)
 	mnl_attr_nest_end(f->nlh, nested_attr);
 }
 
+void lsdn_pedit_init(struct lsdn_pedit *p)
+{
+	p->nkeys = 0;
+}
+
+/** Overwrite `len` bytes of the packet at the given offset with `data`.
+ * The edits are merged into the 32-bit aligned words the kernel works with. */
+void lsdn_pedit_set(struct lsdn_pedit *p, int offset, const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < len; i++) {
+		int pos = offset + (int) i;
+		/* round down, also for the negative offsets */
+		int word = pos >= 0 ? pos / 4 * 4 : -((-pos + 3) / 4 * 4);
+		struct lsdn_pedit_key *key = NULL;
+		for (size_t k = 0; k < p->nkeys; k++) {
+			if (p->keys[k].off == word)
+				key = &p->keys[k];
+		}
+		if (!key) {
+			assert(p->nkeys < LSDN_PEDIT_MAX_KEYS);
+			key = &p->keys[p->nkeys++];
+			key->off = word;
+			key->val = 0;
+			key->mask = UINT32_MAX;
+		}
+		((uint8_t *) &key->val)[pos - word] = bytes[i];
+		((uint8_t *) &key->mask)[pos - word] = 0;
+	}
+}
+
+void lsdn_action_pedit(struct lsdn_filter *f, uint16_t order, const struct lsdn_pedit *p)
+{
+	struct nlattr* nested_attr = mnl_attr_nest_start(f->nlh, order);
+	mnl_attr_put_strz(f->nlh, TCA_ACT_KIND, "pedit");
+	struct nlattr *nested_attr2 = mnl_attr_nest_start(f->nlh, TCA_ACT_OPTIONS);
+
+	struct {
+		struct tc_pedit_sel sel;
+		struct tc_pedit_key keys[LSDN_PEDIT_MAX_KEYS];
+	} pedit;
+	bzero(&pedit, sizeof(pedit));
+	pedit.sel.action = TC_ACT_PIPE;
+	pedit.sel.nkeys = p->nkeys;
+	for (size_t k = 0; k < p->nkeys; k++) {
+		pedit.keys[k].off = p->keys[k].off;
+		pedit.keys[k].val = p->keys[k].val;
+		pedit.keys[k].mask = p->keys[k].mask;
+	}
+	mnl_attr_put(f->nlh, TCA_PEDIT_PARMS,
+		sizeof(pedit.sel) + p->nkeys * sizeof(*pedit.keys), &pedit);
+
+	mnl_attr_nest_end(f->nlh, nested_attr2);
+	mnl_attr_nest_end(f->nlh, nested_attr);
+}
 
 void lsdn_flower_set_src_mac(struct lsdn_filter *f, const char *addr,
 		const char *addr_mask)
@@ -1118,6 +2982,12 @@ void lsdn_flower_set_dst_ipv6(struct lsdn_filter *f, const char *addr,
 	mnl_attr_put(f->nlh, TCA_FLOWER_KEY_IPV6_DST_MASK, 16, addr_mask);
 }
 
+/** Match the interface the packet came from, useful for filters of a shared block. */
+void lsdn_flower_set_indev(struct lsdn_filter *f, const char *ifname)
+{
+	mnl_attr_put_strz(f->nlh, TCA_FLOWER_INDEV, ifname);
+}
+
 void lsdn_flower_set_enc_key_id(struct lsdn_filter *f, uint32_t vni)
 {
 	mnl_attr_put_u32(f->nlh, TCA_FLOWER_KEY_ENC_KEY_ID, htonl(vni));
@@ -1156,18 +3026,45 @@ void lsdn_flower_set_eth_type(struct lsdn_filter *f, uint16_t eth_type)
 	mnl_attr_put_u16(f->nlh, TCA_FLOWER_KEY_ETH_TYPE, eth_type);
 }
 
-lsdn_err_t lsdn_filter_create(struct mnl_socket *sock, struct lsdn_filter *f)
+void lsdn_flower_set_arp_op(struct lsdn_filter *f, uint8_t op)
+{
+	mnl_attr_put_u8(f->nlh, TCA_FLOWER_KEY_ARP_OP, op);
+	mnl_attr_put_u8(f->nlh, TCA_FLOWER_KEY_ARP_OP_MASK, 0xFF);
+}
+
+void lsdn_flower_set_arp_sip(struct lsdn_filter *f, const char *addr,
+		const char *addr_mask)
+{
+	mnl_attr_put(f->nlh, TCA_FLOWER_KEY_ARP_SIP, 4, addr);
+	mnl_attr_put(f->nlh, TCA_FLOWER_KEY_ARP_SIP_MASK, 4, addr_mask);
+}
+
+void lsdn_flower_set_arp_tip(struct lsdn_filter *f, const char *addr,
+		const char *addr_mask)
+{
+	mnl_attr_put(f->nlh, TCA_FLOWER_KEY_ARP_TIP, 4, addr);
+	mnl_attr_put(f->nlh, TCA_FLOWER_KEY_ARP_TIP_MASK, 4, addr_mask);
+}
+
+lsdn_err_t lsdn_filter_create(struct lsdn_nl *sock, struct lsdn_filter *f)
 {
-	unsigned int seq = 0;
 	f->nlh->nlmsg_type = RTM_NEWTFILTER;
 	f->nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK;
-	if (!f->update)
+	/* When reconciling, the filter left in the kernel by the previous run is replaced */
+	if (!f->update && !sock->reconcile)
 		f->nlh->nlmsg_flags |= NLM_F_EXCL;
-	f->nlh->nlmsg_seq = seq;
 
 	mnl_attr_nest_end(f->nlh, f->nested_opts);
 
-	return send_await_response(sock, f->nlh, false);
+	if (sock->reconcile) {
+		struct tcmsg *tcm = mnl_nlmsg_get_payload(f->nlh);
+		struct touched_key key;
+		touched_filter_init(&key, tcm->tcm_ifindex, tcm->tcm_parent, f->chain,
+			TC_H_MAJ(tcm->tcm_info) >> 16, tcm->tcm_handle);
+		touch(sock, &key);
+	}
+
+	return send_batched(sock, f->nlh);
 }
 
 /* Allow an existing TC filter to be updated. Unless this called, the filter must not exist */
@@ -1177,16 +3074,21 @@ void lsdn_filter_set_update(struct lsdn_filter *f)
 }
 
 lsdn_err_t lsdn_filter_delete(
-	struct mnl_socket *sock, uint32_t ifindex, uint32_t handle,
+	struct lsdn_nl *sock, uint32_t ifindex, uint32_t handle,
 	uint32_t parent, uint32_t chain, uint16_t prio)
+{
+	return lsdn_filter_delete_done(sock, ifindex, handle, parent, chain, prio, NULL, NULL);
+}
+
+lsdn_err_t lsdn_filter_delete_done(
+	struct lsdn_nl *sock, uint32_t ifindex, uint32_t handle,
+	uint32_t parent, uint32_t chain, uint16_t prio, lsdn_nl_err_cb done, void *user)
 {
 	nl_buf(buf);
-	unsigned int seq = 0;
 
 	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = RTM_DELTFILTER;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	nlh->nlmsg_seq = seq;
 
 	struct tcmsg *tcm = mnl_nlmsg_put_extra_header(nlh, sizeof(*tcm));
 	tcm->tcm_family = AF_UNSPEC;
@@ -1197,5 +3099,97 @@ lsdn_err_t lsdn_filter_delete(
 
 	mnl_attr_put_u32(nlh, TCA_CHAIN, chain);
 
-	return send_await_response(sock, nlh, false);
+	return send_batched_done(sock, nlh, done, user);
+}
+
+/* Size of the buffer for the verifier log of a rejected program */
+#define BPF_LOG_SIZE 65536
+
+static int bpf_call(struct lsdn_nl *sock, int cmd, union bpf_attr *attr)
+{
+	sock->stats.bpf_calls++;
+	io_before(sock);
+	int ret = sock->transport->ops->bpf(sock->transport, cmd, attr, sizeof(*attr));
+	int saved_errno = errno;
+	io_after(sock);
+	errno = saved_errno;
+	if (ret < 0) {
+		sock->stats.errors++;
+		lsdn_log(LSDN_NLERR, "bpf command %d failed: %s\n", cmd, strerror(errno));
+	}
+	return ret;
+}
+
+lsdn_err_t lsdn_bpf_map_create(struct lsdn_nl *sock,
+		uint32_t key_size, uint32_t value_size, uint32_t max_entries, int *fd)
+{
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = max_entries;
+	attr.map_flags = BPF_F_NO_PREALLOC;
+	int ret = bpf_call(sock, BPF_MAP_CREATE, &attr);
+	if (ret < 0)
+		return LSDNE_NETLINK;
+	*fd = ret;
+	return LSDNE_OK;
+}
+
+lsdn_err_t lsdn_bpf_map_update(struct lsdn_nl *sock, int fd, const void *key, const void *value)
+{
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uintptr_t) key;
+	attr.value = (uintptr_t) value;
+	attr.flags = BPF_ANY;
+	return bpf_call(sock, BPF_MAP_UPDATE_ELEM, &attr) < 0 ? LSDNE_NETLINK : LSDNE_OK;
+}
+
+lsdn_err_t lsdn_bpf_map_delete(struct lsdn_nl *sock, int fd, const void *key)
+{
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.map_fd = fd;
+	attr.key = (uintptr_t) key;
+	return bpf_call(sock, BPF_MAP_DELETE_ELEM, &attr) < 0 ? LSDNE_NETLINK : LSDNE_OK;
+}
+
+lsdn_err_t lsdn_bpf_prog_load(struct lsdn_nl *sock,
+		const struct bpf_insn *insns, size_t count, int *fd)
+{
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+	attr.insns = (uintptr_t) insns;
+	attr.insn_cnt = count;
+	attr.license = (uintptr_t) "GPL";
+	int ret = bpf_call(sock, BPF_PROG_LOAD, &attr);
+	if (ret < 0 && lsdn_log_enabled(LSDN_NLERR)) {
+		/* Load the program again, this time with the verifier log */
+		char *log = malloc(BPF_LOG_SIZE);
+		if (log) {
+			log[0] = 0;
+			attr.log_buf = (uintptr_t) log;
+			attr.log_size = BPF_LOG_SIZE;
+			attr.log_level = 1;
+			int again = sock->transport->ops->bpf(
+				sock->transport, BPF_PROG_LOAD, &attr, sizeof(attr));
+			if (again >= 0)
+				sock->transport->ops->close_fd(sock->transport, again);
+			lsdn_log(LSDN_NLERR, "BPF verifier log:\n%s\n", log);
+			free(log);
+		}
+	}
+	if (ret < 0)
+		return LSDNE_NETLINK;
+	*fd = ret;
+	return LSDNE_OK;
+}
+
+void lsdn_bpf_close(struct lsdn_nl *sock, int fd)
+{
+	sock->transport->ops->close_fd(sock->transport, fd);
 }
@@ -0,0 +1,2414 @@
+/** \file
+ * Emulated kernel for the netlink transport (see private/nlmock.h). */
+#define _GNU_SOURCE /* struct mmsghdr */
+#include "private/nlmock.h"
+#include "private/list.h"
+#include "include/util.h"
+#include <sys/socket.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/tc_act/tc_tunnel_key.h>
+#include <linux/neighbour.h>
+#include <linux/veth.h>
+#include <linux/if_bridge.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+/** Size of the datagrams used for dump responses. */
+#define MOCK_DUMP_DATAGRAM 8192
+/** Maximum size of a single response message (link description or ACK). */
+#define MOCK_MSG_SIZE 1024
+/** MTU of newly created links. */
+#define MOCK_DEFAULT_MTU 1500
+/** Overhead of VXLAN and GENEVE tunnels (IPv4 + UDP + header + inner Ethernet). */
+#define MOCK_TUNNEL_OVERHEAD 50
+/** Priority assigned to the first filter in a chain if not given (same as the kernel). */
+#define MOCK_FIRST_PRIO 0xC000
+/** Space for the kind specific link attributes, reported back in link dumps. */
+#define MOCK_INFO_DATA 128
+/** Maximum size of a BPF map key or value. */
+#define MOCK_BPF_MAX_SIZE 256
+/** File descriptor of the first BPF object, far from the descriptors the process really has. */
+#define MOCK_FIRST_FD 0x10000
+/** Maximum number of shared actions a single filter may refer to. */
+#define MOCK_FILTER_SHARED 4
+/** Space for the parameters of a shared action, reported back in action dumps. */
+#define MOCK_ACTION_PARMS 64
+
+struct mock_link {
+	unsigned int ifindex;
+	char name[IF_NAMESIZE];
+	char kind[16];
+	unsigned int mtu;
+	unsigned int master;
+	/** Lower device (for VLANs) or veth peer. */
+	unsigned int link;
+	bool up;
+	/** The bridge port maps its VLANs to tunnel IDs. */
+	bool vlan_tunnel;
+	/** Payload of `IFLA_INFO_DATA` given when the link was created. */
+	size_t info_data_len;
+	char info_data[MOCK_INFO_DATA];
+	UT_hash_handle hh_index;
+	UT_hash_handle hh_name;
+};
+
+/** Root qdisc slots of a link. The ingress and clsact qdiscs share the same slot. */
+enum mock_qdisc_slot {
+	MOCK_QDISC_ROOT,
+	MOCK_QDISC_INGRESS
+};
+
+struct mock_qdisc_key {
+	unsigned int ifindex;
+	/** A #mock_qdisc_slot, or the parent class of a qdisc nested in a classful qdisc. */
+	uint32_t slot;
+};
+
+struct mock_qdisc {
+	struct mock_qdisc_key key;
+	uint32_t handle;
+	char kind[16];
+	/** Shared block the ingress hook of a clsact qdisc is bound to, 0 if none. */
+	uint32_t ingress_block;
+	UT_hash_handle hh;
+};
+
+struct mock_class_key {
+	unsigned int ifindex;
+	uint32_t classid;
+};
+
+/** Class of a HTB qdisc. Only the existence is emulated, the parameters are not kept. */
+struct mock_class {
+	struct mock_class_key key;
+	UT_hash_handle hh;
+};
+
+/** Identifies a filter chain. Keys are compared as memory, they must be zeroed before filling.
+ * Chains of a shared block have `TCM_IFINDEX_MAGIC_BLOCK` as the ifindex and the block index as
+ * the qdisc handle. */
+struct mock_chain_key {
+	unsigned int ifindex;
+	uint32_t qdisc_handle;
+	/** Ingress (0) or egress (1) block of a clsact qdisc. Always 0 for other qdiscs. */
+	uint32_t block;
+	uint32_t chain;
+};
+
+struct mock_chain {
+	struct mock_chain_key key;
+	size_t prio_count;
+	UT_hash_handle hh;
+};
+
+struct mock_prio_key {
+	struct mock_chain_key chain;
+	uint32_t prio;
+};
+
+/** All filters with the same priority in a chain, they share the kind and protocol. */
+struct mock_prio {
+	struct mock_prio_key key;
+	char kind[16];
+	uint16_t protocol;
+	size_t filter_count;
+	uint32_t next_handle;
+	UT_hash_handle hh;
+};
+
+struct mock_filter_key {
+	struct mock_prio_key prio;
+	uint32_t handle;
+};
+
+struct mock_filter {
+	struct mock_filter_key key;
+	/** Shared actions the filter refers to by index. */
+	size_t shared_count;
+	struct mock_action *shared[MOCK_FILTER_SHARED];
+	UT_hash_handle hh;
+};
+
+/** Keys are compared as memory, they must be zeroed before filling. */
+struct mock_action_key {
+	char kind[16];
+	uint32_t index;
+};
+
+/** A tc action created on its own by `RTM_NEWACTION`. Only the actions with an explicit index
+ * are emulated, the ones inlined into filters exist only as a part of the filter. */
+struct mock_action {
+	struct mock_action_key key;
+	/** Number of filters referring to the action, it can not be deleted while bound. */
+	size_t binds;
+	size_t parms_len;
+	char parms[MOCK_ACTION_PARMS];
+	UT_hash_handle hh;
+};
+
+struct mock_fdb_key {
+	unsigned int ifindex;
+	uint8_t mac[LSDN_MAC_LEN];
+	uint8_t dst_len;
+	uint8_t dst[LSDN_IPv6_LEN];
+	/** VNI of an entry on a metadata tunnel, zero otherwise. */
+	uint32_t src_vni;
+};
+
+struct mock_fdb {
+	struct mock_fdb_key key;
+	uint16_t state;
+	uint8_t flags;
+	UT_hash_handle hh;
+};
+
+struct mock_vlan_key {
+	unsigned int ifindex;
+	uint16_t vid;
+};
+
+/** Membership of a bridge port in a VLAN. */
+struct mock_vlan {
+	struct mock_vlan_key key;
+	uint16_t flags;
+	/** Tunnel ID the VLAN is mapped to, zero if none. */
+	uint32_t tunnel_id;
+	UT_hash_handle hh;
+};
+
+enum mock_bpf_type {
+	MOCK_BPF_MAP,
+	MOCK_BPF_PROG
+};
+
+struct mock_bpf_entry {
+	UT_hash_handle hh;
+	/** The key followed by the value. */
+	char data[];
+};
+
+/** A BPF map or program, identified by its file descriptor. The descriptors are shared by all
+ * the transports, like in a single process. Closing the descriptor destroys the object, even if
+ * a filter still uses it. */
+struct mock_bpf {
+	int fd;
+	enum mock_bpf_type type;
+	uint32_t key_size;
+	uint32_t value_size;
+	uint32_t max_entries;
+	struct mock_bpf_entry *entries;
+	UT_hash_handle hh;
+};
+
+struct lsdn_mock_kernel {
+	/** Serializes the requests of transports used from different threads (commit workers). */
+	pthread_mutex_t lock;
+	/** Number of users, see #lsdn_mock_kernel_ref. */
+	unsigned int refs;
+	unsigned int next_ifindex;
+	/** Objects created since the kernel was created, see #lsdn_mock_state. */
+	size_t links_created;
+	size_t qdiscs_created;
+	size_t filters_created;
+	struct mock_link *links_by_index;
+	struct mock_link *links_by_name;
+	struct mock_qdisc *qdiscs;
+	struct mock_class *classes;
+	struct mock_chain *chains;
+	struct mock_prio *prios;
+	struct mock_filter *filters;
+	struct mock_fdb *fdb;
+	struct mock_vlan *vlans;
+	struct mock_action *actions;
+	struct mock_bpf *bpf;
+	int next_fd;
+	/** List of #mock_transport, for link notifications. */
+	struct lsdn_list_entry transports;
+};
+
+struct mock_datagram {
+	struct mock_datagram *next;
+	size_t len;
+	char data[];
+};
+
+/** Datagrams waiting to be received on a channel. */
+struct mock_queue {
+	struct mock_datagram *head;
+	struct mock_datagram *tail;
+	/** A datagram could not be queued, report `ENOBUFS` like a full socket. */
+	bool overflow;
+};
+
+struct mock_transport {
+	struct lsdn_nl_transport t;
+	struct lsdn_mock_kernel *kernel;
+	bool open[LSDN_NL_CHANNEL_COUNT];
+	struct mock_queue queues[LSDN_NL_CHANNEL_COUNT];
+	struct lsdn_list_entry kernel_entry;
+};
+
+/** A request being processed, the handlers fill in the error message. */
+struct mock_request {
+	struct lsdn_mock_kernel *kernel;
+	struct mock_transport *sender;
+	enum lsdn_nl_channel ch;
+	const struct nlmsghdr *nlh;
+	const char *msg;
+};
+
+/********* Response queues *********/
+
+static void queue_datagram(struct mock_queue *q, struct mock_datagram *d)
+{
+	d->next = NULL;
+	if (q->tail)
+		q->tail->next = d;
+	else
+		q->head = d;
+	q->tail = d;
+}
+
+static void queue_push(struct mock_queue *q, const void *data, size_t len)
+{
+	struct mock_datagram *d = malloc(sizeof(*d) + len);
+	if (!d) {
+		q->overflow = true;
+		return;
+	}
+	memcpy(d->data, data, len);
+	d->len = len;
+	queue_datagram(q, d);
+}
+
+static struct mock_datagram *queue_pop(struct mock_queue *q)
+{
+	struct mock_datagram *d = q->head;
+	if (d) {
+		q->head = d->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	return d;
+}
+
+static void queue_clear(struct mock_queue *q)
+{
+	struct mock_datagram *d;
+	while ((d = queue_pop(q)))
+		free(d);
+	q->overflow = false;
+}
+
+static void reply(struct mock_request *r, const struct nlmsghdr *nlh)
+{
+	queue_push(&r->sender->queues[r->ch], nlh, nlh->nlmsg_len);
+}
+
+static void reply_ack(struct mock_request *r, int err)
+{
+	char buf[MOCK_MSG_SIZE];
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = NLMSG_ERROR;
+	nlh->nlmsg_flags = NLM_F_CAPPED;
+	nlh->nlmsg_seq = r->nlh->nlmsg_seq;
+	struct nlmsgerr *e = mnl_nlmsg_put_extra_header(nlh, sizeof(*e));
+	e->error = err;
+	e->msg = *r->nlh;
+	if (r->msg) {
+		nlh->nlmsg_flags |= NLM_F_ACK_TLVS;
+		mnl_attr_put_strz(nlh, NLMSGERR_ATTR_MSG, r->msg);
+	}
+	reply(r, nlh);
+}
+
+/** Fail the request with the given `errno` value and message. */
+static int fail(struct mock_request *r, int err, const char *msg)
+{
+	r->msg = msg;
+	return -err;
+}
+
+/********* Links *********/
+
+static struct mock_link *link_by_index(struct lsdn_mock_kernel *k, unsigned int ifindex)
+{
+	struct mock_link *l;
+	HASH_FIND(hh_index, k->links_by_index, &ifindex, sizeof(ifindex), l);
+	return l;
+}
+
+static struct mock_link *link_by_name(struct lsdn_mock_kernel *k, const char *name)
+{
+	struct mock_link *l;
+	HASH_FIND(hh_name, k->links_by_name, name, strlen(name), l);
+	return l;
+}
+
+static struct nlmsghdr *put_link_msg(
+	char *buf, const struct mock_link *l, uint16_t type, uint16_t flags, uint32_t seq)
+{
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = flags;
+	nlh->nlmsg_seq = seq;
+
+	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+	ifm->ifi_family = AF_UNSPEC;
+	ifm->ifi_index = l->ifindex;
+	ifm->ifi_flags = l->up ? IFF_UP | IFF_RUNNING : 0;
+
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, l->name);
+	mnl_attr_put_u32(nlh, IFLA_MTU, l->mtu);
+	mnl_attr_put_u8(nlh, IFLA_OPERSTATE, l->up ? 6 /* IF_OPER_UP */ : 2 /* IF_OPER_DOWN */);
+	if (l->master)
+		mnl_attr_put_u32(nlh, IFLA_MASTER, l->master);
+	if (l->link)
+		mnl_attr_put_u32(nlh, IFLA_LINK, l->link);
+	struct nlattr *linkinfo = mnl_attr_nest_start(nlh, IFLA_LINKINFO);
+	mnl_attr_put_strz(nlh, IFLA_INFO_KIND, l->kind);
+	if (l->info_data_len)
+		mnl_attr_put(nlh, IFLA_INFO_DATA, l->info_data_len, l->info_data);
+	mnl_attr_nest_end(nlh, linkinfo);
+	return nlh;
+}
+
+/* Send a link notification to all transports listening for them. */
+static void notify_link(struct lsdn_mock_kernel *k, const struct mock_link *l, uint16_t type)
+{
+	char buf[MOCK_MSG_SIZE];
+	struct nlmsghdr *nlh = put_link_msg(buf, l, type, 0, 0);
+	lsdn_foreach(k->transports, kernel_entry, struct mock_transport, mt) {
+		if (mt->open[LSDN_NL_LINKS])
+			queue_push(&mt->queues[LSDN_NL_LINKS], nlh, nlh->nlmsg_len);
+	}
+}
+
+static struct mock_link *link_add(struct lsdn_mock_kernel *k, const char *name, const char *kind)
+{
+	struct mock_link *l = malloc(sizeof(*l));
+	if (!l)
+		return NULL;
+	l->ifindex = k->next_ifindex++;
+	strncpy(l->name, name, sizeof(l->name) - 1);
+	l->name[sizeof(l->name) - 1] = 0;
+	strncpy(l->kind, kind, sizeof(l->kind) - 1);
+	l->kind[sizeof(l->kind) - 1] = 0;
+	l->mtu = MOCK_DEFAULT_MTU;
+	l->master = 0;
+	l->link = 0;
+	l->up = false;
+	l->vlan_tunnel = false;
+	l->info_data_len = 0;
+	k->links_created++;
+	HASH_ADD(hh_index, k->links_by_index, ifindex, sizeof(l->ifindex), l);
+	HASH_ADD_KEYPTR(hh_name, k->links_by_name, l->name, strlen(l->name), l);
+	return l;
+}
+
+static void qdisc_remove(struct lsdn_mock_kernel *k, struct mock_qdisc *q);
+static void fdb_flush(struct lsdn_mock_kernel *k, unsigned int ifindex);
+static void vlan_flush(struct lsdn_mock_kernel *k, unsigned int ifindex);
+
+/* Remove the link with everything attached to it, including the dependent links. */
+static void link_remove(struct lsdn_mock_kernel *k, struct mock_link *l)
+{
+	unsigned int ifindex = l->ifindex;
+	/* Removing a qdisc removes the nested ones too, start over after each removal */
+	bool removed;
+	do {
+		removed = false;
+		struct mock_qdisc *q, *qtmp;
+		HASH_ITER(hh, k->qdiscs, q, qtmp) {
+			if (q->key.ifindex == ifindex) {
+				qdisc_remove(k, q);
+				removed = true;
+				break;
+			}
+		}
+	} while (removed);
+	fdb_flush(k, ifindex);
+	vlan_flush(k, ifindex);
+
+	notify_link(k, l, RTM_DELLINK);
+	HASH_DELETE(hh_index, k->links_by_index, l);
+	HASH_DELETE(hh_name, k->links_by_name, l);
+	bool veth = strcmp(l->kind, "veth") == 0;
+	free(l);
+
+	struct mock_link *other, *tmp;
+	bool again;
+	do {
+		again = false;
+		HASH_ITER(hh_index, k->links_by_index, other, tmp) {
+			if (other->master == ifindex) {
+				other->master = 0;
+				other->vlan_tunnel = false;
+				vlan_flush(k, other->ifindex);
+				notify_link(k, other, RTM_NEWLINK);
+			}
+			if (other->link == ifindex && (veth || strcmp(other->kind, "vlan") == 0)) {
+				/* May also remove the next link of the iteration, start over */
+				link_remove(k, other);
+				again = true;
+				break;
+			}
+		}
+	} while (again);
+}
+
+struct link_attrs {
+	const char *name;
+	const char *kind;
+	const char *peer_name;
+	bool has_mtu;
+	unsigned int mtu;
+	bool has_master;
+	unsigned int master;
+	unsigned int link;
+	const struct nlattr *info_data;
+};
+
+static void parse_peer(const struct nlattr *peer, struct link_attrs *a)
+{
+	/* The peer is described by struct ifinfomsg followed by attributes */
+	const char *start = (const char *) mnl_attr_get_payload(peer) + NLMSG_ALIGN(sizeof(struct ifinfomsg));
+	const char *end = (const char *) mnl_attr_get_payload(peer) + mnl_attr_get_payload_len(peer);
+	const struct nlattr *attr = (const struct nlattr *) start;
+	while (start < end && mnl_attr_ok(attr, end - (const char *) attr)) {
+		if (mnl_attr_get_type(attr) == IFLA_IFNAME
+		    && mnl_attr_validate(attr, MNL_TYPE_STRING) >= 0)
+			a->peer_name = mnl_attr_get_str(attr);
+		attr = mnl_attr_next(attr);
+	}
+}
+
+static void parse_link_attrs(const struct nlmsghdr *nlh, struct link_attrs *a)
+{
+	struct nlattr *attr, *info, *data;
+	memset(a, 0, sizeof(*a));
+	mnl_attr_for_each(attr, nlh, sizeof(struct ifinfomsg)) {
+		switch (mnl_attr_get_type(attr)) {
+		case IFLA_IFNAME:
+			if (mnl_attr_validate(attr, MNL_TYPE_STRING) >= 0)
+				a->name = mnl_attr_get_str(attr);
+			break;
+		case IFLA_MTU:
+			a->has_mtu = true;
+			a->mtu = mnl_attr_get_u32(attr);
+			break;
+		case IFLA_MASTER:
+			a->has_master = true;
+			a->master = mnl_attr_get_u32(attr);
+			break;
+		case IFLA_LINK:
+			a->link = mnl_attr_get_u32(attr);
+			break;
+		case IFLA_LINKINFO:
+			mnl_attr_for_each_nested(info, attr) {
+				if (mnl_attr_get_type(info) == IFLA_INFO_KIND
+				    && mnl_attr_validate(info, MNL_TYPE_STRING) >= 0)
+					a->kind = mnl_attr_get_str(info);
+				if (mnl_attr_get_type(info) != IFLA_INFO_DATA)
+					continue;
+				a->info_data = info;
+				mnl_attr_for_each_nested(data, info) {
+					if (mnl_attr_get_type(data) == VETH_INFO_PEER)
+						parse_peer(data, a);
+				}
+			}
+			break;
+		}
+	}
+}
+
+static int check_name(struct mock_request *r, const char *name)
+{
+	if (!name || !*name || strlen(name) >= IF_NAMESIZE)
+		return fail(r, EINVAL, "Invalid interface name");
+	if (link_by_name(r->kernel, name))
+		return fail(r, EEXIST, "Interface name already exists");
+	return 0;
+}
+
+/** What the kernel compares to find the VXLAN device receiving a packet. */
+struct vxlan_id {
+	uint32_t vni;
+	uint16_t port;
+	bool ipv6;
+	bool metadata;
+	bool zero_csum6_rx;
+};
+
+static void parse_vxlan_id(const char *data, size_t len, struct vxlan_id *id)
+{
+	memset(id, 0, sizeof(*id));
+	/* Default of the kernel */
+	id->port = htons(8472);
+	const struct nlattr *attr = (const struct nlattr *) data;
+	while (mnl_attr_ok(attr, data + len - (const char *) attr)) {
+		switch (mnl_attr_get_type(attr)) {
+		case IFLA_VXLAN_ID:
+			id->vni = mnl_attr_get_u32(attr);
+			break;
+		case IFLA_VXLAN_PORT:
+			id->port = mnl_attr_get_u16(attr);
+			break;
+		case IFLA_VXLAN_GROUP6:
+		case IFLA_VXLAN_LOCAL6:
+			id->ipv6 = true;
+			break;
+		case IFLA_VXLAN_COLLECT_METADATA:
+			id->metadata = mnl_attr_get_u8(attr);
+			break;
+		case IFLA_VXLAN_UDP_ZERO_CSUM6_RX:
+			id->zero_csum6_rx = mnl_attr_get_u8(attr);
+			break;
+		}
+		attr = mnl_attr_next(attr);
+	}
+}
+
+/* The kernel refuses a VXLAN device that would receive the packets of another one: the same
+ * VNI (zero for the metadata devices) on the same UDP port and address family */
+static int check_vxlan_id(struct mock_request *r, const struct link_attrs *a)
+{
+	struct vxlan_id id, other_id;
+	if (!a->info_data)
+		return 0;
+	parse_vxlan_id(
+		mnl_attr_get_payload(a->info_data), mnl_attr_get_payload_len(a->info_data), &id);
+	struct mock_link *l, *tmp;
+	HASH_ITER(hh_index, r->kernel->links_by_index, l, tmp) {
+		if (strcmp(l->kind, "vxlan") != 0)
+			continue;
+		parse_vxlan_id(l->info_data, l->info_data_len, &other_id);
+		if (memcmp(&id, &other_id, sizeof(id)) == 0)
+			return fail(r, EEXIST, "A VXLAN device with the specified VNI already exists");
+	}
+	return 0;
+}
+
+static int link_create(struct mock_request *r, const struct link_attrs *a)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	int err;
+	if (!a->kind)
+		return fail(r, EOPNOTSUPP, "Link kind is required");
+	if ((err = check_name(r, a->name)))
+		return err;
+
+	bool veth = strcmp(a->kind, "veth") == 0;
+	if (veth) {
+		if ((err = check_name(r, a->peer_name)))
+			return err;
+		if (strcmp(a->name, a->peer_name) == 0)
+			return fail(r, EEXIST, "Interface name already exists");
+	}
+
+	struct mock_link *lower = NULL;
+	if (a->link) {
+		lower = link_by_index(k, a->link);
+		if (!lower)
+			return fail(r, ENODEV, "Lower device does not exist");
+	} else if (strcmp(a->kind, "vlan") == 0) {
+		return fail(r, EINVAL, "VLAN requires a lower device");
+	}
+	if (a->has_master && a->master && !link_by_index(k, a->master))
+		return fail(r, ENODEV, "Master device does not exist");
+	if (strcmp(a->kind, "vxlan") == 0 && (err = check_vxlan_id(r, a)))
+		return err;
+
+	struct mock_link *l = link_add(k, a->name, a->kind);
+	if (!l)
+		return -ENOMEM;
+	if (lower) {
+		l->link = lower->ifindex;
+		l->mtu = lower->mtu;
+	}
+	if (strcmp(a->kind, "vxlan") == 0 || strcmp(a->kind, "geneve") == 0)
+		l->mtu -= MOCK_TUNNEL_OVERHEAD;
+	if (a->has_mtu)
+		l->mtu = a->mtu;
+	if (a->has_master)
+		l->master = a->master;
+	if (a->info_data && mnl_attr_get_payload_len(a->info_data) <= sizeof(l->info_data)) {
+		l->info_data_len = mnl_attr_get_payload_len(a->info_data);
+		memcpy(l->info_data, mnl_attr_get_payload(a->info_data), l->info_data_len);
+	}
+	notify_link(k, l, RTM_NEWLINK);
+
+	if (veth) {
+		struct mock_link *peer = link_add(k, a->peer_name, a->kind);
+		if (!peer) {
+			link_remove(k, l);
+			return -ENOMEM;
+		}
+		peer->link = l->ifindex;
+		l->link = peer->ifindex;
+		notify_link(k, peer, RTM_NEWLINK);
+	}
+	return 0;
+}
+
+static int link_change(struct mock_request *r, struct mock_link *l, const struct link_attrs *a)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(r->nlh);
+	if (a->kind && strcmp(a->kind, l->kind) != 0)
+		return fail(r, EOPNOTSUPP, "Changing the link kind is not supported");
+	if (a->has_master && a->master && (a->master == l->ifindex || !link_by_index(k, a->master)))
+		return fail(r, ENODEV, "Master device does not exist");
+	if (a->name && strcmp(a->name, l->name) != 0) {
+		int err = check_name(r, a->name);
+		if (err)
+			return err;
+		HASH_DELETE(hh_name, k->links_by_name, l);
+		strcpy(l->name, a->name);
+		HASH_ADD_KEYPTR(hh_name, k->links_by_name, l->name, strlen(l->name), l);
+	}
+	if (a->has_mtu)
+		l->mtu = a->mtu;
+	if (a->has_master && a->master != l->master) {
+		/* The port settings do not survive leaving the bridge */
+		l->vlan_tunnel = false;
+		vlan_flush(k, l->ifindex);
+	}
+	if (a->has_master)
+		l->master = a->master;
+	if (ifm->ifi_change & IFF_UP)
+		l->up = ifm->ifi_flags & IFF_UP;
+	notify_link(k, l, RTM_NEWLINK);
+	return 0;
+}
+
+static struct mock_link *find_request_link(struct mock_request *r, const struct link_attrs *a)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(r->nlh);
+	if (ifm->ifi_index)
+		return link_by_index(r->kernel, ifm->ifi_index);
+	if (a->name)
+		return link_by_name(r->kernel, a->name);
+	return NULL;
+}
+
+static int link_new(struct mock_request *r)
+{
+	struct link_attrs a;
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(r->nlh);
+	parse_link_attrs(r->nlh, &a);
+
+	struct mock_link *l = find_request_link(r, &a);
+	if (l) {
+		if (r->nlh->nlmsg_flags & NLM_F_EXCL)
+			return fail(r, EEXIST, "Interface already exists");
+		return link_change(r, l, &a);
+	}
+	if (!(r->nlh->nlmsg_flags & NLM_F_CREATE) || ifm->ifi_index)
+		return fail(r, ENODEV, "Interface does not exist");
+	return link_create(r, &a);
+}
+
+static int link_del(struct mock_request *r)
+{
+	struct link_attrs a;
+	parse_link_attrs(r->nlh, &a);
+	struct mock_link *l = find_request_link(r, &a);
+	if (!l)
+		return fail(r, ENODEV, "Interface does not exist");
+	link_remove(r->kernel, l);
+	return 0;
+}
+
+/** Multipart dump response being built. */
+struct mock_dump {
+	struct mock_request *r;
+	struct mock_datagram *d;
+};
+
+/* Add a message to the dump, the messages are packed into datagrams like the kernel does. */
+static void dump_put(struct mock_dump *dump, const struct nlmsghdr *nlh)
+{
+	struct mock_queue *q = &dump->r->sender->queues[dump->r->ch];
+	size_t len = NLMSG_ALIGN(nlh->nlmsg_len);
+	if (dump->d && dump->d->len + len > MOCK_DUMP_DATAGRAM) {
+		queue_datagram(q, dump->d);
+		dump->d = NULL;
+	}
+	if (!dump->d) {
+		dump->d = malloc(sizeof(*dump->d) + MOCK_DUMP_DATAGRAM);
+		if (!dump->d) {
+			q->overflow = true;
+			return;
+		}
+		dump->d->len = 0;
+	}
+	memcpy(dump->d->data + dump->d->len, nlh, nlh->nlmsg_len);
+	dump->d->len += len;
+}
+
+static void dump_done(struct mock_dump *dump)
+{
+	struct mock_request *r = dump->r;
+	if (dump->d)
+		queue_datagram(&r->sender->queues[r->ch], dump->d);
+
+	char buf[MOCK_MSG_SIZE];
+	struct nlmsghdr *done = mnl_nlmsg_put_header(buf);
+	done->nlmsg_type = NLMSG_DONE;
+	done->nlmsg_flags = NLM_F_MULTI;
+	done->nlmsg_seq = r->nlh->nlmsg_seq;
+	int *status = mnl_nlmsg_put_extra_header(done, sizeof(*status));
+	*status = 0;
+	reply(r, done);
+}
+
+static void dump_links(struct mock_request *r)
+{
+	struct mock_dump dump = {r, NULL};
+	char buf[MOCK_MSG_SIZE];
+	struct mock_link *l, *tmp;
+	HASH_ITER(hh_index, r->kernel->links_by_index, l, tmp) {
+		dump_put(&dump, put_link_msg(buf, l, RTM_NEWLINK, NLM_F_MULTI, r->nlh->nlmsg_seq));
+	}
+	dump_done(&dump);
+}
+
+static int link_get(struct mock_request *r)
+{
+	if (r->nlh->nlmsg_flags & NLM_F_DUMP) {
+		dump_links(r);
+		return 0;
+	}
+
+	struct link_attrs a;
+	parse_link_attrs(r->nlh, &a);
+	struct mock_link *l = find_request_link(r, &a);
+	if (!l)
+		return fail(r, ENODEV, "Interface does not exist");
+	char buf[MOCK_MSG_SIZE];
+	reply(r, put_link_msg(buf, l, RTM_NEWLINK, 0, r->nlh->nlmsg_seq));
+	return 0;
+}
+
+static int addr_change(struct mock_request *r)
+{
+	const struct ifaddrmsg *ifa = mnl_nlmsg_get_payload(r->nlh);
+	if (!link_by_index(r->kernel, ifa->ifa_index))
+		return fail(r, ENODEV, "Interface does not exist");
+	return 0;
+}
+
+/********* BPF maps and programs *********/
+
+static struct mock_bpf *bpf_find(struct lsdn_mock_kernel *k, int fd, enum mock_bpf_type type)
+{
+	struct mock_bpf *b;
+	HASH_FIND_INT(k->bpf, &fd, b);
+	if (b && b->type != type)
+		return NULL;
+	return b;
+}
+
+static struct mock_bpf *bpf_new(struct lsdn_mock_kernel *k, enum mock_bpf_type type)
+{
+	struct mock_bpf *b = malloc(sizeof(*b));
+	if (!b)
+		return NULL;
+	bzero(b, sizeof(*b));
+	b->fd = k->next_fd++;
+	b->type = type;
+	HASH_ADD_INT(k->bpf, fd, b);
+	return b;
+}
+
+static void bpf_remove(struct lsdn_mock_kernel *k, struct mock_bpf *b)
+{
+	struct mock_bpf_entry *e, *tmp;
+	HASH_ITER(hh, b->entries, e, tmp) {
+		HASH_DELETE(hh, b->entries, e);
+		free(e);
+	}
+	HASH_DELETE(hh, k->bpf, b);
+	free(b);
+}
+
+static int bpf_map_create(struct lsdn_mock_kernel *k, const union bpf_attr *attr)
+{
+	if (attr->map_type != BPF_MAP_TYPE_HASH)
+		return -EOPNOTSUPP;
+	if (attr->key_size == 0 || attr->key_size > MOCK_BPF_MAX_SIZE
+	    || attr->value_size == 0 || attr->value_size > MOCK_BPF_MAX_SIZE
+	    || attr->max_entries == 0)
+		return -EINVAL;
+	struct mock_bpf *b = bpf_new(k, MOCK_BPF_MAP);
+	if (!b)
+		return -ENOMEM;
+	b->key_size = attr->key_size;
+	b->value_size = attr->value_size;
+	b->max_entries = attr->max_entries;
+	return b->fd;
+}
+
+/* The program is not verified, only the map references are checked */
+static int bpf_prog_load(struct lsdn_mock_kernel *k, const union bpf_attr *attr)
+{
+	const struct bpf_insn *insns = (const struct bpf_insn *) (uintptr_t) attr->insns;
+	if (attr->prog_type != BPF_PROG_TYPE_SCHED_CLS)
+		return -EOPNOTSUPP;
+	if (attr->insn_cnt == 0 || !insns || !attr->license)
+		return -EINVAL;
+	if (insns[attr->insn_cnt - 1].code != (BPF_JMP | BPF_EXIT))
+		return -EINVAL;
+	for (uint32_t i = 0; i < attr->insn_cnt; i++) {
+		if (insns[i].code != (BPF_LD | BPF_DW | BPF_IMM))
+			continue;
+		/* 64-bit immediate loads take two instructions */
+		if (i + 1 == attr->insn_cnt)
+			return -EINVAL;
+		if (insns[i].src_reg == BPF_PSEUDO_MAP_FD && !bpf_find(k, insns[i].imm, MOCK_BPF_MAP))
+			return -EBADF;
+		i++;
+	}
+	struct mock_bpf *b = bpf_new(k, MOCK_BPF_PROG);
+	if (!b)
+		return -ENOMEM;
+	return b->fd;
+}
+
+static int bpf_map_update(struct lsdn_mock_kernel *k, const union bpf_attr *attr)
+{
+	struct mock_bpf *b = bpf_find(k, attr->map_fd, MOCK_BPF_MAP);
+	if (!b)
+		return -EBADF;
+	if (attr->flags > BPF_EXIST)
+		return -EINVAL;
+	const void *key = (const void *) (uintptr_t) attr->key;
+	const void *value = (const void *) (uintptr_t) attr->value;
+	struct mock_bpf_entry *e;
+	HASH_FIND(hh, b->entries, key, b->key_size, e);
+	if (e && attr->flags == BPF_NOEXIST)
+		return -EEXIST;
+	if (!e && attr->flags == BPF_EXIST)
+		return -ENOENT;
+	if (!e) {
+		if (HASH_COUNT(b->entries) >= b->max_entries)
+			return -E2BIG;
+		e = malloc(sizeof(*e) + b->key_size + b->value_size);
+		if (!e)
+			return -ENOMEM;
+		memcpy(e->data, key, b->key_size);
+		HASH_ADD_KEYPTR(hh, b->entries, e->data, b->key_size, e);
+	}
+	memcpy(e->data + b->key_size, value, b->value_size);
+	return 0;
+}
+
+static int bpf_map_delete(struct lsdn_mock_kernel *k, const union bpf_attr *attr)
+{
+	struct mock_bpf *b = bpf_find(k, attr->map_fd, MOCK_BPF_MAP);
+	if (!b)
+		return -EBADF;
+	struct mock_bpf_entry *e;
+	HASH_FIND(hh, b->entries, (const void *) (uintptr_t) attr->key, b->key_size, e);
+	if (!e)
+		return -ENOENT;
+	HASH_DELETE(hh, b->entries, e);
+	free(e);
+	return 0;
+}
+
+static int bpf_command(struct lsdn_mock_kernel *k, int cmd, const union bpf_attr *attr)
+{
+	switch (cmd) {
+	case BPF_MAP_CREATE:
+		return bpf_map_create(k, attr);
+	case BPF_PROG_LOAD:
+		return bpf_prog_load(k, attr);
+	case BPF_MAP_UPDATE_ELEM:
+		return bpf_map_update(k, attr);
+	case BPF_MAP_DELETE_ELEM:
+		return bpf_map_delete(k, attr);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/* The program of a cls_bpf filter, -1 if not given */
+static int get_bpf_fd(const struct nlmsghdr *nlh)
+{
+	struct nlattr *attr, *opt;
+	mnl_attr_for_each(attr, nlh, sizeof(struct tcmsg)) {
+		if (mnl_attr_get_type(attr) != TCA_OPTIONS)
+			continue;
+		mnl_attr_for_each_nested(opt, attr) {
+			if (mnl_attr_get_type(opt) == TCA_BPF_FD
+			    && mnl_attr_validate(opt, MNL_TYPE_U32) >= 0)
+				return mnl_attr_get_u32(opt);
+		}
+	}
+	return -1;
+}
+
+/********* Qdiscs, chains and filters *********/
+
+static struct mock_qdisc *qdisc_find(
+	struct lsdn_mock_kernel *k, unsigned int ifindex, uint32_t slot)
+{
+	struct mock_qdisc_key key;
+	struct mock_qdisc *q;
+	memset(&key, 0, sizeof(key));
+	key.ifindex = ifindex;
+	key.slot = slot;
+	HASH_FIND(hh, k->qdiscs, &key, sizeof(key), q);
+	return q;
+}
+
+static void prio_remove(struct lsdn_mock_kernel *k, struct mock_prio *p)
+{
+	struct mock_chain *c;
+	HASH_FIND(hh, k->chains, &p->key.chain, sizeof(p->key.chain), c);
+	assert(c);
+	HASH_DELETE(hh, k->prios, p);
+	free(p);
+	if (--c->prio_count == 0) {
+		HASH_DELETE(hh, k->chains, c);
+		free(c);
+	}
+}
+
+static void filter_unbind(struct mock_filter *f)
+{
+	for (size_t i = 0; i < f->shared_count; i++)
+		f->shared[i]->binds--;
+	f->shared_count = 0;
+}
+
+static void filter_remove(struct lsdn_mock_kernel *k, struct mock_filter *f)
+{
+	struct mock_prio *p;
+	HASH_FIND(hh, k->prios, &f->key.prio, sizeof(f->key.prio), p);
+	assert(p);
+	filter_unbind(f);
+	HASH_DELETE(hh, k->filters, f);
+	free(f);
+	if (--p->filter_count == 0)
+		prio_remove(k, p);
+}
+
+/* Remove all filters matching the predicate, emptied priorities and chains are removed with them. */
+#define remove_filters(k, f, pred) \
+	do { \
+		struct mock_filter *f, *f##_tmp; \
+		HASH_ITER(hh, (k)->filters, f, f##_tmp) { \
+			if (pred) \
+				filter_remove(k, f); \
+		} \
+	} while (0)
+
+/* Find a qdisc bound to the shared block, other than `except`. */
+static struct mock_qdisc *block_find(
+	struct lsdn_mock_kernel *k, uint32_t block, const struct mock_qdisc *except)
+{
+	struct mock_qdisc *q, *tmp;
+	HASH_ITER(hh, k->qdiscs, q, tmp) {
+		if (q != except && q->ingress_block == block)
+			return q;
+	}
+	return NULL;
+}
+
+static bool is_nested(const struct mock_qdisc *q)
+{
+	return q->key.slot != MOCK_QDISC_ROOT && q->key.slot != MOCK_QDISC_INGRESS;
+}
+
+/* Find a qdisc nested in a class of the qdisc with the given handle. */
+static struct mock_qdisc *nested_find(struct lsdn_mock_kernel *k, unsigned int ifindex, uint32_t handle)
+{
+	struct mock_qdisc *q, *tmp;
+	HASH_ITER(hh, k->qdiscs, q, tmp) {
+		if (q->key.ifindex == ifindex && is_nested(q) && TC_H_MAJ(q->key.slot) == handle)
+			return q;
+	}
+	return NULL;
+}
+
+static void qdisc_remove(struct lsdn_mock_kernel *k, struct mock_qdisc *q)
+{
+	unsigned int ifindex = q->key.ifindex;
+	uint32_t handle = q->handle;
+	uint32_t block = q->ingress_block;
+	struct mock_qdisc *nested;
+	while ((nested = nested_find(k, ifindex, handle)))
+		qdisc_remove(k, nested);
+	struct mock_class *c, *ctmp;
+	HASH_ITER(hh, k->classes, c, ctmp) {
+		if (c->key.ifindex == ifindex && TC_H_MAJ(c->key.classid) == handle) {
+			HASH_DELETE(hh, k->classes, c);
+			free(c);
+		}
+	}
+	remove_filters(k, f, f->key.prio.chain.ifindex == ifindex
+		&& f->key.prio.chain.qdisc_handle == handle);
+	/* The block is destroyed with the last qdisc bound to it */
+	if (block && !block_find(k, block, q)) {
+		remove_filters(k, f, f->key.prio.chain.ifindex == TCM_IFINDEX_MAGIC_BLOCK
+			&& f->key.prio.chain.qdisc_handle == block);
+	}
+	HASH_DELETE(hh, k->qdiscs, q);
+	free(q);
+}
+
+static struct mock_class *class_find(struct lsdn_mock_kernel *k, unsigned int ifindex, uint32_t classid)
+{
+	struct mock_class_key key;
+	struct mock_class *c;
+	memset(&key, 0, sizeof(key));
+	key.ifindex = ifindex;
+	key.classid = classid;
+	HASH_FIND(hh, k->classes, &key, sizeof(key), c);
+	return c;
+}
+
+/* Find the qdisc owning the class (or the band of a prio qdisc). */
+static struct mock_qdisc *class_owner(struct lsdn_mock_kernel *k, unsigned int ifindex, uint32_t classid)
+{
+	struct mock_qdisc *q, *tmp;
+	HASH_ITER(hh, k->qdiscs, q, tmp) {
+		if (q->key.ifindex == ifindex && q->key.slot != MOCK_QDISC_INGRESS
+		    && q->handle == TC_H_MAJ(classid))
+			return q;
+	}
+	return NULL;
+}
+
+/* The classes of the prio qdiscs are its bands, they always exist. */
+static bool class_exists(struct lsdn_mock_kernel *k, unsigned int ifindex, uint32_t classid)
+{
+	struct mock_qdisc *owner = class_owner(k, ifindex, classid);
+	if (!owner || !TC_H_MIN(classid))
+		return false;
+	return strcmp(owner->kind, "prio") == 0 || class_find(k, ifindex, classid);
+}
+
+/* The slot is also used for the qdiscs nested in classes, the slot is then the class */
+static int qdisc_slot(struct mock_request *r, const struct tcmsg *tcm, uint32_t *slot)
+{
+	if (tcm->tcm_parent == TC_H_ROOT)
+		*slot = MOCK_QDISC_ROOT;
+	else if (tcm->tcm_parent == TC_H_INGRESS)
+		*slot = MOCK_QDISC_INGRESS;
+	else if (TC_H_MAJ(tcm->tcm_parent) && TC_H_MAJ(tcm->tcm_parent) != TC_H_MAJ(TC_H_INGRESS))
+		*slot = tcm->tcm_parent;
+	else
+		return fail(r, EOPNOTSUPP, "Only root, ingress, clsact and nested qdiscs are emulated");
+	return 0;
+}
+
+static const char *get_kind(const struct nlmsghdr *nlh)
+{
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(struct tcmsg)) {
+		if (mnl_attr_get_type(attr) == TCA_KIND && mnl_attr_validate(attr, MNL_TYPE_STRING) >= 0)
+			return mnl_attr_get_str(attr);
+	}
+	return NULL;
+}
+
+static uint32_t get_ingress_block(const struct nlmsghdr *nlh)
+{
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(struct tcmsg)) {
+		if (mnl_attr_get_type(attr) == TCA_INGRESS_BLOCK
+		    && mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+			return mnl_attr_get_u32(attr);
+	}
+	return 0;
+}
+
+static int qdisc_new(struct mock_request *r)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(r->nlh);
+	uint32_t slot;
+	int err;
+	if (!link_by_index(k, tcm->tcm_ifindex))
+		return fail(r, ENODEV, "Interface does not exist");
+	if ((err = qdisc_slot(r, tcm, &slot)))
+		return err;
+	if (slot != MOCK_QDISC_ROOT && slot != MOCK_QDISC_INGRESS
+	    && !class_exists(k, tcm->tcm_ifindex, slot))
+		return fail(r, ENOENT, "Failed to find specified class");
+	const char *kind = get_kind(r->nlh);
+	if (!kind)
+		return fail(r, EINVAL, "Qdisc kind is required");
+	bool ingress_kind = strcmp(kind, "ingress") == 0 || strcmp(kind, "clsact") == 0;
+	if (ingress_kind != (slot == MOCK_QDISC_INGRESS))
+		return fail(r, EINVAL, "Qdisc kind does not match its parent");
+	uint32_t block = get_ingress_block(r->nlh);
+	if (block && strcmp(kind, "clsact") != 0)
+		return fail(r, EINVAL, "Only clsact qdiscs can be bound to a block");
+
+	struct mock_qdisc *q = qdisc_find(k, tcm->tcm_ifindex, slot);
+	if (q) {
+		if (r->nlh->nlmsg_flags & NLM_F_EXCL)
+			return fail(r, EEXIST, "Exclusivity flag on, cannot modify");
+		if (strcmp(q->kind, kind) == 0 && (!tcm->tcm_handle || q->handle == tcm->tcm_handle)) {
+			if (block)
+				return fail(r, EOPNOTSUPP, "Change of blocks is not supported");
+			return 0;
+		}
+		if (!(r->nlh->nlmsg_flags & NLM_F_REPLACE))
+			return fail(r, EEXIST, "Qdisc already exists");
+		qdisc_remove(k, q);
+	} else if (!(r->nlh->nlmsg_flags & NLM_F_CREATE)) {
+		return fail(r, ENOENT, "Qdisc not found");
+	}
+
+	q = malloc(sizeof(*q));
+	if (!q)
+		return -ENOMEM;
+	memset(&q->key, 0, sizeof(q->key));
+	q->key.ifindex = tcm->tcm_ifindex;
+	q->key.slot = slot;
+	q->handle = tcm->tcm_handle;
+	q->ingress_block = block;
+	strncpy(q->kind, kind, sizeof(q->kind) - 1);
+	q->kind[sizeof(q->kind) - 1] = 0;
+	HASH_ADD(hh, k->qdiscs, key, sizeof(q->key), q);
+	k->qdiscs_created++;
+	return 0;
+}
+
+static int qdisc_del(struct mock_request *r)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(r->nlh);
+	uint32_t slot;
+	int err;
+	if (!link_by_index(k, tcm->tcm_ifindex))
+		return fail(r, ENODEV, "Interface does not exist");
+	if ((err = qdisc_slot(r, tcm, &slot)))
+		return err;
+	struct mock_qdisc *q = qdisc_find(k, tcm->tcm_ifindex, slot);
+	if (!q || (tcm->tcm_handle && q->handle != tcm->tcm_handle))
+		return fail(r, ENOENT, "Cannot find specified qdisc on specified device");
+	qdisc_remove(k, q);
+	return 0;
+}
+
+static int class_new(struct mock_request *r)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(r->nlh);
+	if (!link_by_index(k, tcm->tcm_ifindex))
+		return fail(r, ENODEV, "Interface does not exist");
+	struct mock_qdisc *owner = class_owner(k, tcm->tcm_ifindex, tcm->tcm_handle);
+	if (!owner || strcmp(owner->kind, "htb") != 0 || !TC_H_MIN(tcm->tcm_handle))
+		return fail(r, EOPNOTSUPP, "Only the classes of HTB qdiscs are emulated");
+	if (tcm->tcm_parent != owner->handle && !class_find(k, tcm->tcm_ifindex, tcm->tcm_parent))
+		return fail(r, ENOENT, "Parent class not found");
+
+	if (class_find(k, tcm->tcm_ifindex, tcm->tcm_handle)) {
+		if (r->nlh->nlmsg_flags & NLM_F_EXCL)
+			return fail(r, EEXIST, "Class already exists");
+		return 0;
+	} else if (!(r->nlh->nlmsg_flags & NLM_F_CREATE)) {
+		return fail(r, ENOENT, "Class not found");
+	}
+	struct mock_class *c = malloc(sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+	memset(&c->key, 0, sizeof(c->key));
+	c->key.ifindex = tcm->tcm_ifindex;
+	c->key.classid = tcm->tcm_handle;
+	HASH_ADD(hh, k->classes, key, sizeof(c->key), c);
+	return 0;
+}
+
+static int class_del(struct mock_request *r)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(r->nlh);
+	if (!link_by_index(k, tcm->tcm_ifindex))
+		return fail(r, ENODEV, "Interface does not exist");
+	struct mock_class *c = class_find(k, tcm->tcm_ifindex, tcm->tcm_handle);
+	if (!c)
+		return fail(r, ENOENT, "Class not found");
+	if (qdisc_find(k, tcm->tcm_ifindex, tcm->tcm_handle))
+		return fail(r, EBUSY, "Class is in use");
+	HASH_DELETE(hh, k->classes, c);
+	free(c);
+	return 0;
+}
+
+static void chain_key_set_chain(struct mock_request *r, struct mock_chain_key *key)
+{
+	key->chain = 0;
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, r->nlh, sizeof(struct tcmsg)) {
+		if (mnl_attr_get_type(attr) == TCA_CHAIN)
+			key->chain = mnl_attr_get_u32(attr);
+	}
+}
+
+static void block_chain_key(struct mock_request *r, struct mock_chain_key *key, uint32_t block)
+{
+	memset(key, 0, sizeof(*key));
+	key->ifindex = TCM_IFINDEX_MAGIC_BLOCK;
+	key->qdisc_handle = block;
+	chain_key_set_chain(r, key);
+}
+
+/* Find the chain key for a filter request. */
+static int filter_chain_key(struct mock_request *r, struct mock_chain_key *key)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(r->nlh);
+	if (tcm->tcm_ifindex == TCM_IFINDEX_MAGIC_BLOCK) {
+		if (!tcm->tcm_parent || !block_find(k, tcm->tcm_parent, NULL))
+			return fail(r, EINVAL, "Block of given index was not found");
+		block_chain_key(r, key, tcm->tcm_parent);
+		return 0;
+	}
+	if (!link_by_index(k, tcm->tcm_ifindex))
+		return fail(r, ENODEV, "Interface does not exist");
+
+	uint32_t major = TC_H_MAJ(tcm->tcm_parent);
+	struct mock_qdisc *q = qdisc_find(k, tcm->tcm_ifindex, MOCK_QDISC_INGRESS);
+	if (!q || q->handle != major) {
+		q = qdisc_find(k, tcm->tcm_ifindex, MOCK_QDISC_ROOT);
+		if (!q || q->handle != major)
+			return fail(r, EINVAL, "Parent Qdisc doesn't exists");
+	}
+
+	bool egress = strcmp(q->kind, "clsact") == 0
+		&& TC_H_MIN(tcm->tcm_parent) == TC_H_MIN(LSDN_CLSACT_EGRESS_PARENT);
+	/* Filters of a bound ingress hook are those of the block */
+	if (q->ingress_block && !egress) {
+		block_chain_key(r, key, q->ingress_block);
+		return 0;
+	}
+	memset(key, 0, sizeof(*key));
+	key->ifindex = tcm->tcm_ifindex;
+	key->qdisc_handle = q->handle;
+	key->block = egress;
+	chain_key_set_chain(r, key);
+	return 0;
+}
+
+/* Priority for a filter created without one: below all existing priorities in the chain. */
+static uint32_t auto_prio(struct lsdn_mock_kernel *k, const struct mock_chain_key *chain)
+{
+	uint32_t prio = MOCK_FIRST_PRIO;
+	struct mock_prio *p, *tmp;
+	HASH_ITER(hh, k->prios, p, tmp) {
+		if (!memcmp(&p->key.chain, chain, sizeof(*chain)) && p->key.prio <= prio)
+			prio = p->key.prio - 1;
+	}
+	return prio;
+}
+
+static int find_shared_actions(
+	struct mock_request *r, const char *kind, struct mock_action **shared, size_t *count);
+static void filter_bind(struct mock_filter *f, struct mock_action **shared, size_t count)
+{
+	filter_unbind(f);
+	for (size_t i = 0; i < count; i++) {
+		f->shared[i] = shared[i];
+		shared[i]->binds++;
+	}
+	f->shared_count = count;
+}
+
+static int filter_new(struct mock_request *r)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(r->nlh);
+	uint16_t flags = r->nlh->nlmsg_flags;
+	struct mock_filter_key key;
+	struct mock_action *shared[MOCK_FILTER_SHARED];
+	size_t shared_count;
+	int err;
+
+	memset(&key, 0, sizeof(key));
+	if ((err = filter_chain_key(r, &key.prio.chain)))
+		return err;
+	const char *kind = get_kind(r->nlh);
+	if (!kind)
+		return fail(r, EINVAL, "Filter kind is required");
+	if (strcmp(kind, "bpf") == 0) {
+		int fd = get_bpf_fd(r->nlh);
+		if (fd < 0)
+			return fail(r, EINVAL, "Program fd is required");
+		if (!bpf_find(k, fd, MOCK_BPF_PROG))
+			return fail(r, EBADF, "Program fd is not a BPF program");
+	}
+	if ((err = find_shared_actions(r, kind, shared, &shared_count)))
+		return err;
+	uint16_t protocol = TC_H_MIN(tcm->tcm_info);
+	key.prio.prio = TC_H_MAJ(tcm->tcm_info) >> 16;
+	if (key.prio.prio == 0) {
+		if (!(flags & NLM_F_CREATE))
+			return fail(r, ENOENT, "Filter with specified priority/protocol not found");
+		key.prio.prio = auto_prio(k, &key.prio.chain);
+	}
+
+	struct mock_prio *p;
+	HASH_FIND(hh, k->prios, &key.prio, sizeof(key.prio), p);
+	if (p) {
+		if (strcmp(p->kind, kind) != 0)
+			return fail(r, EINVAL, "Specified filter kind does not match existing one");
+		if (p->protocol != protocol)
+			return fail(r, EINVAL, "Filter with specified priority/protocol not found");
+	} else if (!(flags & NLM_F_CREATE)) {
+		return fail(r, ENOENT, "Filter with specified priority/protocol not found");
+	}
+
+	struct mock_filter *f = NULL;
+	key.handle = tcm->tcm_handle;
+	if (key.handle) {
+		HASH_FIND(hh, k->filters, &key, sizeof(key), f);
+		if (f && (flags & NLM_F_EXCL))
+			return fail(r, EEXIST, "Filter already exists");
+		if (f) {
+			/* Replaced, the filter now refers to the new actions */
+			filter_bind(f, shared, shared_count);
+			return 0;
+		}
+		if (!(flags & NLM_F_CREATE))
+			return fail(r, ENOENT, "Filter not found");
+	}
+
+	f = malloc(sizeof(*f));
+	if (!f)
+		return -ENOMEM;
+	if (!p) {
+		struct mock_chain *c;
+		HASH_FIND(hh, k->chains, &key.prio.chain, sizeof(key.prio.chain), c);
+		if (!c) {
+			c = malloc(sizeof(*c));
+			if (!c) {
+				free(f);
+				return -ENOMEM;
+			}
+			c->key = key.prio.chain;
+			c->prio_count = 0;
+			HASH_ADD(hh, k->chains, key, sizeof(c->key), c);
+		}
+		p = malloc(sizeof(*p));
+		if (!p) {
+			free(f);
+			if (c->prio_count == 0) {
+				HASH_DELETE(hh, k->chains, c);
+				free(c);
+			}
+			return -ENOMEM;
+		}
+		p->key = key.prio;
+		strncpy(p->kind, kind, sizeof(p->kind) - 1);
+		p->kind[sizeof(p->kind) - 1] = 0;
+		p->protocol = protocol;
+		p->filter_count = 0;
+		p->next_handle = 1;
+		HASH_ADD(hh, k->prios, key, sizeof(p->key), p);
+		c->prio_count++;
+	}
+	if (!key.handle) {
+		/* Automatically assigned handle, skip the ones taken explicitly */
+		struct mock_filter *taken;
+		do {
+			key.handle = p->next_handle++;
+			HASH_FIND(hh, k->filters, &key, sizeof(key), taken);
+		} while (taken);
+	}
+	f->key = key;
+	f->shared_count = 0;
+	filter_bind(f, shared, shared_count);
+	HASH_ADD(hh, k->filters, key, sizeof(f->key), f);
+	p->filter_count++;
+	k->filters_created++;
+	return 0;
+}
+
+static int filter_del(struct mock_request *r)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(r->nlh);
+	struct mock_filter_key key;
+	int err;
+
+	memset(&key, 0, sizeof(key));
+	if ((err = filter_chain_key(r, &key.prio.chain)))
+		return err;
+	key.prio.prio = TC_H_MAJ(tcm->tcm_info) >> 16;
+	if (key.prio.prio == 0) {
+		/* Flush the whole chain */
+		struct mock_chain *c;
+		HASH_FIND(hh, k->chains, &key.prio.chain, sizeof(key.prio.chain), c);
+		/* Flushing a missing chain succeeds, like in the kernel */
+		if (!c)
+			return 0;
+		struct mock_chain_key chain = key.prio.chain;
+		remove_filters(k, f, !memcmp(&f->key.prio.chain, &chain, sizeof(chain)));
+		return 0;
+	}
+
+	struct mock_prio *p;
+	HASH_FIND(hh, k->prios, &key.prio, sizeof(key.prio), p);
+	if (!p)
+		return fail(r, ENOENT, "Filter with specified priority/protocol not found");
+	if (!tcm->tcm_handle) {
+		/* Delete all filters with the priority */
+		struct mock_prio_key prio = key.prio;
+		remove_filters(k, f, !memcmp(&f->key.prio, &prio, sizeof(prio)));
+		return 0;
+	}
+
+	struct mock_filter *f;
+	key.handle = tcm->tcm_handle;
+	HASH_FIND(hh, k->filters, &key, sizeof(key), f);
+	if (!f)
+		return fail(r, ENOENT, "Specified filter handle not found");
+	filter_remove(k, f);
+	return 0;
+}
+
+static int filter_get(struct mock_request *r)
+{
+	if (!(r->nlh->nlmsg_flags & NLM_F_DUMP))
+		return fail(r, EOPNOTSUPP, "Only filter dumps are emulated");
+
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(r->nlh);
+	struct mock_dump dump = {r, NULL};
+	struct mock_chain_key key;
+	/* Nothing is dumped from a missing qdisc */
+	if (filter_chain_key(r, &key) == 0) {
+		char buf[MOCK_MSG_SIZE];
+		struct mock_filter *f, *tmp;
+		HASH_ITER(hh, r->kernel->filters, f, tmp) {
+			const struct mock_chain_key *c = &f->key.prio.chain;
+			if (c->ifindex != key.ifindex || c->qdisc_handle != key.qdisc_handle
+			    || c->block != key.block)
+				continue;
+			struct mock_prio *p;
+			HASH_FIND(hh, r->kernel->prios, &f->key.prio, sizeof(f->key.prio), p);
+			assert(p);
+
+			struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+			nlh->nlmsg_type = RTM_NEWTFILTER;
+			nlh->nlmsg_flags = NLM_F_MULTI;
+			nlh->nlmsg_seq = r->nlh->nlmsg_seq;
+			struct tcmsg *out = mnl_nlmsg_put_extra_header(nlh, sizeof(*out));
+			out->tcm_family = AF_UNSPEC;
+			out->tcm_ifindex = c->ifindex;
+			out->tcm_parent = tcm->tcm_parent;
+			out->tcm_handle = f->key.handle;
+			out->tcm_info = TC_H_MAKE(f->key.prio.prio << 16, p->protocol);
+			mnl_attr_put_strz(nlh, TCA_KIND, p->kind);
+			mnl_attr_put_u32(nlh, TCA_CHAIN, c->chain);
+			dump_put(&dump, nlh);
+		}
+	}
+	r->msg = NULL;
+	dump_done(&dump);
+	return 0;
+}
+
+/********* FDB *********/
+
+static void fdb_flush(struct lsdn_mock_kernel *k, unsigned int ifindex)
+{
+	struct mock_fdb *e, *tmp;
+	HASH_ITER(hh, k->fdb, e, tmp) {
+		if (e->key.ifindex == ifindex) {
+			HASH_DELETE(hh, k->fdb, e);
+			free(e);
+		}
+	}
+}
+
+static int fdb_key(struct mock_request *r, struct mock_fdb_key *key)
+{
+	const struct ndmsg *nd = mnl_nlmsg_get_payload(r->nlh);
+	bool has_mac = false;
+	memset(key, 0, sizeof(*key));
+	if (!link_by_index(r->kernel, nd->ndm_ifindex))
+		return fail(r, ENODEV, "Interface does not exist");
+	key->ifindex = nd->ndm_ifindex;
+
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, r->nlh, sizeof(*nd)) {
+		uint16_t len = mnl_attr_get_payload_len(attr);
+		switch (mnl_attr_get_type(attr)) {
+		case NDA_LLADDR:
+			if (len != sizeof(key->mac))
+				return fail(r, EINVAL, "Invalid address");
+			memcpy(key->mac, mnl_attr_get_payload(attr), len);
+			has_mac = true;
+			break;
+		case NDA_DST:
+			if (len != LSDN_IPv4_LEN && len != LSDN_IPv6_LEN)
+				return fail(r, EINVAL, "Invalid destination");
+			memcpy(key->dst, mnl_attr_get_payload(attr), len);
+			key->dst_len = len;
+			break;
+		case NDA_SRC_VNI:
+			if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+				return fail(r, EINVAL, "Invalid VNI");
+			key->src_vni = mnl_attr_get_u32(attr);
+			break;
+		}
+	}
+	if (!has_mac)
+		return fail(r, EINVAL, "Address is required");
+	return 0;
+}
+
+static int fdb_new(struct mock_request *r)
+{
+	struct mock_fdb_key key;
+	struct mock_fdb *e;
+	int err;
+	if ((err = fdb_key(r, &key)))
+		return err;
+	HASH_FIND(hh, r->kernel->fdb, &key, sizeof(key), e);
+	if (e)
+		return (r->nlh->nlmsg_flags & NLM_F_EXCL) ? fail(r, EEXIST, "FDB entry already exists") : 0;
+	if (!(r->nlh->nlmsg_flags & NLM_F_CREATE))
+		return fail(r, ENOENT, "FDB entry not found");
+	if (r->nlh->nlmsg_flags & NLM_F_REPLACE) {
+		/* The address has a single destination (in the VNI), drop the previous one */
+		struct mock_fdb *tmp;
+		HASH_ITER(hh, r->kernel->fdb, e, tmp) {
+			if (e->key.ifindex == key.ifindex && e->key.src_vni == key.src_vni
+			    && !memcmp(e->key.mac, key.mac, sizeof(key.mac))) {
+				HASH_DELETE(hh, r->kernel->fdb, e);
+				free(e);
+			}
+		}
+	}
+	const struct ndmsg *nd = mnl_nlmsg_get_payload(r->nlh);
+	e = malloc(sizeof(*e));
+	if (!e)
+		return -ENOMEM;
+	e->key = key;
+	e->state = nd->ndm_state;
+	e->flags = nd->ndm_flags;
+	HASH_ADD(hh, r->kernel->fdb, key, sizeof(e->key), e);
+	return 0;
+}
+
+static int fdb_del(struct mock_request *r)
+{
+	struct mock_fdb_key key;
+	struct mock_fdb *e;
+	int err;
+	if ((err = fdb_key(r, &key)))
+		return err;
+	HASH_FIND(hh, r->kernel->fdb, &key, sizeof(key), e);
+	if (!e)
+		return fail(r, ENOENT, "FDB entry not found");
+	HASH_DELETE(hh, r->kernel->fdb, e);
+	free(e);
+	return 0;
+}
+
+static int fdb_get(struct mock_request *r)
+{
+	if (!(r->nlh->nlmsg_flags & NLM_F_DUMP))
+		return fail(r, EOPNOTSUPP, "Only FDB dumps are emulated");
+
+	struct mock_dump dump = {r, NULL};
+	char buf[MOCK_MSG_SIZE];
+	struct mock_fdb *e, *tmp;
+	HASH_ITER(hh, r->kernel->fdb, e, tmp) {
+		struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+		nlh->nlmsg_type = RTM_NEWNEIGH;
+		nlh->nlmsg_flags = NLM_F_MULTI;
+		nlh->nlmsg_seq = r->nlh->nlmsg_seq;
+		struct ndmsg *nd = mnl_nlmsg_put_extra_header(nlh, sizeof(*nd));
+		nd->ndm_family = PF_BRIDGE;
+		nd->ndm_ifindex = e->key.ifindex;
+		nd->ndm_state = e->state;
+		nd->ndm_flags = e->flags;
+		mnl_attr_put(nlh, NDA_LLADDR, sizeof(e->key.mac), e->key.mac);
+		if (e->key.dst_len)
+			mnl_attr_put(nlh, NDA_DST, e->key.dst_len, e->key.dst);
+		if (e->key.src_vni)
+			mnl_attr_put_u32(nlh, NDA_SRC_VNI, e->key.src_vni);
+		dump_put(&dump, nlh);
+	}
+	dump_done(&dump);
+	return 0;
+}
+
+/********* Bridge VLANs *********/
+
+static void vlan_flush(struct lsdn_mock_kernel *k, unsigned int ifindex)
+{
+	struct mock_vlan *v, *tmp;
+	HASH_ITER(hh, k->vlans, v, tmp) {
+		if (v->key.ifindex == ifindex) {
+			HASH_DELETE(hh, k->vlans, v);
+			free(v);
+		}
+	}
+}
+
+static struct mock_vlan *vlan_find(struct lsdn_mock_kernel *k, unsigned int ifindex, uint16_t vid)
+{
+	struct mock_vlan_key key;
+	struct mock_vlan *v;
+	memset(&key, 0, sizeof(key));
+	key.ifindex = ifindex;
+	key.vid = vid;
+	HASH_FIND(hh, k->vlans, &key, sizeof(key), v);
+	return v;
+}
+
+static int vlan_add(struct mock_request *r, struct mock_link *l, uint16_t vid, uint16_t flags)
+{
+	struct lsdn_mock_kernel *k = r->kernel;
+	struct mock_vlan *v = vlan_find(k, l->ifindex, vid);
+	if (!v) {
+		v = malloc(sizeof(*v));
+		if (!v)
+			return -ENOMEM;
+		memset(&v->key, 0, sizeof(v->key));
+		v->key.ifindex = l->ifindex;
+		v->key.vid = vid;
+		v->tunnel_id = 0;
+		HASH_ADD(hh, k->vlans, key, sizeof(v->key), v);
+	}
+	v->flags = flags & (BRIDGE_VLAN_INFO_PVID | BRIDGE_VLAN_INFO_UNTAGGED);
+	/* A port has a single PVID */
+	if (flags & BRIDGE_VLAN_INFO_PVID) {
+		struct mock_vlan *other, *tmp;
+		HASH_ITER(hh, k->vlans, other, tmp) {
+			if (other != v && other->key.ifindex == l->ifindex)
+				other->flags &= ~BRIDGE_VLAN_INFO_PVID;
+		}
+	}
+	return 0;
+}
+
+static void vlan_del(struct mock_request *r, struct mock_link *l, uint16_t vid)
+{
+	/* Like the kernel, ignore the VLANs the port is not in */
+	struct mock_vlan *v = vlan_find(r->kernel, l->ifindex, vid);
+	if (v) {
+		HASH_DELETE(hh, r->kernel->vlans, v);
+		free(v);
+	}
+}
+
+static int vlan_tunnel_change(struct mock_request *r, struct mock_link *l, const struct nlattr *info, bool add)
+{
+	uint32_t id = 0;
+	uint16_t vid = 0;
+	const struct nlattr *attr;
+	mnl_attr_for_each_nested(attr, info) {
+		if (mnl_attr_get_type(attr) == IFLA_BRIDGE_VLAN_TUNNEL_ID)
+			id = mnl_attr_get_u32(attr);
+		else if (mnl_attr_get_type(attr) == IFLA_BRIDGE_VLAN_TUNNEL_VID)
+			vid = mnl_attr_get_u16(attr);
+	}
+	if (!id || !vid)
+		return fail(r, EINVAL, "Tunnel ID and VLAN are required");
+	struct mock_vlan *v = vlan_find(r->kernel, l->ifindex, vid);
+	if (!v)
+		return fail(r, ENOENT, "VLAN does not exist");
+	if (!add) {
+		v->tunnel_id = 0;
+		return 0;
+	}
+	struct mock_vlan *other, *tmp;
+	HASH_ITER(hh, r->kernel->vlans, other, tmp) {
+		if (other != v && other->key.ifindex == l->ifindex && other->tunnel_id == id)
+			return fail(r, EEXIST, "Tunnel ID is mapped to another VLAN");
+	}
+	v->tunnel_id = id;
+	return 0;
+}
+
+/* Process the VLAN and tunnel entries of IFLA_AF_SPEC in order, like the kernel */
+static int vlan_afspec(struct mock_request *r, struct mock_link *l, const struct nlattr *afspec, bool add)
+{
+	const struct nlattr *attr;
+	uint16_t range_begin = 0;
+	int err;
+	mnl_attr_for_each_nested(attr, afspec) {
+		switch (mnl_attr_get_type(attr)) {
+		case IFLA_BRIDGE_VLAN_INFO: {
+			if (mnl_attr_get_payload_len(attr) != sizeof(struct bridge_vlan_info))
+				return fail(r, EINVAL, "Invalid VLAN info");
+			const struct bridge_vlan_info *vinfo = mnl_attr_get_payload(attr);
+			if (vinfo->vid < 1 || vinfo->vid > 4094)
+				return fail(r, EINVAL, "Invalid VLAN ID");
+			if (vinfo->flags & BRIDGE_VLAN_INFO_RANGE_BEGIN) {
+				range_begin = vinfo->vid;
+				continue;
+			}
+			uint16_t first = vinfo->vid;
+			if (vinfo->flags & BRIDGE_VLAN_INFO_RANGE_END) {
+				if (!range_begin || range_begin > vinfo->vid)
+					return fail(r, EINVAL, "Invalid VLAN range");
+				first = range_begin;
+				range_begin = 0;
+			}
+			for (uint32_t vid = first; vid <= vinfo->vid; vid++) {
+				if (!add)
+					vlan_del(r, l, vid);
+				else if ((err = vlan_add(r, l, vid, vinfo->flags)))
+					return err;
+			}
+			break;
+		}
+		case IFLA_BRIDGE_VLAN_TUNNEL_INFO:
+			if ((err = vlan_tunnel_change(r, l, attr, add)))
+				return err;
+			break;
+		}
+	}
+	return 0;
+}
+
+static struct mock_link *bridge_port(struct mock_request *r)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(r->nlh);
+	struct mock_link *l = link_by_index(r->kernel, ifm->ifi_index);
+	if (!l || !l->master)
+		return NULL;
+	struct mock_link *br = link_by_index(r->kernel, l->master);
+	if (!br || strcmp(br->kind, "bridge") != 0)
+		return NULL;
+	return l;
+}
+
+/** Change the port settings and add the VLANs, `RTM_SETLINK` of the bridge family. Only the
+ * ports are emulated, not the bridge itself (the `self` flag). */
+static int bridge_setlink(struct mock_request *r)
+{
+	struct mock_link *l = bridge_port(r);
+	if (!l)
+		return fail(r, EOPNOTSUPP, "Not a bridge port");
+	const struct nlattr *attr, *port;
+	int err;
+	mnl_attr_for_each(attr, r->nlh, sizeof(struct ifinfomsg)) {
+		switch (mnl_attr_get_type(attr)) {
+		case IFLA_PROTINFO:
+			mnl_attr_for_each_nested(port, attr) {
+				if (mnl_attr_get_type(port) == IFLA_BRPORT_VLAN_TUNNEL)
+					l->vlan_tunnel = mnl_attr_get_u8(port);
+			}
+			break;
+		case IFLA_AF_SPEC:
+			if ((err = vlan_afspec(r, l, attr, true)))
+				return err;
+			break;
+		}
+	}
+	return 0;
+}
+
+/** Remove the VLANs, `RTM_DELLINK` of the bridge family. */
+static int bridge_dellink(struct mock_request *r)
+{
+	struct mock_link *l = bridge_port(r);
+	if (!l)
+		return fail(r, EOPNOTSUPP, "Not a bridge port");
+	const struct nlattr *attr;
+	int err;
+	mnl_attr_for_each(attr, r->nlh, sizeof(struct ifinfomsg)) {
+		if (mnl_attr_get_type(attr) == IFLA_AF_SPEC && (err = vlan_afspec(r, l, attr, false)))
+			return err;
+	}
+	return 0;
+}
+
+static int link_family(const struct nlmsghdr *nlh)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	return ifm->ifi_family;
+}
+
+/********* Shared actions *********/
+
+/** Attribute with the parameters of the action kinds that can be shared. All the parameter
+ * structures start with the index. */
+static const struct {
+	const char *kind;
+	uint16_t parms_attr;
+} shared_kinds[] = {
+	{"tunnel_key", TCA_TUNNEL_KEY_PARMS},
+	{"police", TCA_POLICE_TBF}
+};
+
+/* Attribute with the actions of the filter kind, 0 if the kind has none */
+static uint16_t filter_actions_attr(const char *kind)
+{
+	if (strcmp(kind, "flower") == 0)
+		return TCA_FLOWER_ACT;
+	if (strcmp(kind, "fw") == 0)
+		return TCA_FW_ACT;
+	if (strcmp(kind, "bpf") == 0)
+		return TCA_BPF_ACT;
+	return 0;
+}
+
+/* Parse a single action (the nest in `TCA_ACT_TAB` or filter actions). The parameters are only
+ * returned for the kinds that can be shared, `index` is taken from `TCA_ACT_INDEX` or from them. */
+static int parse_action(
+	struct mock_request *r, const struct nlattr *act, struct mock_action_key *key,
+	const struct nlattr **parms)
+{
+	const struct nlattr *attr, *opt;
+	const struct nlattr *options = NULL;
+	memset(key, 0, sizeof(*key));
+	*parms = NULL;
+	mnl_attr_for_each_nested(attr, act) {
+		switch (mnl_attr_get_type(attr)) {
+		case TCA_ACT_KIND: {
+			/* The kind may come without the terminating zero */
+			size_t len = strnlen(mnl_attr_get_str(attr), mnl_attr_get_payload_len(attr));
+			if (len == 0 || len >= sizeof(key->kind))
+				return fail(r, EINVAL, "Invalid action kind");
+			memcpy(key->kind, mnl_attr_get_str(attr), len);
+			break;
+		}
+		case TCA_ACT_INDEX:
+			if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+				return fail(r, EINVAL, "Invalid action index");
+			key->index = mnl_attr_get_u32(attr);
+			break;
+		case TCA_ACT_OPTIONS:
+			options = attr;
+			break;
+		}
+	}
+	if (!key->kind[0])
+		return fail(r, EINVAL, "Action kind is required");
+	for (size_t i = 0; i < sizeof(shared_kinds) / sizeof(*shared_kinds); i++) {
+		if (strcmp(key->kind, shared_kinds[i].kind) != 0 || !options)
+			continue;
+		mnl_attr_for_each_nested(opt, options) {
+			if (mnl_attr_get_type(opt) != shared_kinds[i].parms_attr)
+				continue;
+			if (mnl_attr_get_payload_len(opt) < sizeof(uint32_t))
+				return fail(r, EINVAL, "Invalid action parameters");
+			*parms = opt;
+			key->index = *(const uint32_t *) mnl_attr_get_payload(opt);
+		}
+	}
+	return 0;
+}
+
+/* The `TCA_ACT_TAB` attribute of an action request */
+static const struct nlattr *action_tab(struct mock_request *r)
+{
+	const struct nlattr *attr;
+	mnl_attr_for_each(attr, r->nlh, sizeof(struct tcamsg)) {
+		if (mnl_attr_get_type(attr) == TCA_ACT_TAB)
+			return attr;
+	}
+	return NULL;
+}
+
+/* Find the shared actions the filter refers to. The actions with a zero index are created
+ * for the filter alone and are not tracked. */
+static int find_shared_actions(
+	struct mock_request *r, const char *kind, struct mock_action **shared, size_t *count)
+{
+	uint16_t acts_attr = filter_actions_attr(kind);
+	const struct nlattr *attr, *opt, *act;
+	*count = 0;
+	if (!acts_attr)
+		return 0;
+	mnl_attr_for_each(attr, r->nlh, sizeof(struct tcmsg)) {
+		if (mnl_attr_get_type(attr) != TCA_OPTIONS)
+			continue;
+		mnl_attr_for_each_nested(opt, attr) {
+			if (mnl_attr_get_type(opt) != acts_attr)
+				continue;
+			mnl_attr_for_each_nested(act, opt) {
+				struct mock_action_key key;
+				const struct nlattr *parms;
+				int err = parse_action(r, act, &key, &parms);
+				if (err)
+					return err;
+				if (!parms || !key.index)
+					continue;
+				struct mock_action *a;
+				HASH_FIND(hh, r->kernel->actions, &key, sizeof(key), a);
+				if (!a)
+					return fail(r, ENOENT, "Shared action with the index not found");
+				if (*count == MOCK_FILTER_SHARED)
+					return fail(r, E2BIG, "Too many shared actions in a filter");
+				shared[(*count)++] = a;
+			}
+		}
+	}
+	return 0;
+}
+
+static int action_new(struct mock_request *r)
+{
+	const struct nlattr *tab = action_tab(r), *act;
+	if (!tab)
+		return fail(r, EINVAL, "Actions are required");
+	mnl_attr_for_each_nested(act, tab) {
+		struct mock_action_key key;
+		const struct nlattr *parms;
+		int err = parse_action(r, act, &key, &parms);
+		if (err)
+			return err;
+		if (!parms || !key.index)
+			return fail(r, EOPNOTSUPP, "Only shared actions with an index are emulated");
+		if (mnl_attr_get_payload_len(parms) > MOCK_ACTION_PARMS)
+			return fail(r, EINVAL, "Invalid action parameters");
+
+		struct mock_action *a;
+		HASH_FIND(hh, r->kernel->actions, &key, sizeof(key), a);
+		if (a && !(r->nlh->nlmsg_flags & NLM_F_REPLACE))
+			return fail(r, EEXIST, "Action already exists");
+		if (!a) {
+			a = malloc(sizeof(*a));
+			if (!a)
+				return -ENOMEM;
+			a->key = key;
+			a->binds = 0;
+			HASH_ADD(hh, r->kernel->actions, key, sizeof(a->key), a);
+		}
+		a->parms_len = mnl_attr_get_payload_len(parms);
+		memcpy(a->parms, mnl_attr_get_payload(parms), a->parms_len);
+	}
+	return 0;
+}
+
+static int action_del(struct mock_request *r)
+{
+	const struct nlattr *tab = action_tab(r), *act;
+	if (!tab)
+		return fail(r, EINVAL, "Actions are required");
+	mnl_attr_for_each_nested(act, tab) {
+		struct mock_action_key key;
+		const struct nlattr *parms;
+		int err = parse_action(r, act, &key, &parms);
+		if (err)
+			return err;
+		struct mock_action *a;
+		HASH_FIND(hh, r->kernel->actions, &key, sizeof(key), a);
+		if (!a)
+			return fail(r, ENOENT, "Action with the index not found");
+		if (a->binds)
+			return fail(r, EPERM, "Action is still bound to a filter");
+		HASH_DELETE(hh, r->kernel->actions, a);
+		free(a);
+	}
+	return 0;
+}
+
+static int action_get(struct mock_request *r)
+{
+	if (!(r->nlh->nlmsg_flags & NLM_F_DUMP))
+		return fail(r, EOPNOTSUPP, "Only action dumps are emulated");
+	const struct nlattr *tab = action_tab(r), *act;
+	struct mock_action_key filter;
+	memset(&filter, 0, sizeof(filter));
+	if (tab) {
+		mnl_attr_for_each_nested(act, tab) {
+			const struct nlattr *parms;
+			int err = parse_action(r, act, &filter, &parms);
+			if (err)
+				return err;
+		}
+	}
+	if (!filter.kind[0])
+		return fail(r, EINVAL, "Action kind is required");
+
+	struct mock_dump dump = {r, NULL};
+	char buf[MOCK_MSG_SIZE];
+	struct mock_action *a, *tmp;
+	HASH_ITER(hh, r->kernel->actions, a, tmp) {
+		if (strcmp(a->key.kind, filter.kind) != 0)
+			continue;
+		uint16_t parms_attr = 0;
+		for (size_t i = 0; i < sizeof(shared_kinds) / sizeof(*shared_kinds); i++) {
+			if (strcmp(a->key.kind, shared_kinds[i].kind) == 0)
+				parms_attr = shared_kinds[i].parms_attr;
+		}
+		struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+		nlh->nlmsg_type = RTM_NEWACTION;
+		nlh->nlmsg_flags = NLM_F_MULTI;
+		nlh->nlmsg_seq = r->nlh->nlmsg_seq;
+		struct tcamsg *tca = mnl_nlmsg_put_extra_header(nlh, sizeof(*tca));
+		tca->tca_family = AF_UNSPEC;
+		struct nlattr *out_tab = mnl_attr_nest_start(nlh, TCA_ACT_TAB);
+		struct nlattr *out_act = mnl_attr_nest_start(nlh, 1);
+		mnl_attr_put_strz(nlh, TCA_ACT_KIND, a->key.kind);
+		struct nlattr *options = mnl_attr_nest_start(nlh, TCA_ACT_OPTIONS);
+		mnl_attr_put(nlh, parms_attr, a->parms_len, a->parms);
+		mnl_attr_nest_end(nlh, options);
+		mnl_attr_nest_end(nlh, out_act);
+		mnl_attr_nest_end(nlh, out_tab);
+		dump_put(&dump, nlh);
+	}
+	r->msg = NULL;
+	dump_done(&dump);
+	return 0;
+}
+
+/********* Request processing *********/
+
+/* Minimal payload size of the request types */
+static size_t payload_size(uint16_t type)
+{
+	switch (type) {
+	case RTM_NEWLINK: case RTM_DELLINK: case RTM_GETLINK: case RTM_SETLINK:
+		return sizeof(struct ifinfomsg);
+	case RTM_NEWADDR: case RTM_DELADDR:
+		return sizeof(struct ifaddrmsg);
+	case RTM_NEWQDISC: case RTM_DELQDISC:
+	case RTM_NEWTCLASS: case RTM_DELTCLASS:
+	case RTM_NEWTFILTER: case RTM_DELTFILTER: case RTM_GETTFILTER:
+		return sizeof(struct tcmsg);
+	case RTM_NEWNEIGH: case RTM_DELNEIGH: case RTM_GETNEIGH:
+		return sizeof(struct ndmsg);
+	case RTM_NEWACTION: case RTM_DELACTION: case RTM_GETACTION:
+		return sizeof(struct tcamsg);
+	default:
+		return 0;
+	}
+}
+
+static void process_request(struct mock_transport *mt, enum lsdn_nl_channel ch, const struct nlmsghdr *nlh)
+{
+	struct mock_request r = {mt->kernel, mt, ch, nlh, NULL};
+	int err;
+	if (nlh->nlmsg_len < NLMSG_LENGTH(payload_size(nlh->nlmsg_type))) {
+		err = fail(&r, EINVAL, "Truncated request");
+	} else {
+		switch (nlh->nlmsg_type) {
+		case RTM_NEWLINK: err = link_new(&r); break;
+		case RTM_DELLINK:
+			err = link_family(nlh) == PF_BRIDGE ? bridge_dellink(&r) : link_del(&r);
+			break;
+		case RTM_SETLINK:
+			err = link_family(nlh) == PF_BRIDGE ? bridge_setlink(&r) : link_new(&r);
+			break;
+		case RTM_GETLINK: err = link_get(&r); break;
+		case RTM_NEWADDR: err = addr_change(&r); break;
+		case RTM_DELADDR: err = addr_change(&r); break;
+		case RTM_NEWQDISC: err = qdisc_new(&r); break;
+		case RTM_DELQDISC: err = qdisc_del(&r); break;
+		case RTM_NEWTCLASS: err = class_new(&r); break;
+		case RTM_DELTCLASS: err = class_del(&r); break;
+		case RTM_NEWTFILTER: err = filter_new(&r); break;
+		case RTM_DELTFILTER: err = filter_del(&r); break;
+		case RTM_GETTFILTER: err = filter_get(&r); break;
+		case RTM_NEWNEIGH: err = fdb_new(&r); break;
+		case RTM_DELNEIGH: err = fdb_del(&r); break;
+		case RTM_GETNEIGH: err = fdb_get(&r); break;
+		case RTM_NEWACTION: err = action_new(&r); break;
+		case RTM_DELACTION: err = action_del(&r); break;
+		case RTM_GETACTION: err = action_get(&r); break;
+		default: err = fail(&r, EOPNOTSUPP, "Request is not emulated"); break;
+		}
+	}
+	if (err || (nlh->nlmsg_flags & NLM_F_ACK))
+		reply_ack(&r, err);
+}
+
+/********* Transport *********/
+
+static int mock_open(struct lsdn_nl_transport *t, enum lsdn_nl_channel ch)
+{
+	struct mock_transport *mt = (struct mock_transport *) t;
+	mt->open[ch] = true;
+	return 0;
+}
+
+static ssize_t mock_send(
+	struct lsdn_nl_transport *t, enum lsdn_nl_channel ch, const void *buf, size_t len)
+{
+	struct mock_transport *mt = (struct mock_transport *) t;
+	if (!mt->open[ch]) {
+		errno = EBADF;
+		return -1;
+	}
+	const struct nlmsghdr *nlh = buf;
+	int left = len;
+	pthread_mutex_lock(&mt->kernel->lock);
+	while (mnl_nlmsg_ok(nlh, left)) {
+		process_request(mt, ch, nlh);
+		nlh = mnl_nlmsg_next(nlh, &left);
+	}
+	pthread_mutex_unlock(&mt->kernel->lock);
+	return len;
+}
+
+/* Take the next datagram, the responses are always ready, so there is no point waiting.
+ * Must be called with the kernel lock held, link notifications are queued by other threads. */
+static struct mock_datagram *mock_take(struct mock_transport *mt, enum lsdn_nl_channel ch)
+{
+	struct mock_queue *q = &mt->queues[ch];
+	if (!mt->open[ch]) {
+		errno = EBADF;
+		return NULL;
+	}
+	if (q->overflow) {
+		q->overflow = false;
+		errno = ENOBUFS;
+		return NULL;
+	}
+	struct mock_datagram *d = queue_pop(q);
+	if (!d)
+		errno = EAGAIN;
+	return d;
+}
+
+static ssize_t mock_recv(
+	struct lsdn_nl_transport *t, enum lsdn_nl_channel ch, void *buf, size_t len, bool wait)
+{
+	LSDN_UNUSED(wait);
+	struct mock_transport *mt = (struct mock_transport *) t;
+	pthread_mutex_lock(&mt->kernel->lock);
+	struct mock_datagram *d = mock_take(mt, ch);
+	pthread_mutex_unlock(&mt->kernel->lock);
+	if (!d)
+		return -1;
+	ssize_t ret = d->len;
+	if (d->len > len) {
+		errno = ENOSPC;
+		ret = -1;
+	} else {
+		memcpy(buf, d->data, d->len);
+	}
+	free(d);
+	return ret;
+}
+
+static int mock_recv_many(struct lsdn_nl_transport *t, struct mmsghdr *msgs, unsigned int count)
+{
+	struct mock_transport *mt = (struct mock_transport *) t;
+	unsigned int n;
+	pthread_mutex_lock(&mt->kernel->lock);
+	for (n = 0; n < count; n++) {
+		if (n > 0 && !mt->queues[LSDN_NL_REQUESTS].head)
+			break;
+		struct mock_datagram *d = mock_take(mt, LSDN_NL_REQUESTS);
+		if (!d) {
+			pthread_mutex_unlock(&mt->kernel->lock);
+			return n > 0 ? (int) n : -1;
+		}
+		/* Truncated like a datagram socket would do it */
+		struct iovec *iov = msgs[n].msg_hdr.msg_iov;
+		size_t len = d->len < iov->iov_len ? d->len : iov->iov_len;
+		memcpy(iov->iov_base, d->data, len);
+		msgs[n].msg_len = len;
+		free(d);
+	}
+	pthread_mutex_unlock(&mt->kernel->lock);
+	return n;
+}
+
+static int mock_bpf(struct lsdn_nl_transport *t, int cmd, union bpf_attr *attr, unsigned int size)
+{
+	struct mock_transport *mt = (struct mock_transport *) t;
+	if (size < sizeof(*attr)) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&mt->kernel->lock);
+	int ret = bpf_command(mt->kernel, cmd, attr);
+	pthread_mutex_unlock(&mt->kernel->lock);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+static void mock_close_fd(struct lsdn_nl_transport *t, int fd)
+{
+	struct mock_transport *mt = (struct mock_transport *) t;
+	pthread_mutex_lock(&mt->kernel->lock);
+	struct mock_bpf *b;
+	HASH_FIND_INT(mt->kernel->bpf, &fd, b);
+	if (b)
+		bpf_remove(mt->kernel, b);
+	pthread_mutex_unlock(&mt->kernel->lock);
+}
+
+static void mock_free(struct lsdn_nl_transport *t)
+{
+	struct mock_transport *mt = (struct mock_transport *) t;
+	pthread_mutex_lock(&mt->kernel->lock);
+	for (int ch = 0; ch < LSDN_NL_CHANNEL_COUNT; ch++)
+		queue_clear(&mt->queues[ch]);
+	lsdn_list_remove(&mt->kernel_entry);
+	pthread_mutex_unlock(&mt->kernel->lock);
+	free(mt);
+}
+
+static const struct lsdn_nl_transport_ops mock_transport_ops = {
+	.open = mock_open,
+	.send = mock_send,
+	.recv = mock_recv,
+	.recv_many = mock_recv_many,
+	.bpf = mock_bpf,
+	.close_fd = mock_close_fd,
+	.free = mock_free
+};
+
+/** Create a transport talking to the emulated kernel.
+ * The kernel must outlive the transport. */
+struct lsdn_nl_transport *lsdn_mock_transport_new(struct lsdn_mock_kernel *k)
+{
+	struct mock_transport *mt = malloc(sizeof(*mt));
+	if (!mt)
+		return NULL;
+	mt->t.ops = &mock_transport_ops;
+	mt->kernel = k;
+	for (int ch = 0; ch < LSDN_NL_CHANNEL_COUNT; ch++) {
+		mt->open[ch] = false;
+		mt->queues[ch].head = NULL;
+		mt->queues[ch].tail = NULL;
+		mt->queues[ch].overflow = false;
+	}
+	pthread_mutex_lock(&k->lock);
+	lsdn_list_init_add(&k->transports, &mt->kernel_entry);
+	pthread_mutex_unlock(&k->lock);
+	return &mt->t;
+}
+
+/********* Kernel *********/
+
+/** Create an emulated kernel without any links. */
+struct lsdn_mock_kernel *lsdn_mock_kernel_new(void)
+{
+	struct lsdn_mock_kernel *k = malloc(sizeof(*k));
+	if (!k)
+		return NULL;
+	k->refs = 1;
+	/* Index 1 is usually the loopback */
+	k->next_ifindex = 2;
+	k->links_created = 0;
+	k->qdiscs_created = 0;
+	k->filters_created = 0;
+	k->links_by_index = NULL;
+	k->links_by_name = NULL;
+	k->qdiscs = NULL;
+	k->classes = NULL;
+	k->chains = NULL;
+	k->prios = NULL;
+	k->filters = NULL;
+	k->fdb = NULL;
+	k->vlans = NULL;
+	k->actions = NULL;
+	k->bpf = NULL;
+	k->next_fd = MOCK_FIRST_FD;
+	lsdn_list_init(&k->transports);
+	pthread_mutex_init(&k->lock, NULL);
+	return k;
+}
+
+/** Take another reference to the emulated kernel, it is freed by the last #lsdn_mock_kernel_free.
+ * @return The kernel. */
+struct lsdn_mock_kernel *lsdn_mock_kernel_ref(struct lsdn_mock_kernel *k)
+{
+	pthread_mutex_lock(&k->lock);
+	k->refs++;
+	pthread_mutex_unlock(&k->lock);
+	return k;
+}
+
+/** Drop a reference to the emulated kernel, the last one frees it with all its tables.
+ * All transports using the kernel must be already freed then. */
+void lsdn_mock_kernel_free(struct lsdn_mock_kernel *k)
+{
+	if (!k)
+		return;
+	pthread_mutex_lock(&k->lock);
+	bool last = --k->refs == 0;
+	pthread_mutex_unlock(&k->lock);
+	if (!last)
+		return;
+	assert(lsdn_is_list_empty(&k->transports));
+	while (k->links_by_index)
+		link_remove(k, k->links_by_index);
+	while (k->bpf)
+		bpf_remove(k, k->bpf);
+	struct mock_action *a, *tmp;
+	HASH_ITER(hh, k->actions, a, tmp) {
+		HASH_DELETE(hh, k->actions, a);
+		free(a);
+	}
+	lsdn_list_init(&k->transports);
+	pthread_mutex_destroy(&k->lock);
+	free(k);
+}
+
+/** Add a link (of the dummy kind, up) to the emulated kernel.
+ * Used to create the interfaces that LSDN expects to exist, like the phys interfaces and virts.
+ * @retval LSDNE_OK The link was added.
+ * @retval LSDNE_DUPLICATE A link with the same name already exists.
+ * @retval LSDNE_NOMEM */
+lsdn_err_t lsdn_mock_kernel_add_link(struct lsdn_mock_kernel *k, const char *name)
+{
+	if (strlen(name) >= IF_NAMESIZE)
+		return LSDNE_PARSE;
+	lsdn_err_t err = LSDNE_OK;
+	pthread_mutex_lock(&k->lock);
+	struct mock_link *l = NULL;
+	if (link_by_name(k, name))
+		err = LSDNE_DUPLICATE;
+	else if (!(l = link_add(k, name, "dummy")))
+		err = LSDNE_NOMEM;
+	if (l) {
+		l->up = true;
+		notify_link(k, l, RTM_NEWLINK);
+	}
+	pthread_mutex_unlock(&k->lock);
+	return err;
+}
+
+/** Count the objects in the emulated kernel tables. */
+void lsdn_mock_kernel_get_state(struct lsdn_mock_kernel *k, struct lsdn_mock_state *state)
+{
+	pthread_mutex_lock(&k->lock);
+	state->links = HASH_CNT(hh_index, k->links_by_index);
+	state->qdiscs = HASH_COUNT(k->qdiscs);
+	state->classes = HASH_COUNT(k->classes);
+	state->chains = HASH_COUNT(k->chains);
+	state->filters = HASH_COUNT(k->filters);
+	state->fdb_entries = HASH_COUNT(k->fdb);
+	state->vlans = HASH_COUNT(k->vlans);
+	state->vlan_tunnels = 0;
+	struct mock_vlan *v, *vtmp;
+	HASH_ITER(hh, k->vlans, v, vtmp) {
+		if (v->tunnel_id)
+			state->vlan_tunnels++;
+	}
+	state->actions = HASH_COUNT(k->actions);
+	state->links_created = k->links_created;
+	state->qdiscs_created = k->qdiscs_created;
+	state->filters_created = k->filters_created;
+	state->bpf_maps = 0;
+	state->bpf_progs = 0;
+	state->bpf_map_entries = 0;
+	struct mock_bpf *b, *tmp;
+	HASH_ITER(hh, k->bpf, b, tmp) {
+		if (b->type == MOCK_BPF_MAP) {
+			state->bpf_maps++;
+			state->bpf_map_entries += HASH_COUNT(b->entries);
+		} else {
+			state->bpf_progs++;
+		}
+	}
+	pthread_mutex_unlock(&k->lock);
+}
@@ -0,0 +1,819 @@
+/** \file
+ * Recording netlink transport (see private/nlrecord.h). */
+#define _GNU_SOURCE /* struct mmsghdr */
+#include "private/nlrecord.h"
+#include "include/util.h"
+#include <sys/socket.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/tc_act/tc_tunnel_key.h>
+#include <linux/neighbour.h>
+#include <linux/veth.h>
+#include <linux/if_bridge.h>
+#include <stdio.h>
+#include <errno.h>
+
+/** Maximum size of a made-up response (ACK or link notification). */
+#define RECORD_MSG_SIZE 1024
+/** MTU announced for the created links, unless the request sets it. */
+#define RECORD_DEFAULT_MTU 1500
+/** Number of operations the plan is allocated for at first. */
+#define RECORD_INITIAL_OPS 64
+/** File descriptor of the first made-up BPF map or program. */
+#define RECORD_FIRST_FD 0x40000000
+/** Number of key bytes shown in the summary of a BPF map operation. */
+#define RECORD_BPF_KEY_SHOWN 16
+
+/** A link that would be created by the plan. */
+struct record_link {
+	unsigned int ifindex;
+	char name[IF_NAMESIZE];
+	unsigned int mtu;
+	UT_hash_handle hh;
+};
+
+/** A BPF map that would be created by the plan. */
+struct record_map {
+	int fd;
+	uint32_t key_size;
+	UT_hash_handle hh;
+};
+
+struct record_datagram {
+	struct record_datagram *next;
+	size_t len;
+	char data[];
+};
+
+/** Made-up responses waiting to be received, they are returned before the responses of the
+ * underlying transport. */
+struct record_queue {
+	struct record_datagram *head;
+	struct record_datagram *tail;
+};
+
+struct record_transport {
+	struct lsdn_nl_transport t;
+	struct lsdn_nl_transport *inner;
+	struct lsdn_plan *plan;
+	/** Number of operations the plan has space for. */
+	size_t plan_size;
+	unsigned int next_ifindex;
+	/** Created links, by ifindex. */
+	struct record_link *links;
+	int next_fd;
+	/** Created BPF maps, by file descriptor. */
+	struct record_map *maps;
+	struct record_queue queues[LSDN_NL_CHANNEL_COUNT];
+};
+
+/********* Made-up responses *********/
+
+static bool queue_push(struct record_queue *q, const struct nlmsghdr *nlh)
+{
+	struct record_datagram *d = malloc(sizeof(*d) + nlh->nlmsg_len);
+	if (!d)
+		return false;
+	memcpy(d->data, nlh, nlh->nlmsg_len);
+	d->len = nlh->nlmsg_len;
+	d->next = NULL;
+	if (q->tail)
+		q->tail->next = d;
+	else
+		q->head = d;
+	q->tail = d;
+	return true;
+}
+
+static struct record_datagram *queue_pop(struct record_queue *q)
+{
+	struct record_datagram *d = q->head;
+	if (d) {
+		q->head = d->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	return d;
+}
+
+static bool queue_ack(struct record_transport *rt, const struct nlmsghdr *req)
+{
+	if (!(req->nlmsg_flags & NLM_F_ACK))
+		return true;
+	char buf[RECORD_MSG_SIZE];
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = NLMSG_ERROR;
+	nlh->nlmsg_flags = NLM_F_CAPPED;
+	nlh->nlmsg_seq = req->nlmsg_seq;
+	struct nlmsgerr *e = mnl_nlmsg_put_extra_header(nlh, sizeof(*e));
+	e->error = 0;
+	e->msg = *req;
+	return queue_push(&rt->queues[LSDN_NL_REQUESTS], nlh);
+}
+
+/* Announce a link change on the link channel, the way the kernel does it. */
+static bool queue_link_notification(
+	struct record_transport *rt, const struct record_link *l, uint16_t type)
+{
+	char buf[RECORD_MSG_SIZE];
+	struct nlmsghdr *nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	struct ifinfomsg *ifm = mnl_nlmsg_put_extra_header(nlh, sizeof(*ifm));
+	ifm->ifi_family = AF_UNSPEC;
+	ifm->ifi_index = l->ifindex;
+	mnl_attr_put_strz(nlh, IFLA_IFNAME, l->name);
+	mnl_attr_put_u32(nlh, IFLA_MTU, l->mtu);
+	return queue_push(&rt->queues[LSDN_NL_LINKS], nlh);
+}
+
+static void queue_clear(struct record_queue *q)
+{
+	struct record_datagram *d;
+	while ((d = queue_pop(q)))
+		free(d);
+}
+
+/********* Recording *********/
+
+static bool link_add(struct record_transport *rt, const char *name, unsigned int mtu,
+	unsigned int *ifindex)
+{
+	struct record_link *l = malloc(sizeof(*l));
+	if (!l)
+		return false;
+	l->ifindex = rt->next_ifindex++;
+	strncpy(l->name, name, sizeof(l->name) - 1);
+	l->name[sizeof(l->name) - 1] = 0;
+	l->mtu = mtu ? mtu : RECORD_DEFAULT_MTU;
+	HASH_ADD(hh, rt->links, ifindex, sizeof(l->ifindex), l);
+	*ifindex = l->ifindex;
+	return queue_link_notification(rt, l, RTM_NEWLINK);
+}
+
+static void link_remove(struct record_transport *rt, unsigned int ifindex)
+{
+	struct record_link *l;
+	HASH_FIND(hh, rt->links, &ifindex, sizeof(ifindex), l);
+	if (l) {
+		HASH_DELETE(hh, rt->links, l);
+		free(l);
+	}
+}
+
+static void format_handle(char *buf, size_t size, uint32_t handle)
+{
+	snprintf(buf, size, "%x:%x", TC_H_MAJ(handle) >> 16, TC_H_MIN(handle));
+}
+
+/** Attributes of a link being created. */
+struct link_create_attrs {
+	const char *name;
+	const char *kind;
+	unsigned int mtu;
+	/** `VETH_INFO_PEER`, the peer description starts with its own ifinfomsg. */
+	const struct nlattr *peer;
+};
+
+static void parse_link_create(const struct nlattr *attr, struct link_create_attrs *a)
+{
+	const struct nlattr *info, *data;
+	switch (mnl_attr_get_type(attr)) {
+	case IFLA_IFNAME:
+		if (mnl_attr_validate(attr, MNL_TYPE_STRING) >= 0)
+			a->name = mnl_attr_get_str(attr);
+		break;
+	case IFLA_MTU:
+		if (mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+			a->mtu = mnl_attr_get_u32(attr);
+		break;
+	case IFLA_LINKINFO:
+		mnl_attr_for_each_nested(info, attr) {
+			uint16_t type = mnl_attr_get_type(info);
+			if (type == IFLA_INFO_KIND && mnl_attr_validate(info, MNL_TYPE_STRING) >= 0) {
+				a->kind = mnl_attr_get_str(info);
+			} else if (type == IFLA_INFO_DATA) {
+				mnl_attr_for_each_nested(data, info) {
+					if (mnl_attr_get_type(data) == VETH_INFO_PEER)
+						a->peer = data;
+				}
+			}
+		}
+		break;
+	}
+}
+
+static bool record_link_create(
+	struct record_transport *rt, const struct nlmsghdr *nlh, struct lsdn_plan_op *op)
+{
+	struct link_create_attrs a = {"", "", 0, NULL};
+	struct link_create_attrs peer = {NULL, NULL, 0, NULL};
+	const struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(struct ifinfomsg))
+		parse_link_create(attr, &a);
+	if (a.peer && mnl_attr_get_payload_len(a.peer) >= sizeof(struct ifinfomsg)) {
+		const char *payload = (const char *) mnl_attr_get_payload(a.peer) + sizeof(struct ifinfomsg);
+		size_t payload_len = mnl_attr_get_payload_len(a.peer) - sizeof(struct ifinfomsg);
+		mnl_attr_for_each_payload(attr, payload, payload_len)
+			parse_link_create(attr, &peer);
+	}
+
+	op->type = LSDN_PLAN_LINK_CREATE;
+	if (!link_add(rt, a.name, a.mtu, &op->ifindex))
+		return false;
+	unsigned int peer_ifindex;
+	if (peer.name && !link_add(rt, peer.name, peer.mtu, &peer_ifindex))
+		return false;
+	snprintf(op->summary, sizeof(op->summary), "create %s link %s%s%s",
+		a.kind, a.name, peer.name ? " peer " : "", peer.name ? peer.name : "");
+	return true;
+}
+
+static void record_link_change(const struct nlmsghdr *nlh, struct lsdn_plan_op *op)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	int len = snprintf(op->summary, sizeof(op->summary), "change link %u", ifm->ifi_index);
+	op->type = LSDN_PLAN_LINK_CHANGE;
+	op->ifindex = ifm->ifi_index;
+	if (ifm->ifi_change & IFF_UP)
+		len += snprintf(op->summary + len, sizeof(op->summary) - len, " %s",
+			(ifm->ifi_flags & IFF_UP) ? "up" : "down");
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(*ifm)) {
+		if ((size_t) len >= sizeof(op->summary))
+			break;
+		if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+			continue;
+		if (mnl_attr_get_type(attr) == IFLA_MASTER)
+			len += snprintf(op->summary + len, sizeof(op->summary) - len,
+				" master %u", mnl_attr_get_u32(attr));
+		else if (mnl_attr_get_type(attr) == IFLA_MTU)
+			len += snprintf(op->summary + len, sizeof(op->summary) - len,
+				" mtu %u", mnl_attr_get_u32(attr));
+	}
+}
+
+static bool record_link_delete(
+	struct record_transport *rt, const struct nlmsghdr *nlh, struct lsdn_plan_op *op)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	op->type = LSDN_PLAN_LINK_DELETE;
+	op->ifindex = ifm->ifi_index;
+	snprintf(op->summary, sizeof(op->summary), "delete link %u", ifm->ifi_index);
+	link_remove(rt, op->ifindex);
+
+	struct record_link l;
+	l.ifindex = op->ifindex;
+	l.name[0] = 0;
+	l.mtu = 0;
+	return queue_link_notification(rt, &l, RTM_DELLINK);
+}
+
+static int link_family(const struct nlmsghdr *nlh)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	return ifm->ifi_family;
+}
+
+/* Bridge port settings and VLANs, they do not change the link itself */
+static void record_bridge_vlan(const struct nlmsghdr *nlh, struct lsdn_plan_op *op)
+{
+	const struct ifinfomsg *ifm = mnl_nlmsg_get_payload(nlh);
+	bool add = nlh->nlmsg_type == RTM_SETLINK;
+	op->type = add ? LSDN_PLAN_VLAN_ADD : LSDN_PLAN_VLAN_DELETE;
+	op->ifindex = ifm->ifi_index;
+	int len = snprintf(op->summary, sizeof(op->summary), "%s bridge port %u",
+		add ? "change" : "remove vlans of", ifm->ifi_index);
+	struct nlattr *attr, *nested;
+	mnl_attr_for_each(attr, nlh, sizeof(*ifm)) {
+		if (mnl_attr_get_type(attr) != IFLA_AF_SPEC)
+			continue;
+		mnl_attr_for_each_nested(nested, attr) {
+			if ((size_t) len >= sizeof(op->summary))
+				break;
+			if (mnl_attr_get_type(nested) == IFLA_BRIDGE_VLAN_INFO
+			    && mnl_attr_get_payload_len(nested) == sizeof(struct bridge_vlan_info)) {
+				const struct bridge_vlan_info *vinfo = mnl_attr_get_payload(nested);
+				len += snprintf(op->summary + len, sizeof(op->summary) - len,
+					" vid %u", vinfo->vid);
+			} else if (mnl_attr_get_type(nested) == IFLA_BRIDGE_VLAN_TUNNEL_INFO) {
+				struct nlattr *tinfo;
+				mnl_attr_for_each_nested(tinfo, nested) {
+					if (mnl_attr_get_type(tinfo) == IFLA_BRIDGE_VLAN_TUNNEL_ID)
+						len += snprintf(op->summary + len, sizeof(op->summary) - len,
+							" tunnel_id %u", mnl_attr_get_u32(tinfo));
+				}
+			}
+		}
+	}
+}
+
+static void record_addr(const struct nlmsghdr *nlh, struct lsdn_plan_op *op)
+{
+	const struct ifaddrmsg *ifa = mnl_nlmsg_get_payload(nlh);
+	bool add = nlh->nlmsg_type == RTM_NEWADDR;
+	op->type = add ? LSDN_PLAN_ADDR_ADD : LSDN_PLAN_ADDR_DELETE;
+	op->ifindex = ifa->ifa_index;
+	snprintf(op->summary, sizeof(op->summary), "%s %s address /%u",
+		add ? "add" : "delete", ifa->ifa_family == AF_INET6 ? "IPv6" : "IPv4",
+		ifa->ifa_prefixlen);
+}
+
+static const char *get_tc_kind(const struct nlmsghdr *nlh)
+{
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(struct tcmsg)) {
+		if (mnl_attr_get_type(attr) == TCA_KIND && mnl_attr_validate(attr, MNL_TYPE_STRING) >= 0)
+			return mnl_attr_get_str(attr);
+	}
+	return "";
+}
+
+static void record_qdisc(const struct nlmsghdr *nlh, struct lsdn_plan_op *op)
+{
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	bool create = nlh->nlmsg_type == RTM_NEWQDISC || nlh->nlmsg_type == RTM_NEWTCLASS;
+	bool class = nlh->nlmsg_type == RTM_NEWTCLASS || nlh->nlmsg_type == RTM_DELTCLASS;
+	char parent[16], handle[16];
+	if (class)
+		op->type = create ? LSDN_PLAN_CLASS_CREATE : LSDN_PLAN_CLASS_DELETE;
+	else
+		op->type = create ? LSDN_PLAN_QDISC_CREATE : LSDN_PLAN_QDISC_DELETE;
+	op->ifindex = tcm->tcm_ifindex;
+	op->parent = tcm->tcm_parent;
+	op->handle = tcm->tcm_handle;
+	format_handle(parent, sizeof(parent), op->parent);
+	format_handle(handle, sizeof(handle), op->handle);
+	const char *kind = get_tc_kind(nlh);
+	snprintf(op->summary, sizeof(op->summary), "%s %s%s%s parent %s handle %s",
+		create ? "create" : "delete", class ? "class" : "qdisc",
+		*kind ? " " : "", kind, parent, handle);
+}
+
+static void record_filter(const struct nlmsghdr *nlh, struct lsdn_plan_op *op)
+{
+	const struct tcmsg *tcm = mnl_nlmsg_get_payload(nlh);
+	const char *action;
+	if (nlh->nlmsg_type == RTM_DELTFILTER) {
+		op->type = LSDN_PLAN_FILTER_DELETE;
+		action = "delete";
+	} else if (nlh->nlmsg_flags & NLM_F_EXCL) {
+		op->type = LSDN_PLAN_FILTER_CREATE;
+		action = "create";
+	} else {
+		op->type = LSDN_PLAN_FILTER_REPLACE;
+		action = "replace";
+	}
+	op->ifindex = tcm->tcm_ifindex;
+	op->parent = tcm->tcm_parent;
+	op->prio = TC_H_MAJ(tcm->tcm_info) >> 16;
+	op->handle = tcm->tcm_handle;
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(*tcm)) {
+		if (mnl_attr_get_type(attr) == TCA_CHAIN && mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+			op->chain = mnl_attr_get_u32(attr);
+	}
+	char parent[16];
+	format_handle(parent, sizeof(parent), op->parent);
+	const char *kind = get_tc_kind(nlh);
+	snprintf(op->summary, sizeof(op->summary),
+		"%s filter%s%s parent %s chain %u prio %u handle %x",
+		action, *kind ? " " : "", kind, parent, op->chain, op->prio, op->handle);
+}
+
+static void record_fdb(const struct nlmsghdr *nlh, struct lsdn_plan_op *op)
+{
+	const struct ndmsg *nd = mnl_nlmsg_get_payload(nlh);
+	bool add = nlh->nlmsg_type == RTM_NEWNEIGH;
+	char mac_str[LSDN_MAC_STRING_LEN + 1] = "?";
+	char ip_str[LSDN_IP_STRING_LEN + 1] = "?";
+	op->type = add ? LSDN_PLAN_FDB_ADD : LSDN_PLAN_FDB_DELETE;
+	op->ifindex = nd->ndm_ifindex;
+	struct nlattr *attr;
+	mnl_attr_for_each(attr, nlh, sizeof(*nd)) {
+		uint16_t type = mnl_attr_get_type(attr);
+		uint16_t len = mnl_attr_get_payload_len(attr);
+		if (type == NDA_LLADDR && len == LSDN_MAC_LEN) {
+			lsdn_mac_t mac;
+			memcpy(mac.bytes, mnl_attr_get_payload(attr), LSDN_MAC_LEN);
+			lsdn_mac_to_string(&mac, mac_str);
+		} else if (type == NDA_DST && (len == LSDN_IPv4_LEN || len == LSDN_IPv6_LEN)) {
+			lsdn_ip_t ip;
+			ip.v = len == LSDN_IPv4_LEN ? LSDN_IPv4 : LSDN_IPv6;
+			if (ip.v == LSDN_IPv4)
+				memcpy(ip.v4.bytes, mnl_attr_get_payload(attr), len);
+			else
+				memcpy(ip.v6.bytes, mnl_attr_get_payload(attr), len);
+			lsdn_ip_to_string(&ip, ip_str);
+		}
+	}
+	if (nd->ndm_flags & NTF_MASTER)
+		snprintf(op->summary, sizeof(op->summary), "%s bridge fdb entry %s",
+			add ? "add" : "delete", mac_str);
+	else
+		snprintf(op->summary, sizeof(op->summary), "%s fdb entry %s dst %s",
+			add ? "add" : "delete", mac_str, ip_str);
+}
+
+/* Attribute with the parameters of a shared action kind, they start with the index */
+static uint16_t action_parms_attr(const char *kind)
+{
+	if (strcmp(kind, "tunnel_key") == 0)
+		return TCA_TUNNEL_KEY_PARMS;
+	if (strcmp(kind, "police") == 0)
+		return TCA_POLICE_TBF;
+	return 0;
+}
+
+static void record_action(const struct nlmsghdr *nlh, struct lsdn_plan_op *op)
+{
+	bool create = nlh->nlmsg_type == RTM_NEWACTION;
+	const char *kind = "";
+	const struct nlattr *options = NULL;
+	op->type = create ? LSDN_PLAN_ACTION_CREATE : LSDN_PLAN_ACTION_DELETE;
+	/* LSDN sends a single action per request */
+	const struct nlattr *tab, *act, *attr;
+	mnl_attr_for_each(tab, nlh, sizeof(struct tcamsg)) {
+		if (mnl_attr_get_type(tab) != TCA_ACT_TAB)
+			continue;
+		mnl_attr_for_each_nested(act, tab) {
+			mnl_attr_for_each_nested(attr, act) {
+				uint16_t type = mnl_attr_get_type(attr);
+				if (type == TCA_ACT_KIND && mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) >= 0)
+					kind = mnl_attr_get_str(attr);
+				else if (type == TCA_ACT_INDEX && mnl_attr_validate(attr, MNL_TYPE_U32) >= 0)
+					op->handle = mnl_attr_get_u32(attr);
+				else if (type == TCA_ACT_OPTIONS)
+					options = attr;
+			}
+		}
+	}
+	uint16_t parms_attr = action_parms_attr(kind);
+	if (options && parms_attr) {
+		mnl_attr_for_each_nested(attr, options) {
+			if (mnl_attr_get_type(attr) == parms_attr
+			    && mnl_attr_get_payload_len(attr) >= sizeof(uint32_t))
+				op->handle = *(const uint32_t *) mnl_attr_get_payload(attr);
+		}
+	}
+	snprintf(op->summary, sizeof(op->summary), "%s action%s%s index %x",
+		create ? "create" : "delete", *kind ? " " : "", kind, op->handle);
+}
+
+static void count_op(struct lsdn_nl_stats *stats, const struct nlmsghdr *nlh, enum lsdn_plan_op_type type)
+{
+	switch (type) {
+	case LSDN_PLAN_LINK_CREATE:
+	case LSDN_PLAN_LINK_CHANGE:
+	case LSDN_PLAN_LINK_DELETE:
+	case LSDN_PLAN_ADDR_ADD:
+	case LSDN_PLAN_ADDR_DELETE:
+	case LSDN_PLAN_VLAN_ADD:
+	case LSDN_PLAN_VLAN_DELETE:
+		stats->link_msgs++;
+		break;
+	case LSDN_PLAN_QDISC_CREATE:
+	case LSDN_PLAN_QDISC_DELETE:
+	case LSDN_PLAN_CLASS_CREATE:
+	case LSDN_PLAN_CLASS_DELETE:
+		stats->qdisc_msgs++;
+		break;
+	case LSDN_PLAN_FILTER_CREATE:
+	case LSDN_PLAN_FILTER_REPLACE:
+	case LSDN_PLAN_FILTER_DELETE:
+		stats->filter_msgs++;
+		break;
+	case LSDN_PLAN_FDB_ADD:
+	case LSDN_PLAN_FDB_DELETE:
+		stats->fdb_msgs++;
+		break;
+	case LSDN_PLAN_ACTION_CREATE:
+	case LSDN_PLAN_ACTION_DELETE:
+		stats->action_msgs++;
+		break;
+	default:
+		stats->other_msgs++;
+	}
+	stats->bytes += nlh->nlmsg_len;
+}
+
+static size_t payload_size(uint16_t type)
+{
+	switch (type) {
+	case RTM_NEWLINK: case RTM_DELLINK: case RTM_SETLINK:
+		return sizeof(struct ifinfomsg);
+	case RTM_NEWADDR: case RTM_DELADDR:
+		return sizeof(struct ifaddrmsg);
+	case RTM_NEWQDISC: case RTM_DELQDISC:
+	case RTM_NEWTCLASS: case RTM_DELTCLASS:
+	case RTM_NEWTFILTER: case RTM_DELTFILTER:
+		return sizeof(struct tcmsg);
+	case RTM_NEWNEIGH: case RTM_DELNEIGH:
+		return sizeof(struct ndmsg);
+	case RTM_NEWACTION: case RTM_DELACTION:
+		return sizeof(struct tcamsg);
+	default:
+		return 0;
+	}
+}
+
+/* Space for the next operation of the plan, cleared. It is not counted until the caller
+ * increments the count. */
+static struct lsdn_plan_op *next_op(struct record_transport *rt)
+{
+	struct lsdn_plan *plan = rt->plan;
+	if (plan->count == rt->plan_size) {
+		size_t size = rt->plan_size ? rt->plan_size * 2 : RECORD_INITIAL_OPS;
+		struct lsdn_plan_op *ops = realloc(plan->ops, size * sizeof(*ops));
+		if (!ops)
+			return NULL;
+		plan->ops = ops;
+		rt->plan_size = size;
+	}
+
+	struct lsdn_plan_op *op = &plan->ops[plan->count];
+	memset(op, 0, sizeof(*op));
+	return op;
+}
+
+/* Record a request changing the kernel state and acknowledge it. */
+static bool record(struct record_transport *rt, const struct nlmsghdr *nlh)
+{
+	struct lsdn_plan *plan = rt->plan;
+	struct lsdn_plan_op *op = next_op(rt);
+	if (!op)
+		return false;
+	bool ok = true;
+	if (nlh->nlmsg_len < NLMSG_LENGTH(payload_size(nlh->nlmsg_type))) {
+		op->type = LSDN_PLAN_OTHER;
+		snprintf(op->summary, sizeof(op->summary), "truncated request %u", nlh->nlmsg_type);
+	} else {
+		switch (nlh->nlmsg_type) {
+		case RTM_NEWLINK:
+			if (nlh->nlmsg_flags & NLM_F_CREATE)
+				ok = record_link_create(rt, nlh, op);
+			else
+				record_link_change(nlh, op);
+			break;
+		case RTM_SETLINK:
+			if (link_family(nlh) == PF_BRIDGE)
+				record_bridge_vlan(nlh, op);
+			else
+				record_link_change(nlh, op);
+			break;
+		case RTM_DELLINK:
+			if (link_family(nlh) == PF_BRIDGE)
+				record_bridge_vlan(nlh, op);
+			else
+				ok = record_link_delete(rt, nlh, op);
+			break;
+		case RTM_NEWADDR: case RTM_DELADDR: record_addr(nlh, op); break;
+		case RTM_NEWQDISC: case RTM_DELQDISC:
+		case RTM_NEWTCLASS: case RTM_DELTCLASS: record_qdisc(nlh, op); break;
+		case RTM_NEWTFILTER: case RTM_DELTFILTER: record_filter(nlh, op); break;
+		case RTM_NEWNEIGH: case RTM_DELNEIGH: record_fdb(nlh, op); break;
+		case RTM_NEWACTION: case RTM_DELACTION: record_action(nlh, op); break;
+		default:
+			op->type = LSDN_PLAN_OTHER;
+			snprintf(op->summary, sizeof(op->summary), "request %u", nlh->nlmsg_type);
+		}
+	}
+	if (!ok)
+		return false;
+	plan->count++;
+	count_op(&plan->stats, nlh, op->type);
+	return queue_ack(rt, nlh);
+}
+
+static void format_key(char *buf, const struct record_map *map, const void *key)
+{
+	const uint8_t *bytes = key;
+	size_t len = map ? map->key_size : 0;
+	if (len == 0) {
+		strcpy(buf, "?");
+		return;
+	}
+	if (len > RECORD_BPF_KEY_SHOWN)
+		len = RECORD_BPF_KEY_SHOWN;
+	for (size_t i = 0; i < len; i++)
+		sprintf(buf + 2 * i, "%02x", bytes[i]);
+}
+
+/* Record a bpf call. The maps and programs get made-up file descriptors and the map updates
+ * are not done, nothing is ever looked up in the maps. */
+static int record_bpf_call(struct record_transport *rt, int cmd, const union bpf_attr *attr)
+{
+	struct lsdn_plan_op *op = next_op(rt);
+	if (!op) {
+		errno = ENOMEM;
+		return -1;
+	}
+	int ret = 0;
+	struct record_map *map;
+	char key[2 * RECORD_BPF_KEY_SHOWN + 1];
+	switch (cmd) {
+	case BPF_MAP_CREATE:
+		map = malloc(sizeof(*map));
+		if (!map) {
+			errno = ENOMEM;
+			return -1;
+		}
+		map->fd = ret = rt->next_fd++;
+		map->key_size = attr->key_size;
+		HASH_ADD_INT(rt->maps, fd, map);
+		op->type = LSDN_PLAN_BPF_CREATE;
+		snprintf(op->summary, sizeof(op->summary),
+			"create bpf map %d type %u key %u value %u entries %u", ret,
+			attr->map_type, attr->key_size, attr->value_size, attr->max_entries);
+		break;
+	case BPF_PROG_LOAD:
+		ret = rt->next_fd++;
+		op->type = LSDN_PLAN_BPF_CREATE;
+		snprintf(op->summary, sizeof(op->summary),
+			"load bpf program %d type %u insns %u", ret, attr->prog_type, attr->insn_cnt);
+		break;
+	case BPF_MAP_UPDATE_ELEM:
+	case BPF_MAP_DELETE_ELEM: {
+		int fd = attr->map_fd;
+		HASH_FIND_INT(rt->maps, &fd, map);
+		format_key(key, map, (const void *) (uintptr_t) attr->key);
+		bool update = cmd == BPF_MAP_UPDATE_ELEM;
+		op->type = update ? LSDN_PLAN_BPF_UPDATE : LSDN_PLAN_BPF_DELETE;
+		snprintf(op->summary, sizeof(op->summary), "%s bpf map %d key %s",
+			update ? "update" : "delete", fd, key);
+		break;
+	}
+	default:
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	rt->plan->count++;
+	rt->plan->stats.bpf_calls++;
+	return ret;
+}
+
+static bool is_read_request(const struct nlmsghdr *nlh)
+{
+	switch (nlh->nlmsg_type) {
+	case RTM_GETLINK:
+	case RTM_GETADDR:
+	case RTM_GETQDISC:
+	case RTM_GETTFILTER:
+	case RTM_GETNEIGH:
+	case RTM_GETACTION:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/********* Transport *********/
+
+static int record_open(struct lsdn_nl_transport *t, enum lsdn_nl_channel ch)
+{
+	struct record_transport *rt = (struct record_transport *) t;
+	return rt->inner->ops->open(rt->inner, ch);
+}
+
+static ssize_t record_send(
+	struct lsdn_nl_transport *t, enum lsdn_nl_channel ch, const void *buf, size_t len)
+{
+	struct record_transport *rt = (struct record_transport *) t;
+	const struct nlmsghdr *nlh = buf;
+	int left = len;
+	while (mnl_nlmsg_ok(nlh, left)) {
+		if (ch == LSDN_NL_LINKS && nlh->nlmsg_type == RTM_GETLINK) {
+			/* The dump replaces the link cache, the created links must be in it again */
+			struct record_link *l, *tmp;
+			HASH_ITER(hh, rt->links, l, tmp) {
+				if (!queue_link_notification(rt, l, RTM_NEWLINK)) {
+					errno = ENOMEM;
+					return -1;
+				}
+			}
+		}
+		if (ch == LSDN_NL_LINKS || is_read_request(nlh)) {
+			if (rt->inner->ops->send(rt->inner, ch, nlh, nlh->nlmsg_len) == -1)
+				return -1;
+		} else if (!record(rt, nlh)) {
+			errno = ENOMEM;
+			return -1;
+		}
+		nlh = mnl_nlmsg_next(nlh, &left);
+	}
+	return len;
+}
+
+static ssize_t record_recv(
+	struct lsdn_nl_transport *t, enum lsdn_nl_channel ch, void *buf, size_t len, bool wait)
+{
+	struct record_transport *rt = (struct record_transport *) t;
+	struct record_datagram *d = queue_pop(&rt->queues[ch]);
+	if (!d)
+		return rt->inner->ops->recv(rt->inner, ch, buf, len, wait);
+	ssize_t ret = d->len;
+	if (d->len > len) {
+		errno = ENOSPC;
+		ret = -1;
+	} else {
+		memcpy(buf, d->data, d->len);
+	}
+	free(d);
+	return ret;
+}
+
+static int record_recv_many(struct lsdn_nl_transport *t, struct mmsghdr *msgs, unsigned int count)
+{
+	struct record_transport *rt = (struct record_transport *) t;
+	struct record_queue *q = &rt->queues[LSDN_NL_REQUESTS];
+	if (!q->head)
+		return rt->inner->ops->recv_many(rt->inner, msgs, count);
+
+	unsigned int n;
+	for (n = 0; n < count && q->head; n++) {
+		struct record_datagram *d = queue_pop(q);
+		/* Truncated like a datagram socket would do it */
+		struct iovec *iov = msgs[n].msg_hdr.msg_iov;
+		size_t len = d->len < iov->iov_len ? d->len : iov->iov_len;
+		memcpy(iov->iov_base, d->data, len);
+		msgs[n].msg_len = len;
+		free(d);
+	}
+	return n;
+}
+
+static int record_bpf(struct lsdn_nl_transport *t, int cmd, union bpf_attr *attr, unsigned int size)
+{
+	struct record_transport *rt = (struct record_transport *) t;
+	if (size < sizeof(*attr)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return record_bpf_call(rt, cmd, attr);
+}
+
+static void record_close_fd(struct lsdn_nl_transport *t, int fd)
+{
+	struct record_transport *rt = (struct record_transport *) t;
+	struct record_map *map;
+	HASH_FIND_INT(rt->maps, &fd, map);
+	if (map) {
+		HASH_DELETE(hh, rt->maps, map);
+		free(map);
+	}
+}
+
+static void record_free(struct lsdn_nl_transport *t)
+{
+	struct record_transport *rt = (struct record_transport *) t;
+	struct record_link *l, *tmp;
+	HASH_ITER(hh, rt->links, l, tmp) {
+		HASH_DELETE(hh, rt->links, l);
+		free(l);
+	}
+	struct record_map *map, *map_tmp;
+	HASH_ITER(hh, rt->maps, map, map_tmp) {
+		HASH_DELETE(hh, rt->maps, map);
+		free(map);
+	}
+	for (int ch = 0; ch < LSDN_NL_CHANNEL_COUNT; ch++)
+		queue_clear(&rt->queues[ch]);
+	rt->inner->ops->free(rt->inner);
+	free(rt);
+}
+
+static const struct lsdn_nl_transport_ops record_transport_ops = {
+	.open = record_open,
+	.send = record_send,
+	.recv = record_recv,
+	.recv_many = record_recv_many,
+	.bpf = record_bpf,
+	.close_fd = record_close_fd,
+	.free = record_free
+};
+
+/** Create a transport recording the requests to the plan.
+ * The recording transport takes the ownership of the underlying transport, it is freed even if
+ * the recording transport can not be created. The plan must outlive the transport, its
+ * operations are reallocated as needed. */
+struct lsdn_nl_transport *lsdn_record_transport_new(
+	struct lsdn_nl_transport *inner, struct lsdn_plan *plan)
+{
+	struct record_transport *rt = malloc(sizeof(*rt));
+	if (!rt) {
+		inner->ops->free(inner);
+		return NULL;
+	}
+	rt->t.ops = &record_transport_ops;
+	rt->inner = inner;
+	rt->plan = plan;
+	rt->plan_size = 0;
+	rt->next_ifindex = LSDN_PLAN_FIRST_IFINDEX;
+	rt->links = NULL;
+	rt->next_fd = RECORD_FIRST_FD;
+	rt->maps = NULL;
+	for (int ch = 0; ch < LSDN_NL_CHANNEL_COUNT; ch++) {
+		rt->queues[ch].head = NULL;
+		rt->queues[ch].tail = NULL;
+	}
+	return &rt->t;
+}
@@ -0,0 +1,65 @@
+/** \file
+ * Helpers for writing BPF programs as instruction arrays.
+ *
+ * LSDN loads its few BPF programs without a compiler, the instructions are written directly
+ * (see `Documentation/networking/filter.txt` in the kernel for the instruction set). The macros
+ * follow the naming of the kernel's `include/linux/filter.h`. */
+#pragma once
+
+#include <linux/bpf.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LSDN_BPF_INSN(c, dst, src, o, i) \
+	((struct bpf_insn) {.code = (c), .dst_reg = (dst), .src_reg = (src), .off = (o), .imm = (i)})
+
+/** `dst = src` */
+#define LSDN_BPF_MOV64_REG(dst, src) \
+	LSDN_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+/** `dst = imm` */
+#define LSDN_BPF_MOV64_IMM(dst, imm) \
+	LSDN_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+/** `dst += imm` */
+#define LSDN_BPF_ADD64_IMM(dst, imm) \
+	LSDN_BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, dst, 0, 0, imm)
+/** `dst op= imm`, e.g. `BPF_AND` or `BPF_RSH` */
+#define LSDN_BPF_ALU64_IMM(op, dst, imm) \
+	LSDN_BPF_INSN(BPF_ALU64 | (op) | BPF_K, dst, 0, 0, imm)
+/** `dst op= src` */
+#define LSDN_BPF_ALU64_REG(op, dst, src) \
+	LSDN_BPF_INSN(BPF_ALU64 | (op) | BPF_X, dst, src, 0, 0)
+/** `dst = *(size *) (src + off)` */
+#define LSDN_BPF_LDX_MEM(size, dst, src, off) \
+	LSDN_BPF_INSN(BPF_LDX | BPF_MEM | (size), dst, src, off, 0)
+/** `*(size *) (dst + off) = src` */
+#define LSDN_BPF_STX_MEM(size, dst, src, off) \
+	LSDN_BPF_INSN(BPF_STX | BPF_MEM | (size), dst, src, off, 0)
+/** `*(size *) (dst + off) = imm` */
+#define LSDN_BPF_ST_MEM(size, dst, off, imm) \
+	LSDN_BPF_INSN(BPF_ST | BPF_MEM | (size), dst, 0, off, imm)
+/** `if (dst op imm) goto pc + off + 1`, the offset is usually filled in by #lsdn_bpf_patch_jump */
+#define LSDN_BPF_JMP_IMM(op, dst, imm, off) \
+	LSDN_BPF_INSN(BPF_JMP | (op) | BPF_K, dst, 0, off, imm)
+/** `if (dst op src) goto pc + off + 1` */
+#define LSDN_BPF_JMP_REG(op, dst, src, off) \
+	LSDN_BPF_INSN(BPF_JMP | (op) | BPF_X, dst, src, off, 0)
+/** Call a helper function (`BPF_FUNC_*`), the arguments are in r1 - r5 and the result in r0 */
+#define LSDN_BPF_CALL(fn) \
+	LSDN_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, fn)
+#define LSDN_BPF_EXIT() \
+	LSDN_BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/** Point the jump instruction at index `from` to the instruction at index `to`. */
+static inline void lsdn_bpf_patch_jump(struct bpf_insn *prog, size_t from, size_t to)
+{
+	prog[from].off = to - from - 1;
+}
+
+/** Write `dst = map`, with the map given by its file descriptor.
+ * @return The number of instructions written (two). */
+static inline size_t lsdn_bpf_ld_map_fd(struct bpf_insn *prog, uint8_t dst, int fd)
+{
+	prog[0] = LSDN_BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+	prog[1] = LSDN_BPF_INSN(0, 0, 0, 0, 0);
+	return 2;
+}
@@ -37,12 +37,25 @@ static inline void *ret_ptr(struct lsdn_context *ctx, void *ptr){
 	return ptr;
 }
 
+/* Objects failing to commit must be retried by the next commit, even if they were not scheduled
+ * for this one (e.g. a remote PA seen by a new local PA). */
+static inline void mark_subject_dirty(enum lsdn_problem_ref_type type, void *subj)
+{
+	if (type == LSDNS_VIRT)
+		lsdn_virt_mark_dirty(subj);
+	else if (type == LSDNS_PA)
+		lsdn_pa_mark_dirty(subj);
+}
+
 static inline bool mark_commit_err(
 	struct lsdn_context *ctx, enum lsdn_state *s, enum lsdn_problem_ref_type type, void *subj, bool fatal, lsdn_err_t err)
 {
 	if (*s == LSDN_STATE_FAIL)
 		return true;
 
+	if (err != LSDNE_OK)
+		mark_subject_dirty(type, subj);
+
 	if (err == LSDNE_INCONSISTENT || (fatal && err == LSDNE_NETLINK)) {
 		*s = LSDN_STATE_FAIL;
 		lsdn_problem_report(ctx, LSDNP_COMMIT_NETLINK_CLEANUP, type, subj, LSDNS_END);
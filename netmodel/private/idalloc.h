@@ -5,14 +5,27 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-/** ID allocation record. */
+/** Maximum depth of the free ID bitmap, enough for the full 32-bit ID range. */
+#define LSDN_IDALLOC_LEVELS 6
+
+/** ID allocation record.
+ * IDs are allocated from the range [`min`, `max`). Returned IDs are remembered in a hierarchical
+ * bitmap and the lowest free ID is always allocated first, so that the IDs stay dense. */
 struct lsdn_idalloc{
 	/** Starting ID. */
 	uint32_t min;
 	/** Maximum allowable ID. */
 	uint32_t max;
-	/** Next ID to allocate. */
+	/** All IDs below `next` were allocated at some point. */
 	uint32_t next;
+	/** Number of IDs (counted from `min`) the bitmap can describe. */
+	uint64_t capacity;
+	/** Number of bitmap levels in use. */
+	unsigned int depth;
+	/** Hierarchical bitmap of returned IDs.
+	 * Bit `i` of level 0 is set if ID `min + i` is free, bit `i` of level `l + 1` is set
+	 * if word `i` of level `l` is non-zero. The top level has a single word. */
+	uint64_t *levels[LSDN_IDALLOC_LEVELS];
 };
 
 void lsdn_idalloc_init(struct lsdn_idalloc *idalloc, uint32_t min, uint32_t max);
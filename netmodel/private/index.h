@@ -0,0 +1,61 @@
+/** \file
+ * Attribute index related structs and definitions.
+ *
+ * An index maps a value of some attribute (MAC address, IP address, ...) to the group of objects
+ * currently having that value. The validation uses the indices to find objects with conflicting
+ * attributes without comparing all pairs of objects. */
+#pragma once
+
+#include <stdint.h>
+#include <uthash.h>
+#include "list.h"
+#include "../include/errors.h"
+#include "../include/nettypes.h"
+
+/** Size of an index key. Large enough for any indexed attribute (IP address with its version). */
+#define LSDN_INDEX_KEY_LEN (1 + LSDN_IPv6_LEN)
+
+/** Index key.
+ * Must be zero-initialized before filling, the whole buffer is hashed and compared. */
+struct lsdn_index_key {
+	/** Raw key bytes. */
+	uint8_t bytes[LSDN_INDEX_KEY_LEN];
+};
+
+/** Group of index members sharing the same key. */
+struct lsdn_index_group {
+	/** The shared key. */
+	struct lsdn_index_key key;
+	/** List of #lsdn_index_member.entry. */
+	struct lsdn_list_entry members;
+	/** Hash table membership. */
+	UT_hash_handle hh;
+};
+
+/** Index membership, embedded in the indexed object. */
+struct lsdn_index_member {
+	/** Group the object is currently in, `NULL` if not indexed. */
+	struct lsdn_index_group *group;
+	/** Membership in #lsdn_index_group.members. */
+	struct lsdn_list_entry entry;
+};
+
+/** Index of objects by an attribute value.
+ * Groups are allocated on demand and freed once they become empty. */
+struct lsdn_index {
+	/** Hash table of #lsdn_index_group. */
+	struct lsdn_index_group *groups;
+};
+
+void lsdn_index_init(struct lsdn_index *index);
+void lsdn_index_free(struct lsdn_index *index);
+void lsdn_index_member_init(struct lsdn_index_member *member);
+lsdn_err_t lsdn_index_set(
+	struct lsdn_index *index, struct lsdn_index_member *member, const struct lsdn_index_key *key);
+void lsdn_index_clear(struct lsdn_index *index, struct lsdn_index_member *member);
+struct lsdn_index_group *lsdn_index_find(struct lsdn_index *index, const struct lsdn_index_key *key);
+
+void lsdn_index_key_mac(struct lsdn_index_key *key, lsdn_mac_t mac);
+void lsdn_index_key_ip(struct lsdn_index_key *key, lsdn_ip_t ip);
+void lsdn_index_key_u32(struct lsdn_index_key *key, uint8_t kind, uint32_t value);
+
@@ -6,9 +6,13 @@
 #include "rules.h"
 #include "clist.h"
 #include "sbridge.h"
+#include "idalloc.h"
+#include "list.h"
 
 struct lsdn_virt;
+struct lsdn_phys;
 struct lsdn_phys_attachment;
+struct lsdn_settings;
 
 /** Linux Bridge.
  * Currently only holds a reference to the context
@@ -50,6 +54,48 @@ struct lsdn_lbridge_route {
 	struct lsdn_lbridge_if lbridge_if;
 };
 
+/** A static forwarding entry for a remote virt.
+ * Without it, the first packets to the virt are flooded to all remote PAs until its address is
+ * learned. The address is kept, because the virt's own may already be changed when the entry
+ * is removed. */
+struct lsdn_lbridge_mac {
+	bool installed;
+	lsdn_mac_t mac;
+};
+
+/** VLAN-aware bridge shared by the learning networks of a phys.
+ * Used instead of a bridge per PA if #lsdn_context_set_vlan_bridge is enabled. Each PA gets
+ * a VLAN of the bridge, mapped to the network's VNI on the metadata tunnel of its settings. */
+struct lsdn_vlan_bridge {
+	/** Number of PAs using the bridge, it exists while non-zero. */
+	unsigned int users;
+	struct lsdn_lbridge lbridge;
+	/** VLAN IDs of the PAs. */
+	struct lsdn_idalloc vlan_ids;
+	/** List of #lsdn_vlan_tunnel. */
+	struct lsdn_list_entry tunnel_list;
+};
+
+/** Metadata tunnel connected to a #lsdn_vlan_bridge.
+ * The kernel has a single metadata tunnel for a UDP port and address family, so the networks of
+ * all the settings with that port share it, the per-network data are in the VNI-tagged
+ * forwarding entries. The settings must agree on the rest of the tunnel's configuration, this is
+ * checked by the validation. */
+struct lsdn_vlan_tunnel {
+	/** UDP port the tunnel receives on. */
+	uint16_t port;
+	enum lsdn_ipv ipv;
+	/** Number of PAs using the tunnel. */
+	unsigned int users;
+	struct lsdn_if tunnel_if;
+	struct lsdn_lbridge_if lbridge_if;
+	/** Membership in #lsdn_vlan_bridge.tunnel_list. */
+	struct lsdn_list_entry tunnel_entry;
+};
+
+/** Create the metadata tunnel interface for the settings of a PA, the first one using it. */
+typedef lsdn_err_t (*lsdn_vlan_tunnel_create_cb)(struct lsdn_phys_attachment *a, struct lsdn_if *tunnel_if);
+
 lsdn_err_t lsdn_lbridge_init(struct lsdn_context *ctx, struct lsdn_lbridge *br);
 lsdn_err_t lsdn_lbridge_free(struct lsdn_lbridge *br);
 lsdn_err_t lsdn_lbridge_add(struct lsdn_lbridge *br, struct lsdn_lbridge_if *br_if, struct lsdn_if *iface);
@@ -58,7 +104,14 @@ lsdn_err_t lsdn_lbridge_remove(struct lsdn_lbridge_if *iface);
 /* lsdn_net_ops implementations and helpers */
 lsdn_err_t lsdn_lbridge_create_pa(struct lsdn_phys_attachment *a);
 lsdn_err_t lsdn_lbridge_destroy_pa(struct lsdn_phys_attachment *a);
+void lsdn_vlan_bridge_init(struct lsdn_vlan_bridge *vb);
+void lsdn_vlan_bridge_free(struct lsdn_vlan_bridge *vb);
+lsdn_err_t lsdn_vlan_bridge_create_pa(
+	struct lsdn_phys_attachment *a, enum lsdn_ipv ipv, lsdn_vlan_tunnel_create_cb create_tunnel);
 lsdn_err_t lsdn_lbridge_add_virt(struct lsdn_virt *v);
 lsdn_err_t lsdn_lbridge_remove_virt(struct lsdn_virt *v);
 lsdn_err_t lsdn_lbridge_add_route(struct lsdn_lbridge *br, struct lsdn_lbridge_route *route, uint32_t vid);
 lsdn_err_t lsdn_lbridge_remove_route(struct lsdn_lbridge_route *route);
+lsdn_err_t lsdn_lbridge_add_route_mac(
+	struct lsdn_lbridge_route *route, struct lsdn_lbridge_mac *entry, const lsdn_mac_t *mac);
+lsdn_err_t lsdn_lbridge_remove_route_mac(struct lsdn_lbridge_route *route, struct lsdn_lbridge_mac *entry);
@@ -15,6 +15,8 @@
 	x(LSDNL_NETOPS, "netops") \
 	/** TC rules. */ \
 	x(LSDNL_RULES, "rules") \
+	/** Batched netlink requests. */ \
+	x(LSDNL_NL, "nl") \
 	/** Netlink and other low-level failures */ \
 	x(LSDN_NLERR, "nlerr")
 
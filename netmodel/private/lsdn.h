@@ -4,6 +4,7 @@
 
 #include "../include/lsdn.h"
 #include "names.h"
+#include "index.h"
 #include "list.h"
 #include "rules.h"
 #include "nl.h"
@@ -11,6 +12,10 @@
 #include "sbridge.h"
 #include "lbridge.h"
 #include "state.h"
+#include <pthread.h>
+
+/** Size of the buffer for generated object names. */
+#define LSDN_NAMEBUF_SIZE (64 + 1)
 
 /** LSDN Context.
  * This is the central structure that keeps track of the in-memory network model as a whole.
@@ -50,10 +55,73 @@ struct lsdn_context {
 	/** List of list of physes. */
 	struct lsdn_list_entry phys_list;
 
+	/** @name Dirty lists.
+	 * Objects that were changed since the last commit (or are not yet committed successfully).
+	 * Validation and commit only walk these lists and the objects reachable from them, so their
+	 * cost depends on the size of the change, not on the size of the model. */
+	/** @{ */
+	struct lsdn_list_entry dirty_settings_list;
+	struct lsdn_list_entry dirty_net_list;
+	struct lsdn_list_entry dirty_phys_list;
+	struct lsdn_list_entry dirty_pa_list;
+	struct lsdn_list_entry dirty_virt_list;
+	/** @} */
+
+	/** @name Validation indices.
+	 * Allow the validation to find conflicting objects without walking the whole model. */
+	/** @{ */
+	/** Physes by IP address. */
+	struct lsdn_index phys_ip_index;
+	/** Networks by network type and vnet ID. */
+	struct lsdn_index vnet_id_index;
+	/** VXLAN networks by UDP port and switch type (static or not). */
+	struct lsdn_index vxlan_port_index;
+	/** @} */
+
+	/** Flower rules changed during the commit, sent to kernel by #lsdn_rulesets_flush. */
+	struct lsdn_list_entry pending_fl_list;
+	/** Versioned rulesets changed during the commit, rebuilt by #lsdn_rulesets_flush. */
+	struct lsdn_list_entry pending_rs_list;
+	/** Shared actions freed during the commit, deleted by #lsdn_rulesets_flush. */
+	struct lsdn_list_entry pending_action_list;
+
 	/** Netlink socket for installing tc rules. */
-	struct mnl_socket *nlsock;
+	struct lsdn_nl *nlsock;
+	/** Emulated kernel used instead of the real one, if set. */
+	struct lsdn_mock_kernel *mock;
 	/** Should we try to blindly overwrite existing interfaces and QDiscs */
 	bool overwrite;
+	/** Attach the rulesets to a clsact qdisc instead of ingress and root prio qdiscs */
+	bool clsact;
+	/** Adopt the kernel objects left by a previous run in the next commit */
+	bool reconcile;
+	/** Rebuild the changed rulesets in a new chain instead of updating them in place */
+	bool versioned_rules;
+	/** Share a tc block among the local virts of a static bridge */
+	bool shared_blocks;
+	/** Indices of the shared blocks */
+	struct lsdn_idalloc block_ids;
+	/** Indices of the shared actions */
+	struct lsdn_idalloc action_ids;
+	/** Switch the unicast traffic of static bridges by a BPF program */
+	bool bpf_switching;
+	/** Connect the learning networks of a phys to a single VLAN-aware bridge */
+	bool vlan_bridge;
+	/** Reuse the message buffers of the tc filters (see #lsdn_context_set_filter_pool) */
+	bool filter_pool;
+	/** Statistics of the last commit (or validation). */
+	struct lsdn_commit_stats stats;
+
+	/** @name Parallel commit.
+	 * @see lsdn_context_set_commit_workers */
+	/** @{ */
+	/** Number of commit worker threads, the commit is sequential if less than two. */
+	unsigned int commit_workers;
+	/** Netlink sockets of the workers, opened by the first parallel commit. */
+	struct lsdn_nl **worker_socks;
+	/** Held by the worker running the model code, released while waiting for the kernel. */
+	pthread_mutex_t commit_lock;
+	/** @} */
 
 	/** User-specified problem callback. */
 	lsdn_problem_cb problem_cb;
@@ -82,8 +150,11 @@ struct lsdn_context {
 	int obj_count;
 
 	/** Name buffer.
-	 * Space for rendering unique LSDN object names. */
-	char namebuf[64 + 1];
+	 * Space for rendering unique LSDN object names. Points to #own_namebuf, or to the buffer
+	 * of the running commit worker, since the names must stay valid while it waits for the
+	 * kernel. */
+	char *namebuf;
+	char own_namebuf[LSDN_NAMEBUF_SIZE];
 };
 
 /** Type of network encapsulation. */
@@ -129,6 +200,8 @@ struct lsdn_settings {
 	/** Membership in list of all settings.
 	 * @see #lsdn_context.settings_list */
 	struct lsdn_list_entry settings_entry;
+	/** Membership in #lsdn_context.dirty_settings_list. */
+	struct lsdn_list_entry dirty_entry;
 	/** List of users of this settings object. */
 	struct lsdn_list_entry setting_users_list;
 
@@ -143,6 +216,10 @@ struct lsdn_settings {
 	enum lsdn_nettype nettype;
 	/** Switch type. */
 	enum lsdn_switch switch_type;
+	/** How the virts without their own mode enforce the inbound bandwidth limit. */
+	enum lsdn_qos_mode qos_mode;
+	/** Options of the tunnel interfaces, applied when they are created. */
+	struct lsdn_tunnel_opts tunnel_opts;
 
 	union {
 		/** Properties for the VXLAN network type. */
@@ -186,6 +263,34 @@ struct lsdn_settings {
 	struct lsdn_user_hooks *user_hooks;
 };
 
+/** A policer shared by all virts of a network or a phys.
+ * The police action is created when the first virt starts using it. It is deleted at the end of
+ * the commit if no virt uses it anymore, so it survives the virts being renewed. */
+struct lsdn_aggregate_rate {
+	/** #police is valid. */
+	bool created;
+	/** The shared police action. */
+	struct lsdn_shared_action police;
+	/** The rate the police action was created (or last replaced) with. */
+	lsdn_qos_rate_t committed_rate;
+	/** Number of committed virts referencing #police. */
+	size_t users;
+};
+
+/** Policing of one direction of a virt.
+ * The rule chains the virt's own policer and the aggregate policers of its network and phys. */
+struct lsdn_virt_policing {
+	/** Priority of #rule, `NULL` if the policing is not committed. */
+	struct lsdn_ruleset_prio *prio;
+	struct lsdn_rule rule;
+	/** #own is valid, the virt has its own rate limit. */
+	bool has_own;
+	struct lsdn_shared_action own;
+	/** Aggregate policers referenced by #rule (network and phys). */
+	struct lsdn_aggregate_rate *aggregates[2];
+	size_t aggregate_count;
+};
+
 /** LSDN phys.
  * Phys is a representation of a physical machine hosting tenants of the LSDN network.
  * Virts (tenant representations) can be attached to a phys, detached, and migrated
@@ -207,6 +312,10 @@ struct lsdn_phys {
 	/** Membership in list of all physes.
 	 * @see #lsdn_context.phys_list. */
 	struct lsdn_list_entry phys_entry;
+	/** Membership in #lsdn_context.dirty_phys_list. */
+	struct lsdn_list_entry dirty_entry;
+	/** Membership in #lsdn_context.phys_ip_index. */
+	struct lsdn_index_member ip_index_entry;
 	/** List of attached virts. */
 	struct lsdn_list_entry attached_to_list;
 
@@ -225,6 +334,16 @@ struct lsdn_phys {
 	char *attr_iface;
 	/** IP address on the physical network. */
 	lsdn_ip_t *attr_ip;
+	/** Aggregate bandwidth limit of all virts connected through this phys (virt's ingress). */
+	lsdn_qos_rate_t *attr_rate_in;
+	/** Aggregate bandwidth limit of all virts connected through this phys (virt's egress). */
+	lsdn_qos_rate_t *attr_rate_out;
+	/** The policer shared by the virts for #attr_rate_in. */
+	struct lsdn_aggregate_rate aggregate_rate_in;
+	/** The policer shared by the virts for #attr_rate_out. */
+	struct lsdn_aggregate_rate aggregate_rate_out;
+	/** The bridge shared by the learning networks if #lsdn_context.vlan_bridge is set. */
+	struct lsdn_vlan_bridge vlan_bridge;
 };
 
 struct lsdn_net {
@@ -232,6 +351,12 @@ struct lsdn_net {
 	bool pending_free;
 	struct lsdn_list_entry networks_entry;
 	struct lsdn_list_entry settings_users_entry;
+	/* Membership in lsdn_context.dirty_net_list */
+	struct lsdn_list_entry dirty_entry;
+	/* Membership in lsdn_context.vnet_id_index */
+	struct lsdn_index_member vnet_id_index_entry;
+	/* Membership in lsdn_context.vxlan_port_index (VXLAN networks only) */
+	struct lsdn_index_member vxlan_port_index_entry;
 	struct lsdn_context *ctx;
 	struct lsdn_settings *settings;
 	struct lsdn_name name;
@@ -241,6 +366,18 @@ struct lsdn_net {
 	/* List of lsdn_phys_attachement attached to this network */
 	struct lsdn_list_entry attached_list;
 	struct lsdn_names virt_names;
+	/* Virts by MAC address */
+	struct lsdn_index mac_index;
+	/* Virts by IP address */
+	struct lsdn_index ip_index;
+	/* Number of attachments whose phys has an IPv4 (IPv6) address */
+	size_t ipv4_pa_count;
+	size_t ipv6_pa_count;
+	/* Aggregate bandwidth limits of all virts in the network */
+	lsdn_qos_rate_t *attr_rate_in;
+	lsdn_qos_rate_t *attr_rate_out;
+	struct lsdn_aggregate_rate aggregate_rate_in;
+	struct lsdn_aggregate_rate aggregate_rate_out;
 };
 
 struct lsdn_phys_attachment {
@@ -250,6 +387,10 @@ struct lsdn_phys_attachment {
 	struct lsdn_list_entry attached_entry;
 	/* list held by phys */
 	struct lsdn_list_entry attached_to_entry;
+	/* Membership in lsdn_context.dirty_pa_list */
+	struct lsdn_list_entry dirty_entry;
+	/* Membership in a group of the parallel commit */
+	struct lsdn_list_entry commit_group_entry;
 	struct lsdn_list_entry connected_virt_list;
 	/* List of remote PAs that correspond to this PA */
 	struct lsdn_list_entry pa_view_list;
@@ -268,6 +409,10 @@ struct lsdn_phys_attachment {
 	struct lsdn_if tunnel_if;
 	struct lsdn_lbridge lbridge;
 	struct lsdn_lbridge_if lbridge_if;
+	/* The tunnel of the phys' shared bridge, NULL if the PA has its own bridge (lbridge) */
+	struct lsdn_vlan_tunnel *vlan_tunnel;
+	/* VLAN of the PA on the phys' shared bridge */
+	uint16_t vlan_id;
 
 	struct lsdn_sbridge sbridge;
 	struct lsdn_sbridge_if sbridge_if;
@@ -279,6 +424,14 @@ struct lsdn_virt {
 	bool pending_free;
 	struct lsdn_name name;
 	struct lsdn_list_entry virt_entry;
+	/* Membership in lsdn_context.dirty_virt_list */
+	struct lsdn_list_entry dirty_entry;
+	/* Membership in a group of the parallel commit */
+	struct lsdn_list_entry commit_group_entry;
+	/* Membership in lsdn_net.mac_index */
+	struct lsdn_index_member mac_index_entry;
+	/* Membership in lsdn_net.ip_index */
+	struct lsdn_index_member ip_index_entry;
 	struct lsdn_list_entry connected_virt_entry;
 	struct lsdn_list_entry virt_view_list;
 	struct lsdn_net* network;
@@ -291,7 +444,8 @@ struct lsdn_virt {
 	lsdn_mac_t *attr_mac;
 	lsdn_qos_rate_t *attr_rate_in;
 	lsdn_qos_rate_t *attr_rate_out;
-	/*lsdn_ip_t *attr_ip; */
+	lsdn_ip_t *attr_ip;
+	enum lsdn_qos_mode attr_qos_mode;
 
 	union {
 		struct {
@@ -306,13 +460,16 @@ struct lsdn_virt {
 		};
 	};
 
-	/** A rule for doing the policing on virt's ingress (our egress) */
-	struct lsdn_ruleset_prio *commited_policing_in;
-	struct lsdn_rule commited_policing_rule_in;
-	/** A rule for doing the policing on virt's egress (our ingress) */
-	struct lsdn_ruleset_prio *commited_policing_out;
-	struct lsdn_rule commited_policing_rule_out;
+	/** Policing on virt's ingress (our egress) */
+	struct lsdn_virt_policing commited_policing_in;
+	/** Policing on virt's egress (our ingress) */
+	struct lsdn_virt_policing commited_policing_out;
+	/** Parent of the shaper on virt's ingress (our egress), 0 if it is not shaped */
+	uint32_t commited_shaping_parent;
 
+	/** The virt's egress (our ingress) is bound to the shared block of its static bridge and
+	 * #rules_in is not used. */
+	bool shared_block;
 	/** A ruleset on virt's egress (our ingress) */
 	struct lsdn_ruleset rules_in;
 	/** A ruleset on virt's ingress (our egress) */
@@ -320,3 +477,17 @@ struct lsdn_virt {
 	struct vr_prio *ht_in_rules;
 	struct vr_prio *ht_out_rules;
 };
+
+/** @name Dirty tracking.
+ * Schedule the object for processing by the next validation and commit. Every change of the
+ * commit state (or of anything else the commit depends on) must be followed by one of these. */
+/** @{ */
+void lsdn_settings_mark_dirty(struct lsdn_settings *s);
+void lsdn_pa_mark_dirty(struct lsdn_phys_attachment *pa);
+void lsdn_virt_mark_dirty(struct lsdn_virt *v);
+/** @} */
+
+bool lsdn_virt_has_ingress_rules(struct lsdn_virt *v);
+
+/* Test hook for the benchmark, measures what the reuse of the filter buffers saves */
+void lsdn_context_set_filter_pool(struct lsdn_context *ctx, bool pool);
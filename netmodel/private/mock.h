@@ -0,0 +1,45 @@
+/** \file
+ * Test hooks for running a context against the emulated kernel.
+ *
+ * These are not a part of the public API, they are used by the tests and benchmarks only.
+ * @see nlmock.h */
+#pragma once
+
+#include "../include/lsdn.h"
+
+/** Number of objects in the emulated kernel.
+ * @see lsdn_context_use_mock_kernel */
+struct lsdn_mock_state {
+	size_t links;
+	size_t qdiscs;
+	/** Classes of the classful qdiscs (the bands of a prio qdisc are not counted). */
+	size_t classes;
+	/** Filter chains, a chain exists while it has any filters. */
+	size_t chains;
+	size_t filters;
+	size_t fdb_entries;
+	/** VLANs of the bridge ports (a port in two VLANs counts twice). */
+	size_t vlans;
+	/** VLANs mapped to a tunnel ID. */
+	size_t vlan_tunnels;
+	/** Links created since the emulated kernel was created (including the deleted ones). */
+	size_t links_created;
+	/** Qdiscs created since the emulated kernel was created, replacing a qdisc of another kind
+	 * counts as a creation. */
+	size_t qdiscs_created;
+	/** Filters created since the emulated kernel was created, replacing the actions of an
+	 * existing filter does not count. */
+	size_t filters_created;
+	/** BPF maps and programs with an open file descriptor. */
+	size_t bpf_maps;
+	size_t bpf_progs;
+	/** Entries in all the open BPF maps. */
+	size_t bpf_map_entries;
+	/** Shared tc actions, those created on their own and referenced by filters. */
+	size_t actions;
+};
+
+lsdn_err_t lsdn_context_use_mock_kernel(struct lsdn_context *ctx);
+lsdn_err_t lsdn_context_share_mock_kernel(struct lsdn_context *ctx, struct lsdn_context *other);
+lsdn_err_t lsdn_context_mock_add_link(struct lsdn_context *ctx, const char *name);
+void lsdn_context_mock_get_state(struct lsdn_context *ctx, struct lsdn_mock_state *state);
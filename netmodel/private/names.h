@@ -2,23 +2,29 @@
  * Name-related structs and definitions. */
 #pragma once
 
-#include "list.h"
+#include <uthash.h>
 #include "../include/errors.h"
 
-/** List of names.
+struct lsdn_name;
+
+/** Table of names.
  * Contains a collection of names that should be unique over their domain.
- * E.g., names of all networks (physes, virts) in a context. */
+ * E.g., names of all networks (physes, virts) in a context.
+ * The names are kept in a hash table, so that lookup, insertion and removal
+ * take constant time. */
 struct lsdn_names {
-	/** Head of the list. */
-	struct lsdn_list_entry head;
+	/** Hash table of #lsdn_name, keyed by #lsdn_name.str. */
+	struct lsdn_name *ht;
 };
 
 /** Individual name entry. */
 struct lsdn_name {
 	/** Name. */
 	char* str;
-	/** List membership. */
-	struct lsdn_list_entry entry;
+	/** Table the name is registered in, `NULL` if the name is not set. */
+	struct lsdn_names *table;
+	/** Hash table membership. */
+	UT_hash_handle hh;
 };
 
 void lsdn_names_init(struct lsdn_names *tab);
@@ -27,4 +33,3 @@ lsdn_err_t lsdn_name_set(struct lsdn_name *name, struct lsdn_names *table, const
 void lsdn_name_init(struct lsdn_name *name);
 void lsdn_name_free(struct lsdn_name *name);
 struct lsdn_name * lsdn_names_search(struct lsdn_names *tab, const char* key);
-// TODO: allow names removal
@@ -28,8 +28,12 @@ struct lsdn_remote_pa {
 		struct lsdn_sbridge_route sbridge_route;
 		struct lsdn_lbridge_route lbridge_route;
 	};
+	/** Tunnel metadata for the packets sent to the remote PA, for the metadata-mode tunnels. */
+	struct lsdn_shared_action tunnel_key;
 };
 
+lsdn_err_t lsdn_remote_pa_tunnel_key_init(struct lsdn_remote_pa *pa, struct lsdn_action_desc *action);
+
 /** Per-local PA view of a remote virt. TODO
  * This structure exists for each combination
  * of (local PA, virt on any other PA).
@@ -40,7 +44,10 @@ struct lsdn_remote_virt {
 	struct lsdn_remote_pa *pa;
 	struct lsdn_virt *virt;
 
-	struct lsdn_sbridge_mac sbridge_mac;
+	union {
+		struct lsdn_sbridge_mac sbridge_mac;
+		struct lsdn_lbridge_mac lbridge_mac;
+	};
 };
 
 /** Implementations of network operations.
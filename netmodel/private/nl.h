@@ -2,9 +2,11 @@
 
 #include "../include/errors.h"
 #include "../include/nettypes.h"
+#include "../include/lsdn.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <arpa/inet.h>
 #include <libmnl/libmnl.h>
 #include <linux/tc_act/tc_gact.h>
@@ -12,11 +14,25 @@
 #include <linux/if_link.h>
 #include <linux/if_ether.h>
 #include <linux/rtnetlink.h>
+#include <linux/bpf.h>
+#include <uthash.h>
 
 
 /* Pseudo-handle for the linux ingress qdiscs */
 #define LSDN_INGRESS_HANDLE 0xffff0000
 #define LSDN_ROOT_HANDLE 0x00010000
+/* Parents for filters attached to the ingress and egress hooks of a clsact qdisc
+ * (the clsact qdisc itself has LSDN_INGRESS_HANDLE) */
+#define LSDN_CLSACT_INGRESS_PARENT 0xfffffff2
+#define LSDN_CLSACT_EGRESS_PARENT 0xfffffff3
+/* Band of the root prio qdisc (#LSDN_ROOT_HANDLE) all the egress traffic goes through */
+#define LSDN_ROOT_BAND 0x00010001
+/* The shaper of a virt's interface: HTB qdisc, its only class and the fq_codel qdisc in it */
+#define LSDN_SHAPING_HANDLE 0x00020000
+#define LSDN_SHAPING_CLASS 0x00020001
+#define LSDN_SHAPING_LEAF_HANDLE 0x00030000
+/* Pseudo-ifindex for filters of a shared block, the block index is then given as the parent */
+#define LSDN_BLOCK_IFINDEX TCM_IFINDEX_MAGIC_BLOCK
 
 /* Default priority for our fixed-function filters
  * (like those who catch ingress trafic and redirect to appropriate internal if)
@@ -25,6 +41,8 @@
 
 #define LSDN_DEFAULT_CHAIN 0
 
+struct lsdn_nl;
+
 /**
  * A handle used to identify a linux interface, stores both name and ifindex.
  *
@@ -69,75 +87,318 @@ static inline bool lsdn_if_is_set(const struct lsdn_if *lsdn_if)
  * Make sure the ifindex is valid, if possible.
  *
  * If sucesfull, fills in the ifindex and moves the lsdn_if into *resolved* state.
+ * The name is looked up in the link cache of the socket (see #lsdn_link_cache_sync). If the socket
+ * is NULL or the cache is not available, the kernel is asked directly.
  */
-lsdn_err_t lsdn_if_resolve(struct lsdn_if *lsdn_if);
+lsdn_err_t lsdn_if_resolve(struct lsdn_nl *sock, struct lsdn_if *lsdn_if);
+
+/** Cached state of a kernel network interface. */
+struct lsdn_link_info {
+	unsigned int ifindex;
+	char name[IF_NAMESIZE];
+	unsigned int mtu;
+	UT_hash_handle hh_name;
+	UT_hash_handle hh_index;
+};
+
+/** Callback notified when a batched netlink request fails. */
+typedef void (*lsdn_nl_err_cb)(lsdn_err_t err, void *user);
+
+/** Owner of batched netlink requests.
+ * Errors of the batched requests are reported to the owner that was active when the request
+ * was queued, so that they can be attributed to the right object. */
+struct lsdn_nl_owner {
+	lsdn_nl_err_cb cb;
+	void *user;
+};
+
+/** Callbacks around the blocking calls on the request channel.
+ * Allow other threads to run while a socket waits for the kernel (see the parallel commit in
+ * #lsdn_context_set_commit_workers). */
+struct lsdn_nl_io_hooks {
+	/** Called before a request is sent or a response is received. */
+	void (*before)(void *user);
+	/** Called after the call returns, before the response is processed. */
+	void (*after)(void *user);
+	void *user;
+};
+
+/** Maximum number of requests sent in a single batch.
+ * All ACKs for the batch must fit into the socket receive buffer. */
+#define LSDN_NL_BATCH_MSGS 64
+/** Size of the buffer holding the batched requests. */
+#define LSDN_NL_BATCH_SIZE (8 * MNL_SOCKET_BUFFER_SIZE)
+/** Space reserved for receiving a single ACK (capped, with extended error message). */
+#define LSDN_NL_ACK_SIZE 1024
+
+/** Channel of a netlink transport. */
+enum lsdn_nl_channel {
+	/** Requests and their responses. */
+	LSDN_NL_REQUESTS,
+	/** Link dumps and link change notifications, used for the link cache. */
+	LSDN_NL_LINKS,
+	LSDN_NL_CHANNEL_COUNT
+};
 
-struct mnl_socket *lsdn_socket_init();
+struct lsdn_nl_transport;
+struct mmsghdr;
+
+/** Operations of a netlink transport.
+ * The operations follow the semantics of the corresponding socket calls: they return -1 and
+ * set `errno` on failure and every response (or group of dump responses) is received as a
+ * separate datagram. */
+struct lsdn_nl_transport_ops {
+	/** Open a channel. The link channel is subscribed to link notifications. */
+	int (*open)(struct lsdn_nl_transport *t, enum lsdn_nl_channel ch);
+	/** Send one or more requests. */
+	ssize_t (*send)(struct lsdn_nl_transport *t, enum lsdn_nl_channel ch,
+		const void *buf, size_t len);
+	/** Receive a datagram. If `wait` is false and nothing is pending, fails with `EAGAIN`.
+	 * Fails with `ENOSPC` if the datagram does not fit into the buffer. */
+	ssize_t (*recv)(struct lsdn_nl_transport *t, enum lsdn_nl_channel ch,
+		void *buf, size_t len, bool wait);
+	/** Receive up to `count` datagrams from the request channel, waiting only for the first
+	 * one (like `recvmmsg` with `MSG_WAITFORONE`). */
+	int (*recv_many)(struct lsdn_nl_transport *t, struct mmsghdr *msgs, unsigned int count);
+	/** Call the `bpf` system call. BPF maps and programs are not managed through netlink, but
+	 * they belong to the same kernel as the filters using them. */
+	int (*bpf)(struct lsdn_nl_transport *t, int cmd, union bpf_attr *attr, unsigned int size);
+	/** Close a file descriptor returned by #bpf. */
+	void (*close_fd)(struct lsdn_nl_transport *t, int fd);
+	/** Close all channels and free the transport. */
+	void (*free)(struct lsdn_nl_transport *t);
+};
+
+/** Netlink transport, the way the requests get to the kernel.
+ * Normally the requests are sent through netlink sockets (see #lsdn_nl_transport_mnl_new),
+ * but they can be also processed by an emulated kernel (see #lsdn_mock_transport_new).
+ * Implementations embed this structure. */
+struct lsdn_nl_transport {
+	const struct lsdn_nl_transport_ops *ops;
+};
 
-void lsdn_socket_free(struct mnl_socket *s);
+struct lsdn_nl_transport *lsdn_nl_transport_mnl_new(void);
 
-lsdn_err_t lsdn_link_dummy_create(struct mnl_socket *sock,
+/** A batched request waiting for its ACK. */
+struct lsdn_nl_pending {
+	uint32_t seq;
+	bool acked;
+	struct lsdn_nl_owner owner;
+	/** Called when the request is acknowledged, successfully or not. */
+	lsdn_nl_err_cb done;
+	void *done_user;
+};
+
+/**
+ * Netlink socket used for talking to the kernel.
+ *
+ * Assigns a sequence number to every request and matches the responses by it. In batching mode,
+ * filter and FDB requests are not sent immediately, but collected and sent using a single
+ * `sendmsg` call (see #lsdn_nl_batch_begin). Other requests are always synchronous and flush the
+ * batch first, so the ordering of the requests is kept.
+ */
+struct lsdn_nl {
+	struct lsdn_nl_transport *transport;
+	/** Sequence number of the last request. */
+	uint32_t seq;
+	bool batching;
+	/** Owner assigned to newly queued requests. */
+	struct lsdn_nl_owner owner;
+	char *batch_buf;
+	size_t batch_len;
+	char *ack_buf;
+	struct lsdn_nl_pending pending[LSDN_NL_BATCH_MSGS];
+	size_t pending_count;
+	/** Number of failed requests queued without an owner. */
+	size_t orphan_errors;
+	/** Requests sent since the counters were last cleared (by zeroing them). */
+	struct lsdn_nl_stats stats;
+	/** Free filters (and their message buffers) ready for reuse. */
+	struct lsdn_filter *filter_pool;
+	size_t filter_pool_count;
+	/** Maximum number of free filters kept in the pool, zero disables the reuse. */
+	size_t filter_pool_max;
+	/** The link channel of the transport is open, notifications keep the link cache up to date. */
+	bool links_open;
+	/** The link cache was filled by a dump and no notifications were lost since. */
+	bool links_valid;
+	struct lsdn_link_info *links_by_name;
+	struct lsdn_link_info *links_by_index;
+	/** Socket whose link cache is used, the socket itself unless shared. */
+	struct lsdn_nl *link_cache;
+	struct lsdn_nl_io_hooks io_hooks;
+	/** Existing kernel objects are adopted instead of replaced (see #lsdn_nl_reconcile_begin). */
+	bool reconcile;
+	/** Some touched object could not be recorded, nothing is safe to sweep. */
+	bool touched_lost;
+	/** Kernel objects created or adopted while reconciling. */
+	struct lsdn_nl_touched *touched;
+};
+
+/** Maximum number of free filters kept in the pool of a socket. */
+#define LSDN_NL_FILTER_POOL 16
+/** Size of the buffer for receiving link dumps and notifications. */
+#define LSDN_NL_DUMP_SIZE 32768
+/** How many times an interrupted link dump is restarted before giving up. */
+#define LSDN_NL_DUMP_RETRIES 3
+
+struct lsdn_nl *lsdn_socket_init();
+struct lsdn_nl *lsdn_socket_init_transport(struct lsdn_nl_transport *transport);
+
+void lsdn_socket_free(struct lsdn_nl *s);
+
+/** Start queueing filter and FDB requests instead of sending them immediately.
+ * The queued requests return #LSDNE_OK and the kernel errors are reported to the owner
+ * (see #lsdn_nl_set_owner) when the batch is flushed. */
+void lsdn_nl_batch_begin(struct lsdn_nl *s);
+/** Send all queued requests and wait for their ACKs.
+ * @retval LSDNE_NETLINK if the batch could not be sent or received (the owners are notified). */
+lsdn_err_t lsdn_nl_batch_flush(struct lsdn_nl *s);
+/** Flush the queued requests and switch back to synchronous mode.
+ * @retval LSDNE_NETLINK if any of the requests without an owner has failed. */
+lsdn_err_t lsdn_nl_batch_end(struct lsdn_nl *s);
+/** Set the owner for newly queued requests.
+ * @return The previous owner, so that it can be restored later. */
+struct lsdn_nl_owner lsdn_nl_set_owner(struct lsdn_nl *s, struct lsdn_nl_owner owner);
+
+/** Use the link cache of another socket, which must outlive this one.
+ * The links are then dumped and tracked only once for a group of sockets. */
+void lsdn_nl_share_link_cache(struct lsdn_nl *s, struct lsdn_nl *cache);
+/** Set the maximum number of free filters kept for reuse, #LSDN_NL_FILTER_POOL by default. */
+void lsdn_nl_set_filter_pool(struct lsdn_nl *s, size_t max);
+/** Set the callbacks called around the blocking calls of the socket. */
+void lsdn_nl_set_io_hooks(struct lsdn_nl *s, struct lsdn_nl_io_hooks hooks);
+
+/** Start reconciling the kernel state with the requests sent through the socket.
+ *
+ * Until #lsdn_nl_reconcile_end is called, links matching the creation request (same kind, lower
+ * device and parameters) are adopted instead of being deleted and created again, qdiscs of the
+ * same kind are kept and filters are replaced in place. All links, qdiscs, filters and FDB
+ * entries created or adopted are recorded. */
+void lsdn_nl_reconcile_begin(struct lsdn_nl *s);
+/** Delete the stale kernel objects and stop reconciling.
+ *
+ * Removes the filters found on the recorded qdiscs and the permanent FDB entries found on the
+ * recorded links that were not created through the socket since #lsdn_nl_reconcile_begin, and
+ * the shared actions from the range starting at `action_first` that were not created. Then
+ * removes the links whose name starts with `link_prefix` that were not created or adopted.
+ * @retval LSDNE_NETLINK if the kernel state could not be dumped or some stale object could not
+ * be removed. */
+lsdn_err_t lsdn_nl_reconcile_end(struct lsdn_nl *s, const char *link_prefix, uint32_t action_first);
+
+/** Bring the link cache up to date.
+ *
+ * On first use (or when notifications were lost), all links are dumped from the kernel. Afterwards,
+ * only the pending link notifications are applied, so the call is cheap.
+ * @retval LSDNE_NETLINK if the cache is not available. */
+lsdn_err_t lsdn_link_cache_sync(struct lsdn_nl *s);
+/** Find a link in the cache by name.
+ * The cache is synchronized if the link is not found.
+ * @return The cached link state, valid until the next cache synchronization, or NULL. */
+const struct lsdn_link_info *lsdn_link_lookup_name(struct lsdn_nl *s, const char *name);
+/** Find a link in the cache by ifindex, see #lsdn_link_lookup_name. */
+const struct lsdn_link_info *lsdn_link_lookup_index(struct lsdn_nl *s, unsigned int ifindex);
+
+lsdn_err_t lsdn_link_dummy_create(struct lsdn_nl *sock,
 		struct lsdn_if *dst_if,
 		const char *if_name, bool overwrite);
 
-lsdn_err_t lsdn_link_vlan_create(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_vlan_create(struct lsdn_nl *sock,
 		struct lsdn_if *dst_if, const char *if_name,
 		const char *vlan_name, uint16_t vlanid, bool overwrite);
 
-lsdn_err_t lsdn_link_vxlan_create(struct mnl_socket *sock, struct lsdn_if* dst_if,
+lsdn_err_t lsdn_link_vxlan_create(struct lsdn_nl *sock, struct lsdn_if* dst_if,
 		const char *if_name, const char *vxlan_name,
 		lsdn_ip_t *mcast_group, uint32_t vxlanid, uint16_t port,
-		bool learning, bool collect_metadata, enum lsdn_ipv ipv, bool overwrite);
+		bool learning, bool collect_metadata, enum lsdn_ipv ipv,
+		const struct lsdn_tunnel_opts *opts, bool overwrite);
 
-lsdn_err_t lsdn_link_geneve_create(struct mnl_socket *sock, struct lsdn_if* dst_if,
-	const char *new_if, uint16_t port, bool collect_metadata, bool overwrite);
+lsdn_err_t lsdn_link_geneve_create(struct lsdn_nl *sock, struct lsdn_if* dst_if,
+	const char *new_if, uint16_t port, bool collect_metadata,
+	const struct lsdn_tunnel_opts *opts, bool overwrite);
 
-lsdn_err_t lsdn_link_veth_create(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_veth_create(struct lsdn_nl *sock,
 		struct lsdn_if *if1, const char *if_name1,
 		struct lsdn_if *if2, const char *if_name2);
 
-lsdn_err_t lsdn_link_bridge_create(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_bridge_create(struct lsdn_nl *sock,
 		struct lsdn_if *dst_id,
-		const char *if_name, bool overwrite);
+		const char *if_name, bool vlan_filtering, bool overwrite);
 
-lsdn_err_t lsdn_link_delete(struct mnl_socket *sock, struct lsdn_if *iface);
+lsdn_err_t lsdn_bridge_port_set_vlan_tunnel(struct lsdn_nl *sock, unsigned int ifindex);
+lsdn_err_t lsdn_bridge_vlan_add(struct lsdn_nl *sock, unsigned int ifindex, uint16_t vid,
+	bool access, uint32_t tunnel_id);
+lsdn_err_t lsdn_bridge_port_reset_vlans(struct lsdn_nl *sock, unsigned int ifindex);
+lsdn_err_t lsdn_bridge_vlan_delete(struct lsdn_nl *sock, unsigned int ifindex, uint16_t vid,
+	uint32_t tunnel_id);
 
-lsdn_err_t lsdn_link_get_mtu(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_delete(struct lsdn_nl *sock, struct lsdn_if *iface);
+
+lsdn_err_t lsdn_link_get_mtu(struct lsdn_nl *sock,
 		unsigned int ifindex, unsigned int *mtu);
 
-lsdn_err_t lsdn_link_set_master(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_set_master(struct lsdn_nl *sock,
 		unsigned int master, unsigned int slave);
 
-lsdn_err_t lsdn_link_set_ip(struct mnl_socket *sock,
+lsdn_err_t lsdn_link_set_ip(struct lsdn_nl *sock,
 		const char *iface, lsdn_ip_t ip);
 
-lsdn_err_t lsdn_link_set(struct mnl_socket *sock, unsigned int ifindex, bool up);
+lsdn_err_t lsdn_link_set(struct lsdn_nl *sock, unsigned int ifindex, bool up);
+
+lsdn_err_t lsdn_qdisc_ingress_create(struct lsdn_nl *sock, unsigned int ifindex, bool overwrite);
+lsdn_err_t lsdn_qdisc_egress_create(struct lsdn_nl *sock, unsigned int ifindex, bool overwrite);
+lsdn_err_t lsdn_qdisc_clsact_create(struct lsdn_nl *sock, unsigned int ifindex, bool overwrite);
+lsdn_err_t lsdn_qdisc_clsact_create_block(
+	struct lsdn_nl *sock, unsigned int ifindex, uint32_t block, bool overwrite);
+lsdn_err_t lsdn_qdisc_egress_delete(struct lsdn_nl *sock, unsigned int ifindex);
+lsdn_err_t lsdn_qdisc_ingress_delete(struct lsdn_nl *sock, unsigned int ifindex);
+lsdn_err_t lsdn_qdisc_shaping_create(struct lsdn_nl *sock, unsigned int ifindex, uint32_t parent,
+	uint32_t avg_rate, uint32_t burst);
+lsdn_err_t lsdn_qdisc_shaping_delete(struct lsdn_nl *sock, unsigned int ifindex, uint32_t parent);
 
-lsdn_err_t lsdn_qdisc_ingress_create(struct mnl_socket *sock, unsigned int ifindex, bool overwrite);
-lsdn_err_t lsdn_qdisc_egress_create(struct mnl_socket *sock, unsigned int ifindex, bool overwrite);
-lsdn_err_t lsdn_qdisc_egress_delete(struct mnl_socket *sock, unsigned int ifindex);
-lsdn_err_t lsdn_qdisc_ingress_delete(struct mnl_socket *sock, unsigned int ifindex);
+lsdn_err_t lsdn_fdb_add_entry(struct lsdn_nl *sock, unsigned int ifindex,
+		lsdn_mac_t mac, lsdn_ip_t ip, uint32_t vni);
 
-lsdn_err_t lsdn_fdb_add_entry(struct mnl_socket *sock, unsigned int ifindex,
-		lsdn_mac_t mac, lsdn_ip_t ip);
+lsdn_err_t lsdn_fdb_remove_entry(struct lsdn_nl *sock, unsigned int ifindex,
+		lsdn_mac_t mac, lsdn_ip_t ip, uint32_t vni);
 
-lsdn_err_t lsdn_fdb_remove_entry(struct mnl_socket *sock, unsigned int ifindex,
-		lsdn_mac_t mac, lsdn_ip_t ip);
+/** Point `mac` to the bridge port `ifindex` by a static entry in the bridge's forwarding database. */
+lsdn_err_t lsdn_fdb_add_master_entry(struct lsdn_nl *sock, unsigned int ifindex, lsdn_mac_t mac);
+lsdn_err_t lsdn_fdb_remove_master_entry(struct lsdn_nl *sock, unsigned int ifindex, lsdn_mac_t mac);
 
+/**
+ * A TC filter being constructed.
+ *
+ * Filters are allocated from a pool on the netlink socket and returned there by
+ * #lsdn_filter_free. The message buffer is reused and it is not cleared, only the parts
+ * actually written are valid.
+ */
 struct lsdn_filter {
 	/** setting this flag will replace the existing filter (if any) */
 	bool update;
+	uint32_t chain;
 	struct nlmsghdr *nlh;
 	struct nlattr *nested_opts;
 	struct nlattr *nested_acts;
+	/** Socket owning the pool this filter came from. */
+	struct lsdn_nl *pool;
+	/** Next free filter in the pool. */
+	struct lsdn_filter *next_free;
 };
 
-struct lsdn_filter *lsdn_filter_flower_init(
+struct lsdn_filter *lsdn_filter_flower_init(struct lsdn_nl *sock,
 		uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio);
 
-struct lsdn_filter *lsdn_filter_fw_init(
+struct lsdn_filter *lsdn_filter_fw_init(struct lsdn_nl *sock,
 		uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio);
 
+struct lsdn_filter *lsdn_filter_bpf_init(struct lsdn_nl *sock,
+		uint32_t if_index, uint32_t handle, uint32_t parent, uint32_t chain, uint16_t prio);
+
+/** Set the program of a cls_bpf filter. The program runs in the direct action mode, its return
+ * value is the verdict of the filter (`TC_ACT_*`). */
+void lsdn_bpf_set_prog(struct lsdn_filter *f, int fd, const char *name);
+
 void lsdn_filter_set_update(struct lsdn_filter *f);
 
 void lsdn_filter_free(struct lsdn_filter *f);
@@ -162,11 +423,41 @@ void lsdn_action_redir_egress_add(
 void lsdn_action_mirror_egress_add(
 		struct lsdn_filter *f, uint16_t order, uint32_t ifindex);
 
-void lsdn_action_set_tunnel_key(
-		struct lsdn_filter *f, uint16_t order,
-		uint32_t vni, lsdn_ip_t *src_ip, lsdn_ip_t *dst_ip);
+/** \name Shared actions.
+ * A tunnel_key or police action can be created on its own, with an index chosen by LSDN, and then
+ * referenced by that index from any number of filters. The kernel keeps a single copy of the
+ * action, replacing it changes all the filters at once and a policer shares its buckets among
+ * them. An action can not be deleted while a filter still refers to it.
+ *
+ * The actions are created with the `replace` flag set only to change an existing action of the
+ * context in place. Otherwise, creating an action whose index is taken fails with `EEXIST`
+ * instead of replacing an action of someone else, unless the socket is reconciling (see
+ * #lsdn_nl_reconcile_begin) and the action is adopted. As the request may be batched, the result
+ * is passed to `done` (if not `NULL`) once the kernel has answered. */
+/** @{ */
+
+/** Kinds of the actions that can be shared. */
+enum lsdn_action_kind {
+	LSDN_ACTION_TUNNEL_KEY,
+	LSDN_ACTION_POLICE,
+	LSDN_ACTION_KIND_COUNT
+};
 
-/** If you want to know more, check tcf_act_police in kernel.
+/** First index of the shared actions. The kernel numbers the actions created without an index
+ * from one, LSDN keeps its actions above them. */
+#define LSDN_ACTION_FIRST_INDEX 0x40000000
+/** Size of the shared action index range of a context, as a power of two.
+ * The kernel has a single action index space in a network namespace, so each context takes its
+ * own range above #LSDN_ACTION_FIRST_INDEX (see #lsdn_action_range_first) and only creates,
+ * replaces and, when reconciling, removes the actions from it. */
+#define LSDN_ACTION_RANGE_BITS 20
+
+uint32_t lsdn_action_range_first(const char *ctx_name);
+
+lsdn_err_t lsdn_action_tunnel_key_create(struct lsdn_nl *sock, uint32_t index, bool replace,
+	uint32_t vni, const lsdn_ip_t *src_ip, const lsdn_ip_t *dst_ip,
+	lsdn_nl_err_cb done, void *user);
+/** Create a shared police action. If you want to know more, check tcf_act_police in kernel.
  *
  * The action keeps two token buckets: peak and burst. Each token corresponds to one ns elapsed.
  * Each bucket has a depletion rate -- how fast packets deplete the tokens, in order words,
@@ -214,9 +505,13 @@ void lsdn_action_set_tunnel_key(
  *
  * If you do not want to use \a peakrate, set it to 0.
  */
-void lsdn_action_police(struct lsdn_filter *f,  uint16_t order,
+lsdn_err_t lsdn_action_police_create(struct lsdn_nl *sock, uint32_t index, bool replace,
 	uint32_t avg_rate, uint32_t burst, uint32_t peakrate, uint32_t mtu,
-	int gact_conforming, int gact_overlimit);
+	int gact_conforming, int gact_overlimit, lsdn_nl_err_cb done, void *user);
+lsdn_err_t lsdn_action_delete(struct lsdn_nl *sock, enum lsdn_action_kind kind, uint32_t index);
+/** Add a reference to a shared action to the filter. */
+void lsdn_action_ref(struct lsdn_filter *f, uint16_t order, enum lsdn_action_kind kind, uint32_t index);
+/** @} */
 
 void lsdn_action_drop(struct lsdn_filter *f, uint16_t order);
 
@@ -226,6 +521,28 @@ void lsdn_action_goto_chain(struct lsdn_filter *f, uint16_t order, uint32_t chai
 
 void lsdn_action_skbmark(struct lsdn_filter *f, uint16_t order, uint32_t mark);
 
+/** Maximum number of 32-bit words changed by a single pedit action. */
+#define LSDN_PEDIT_MAX_KEYS 16
+
+/** A word of the packet changed by the pedit action, see tcf_pedit_act in kernel.
+ * The kernel computes `word = (word & mask) ^ val`. */
+struct lsdn_pedit_key {
+	/** Offset from the network header, the ethernet header is at negative offsets. */
+	int32_t off;
+	uint32_t val;
+	uint32_t mask;
+};
+
+/** Description of the packet edits for lsdn_action_pedit. */
+struct lsdn_pedit {
+	size_t nkeys;
+	struct lsdn_pedit_key keys[LSDN_PEDIT_MAX_KEYS];
+};
+
+void lsdn_pedit_init(struct lsdn_pedit *p);
+void lsdn_pedit_set(struct lsdn_pedit *p, int offset, const void *data, size_t len);
+void lsdn_action_pedit(struct lsdn_filter *f, uint16_t order, const struct lsdn_pedit *p);
+
 void lsdn_flower_set_src_mac(struct lsdn_filter *f, const char *addr,
 		const char *addr_mask);
 
@@ -244,9 +561,16 @@ void lsdn_flower_set_src_ipv6(struct lsdn_filter *f, const char *addr,
 void lsdn_flower_set_dst_ipv6(struct lsdn_filter *f, const char *addr,
 		const char *addr_mask);
 
+void lsdn_flower_set_indev(struct lsdn_filter *f, const char *ifname);
+
 void lsdn_flower_set_enc_key_id(struct lsdn_filter *f, uint32_t vni);
 
 void lsdn_flower_set_eth_type(struct lsdn_filter *f, uint16_t eth_type);
+void lsdn_flower_set_arp_op(struct lsdn_filter *f, uint8_t op);
+void lsdn_flower_set_arp_sip(struct lsdn_filter *f, const char *addr,
+		const char *addr_mask);
+void lsdn_flower_set_arp_tip(struct lsdn_filter *f, const char *addr,
+		const char *addr_mask);
 void lsdn_flower_set_enc_dst_ipv4(
 	struct lsdn_filter *f, const char *addr, const char *addr_mask);
 void lsdn_flower_set_enc_dst_ipv6(
@@ -256,7 +580,28 @@ void lsdn_flower_set_enc_src_ipv4(
 void lsdn_flower_set_enc_src_ipv6(
 	struct lsdn_filter *f, const char *addr, const char *addr_mask);
 
-lsdn_err_t lsdn_filter_create(struct mnl_socket *sock, struct lsdn_filter *f);
+lsdn_err_t lsdn_filter_create(struct lsdn_nl *sock, struct lsdn_filter *f);
 
-lsdn_err_t lsdn_filter_delete(struct mnl_socket *sock, uint32_t ifindex, uint32_t handle,
+lsdn_err_t lsdn_filter_delete(struct lsdn_nl *sock, uint32_t ifindex, uint32_t handle,
 		uint32_t parent, uint32_t chain, uint16_t prio);
+/** Delete a filter and call `done` with the result once the kernel has answered.
+ * With batching, that is when the batch is flushed, otherwise before returning. */
+lsdn_err_t lsdn_filter_delete_done(struct lsdn_nl *sock, uint32_t ifindex, uint32_t handle,
+		uint32_t parent, uint32_t chain, uint16_t prio, lsdn_nl_err_cb done, void *user);
+
+/** Create a BPF hash map. The entries are allocated as they are added.
+ * @retval LSDNE_NETLINK if the kernel refused to create the map. */
+lsdn_err_t lsdn_bpf_map_create(struct lsdn_nl *sock,
+		uint32_t key_size, uint32_t value_size, uint32_t max_entries, int *fd);
+/** Add a BPF map entry or replace the existing one. */
+lsdn_err_t lsdn_bpf_map_update(struct lsdn_nl *sock, int fd, const void *key, const void *value);
+/** Remove a BPF map entry. */
+lsdn_err_t lsdn_bpf_map_delete(struct lsdn_nl *sock, int fd, const void *key);
+/** Load a BPF program for the cls_bpf classifier.
+ * If the verifier rejects the program, its log is written to the `nlerr` log category.
+ * @retval LSDNE_NETLINK if the program could not be loaded. */
+lsdn_err_t lsdn_bpf_prog_load(struct lsdn_nl *sock,
+		const struct bpf_insn *insns, size_t count, int *fd);
+/** Close the file descriptor of a BPF map or program. The object lives on as long as
+ * something in the kernel (like a filter) uses it. */
+void lsdn_bpf_close(struct lsdn_nl *sock, int fd);
@@ -0,0 +1,27 @@
+/** \file
+ * Emulated kernel for the netlink transport.
+ *
+ * The mock kernel processes the netlink requests in-process, keeping tables of links, qdiscs,
+ * filter chains, filters and FDB entries. Requests are checked against the tables the same way
+ * the kernel does (creating an existing object fails with `EEXIST`, deleting a missing one with
+ * `ENOENT` or `ENODEV`...) and the links, filters and FDB entries can be dumped, but nothing is
+ * installed to the real kernel. This allows running (and measuring) commits of large models
+ * without root privileges and real interfaces.
+ *
+ * The emulation only covers the requests LSDN sends. Filter and action options are accepted,
+ * but not interpreted. BPF hash maps keep their entries, but BPF programs are not verified or
+ * run. The kernel can be shared by transports used from different threads. */
+#pragma once
+
+#include "nl.h"
+#include "mock.h"
+
+struct lsdn_mock_kernel;
+
+struct lsdn_mock_kernel *lsdn_mock_kernel_new(void);
+struct lsdn_mock_kernel *lsdn_mock_kernel_ref(struct lsdn_mock_kernel *k);
+void lsdn_mock_kernel_free(struct lsdn_mock_kernel *k);
+lsdn_err_t lsdn_mock_kernel_add_link(struct lsdn_mock_kernel *k, const char *name);
+void lsdn_mock_kernel_get_state(struct lsdn_mock_kernel *k, struct lsdn_mock_state *state);
+
+struct lsdn_nl_transport *lsdn_mock_transport_new(struct lsdn_mock_kernel *k);
@@ -0,0 +1,15 @@
+/** \file
+ * Recording netlink transport, used for planning commits (see #lsdn_commit_plan).
+ *
+ * Requests changing the kernel state are not sent, but recorded as #lsdn_plan_op and
+ * acknowledged as if they have succeeded. Requests only reading the state (link, filter and FDB
+ * dumps) are passed to the underlying transport. Links that would be created are announced on the
+ * link channel under made-up interface indices (see #LSDN_PLAN_FIRST_IFINDEX), so that they can be
+ * resolved the usual way. The `bpf` calls are recorded too, the BPF maps and programs get made-up
+ * file descriptors. */
+#pragma once
+
+#include "nl.h"
+
+struct lsdn_nl_transport *lsdn_record_transport_new(
+	struct lsdn_nl_transport *inner, struct lsdn_plan *plan);
@@ -17,6 +17,9 @@
 #define LSDN_IF_PRIO_FALLBACK 0xFF02
 #define LSDN_IF_PRIO_SOURCE 0xFF03
 #define LSDN_SBRIDGE_IF_SUBPRIO 0xFFFFFF00
+/** The two chains alternately holding the rules of a versioned ruleset (see #lsdn_ruleset.versioned).
+ * They are above the chains allocated for the sbridge broadcast on the same interface. */
+#define LSDN_RULESET_VERSION_CHAIN 0x10000
 
 /** Action generator callback signature.
  * @see lsdn_action_desc */
@@ -37,6 +40,29 @@ struct lsdn_action_desc {
 };
 
 void lsdn_action_init(struct lsdn_action_desc *action, size_t count, lsdn_mkaction_fn fn, void *user);
+
+/** A tc action shared by the filters of many rules (see the shared actions in `nl.h`).
+ * The action is created in the kernel right away, before the filters referring to it are flushed.
+ * Its deletion is postponed after the flush, when no filter refers to it any more, and so is the
+ * reuse of its index. */
+struct lsdn_shared_action {
+	struct lsdn_context *ctx;
+	enum lsdn_action_kind kind;
+	uint32_t index;
+	/** Cleared if the kernel refused to create the action, the index is taken by someone else. */
+	bool created;
+};
+
+lsdn_err_t lsdn_shared_tunnel_key_init(
+	struct lsdn_shared_action *action, struct lsdn_context *ctx,
+	uint32_t vni, const lsdn_ip_t *src_ip, const lsdn_ip_t *dst_ip);
+lsdn_err_t lsdn_shared_police_init(
+	struct lsdn_shared_action *action, struct lsdn_context *ctx,
+	uint32_t avg_rate, uint32_t burst, uint32_t peakrate, uint32_t mtu,
+	int gact_conforming, int gact_overlimit);
+void lsdn_shared_action_free(struct lsdn_shared_action *action);
+/** Action constructor referring to the #lsdn_shared_action given as `user`, it is a single action. */
+void lsdn_mkaction_shared(struct lsdn_filter *f, uint16_t order, void *user);
 bool lsdn_target_supports_masking(enum lsdn_rule_target);
 
 struct lsdn_flower_rule;
@@ -60,6 +86,8 @@ union lsdn_matchdata {
 	/** Value as tunnel key ID. */
 	uint32_t enc_key_id;
 	uint32_t skbmark;
+	/** Value as interface name (`IFNAMSIZ` is the same as #LSDN_MAX_MATCH_LEN). */
+	char indev[LSDN_MAX_MATCH_LEN];
 };
 
 #define LSDN_KEY_SIZE (LSDN_MAX_MATCH_LEN * LSDN_MAX_MATCHES)
@@ -119,11 +147,25 @@ struct lsdn_ruleset {
 	/** LSDN context. */
 	struct lsdn_context *ctx;
 	uint32_t parent_handle;
+	/** Chain with the filters, the active version if versioned. */
 	uint32_t chain;
 	int prio_start;
 	int prio_count;
 
 	struct lsdn_ruleset_prio *hash_prios;
+
+	/** @name Versioned rulesets.
+	 * A versioned ruleset is rebuilt in a fresh chain whenever it changes and the traffic is switched
+	 * to it by replacing a single entry filter (see #lsdn_context_set_versioned_rules). */
+	/** @{ */
+	bool versioned;
+	/** Chain with the entry filter jumping to the active version. */
+	uint32_t entry_chain;
+	/** Was the entry filter already sent to the kernel? */
+	bool entry_committed;
+	/** Membership in #lsdn_context.pending_rs_list, if the ruleset needs to be rebuilt. */
+	struct lsdn_list_entry pending_entry;
+	/** @} */
 };
 
 struct lsdn_ruleset_prio {
@@ -132,6 +174,10 @@ struct lsdn_ruleset_prio {
 	union lsdn_matchdata masks[LSDN_MAX_MATCHES];
 	struct lsdn_ruleset *parent;
 	struct lsdn_idalloc handle_alloc;
+	/** Handles of deleted filters waiting for the kernel to confirm the delete. */
+	unsigned int releasing;
+	/** The priority was removed, it is freed once no handles are being released. */
+	bool removed;
 
 	UT_hash_handle hh;
 	struct lsdn_flower_rule *hash_fl_rules;
@@ -146,6 +192,14 @@ struct lsdn_flower_rule {
 	uint32_t fl_handle;
 	/** List of rules that are combined into these flower rules */
 	struct lsdn_list_entry sources_list;
+	/** Priority the rule belongs to. */
+	struct lsdn_ruleset_prio *prio;
+	/** Was the filter already sent to the kernel? */
+	bool committed;
+	/** Membership in #lsdn_context.pending_fl_list, if the filter needs to be (re)sent. */
+	struct lsdn_list_entry pending_entry;
+	/** Owner of the change, notified if sending the filter fails. */
+	struct lsdn_nl_owner owner;
 	UT_hash_handle hh;
 };
 
@@ -165,52 +219,16 @@ void lsdn_rule_apply_mask(
 	struct lsdn_rule *r, enum lsdn_rule_target targets[], union lsdn_matchdata masks[]);
 lsdn_err_t lsdn_ruleset_remove(struct lsdn_rule *rule);
 void lsdn_ruleset_free(struct lsdn_ruleset *ruleset);
+void lsdn_rulesets_flush(struct lsdn_context *ctx);
 
+/* The actions list in kernel is limited to TCA_ACT_MAX_PRIO */
 #define LSDN_MAX_ACT_PRIO 32
 
-/* Represents an action mirroring packets to different entities. It is the analogy of
- * struct lsdn_flower for the broadcast case.
- *
- * Because the actions list in kernel is limited to TCA_ACT_MAX_PRIO (=32), we need to split
- * the actions among multiple filters for a long list. For this reasons, the user provides
- * callbacks for creating the actions. For composability, multiple lsdn_action_desc entries
- * can be given using lsdn_action_desc.
- */
-struct lsdn_broadcast {
-	struct lsdn_context *ctx;
-	struct lsdn_if *iface;
-	/* First priority usable for our filter chain */
-	uint32_t chain;
-	uint16_t free_prio;
-	struct lsdn_list_entry filters_list;
-};
-
-struct lsdn_broadcast_action {
-	struct lsdn_broadcast_filter *filter;
-	size_t filter_entry_index;
-	struct lsdn_action_desc action;
-};
-
-struct lsdn_broadcast_filter {
-	struct lsdn_broadcast *broadcast;
-	struct lsdn_list_entry filters_entry;
-	int prio;
-	size_t free_actions;
-	/* The last action is reserved for the potential continue action,
-	 * that is why we keep track of at most LSDN_MAX_PRIO - 1 actions.
-	 */
-	struct lsdn_broadcast_action *actions[LSDN_MAX_ACT_PRIO - 1];
-};
-
-void lsdn_broadcast_init(struct lsdn_broadcast *br, struct lsdn_context *ctx, struct lsdn_if *iface, int chain);
-lsdn_err_t lsdn_broadcast_add(struct lsdn_broadcast *br, struct lsdn_broadcast_action *action, struct lsdn_action_desc desc);
-lsdn_err_t lsdn_broadcast_remove(struct lsdn_broadcast_action *action);
-lsdn_err_t lsdn_broadcast_free(struct lsdn_broadcast *br);
-
 const char* lsdn_rule_target_name(enum lsdn_rule_target t);
 
 #define LSDN_VR_SUBPRIO 0
 struct lsdn_vr {
+	struct lsdn_virt *virt;
 	struct lsdn_list_entry rules_entry;
 	uint8_t pos;
 	enum lsdn_state state;
@@ -234,4 +252,5 @@ struct lsdn_vr_action {
 	struct lsdn_action_desc desc;
 };
 
+void lsdn_vr_do_free(struct lsdn_vr *vr);
 void lsdn_vr_do_free_all_rules(struct lsdn_virt *virt);
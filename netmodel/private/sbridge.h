@@ -13,7 +13,57 @@ struct lsdn_sbridge;
 struct lsdn_sbridge_if;
 struct lsdn_sbridge_if_route;
 
-/* A single static bridge */
+struct lsdn_sbridge_phys_if {
+	/* TODO: Lbridge now can use it to, rename it and move it */
+	struct lsdn_if *iface;
+	struct lsdn_ruleset_prio *rules_match_mac;
+	struct lsdn_ruleset_prio *rules_fallback;
+	struct lsdn_ruleset_prio *rules_source;
+	/* The rules are in a shared block, the interfaces are told apart by LSDN_MATCH_INDEV and
+	 * the fallback rule is common for all of them (see lsdn_sbridge_block). */
+	bool shared;
+};
+
+/* Shared tc block bound to the ingress of the local virts of a static bridge
+ * (see lsdn_context_set_shared_blocks).
+ *
+ * The fallback rule redirecting the unicast traffic to the bridge is installed only once for
+ * all the member virts. The broadcast classification stays per virt, because it marks the packets
+ * with the source interface, but it lives in the block too, so the virts do not need their own
+ * ingress filters. */
+struct lsdn_sbridge_block {
+	/* Block index, valid if there are any members */
+	uint32_t index;
+	size_t members;
+	/* Pseudo-interface for addressing the filters of the block */
+	struct lsdn_if iface;
+	struct lsdn_ruleset ruleset;
+	struct lsdn_sbridge_phys_if phys_if;
+	struct lsdn_rule rule_fallback;
+};
+
+/* A single static bridge
+ *
+ * Broadcast packets are marked with the mark of their source sbridge_if and redirected to the
+ * bridge interface, where they are replicated to all the routes of the bridge. Each route has
+ * its own chain there, with a filter sending the packet to the route and a fw filter skipping
+ * that for the packets marked by the route's own sbridge_if. The chains are linked into a list
+ * by goto_chain actions, starting from the head chain. So adding or removing a route only
+ * changes its own chain and the chain before it, no matter how many routes there are.
+ *
+ * Before the replication, the broadcasts pass the ARP responder. An ARP request of a local virt
+ * with a known IP address for a virt with a known IP address is turned into the reply right
+ * there and sent back to the requester. The request passes three chains: the source chain
+ * checks the sender against the local virt it came from, the target chain fills in the answer
+ * of the target virt and the reply chain fills in the requester and sends the reply to the
+ * interface given by the mark. The IPv6 neighbor solicitations are answered the same way by a
+ * BPF program at the start of the source chain, with the requesters (by the mark) and the targets
+ * (by the address) in two BPF hash maps. Flower can not match the target address of the
+ * solicitation. Everything else goes on to the replication.
+ *
+ * The unicast packets are switched by a flower filter for each MAC address. Alternatively (see
+ * lsdn_context_set_bpf_switching), a single BPF program before them looks the MAC address up in
+ * a BPF hash map, which then holds the destinations instead of the filters. */
 struct lsdn_sbridge {
 	struct lsdn_list_entry if_list;
 	struct lsdn_context *ctx;
@@ -21,6 +71,35 @@ struct lsdn_sbridge {
 	struct lsdn_if bridge_if;
 	struct lsdn_ruleset bridge_ruleset_main;
 	struct lsdn_ruleset_prio *bridge_ruleset;
+	struct lsdn_sbridge_block block;
+
+	/* Chains of the broadcast replication on the bridge interface */
+	struct lsdn_idalloc br_chain_ids;
+	/* Marks of the sbridge_ifs */
+	struct lsdn_idalloc if_marks;
+	uint32_t bcast_head_chain;
+	/* Routes in the order of the replication */
+	struct lsdn_list_entry bcast_list;
+	struct lsdn_ruleset_prio *bcast_prio;
+	struct lsdn_rule rule_bcast;
+
+	/* Chains of the ARP responder on the bridge interface */
+	uint32_t arp_src_chain;
+	uint32_t arp_dst_chain;
+	uint32_t arp_reply_chain;
+	/* Handles of the filters in the target chain */
+	struct lsdn_idalloc arp_handles;
+
+	/* The neighbor discovery responder, created with the first IPv6 address */
+	bool nd;
+	int nd_requesters;
+	int nd_targets;
+	int nd_prog;
+
+	/* The unicast destinations are in the BPF map instead of bridge_ruleset */
+	bool bpf;
+	int bpf_map;
+	int bpf_prog;
 };
 
 typedef void (*lsdn_mkmatch_cb)(struct lsdn_filter *f, void *user);
@@ -34,42 +113,45 @@ struct lsdn_sbridge_if {
 	 * or set it to false if not.
 	 */
 	struct lsdn_sbridge_phys_if *phys_if;
+	/* The interface the traffic for this sbridge_if is sent to. Usually phys_if->iface, but the
+	 * rules of a shared phys_if are not on the outgoing interface. */
+	struct lsdn_if *out_if;
 
 	enum lsdn_rule_target additional_match;
 	union lsdn_matchdata additional_matchdata;
 
 	/* Private part starts here */
-	struct lsdn_broadcast broadcast;
+	/* Mark of the broadcast packets coming from this interface */
+	uint32_t mark;
+	/* The ARP requests from this interface are answered by the bridge */
+	bool arp_requester;
+	/* And so are the neighbor solicitations */
+	bool nd_requester;
 	struct lsdn_sbridge *bridge;
 	struct lsdn_list_entry if_entry;
 	struct lsdn_list_entry route_list;
-	struct lsdn_clist cl_owner;
 
 	struct lsdn_rule rule_match_br;
 	struct lsdn_rule rule_fallback;
 };
 
-struct lsdn_sbridge_phys_if {
-	/* TODO: Lbridge now can use it to, rename it and move it */
-	struct lsdn_if *iface;
-	struct lsdn_idalloc br_chain_ids;
-	struct lsdn_ruleset_prio *rules_match_mac;
-	struct lsdn_ruleset_prio *rules_fallback;
-	struct lsdn_ruleset_prio *rules_source;
-};
-
 /* Outgoing route from a bridge. because data outgoing from the bridge sometimes need a tunneling metadata,
  * so there might be multiple routes for single lsdn_sbridge_if.
  */
 struct lsdn_sbridge_route {
 	/* Callback to add an action setting the tunnel metadata.*/
 	struct lsdn_action_desc tunnel_action;
+	/* The same metadata for the BPF switch, if the tunnel_action is set */
+	uint32_t tunnel_vni;
+	const lsdn_ip_t *tunnel_dst;
 
 	/* Private part starts here */
 	struct lsdn_list_entry route_entry;
 	struct lsdn_sbridge_if *iface;
 	struct lsdn_list_entry mac_list;
-	struct lsdn_clist cl_dest;
+	/* Chain replicating the broadcast packets to this route */
+	uint32_t bcast_chain;
+	struct lsdn_list_entry bcast_entry;
 };
 
 struct lsdn_sbridge_mac {
@@ -77,6 +159,11 @@ struct lsdn_sbridge_mac {
 	struct lsdn_list_entry mac_entry;
 	lsdn_mac_t mac;
 	struct lsdn_clist cl_dest;
+	/* Handle of the ARP responder filter answering for this mac, 0 if none */
+	uint32_t arp_handle;
+	/* The neighbor discovery responder answers for this mac and address */
+	bool nd_target;
+	lsdn_ipv6_t nd_ip;
 };
 
 /* Create a bridge using tc rules to route the packets between it's interfaces. Since the bridge
@@ -88,8 +175,11 @@ lsdn_err_t lsdn_sbridge_remove_if(struct lsdn_sbridge_if *iface);
 lsdn_err_t lsdn_sbridge_add_route(struct lsdn_sbridge_if *iface, struct lsdn_sbridge_route *route);
 lsdn_err_t lsdn_sbridge_add_route_default(struct lsdn_sbridge_if *iface, struct lsdn_sbridge_route *route);
 lsdn_err_t lsdn_sbridge_remove_route(struct lsdn_sbridge_route *route);
+/* If the IP address is given (it may be NULL), the bridge answers the ARP requests or the neighbor
+ * solicitations for it */
 lsdn_err_t lsdn_sbridge_add_mac(
-	struct lsdn_sbridge_route* route, struct lsdn_sbridge_mac *mac_entry, lsdn_mac_t mac);
+	struct lsdn_sbridge_route* route, struct lsdn_sbridge_mac *mac_entry, lsdn_mac_t mac,
+	const lsdn_ip_t *ip);
 lsdn_err_t lsdn_sbridge_remove_mac(struct lsdn_sbridge_mac *mac);
 lsdn_err_t lsdn_sbridge_phys_if_init(
 	struct lsdn_context *ctx, struct lsdn_sbridge_phys_if *sbridge_if,
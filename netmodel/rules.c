@@ -69,6 +69,7 @@ struct lsdn_vr *lsdn_vr_new(
 		HASH_ADD(hh, *ht, prio_num, sizeof(prio->prio_num), prio);
 	}
 
+	vr->virt = virt;
 	vr->pos = 0;
 	vr->pending_free = false;
 	vr->state = LSDN_STATE_NEW;
@@ -78,10 +79,12 @@ struct lsdn_vr *lsdn_vr_new(
 		bzero(vr->masks[i].bytes, sizeof(vr->masks[i].bytes));
 	}
 	lsdn_list_init_add(&prio->rules_list, &vr->rules_entry);
+	/* The rule is committed together with the virt */
+	lsdn_virt_mark_dirty(virt);
 	return vr;
 }
 
-static void do_free_vr(struct lsdn_vr *vr)
+void lsdn_vr_do_free(struct lsdn_vr *vr)
 {
 	lsdn_list_remove(&vr->rules_entry);
 	free(vr);
@@ -90,7 +93,7 @@ static void do_free_vr(struct lsdn_vr *vr)
 static void do_free_vr_prio(struct vr_prio **ht, struct vr_prio *prio)
 {
 	lsdn_foreach(prio->rules_list, rules_entry, struct lsdn_vr, r) {
-		do_free_vr(r);
+		lsdn_vr_do_free(r);
 	}
 	HASH_DELETE(hh, *ht, prio);
 	free(prio);
@@ -112,7 +115,10 @@ void lsdn_vr_do_free_all_rules(struct lsdn_virt *virt)
  * @param vr Rule to deallocate. */
 void lsdn_vr_free(struct lsdn_vr *vr)
 {
-	free_helper(vr, do_free_vr);
+	/* The rule is removed from the kernel by the next commit of the virt */
+	if (vr->state != LSDN_STATE_NEW)
+		lsdn_virt_mark_dirty(vr->virt);
+	free_helper(vr, lsdn_vr_do_free);
 }
 
 /** Deallocate all rules for a virt.
@@ -194,6 +200,107 @@ void lsdn_action_init(struct lsdn_action_desc *action, size_t count, lsdn_mkacti
 	action->user = user;
 }
 
+/** A shared action waiting for the flush to be deleted, the #lsdn_shared_action itself may be
+ * freed by then. */
+struct pending_action {
+	struct lsdn_list_entry pending_entry;
+	enum lsdn_action_kind kind;
+	uint32_t index;
+};
+
+static lsdn_err_t shared_action_alloc(
+	struct lsdn_shared_action *action, struct lsdn_context *ctx, enum lsdn_action_kind kind)
+{
+	action->ctx = ctx;
+	action->kind = kind;
+	action->created = true;
+	if (!lsdn_idalloc_get(&ctx->action_ids, &action->index))
+		return LSDNE_NOMEM;
+	return LSDNE_OK;
+}
+
+/* The create request may be batched, the action is only known to be ours once it is answered */
+static void shared_action_created(lsdn_err_t err, void *user)
+{
+	struct lsdn_shared_action *action = user;
+	if (err != LSDNE_OK)
+		action->created = false;
+}
+
+/** Create a shared action setting the tunnel metadata. */
+lsdn_err_t lsdn_shared_tunnel_key_init(
+	struct lsdn_shared_action *action, struct lsdn_context *ctx,
+	uint32_t vni, const lsdn_ip_t *src_ip, const lsdn_ip_t *dst_ip)
+{
+	lsdn_err_t err = shared_action_alloc(action, ctx, LSDN_ACTION_TUNNEL_KEY);
+	if (err != LSDNE_OK)
+		return err;
+	err = lsdn_action_tunnel_key_create(ctx->nlsock, action->index, false, vni, src_ip, dst_ip,
+		shared_action_created, action);
+	if (err != LSDNE_OK)
+		lsdn_idalloc_return(&ctx->action_ids, action->index);
+	return err;
+}
+
+/** Create a shared policer, see #lsdn_action_police_create for the parameters. */
+lsdn_err_t lsdn_shared_police_init(
+	struct lsdn_shared_action *action, struct lsdn_context *ctx,
+	uint32_t avg_rate, uint32_t burst, uint32_t peakrate, uint32_t mtu,
+	int gact_conforming, int gact_overlimit)
+{
+	lsdn_err_t err = shared_action_alloc(action, ctx, LSDN_ACTION_POLICE);
+	if (err != LSDNE_OK)
+		return err;
+	err = lsdn_action_police_create(ctx->nlsock, action->index, false,
+		avg_rate, burst, peakrate, mtu, gact_conforming, gact_overlimit,
+		shared_action_created, action);
+	if (err != LSDNE_OK)
+		lsdn_idalloc_return(&ctx->action_ids, action->index);
+	return err;
+}
+
+/** Schedule the deletion of the shared action, the rules using it must be already removed.
+ * The action is deleted by #lsdn_rulesets_flush. */
+void lsdn_shared_action_free(struct lsdn_shared_action *action)
+{
+	struct lsdn_context *ctx = action->ctx;
+	/* Not ours to delete, nor is its index free for reuse */
+	if (!action->created)
+		return;
+	if (ctx->disable_decommit) {
+		lsdn_idalloc_return(&ctx->action_ids, action->index);
+		return;
+	}
+	struct pending_action *pending = malloc(sizeof(*pending));
+	if (!pending) {
+		/* The action stays in the kernel and its index is not reused */
+		ctx->inconsistent = true;
+		return;
+	}
+	pending->kind = action->kind;
+	pending->index = action->index;
+	lsdn_list_init_add(ctx->pending_action_list.previous, &pending->pending_entry);
+}
+
+void lsdn_mkaction_shared(struct lsdn_filter *f, uint16_t order, void *user)
+{
+	struct lsdn_shared_action *action = user;
+	lsdn_action_ref(f, order, action->kind, action->index);
+}
+
+/* Delete the shared actions no longer used by any filter */
+static void flush_pending_actions(struct lsdn_context *ctx)
+{
+	lsdn_foreach(ctx->pending_action_list, pending_entry, struct pending_action, pending) {
+		lsdn_list_remove(&pending->pending_entry);
+		if (lsdn_action_delete(ctx->nlsock, pending->kind, pending->index) == LSDNE_OK)
+			lsdn_idalloc_return(&ctx->action_ids, pending->index);
+		else
+			ctx->inconsistent = true;
+		free(pending);
+	}
+}
+
 void lsdn_ruleset_init(struct lsdn_ruleset *ruleset, struct lsdn_context *ctx,
 	struct lsdn_if *iface, uint32_t parent_handle, uint32_t chain, uint32_t prio_start, uint32_t prio_count)
 {
@@ -204,6 +311,13 @@ void lsdn_ruleset_init(struct lsdn_ruleset *ruleset, struct lsdn_context *ctx,
 	ruleset->prio_count = prio_count;
 	ruleset->ctx = ctx;
 	ruleset->hash_prios = NULL;
+	ruleset->versioned = ctx->versioned_rules;
+	ruleset->entry_committed = false;
+	lsdn_list_init(&ruleset->pending_entry);
+	if (ruleset->versioned) {
+		ruleset->entry_chain = chain;
+		ruleset->chain = LSDN_RULESET_VERSION_CHAIN;
+	}
 }
 
 static char hexdigit(uint8_t val)
@@ -240,6 +354,7 @@ bool lsdn_target_supports_masking(enum lsdn_rule_target target)
 	switch(target) {
 	case LSDN_MATCH_NONE:
 	case LSDN_MATCH_ENC_KEY_ID:
+	case LSDN_MATCH_INDEV:
 		return false;
 	default:
 		return true;
@@ -262,11 +377,24 @@ struct lsdn_ruleset_prio* lsdn_ruleset_define_prio(struct lsdn_ruleset *rs, uint
 	bzero(&p->targets, sizeof(p->targets));
 	bzero(&p->masks, sizeof(p->masks));
 	lsdn_idalloc_init(&p->handle_alloc, 1, 0xFFFF);
+	p->releasing = 0;
+	p->removed = false;
 	/* warning: HASH_ADD_INT is really only for ints, not uint16_t */
 	HASH_ADD(hh, rs->hash_prios, prio, sizeof(p->prio), p);
 	return p;
 }
 
+/* Free a priority removed from its ruleset, unless some of its handles are still being released */
+static void drop_prio(struct lsdn_ruleset_prio *prio)
+{
+	if (prio->releasing) {
+		prio->removed = true;
+		return;
+	}
+	lsdn_idalloc_free(&prio->handle_alloc);
+	free(prio);
+}
+
 struct lsdn_ruleset_prio *lsdn_ruleset_get_prio(struct lsdn_ruleset *rs, uint16_t main)
 {
 	struct lsdn_ruleset_prio *p;
@@ -280,8 +408,11 @@ void lsdn_ruleset_free(struct lsdn_ruleset *ruleset)
 	HASH_ITER(hh, ruleset->hash_prios, prio, prio_tmp) {
 		assert(HASH_COUNT(prio->hash_fl_rules) == 0);
 		HASH_DEL(ruleset->hash_prios, prio);
-		free(prio);
+		drop_prio(prio);
 	}
+	/* The kernel objects are gone with the qdisc or interface, there is nothing to rebuild */
+	if (!lsdn_is_list_empty(&ruleset->pending_entry))
+		lsdn_list_remove(&ruleset->pending_entry);
 }
 
 static uint16_t key_ethtype(enum lsdn_rule_target t)
@@ -304,6 +435,7 @@ static uint16_t key_ethtype(enum lsdn_rule_target t)
 	case LSDN_MATCH_ENC_KEY_SRC_IPV4:
 	case LSDN_MATCH_ENC_KEY_DST_IPV6:
 	case LSDN_MATCH_ENC_KEY_SRC_IPV6:
+	case LSDN_MATCH_INDEV:
 	case LSDN_MATCH_NONE:
 		return ETH_P_ALL;
 	default:
@@ -329,7 +461,7 @@ static bool find_common_ethtype(struct lsdn_flower_rule *fl, struct lsdn_ruleset
 static lsdn_err_t flush_fl_rule(struct lsdn_flower_rule *fl, struct lsdn_ruleset_prio *prio, bool update)
 {
 	struct lsdn_ruleset *ruleset = prio->parent;
-	struct lsdn_filter *filter = lsdn_filter_flower_init(
+	struct lsdn_filter *filter = lsdn_filter_flower_init(ruleset->ctx->nlsock,
 		ruleset->iface->ifindex, fl->fl_handle, ruleset->parent_handle,
 		ruleset->chain, prio->prio + ruleset->prio_start);
 	if (!filter)
@@ -385,6 +517,9 @@ static lsdn_err_t flush_fl_rule(struct lsdn_flower_rule *fl, struct lsdn_ruleset
 		case LSDN_MATCH_ENC_KEY_DST_IPV6:
 			lsdn_flower_set_enc_dst_ipv6(filter, match->ipv4.chr, mask->ipv4.chr);
 			break;
+		case LSDN_MATCH_INDEV:
+			lsdn_flower_set_indev(filter, match->indev);
+			break;
 		case LSDN_MATCH_NONE:
 			break;
 		default:
@@ -412,17 +547,176 @@ static lsdn_err_t flush_fl_rule(struct lsdn_flower_rule *fl, struct lsdn_ruleset
 	return LSDNE_OK;
 }
 
+/* Schedule a versioned ruleset to be rebuilt at the end of the commit. */
+static void mark_ruleset_pending(struct lsdn_ruleset *rs)
+{
+	if (rs->versioned && lsdn_is_list_empty(&rs->pending_entry))
+		lsdn_list_add(rs->ctx->pending_rs_list.previous, &rs->pending_entry);
+}
+
+/* Schedule the flower rule to be sent to the kernel at the end of the commit. Multiple changes
+ * of the same rule during the commit result in a single create or replace. */
+static void mark_fl_pending(struct lsdn_flower_rule *fl, struct lsdn_nl_owner owner)
+{
+	struct lsdn_context *ctx = fl->prio->parent->ctx;
+	fl->owner = owner;
+	if (lsdn_is_list_empty(&fl->pending_entry))
+		lsdn_list_add(ctx->pending_fl_list.previous, &fl->pending_entry);
+	mark_ruleset_pending(fl->prio->parent);
+}
+
+/* Send the flower rule to the kernel, reporting errors to the owner of the last change */
+static void flush_pending_fl_rule(struct lsdn_flower_rule *fl, struct lsdn_nl_owner owner, bool update)
+{
+	struct lsdn_context *ctx = fl->prio->parent->ctx;
+	struct lsdn_nl_owner old_owner = lsdn_nl_set_owner(ctx->nlsock, owner);
+	lsdn_err_t err = flush_fl_rule(fl, fl->prio, update);
+	lsdn_nl_set_owner(ctx->nlsock, old_owner);
+	if (err == LSDNE_OK) {
+		fl->committed = true;
+	} else if (owner.cb) {
+		owner.cb(err, owner.user);
+	} else {
+		ctx->inconsistent = true;
+	}
+}
+
+/* Point the entry filter of a versioned ruleset to its active chain */
+static lsdn_err_t flush_entry_filter(struct lsdn_ruleset *rs)
+{
+	struct lsdn_filter *filter = lsdn_filter_flower_init(rs->ctx->nlsock,
+		rs->iface->ifindex, 1, rs->parent_handle, rs->entry_chain, rs->prio_start);
+	if (!filter)
+		return LSDNE_NOMEM;
+	if (rs->entry_committed)
+		lsdn_filter_set_update(filter);
+
+	lsdn_log(LSDNL_RULES, "ruleset_switch(iface=%s, chain=%d)\n", rs->iface->ifname, rs->chain);
+	lsdn_flower_actions_start(filter);
+	lsdn_action_goto_chain(filter, 1, rs->chain);
+	lsdn_flower_actions_end(filter);
+	lsdn_err_t err = lsdn_filter_create(rs->ctx->nlsock, filter);
+	lsdn_filter_free(filter);
+	return err;
+}
+
+/* Build the whole versioned ruleset in the inactive chain, switch to it and flush the old one.
+ * The requests are processed by the kernel in order, so the traffic sees either the old or the
+ * new version, never a mixture. */
+static void flush_ruleset_version(struct lsdn_ruleset *rs)
+{
+	struct lsdn_context *ctx = rs->ctx;
+	uint32_t old_chain = rs->chain;
+	if (rs->entry_committed)
+		rs->chain = LSDN_RULESET_VERSION_CHAIN + (old_chain == LSDN_RULESET_VERSION_CHAIN);
+
+	struct lsdn_ruleset_prio *prio, *prio_tmp;
+	HASH_ITER(hh, rs->hash_prios, prio, prio_tmp) {
+		struct lsdn_flower_rule *fl, *fl_tmp;
+		HASH_ITER(hh, prio->hash_fl_rules, fl, fl_tmp) {
+			/* The owners of unchanged rules may be long gone */
+			struct lsdn_nl_owner owner = { NULL, NULL };
+			if (!lsdn_is_list_empty(&fl->pending_entry)) {
+				owner = fl->owner;
+				lsdn_list_remove(&fl->pending_entry);
+			}
+			flush_pending_fl_rule(fl, owner, false);
+		}
+	}
+
+	lsdn_err_t err = flush_entry_filter(rs);
+	if (err != LSDNE_OK) {
+		/* The traffic stays in the old chain, which no longer matches the model */
+		ctx->inconsistent = true;
+		return;
+	}
+	if (rs->entry_committed) {
+		/* A filter deletion without a priority flushes the whole chain */
+		err = lsdn_filter_delete(
+			ctx->nlsock, rs->iface->ifindex, 0, rs->parent_handle, old_chain, 0);
+		if (err != LSDNE_OK)
+			ctx->inconsistent = true;
+	}
+	rs->entry_committed = true;
+}
+
+/** Send all flower rules changed during the commit to the kernel.
+ * Errors are reported to the owner of the last change (the object that added a rule to the
+ * flower rule). If there is no owner, the context is marked as inconsistent.
+ * The changed versioned rulesets are sent as a whole, in a new chain. Then the shared actions
+ * freed during the commit are deleted. */
+void lsdn_rulesets_flush(struct lsdn_context *ctx)
+{
+	lsdn_foreach(ctx->pending_rs_list, pending_entry, struct lsdn_ruleset, rs) {
+		lsdn_list_remove(&rs->pending_entry);
+		flush_ruleset_version(rs);
+	}
+	lsdn_foreach(ctx->pending_fl_list, pending_entry, struct lsdn_flower_rule, fl) {
+		lsdn_list_remove(&fl->pending_entry);
+		flush_pending_fl_rule(fl, fl->owner, fl->committed);
+	}
+	flush_pending_actions(ctx);
+}
+
+/** Handle of a deleted filter, returned to the allocator once the delete is confirmed. */
+struct fl_handle_release {
+	struct lsdn_ruleset_prio *prio;
+	uint32_t handle;
+};
+
+static void release_fl_handle(lsdn_err_t err, void *user)
+{
+	struct fl_handle_release *r = user;
+	struct lsdn_ruleset_prio *prio = r->prio;
+	/* A handle that failed to be deleted is still taken in the kernel */
+	if (err == LSDNE_OK && !prio->removed)
+		lsdn_idalloc_return(&prio->handle_alloc, r->handle);
+	free(r);
+	prio->releasing--;
+	if (prio->removed)
+		drop_prio(prio);
+}
+
 static lsdn_err_t free_fl_rule(struct lsdn_flower_rule *fl, struct lsdn_ruleset_prio *prio)
 {
 	lsdn_err_t err = LSDNE_OK;
 	struct lsdn_ruleset *rs = prio->parent;
+	if (!lsdn_is_list_empty(&fl->pending_entry))
+		lsdn_list_remove(&fl->pending_entry);
+	if (rs->versioned) {
+		/* Only the next version will be without the rule */
+		if (fl->committed)
+			mark_ruleset_pending(rs);
+		lsdn_idalloc_return(&prio->handle_alloc, fl->fl_handle);
+		HASH_DEL(prio->hash_fl_rules, fl);
+		free(fl);
+		return LSDNE_OK;
+	}
+	if (!fl->committed) {
+		/* Never sent to the kernel, nothing to delete */
+		lsdn_idalloc_return(&prio->handle_alloc, fl->fl_handle);
+		HASH_DEL(prio->hash_fl_rules, fl);
+		free(fl);
+		return LSDNE_OK;
+	}
+
 	lsdn_log(LSDNL_RULES, "fl_delete(handle=0x%x)\n", fl->fl_handle);
-	if (!prio->parent->ctx->disable_decommit) {
-		err = lsdn_filter_delete(
+	if (prio->parent->ctx->disable_decommit) {
+		lsdn_idalloc_return(&prio->handle_alloc, fl->fl_handle);
+	} else {
+		/* With batching, the delete is only confirmed when the batch is flushed. Without
+		 * memory for the release, the handle is never reused, which is safe. */
+		struct fl_handle_release *r = malloc(sizeof(*r));
+		if (r) {
+			r->prio = prio;
+			r->handle = fl->fl_handle;
+			prio->releasing++;
+		}
+		err = lsdn_filter_delete_done(
 			rs->ctx->nlsock, rs->iface->ifindex, fl->fl_handle,
-			rs->parent_handle, rs->chain, prio->prio + rs->prio_start);
+			rs->parent_handle, rs->chain, prio->prio + rs->prio_start,
+			r ? release_fl_handle : NULL, r);
 	}
-
 	HASH_DEL(prio->hash_fl_rules, fl);
 	free(fl);
 	return err;
@@ -438,7 +732,9 @@ lsdn_err_t lsdn_ruleset_remove(struct lsdn_rule *rule)
 	if (lsdn_is_list_empty(&rule->fl_rule->sources_list)) {
 		err = free_fl_rule(rule->fl_rule, rule->prio);
 	} else {
-		err = flush_fl_rule(rule->fl_rule, rule->prio, true);
+		/* The rule is being removed by an object that may be freed before the flush */
+		struct lsdn_nl_owner no_owner = { NULL, NULL };
+		mark_fl_pending(rule->fl_rule, no_owner);
 	}
 	rule->fl_rule = NULL;
 	return err;
@@ -448,13 +744,13 @@ lsdn_err_t lsdn_ruleset_remove_prio(struct lsdn_ruleset_prio *prio)
 {
 	assert(HASH_COUNT(prio->hash_fl_rules) == 0);
 	HASH_DELETE(hh, prio->parent->hash_prios, prio);
-	free(prio);
+	drop_prio(prio);
 	return LSDNE_OK;
 }
 
 static void hard_mask(char *value, size_t valsize)
 {
-	assert(valsize < LSDN_MAX_MATCH_LEN);
+	assert(valsize <= LSDN_MAX_MATCH_LEN);
 	bzero(value + valsize, LSDN_MAX_MATCH_LEN - valsize);
 }
 
@@ -470,6 +766,9 @@ void lsdn_rule_apply_mask(
 			case LSDN_MATCH_ENC_KEY_ID:
 				hard_mask(r->matches[i].bytes, sizeof(r->matches[i].enc_key_id));
 			break;
+			case LSDN_MATCH_INDEV:
+				hard_mask(r->matches[i].bytes, sizeof(r->matches[i].indev));
+			break;
 			default:
 				abort();
 			}
@@ -483,8 +782,6 @@ void lsdn_rule_apply_mask(
 
 lsdn_err_t lsdn_ruleset_add(struct lsdn_ruleset_prio *prio, struct lsdn_rule *rule)
 {
-	bool update = true;
-	lsdn_err_t err = LSDNE_OK;
 	rule->prio = prio;
 	rule->ruleset = prio->parent;
 	lsdn_rule_apply_mask(rule, prio->targets, prio->masks);
@@ -506,9 +803,11 @@ lsdn_err_t lsdn_ruleset_add(struct lsdn_ruleset_prio *prio, struct lsdn_rule *ru
 		}
 		memcpy(fl->matches, rule->matches, sizeof(fl->matches));
 		lsdn_list_init(&fl->sources_list);
+		lsdn_list_init(&fl->pending_entry);
 		fl->fl_handle = handle;
+		fl->prio = prio;
+		fl->committed = false;
 		HASH_ADD(hh, rule->prio->hash_fl_rules, matches, sizeof(fl->matches), fl);
-		update = false;
 	}
 	rule->fl_rule = fl;
 
@@ -525,124 +824,6 @@ lsdn_err_t lsdn_ruleset_add(struct lsdn_ruleset_prio *prio, struct lsdn_rule *ru
 	}
 	lsdn_list_init_add(nearest_lower, &rule->sources_entry);
 
-	err = flush_fl_rule(fl, prio, update);
-	if (err != LSDNE_OK) {
-		lsdn_list_remove(&rule->sources_entry);
-		acc_inconsistent(&err, free_fl_rule(fl, prio));
-	}
-	return err;
-}
-
-void lsdn_broadcast_init(struct lsdn_broadcast *br, struct lsdn_context *ctx, struct lsdn_if *iface, int chain)
-{
-	br->ctx = ctx;
-	br->iface = iface;
-	br->chain = chain;
-	br->free_prio = 1;
-	lsdn_list_init(&br->filters_list);
-}
-
-static bool lsdn_find_free_action(
-	struct lsdn_broadcast *br, size_t actions,
-	struct lsdn_broadcast_filter** out_filter, size_t* out_action_index)
-{
-	lsdn_foreach(br->filters_list, filters_entry, struct lsdn_broadcast_filter, f) {
-		if (f->free_actions >= actions) {
-			for(size_t i = 0; i<LSDN_MAX_ACT_PRIO - 1; i++) {
-				struct lsdn_broadcast_action **a = &f->actions[i];
-				if(!*a) {
-					*out_filter = f;
-					*out_action_index = i;
-					return true;
-				}
-			}
-			/* should not happen if there are free actions */
-			abort();
-		}
-	}
-
-	// create new filter
-
-	struct lsdn_broadcast_filter *f = malloc(sizeof(*f));
-	if(!f)
-		return false;
-
-	lsdn_list_init_add(&br->filters_list, &f->filters_entry);
-	f->broadcast = br;
-	f->free_actions = LSDN_MAX_ACT_PRIO - 1;
-	f->prio = br->free_prio++;
-	for(size_t i = 0; i<LSDN_MAX_ACT_PRIO - 1; i++) {
-		f->actions[i] = NULL;
-	}
-	*out_filter = f;
-	*out_action_index = 0;
-
-	return true;
-}
-
-#define MAIN_RULE_HANDLE 1
-
-/** Update the broadcast filter and all it's actions. */
-static lsdn_err_t lsdn_flush_action_list(struct lsdn_broadcast_filter* br_filter)
-{
-	struct lsdn_broadcast *br = br_filter->broadcast;
-	struct lsdn_filter *filter = lsdn_filter_flower_init(
-		br->iface->ifindex,
-		MAIN_RULE_HANDLE, LSDN_INGRESS_HANDLE, br->chain, br_filter->prio);
-	lsdn_filter_set_update(filter);
-	size_t order = 1;
-
-	lsdn_flower_actions_start(filter);
-	for(size_t i = 0; i < LSDN_MAX_ACT_PRIO - 1; i++) {
-		struct lsdn_broadcast_action *action = br_filter->actions[i];
-		if (!action)
-			continue;
-		//printf("Adding action to filter at %d if %s\n", order, iface->ifname);
-		action->action.fn(filter, order, action->action.user);
-		order += action->action.actions_count;
-	}
-	lsdn_action_continue(filter, order);
-	lsdn_flower_actions_end(filter);
-	lsdn_err_t err = lsdn_filter_create(br->ctx->nlsock, filter);
-	lsdn_filter_free(filter);
-	return err;
-}
-
-lsdn_err_t lsdn_broadcast_add(struct lsdn_broadcast *br, struct lsdn_broadcast_action *action, struct lsdn_action_desc desc)
-{
-	struct lsdn_broadcast_filter *f;
-	size_t i;
-	if (!lsdn_find_free_action(br, desc.actions_count, &f, &i))
-		return LSDNE_NOMEM;
-	f->free_actions -= desc.actions_count;
-	f->actions[i] = action;
-	action->action = desc;
-	action->filter = f;
-	action->filter_entry_index = i;
-	return lsdn_flush_action_list(f);
-}
-
-lsdn_err_t lsdn_broadcast_remove(struct lsdn_broadcast_action *action)
-{
-	lsdn_err_t err = LSDNE_OK;
-	action->filter->free_actions += action->action.actions_count;
-	action->filter->actions[action->filter_entry_index] = NULL;
-	if(!action->filter->broadcast->ctx->disable_decommit)
-		acc_inconsistent(&err, lsdn_flush_action_list(action->filter));
-	return err;
-}
-
-lsdn_err_t lsdn_broadcast_free(struct lsdn_broadcast *br)
-{
-	lsdn_err_t err = LSDNE_OK;
-	lsdn_foreach(br->filters_list, filters_entry, struct lsdn_broadcast_filter, f)
-	{
-		if(!br->ctx->disable_decommit) {
-			acc_inconsistent(&err, lsdn_filter_delete(
-				br->ctx->nlsock, br->iface->ifindex,
-				MAIN_RULE_HANDLE, LSDN_INGRESS_HANDLE, br->chain, f->prio));
-		}
-		free(f);
-	}
-	return err;
+	mark_fl_pending(fl, prio->parent->ctx->nlsock->owner);
+	return LSDNE_OK;
 }
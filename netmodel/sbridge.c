@@ -1,59 +1,839 @@
 #include "private/sbridge.h"
 #include "private/net.h"
 #include "private/errors.h"
+#include "private/bpf.h"
+#include <net/if_arp.h>
+#include <netinet/icmp6.h>
+#include <netinet/in.h>
+#include <linux/pkt_cls.h>
 
 enum {CL_OWNER, CL_DEST};
 
-/* Broadcast rule (well, action) on the sbridge_if. */
-struct if_br_action {
-	struct lsdn_clist_entry clist;
-	struct lsdn_sbridge_route *route;
-	struct lsdn_broadcast_action action;
-};
+/** @name Broadcast replication.
+ * The chains on the bridge interface, see lsdn_sbridge. */
+/** @{ */
+#define BCAST_SKIP_PRIO 1
+#define BCAST_SEND_PRIO 2
+#define BCAST_HANDLE 1
+
+static struct lsdn_sbridge_route *bcast_next(struct lsdn_sbridge_route *route)
+{
+	struct lsdn_list_entry *next = route->bcast_entry.next;
+	if (next == &route->iface->bridge->bcast_list)
+		return NULL;
+	return lsdn_container_of(next, struct lsdn_sbridge_route, bcast_entry);
+}
 
-static lsdn_err_t if_br_action_free(void *user)
+/* Continue with the next route, or drop the packet if there is none */
+static void bcast_action_next(struct lsdn_filter *f, uint16_t order, struct lsdn_sbridge_route *next)
 {
-	struct if_br_action *action = user;
-	lsdn_err_t err = lsdn_broadcast_remove(&action->action);
-	free(action);
+	if (next)
+		lsdn_action_goto_chain(f, order, next->bcast_chain);
+	else
+		lsdn_action_drop(f, order);
+}
+
+/* (Re)create the head chain, jumping to the first route */
+static lsdn_err_t bcast_flush_head(struct lsdn_sbridge *br)
+{
+	struct lsdn_sbridge_route *first = NULL;
+	if (!lsdn_is_list_empty(&br->bcast_list))
+		first = lsdn_container_of(br->bcast_list.next, struct lsdn_sbridge_route, bcast_entry);
+
+	struct lsdn_filter *f = lsdn_filter_flower_init(
+		br->ctx->nlsock, br->bridge_if.ifindex, BCAST_HANDLE,
+		LSDN_INGRESS_HANDLE, br->bcast_head_chain, BCAST_SKIP_PRIO);
+	if (!f)
+		return LSDNE_NOMEM;
+	lsdn_filter_set_update(f);
+	lsdn_flower_actions_start(f);
+	bcast_action_next(f, 1, first);
+	lsdn_flower_actions_end(f);
+	lsdn_err_t err = lsdn_filter_create(br->ctx->nlsock, f);
+	lsdn_filter_free(f);
 	return err;
 }
 
-static void if_br_mkaction(struct lsdn_filter *f, uint16_t order, void *user)
+/* (Re)create the chain of the route: skip the packets from the route's own interface and send
+ * the rest to the route. The last route does not need to make a copy. */
+static lsdn_err_t bcast_flush_route(struct lsdn_sbridge_route *route)
 {
-	struct if_br_action *action = user;
-	struct lsdn_action_desc *tun_action = &action->route->tunnel_action;
+	struct lsdn_sbridge *br = route->iface->bridge;
+	struct lsdn_sbridge_route *next = bcast_next(route);
+	lsdn_err_t err;
+
+	struct lsdn_filter *f = lsdn_filter_fw_init(
+		br->ctx->nlsock, br->bridge_if.ifindex, route->iface->mark,
+		LSDN_INGRESS_HANDLE, route->bcast_chain, BCAST_SKIP_PRIO);
+	if (!f)
+		return LSDNE_NOMEM;
+	lsdn_filter_set_update(f);
+	lsdn_fw_actions_start(f);
+	bcast_action_next(f, 1, next);
+	lsdn_fw_actions_end(f);
+	err = lsdn_filter_create(br->ctx->nlsock, f);
+	lsdn_filter_free(f);
+	if (err != LSDNE_OK)
+		return err;
+
+	f = lsdn_filter_flower_init(
+		br->ctx->nlsock, br->bridge_if.ifindex, BCAST_HANDLE,
+		LSDN_INGRESS_HANDLE, route->bcast_chain, BCAST_SEND_PRIO);
+	if (!f)
+		return LSDNE_NOMEM;
+	lsdn_filter_set_update(f);
+	lsdn_flower_actions_start(f);
+	uint16_t order = 1;
+	struct lsdn_action_desc *tun_action = &route->tunnel_action;
 	if (tun_action->fn) {
 		tun_action->fn(f, order, tun_action->user);
 		order += tun_action->actions_count;
 	}
-	lsdn_action_mirror_egress_add(f, order, action->route->iface->phys_if->iface->ifindex);
+	if (next) {
+		lsdn_action_mirror_egress_add(f, order++, route->iface->out_if->ifindex);
+		lsdn_action_goto_chain(f, order, next->bcast_chain);
+	} else {
+		lsdn_action_redir_egress_add(f, order, route->iface->out_if->ifindex);
+	}
+	lsdn_flower_actions_end(f);
+	err = lsdn_filter_create(br->ctx->nlsock, f);
+	lsdn_filter_free(f);
+	return err;
+}
+
+/* Update whatever jumps to the route's chain, after the route was linked or unlinked */
+static lsdn_err_t bcast_flush_previous(struct lsdn_sbridge *br, struct lsdn_list_entry *previous)
+{
+	if (previous == &br->bcast_list)
+		return bcast_flush_head(br);
+	return bcast_flush_route(
+		lsdn_container_of(previous, struct lsdn_sbridge_route, bcast_entry));
+}
+
+static lsdn_err_t bcast_remove(struct lsdn_sbridge_route *route)
+{
+	struct lsdn_sbridge *br = route->iface->bridge;
+	lsdn_err_t err = LSDNE_OK;
+	struct lsdn_list_entry *previous = route->bcast_entry.previous;
+	lsdn_list_remove(&route->bcast_entry);
+	if (!br->ctx->disable_decommit) {
+		acc_inconsistent(&err, bcast_flush_previous(br, previous));
+		/* Flush the whole chain of the route */
+		acc_inconsistent(&err, lsdn_filter_delete(
+			br->ctx->nlsock, br->bridge_if.ifindex, 0,
+			LSDN_INGRESS_HANDLE, route->bcast_chain, 0));
+	}
+	lsdn_idalloc_return(&br->br_chain_ids, route->bcast_chain);
+	return err;
+}
+
+/* Append the route to the replication */
+static lsdn_err_t bcast_add(struct lsdn_sbridge_route *route)
+{
+	struct lsdn_sbridge *br = route->iface->bridge;
+	if (!lsdn_idalloc_get(&br->br_chain_ids, &route->bcast_chain))
+		return LSDNE_NOMEM;
+	lsdn_list_init_add(br->bcast_list.previous, &route->bcast_entry);
+	lsdn_err_t err = bcast_flush_route(route);
+	if (err == LSDNE_OK)
+		err = bcast_flush_previous(br, route->bcast_entry.previous);
+	if (err != LSDNE_OK)
+		acc_inconsistent(&err, bcast_remove(route));
+	return err;
+}
+/** @} */
+
+/** @name ARP responder.
+ * The chains on the bridge interface, see lsdn_sbridge. */
+/** @{ */
+/* After the neighbor discovery responder */
+#define ARP_MATCH_PRIO 2
+#define ARP_FALLBACK_PRIO 3
+#define ARP_FALLBACK_HANDLE 1
+
+/* Offsets of the fields from the start of the ARP header (for ethernet and IPv4) */
+#define ETH_DST_OFF (-14)
+#define ETH_SRC_OFF (-8)
+#define ARP_OP_OFF 6
+#define ARP_SHA_OFF 8
+#define ARP_SPA_OFF 14
+#define ARP_THA_OFF 18
+#define ARP_TPA_OFF 24
+
+/* Send the packets not matched in the chain to the replication, or drop them */
+static lsdn_err_t arp_flush_fallback(struct lsdn_sbridge *br, uint32_t chain, bool drop)
+{
+	struct lsdn_filter *f = lsdn_filter_flower_init(
+		br->ctx->nlsock, br->bridge_if.ifindex, ARP_FALLBACK_HANDLE,
+		LSDN_INGRESS_HANDLE, chain, ARP_FALLBACK_PRIO);
+	if (!f)
+		return LSDNE_NOMEM;
+	lsdn_filter_set_update(f);
+	lsdn_flower_actions_start(f);
+	if (drop)
+		lsdn_action_drop(f, 1);
+	else
+		lsdn_action_goto_chain(f, 1, br->bcast_head_chain);
+	lsdn_flower_actions_end(f);
+	lsdn_err_t err = lsdn_filter_create(br->ctx->nlsock, f);
+	lsdn_filter_free(f);
+	return err;
 }
 
-static lsdn_err_t if_br_make(struct lsdn_sbridge_if *from, struct lsdn_sbridge_route *to)
+static lsdn_err_t arp_init(struct lsdn_sbridge *br)
 {
-	struct if_br_action *bra = malloc(sizeof(*bra));
-	if (!bra)
+	lsdn_err_t err;
+	if (!lsdn_idalloc_get(&br->br_chain_ids, &br->arp_src_chain)
+		|| !lsdn_idalloc_get(&br->br_chain_ids, &br->arp_dst_chain)
+		|| !lsdn_idalloc_get(&br->br_chain_ids, &br->arp_reply_chain))
 		return LSDNE_NOMEM;
-	lsdn_clist_init_entry(&bra->clist, if_br_action_free, bra);
-	bra->route = to;
-	struct lsdn_action_desc desc;
-	/* Set tunnel metadata + mirred */
-	desc.name = NULL;
-	desc.actions_count = to->tunnel_action.actions_count + 1;
-	desc.fn = if_br_mkaction;
-	desc.user = bra;
-	lsdn_err_t err = lsdn_broadcast_add(&from->broadcast, &bra->action, desc);
+	err = arp_flush_fallback(br, br->arp_src_chain, false);
+	if (err != LSDNE_OK)
+		return err;
+	err = arp_flush_fallback(br, br->arp_dst_chain, false);
+	if (err != LSDNE_OK)
+		return err;
+	/* The request was already changed by the target chain */
+	return arp_flush_fallback(br, br->arp_reply_chain, true);
+}
+
+/* Answer the requests from the interface, if they come from the given mac and IP address */
+static lsdn_err_t arp_add_requester(struct lsdn_sbridge_if *iface, lsdn_mac_t mac, lsdn_ip_t ip)
+{
+	struct lsdn_sbridge *br = iface->bridge;
+	lsdn_err_t err;
+
+	struct lsdn_filter *f = lsdn_filter_flower_init(
+		br->ctx->nlsock, br->bridge_if.ifindex, iface->mark,
+		LSDN_INGRESS_HANDLE, br->arp_src_chain, ARP_MATCH_PRIO);
+	if (!f)
+		return LSDNE_NOMEM;
+	lsdn_flower_set_eth_type(f, htons(ETH_P_ARP));
+	lsdn_flower_set_src_mac(f, mac.chr, lsdn_single_mac_mask.chr);
+	lsdn_flower_set_arp_op(f, ARPOP_REQUEST);
+	lsdn_flower_set_arp_sip(f, ip.v4.chr, lsdn_single_ipv4_mask.v4.chr);
+	lsdn_flower_actions_start(f);
+	lsdn_action_goto_chain(f, 1, br->arp_dst_chain);
+	lsdn_flower_actions_end(f);
+	err = lsdn_filter_create(br->ctx->nlsock, f);
+	lsdn_filter_free(f);
+	if (err != LSDNE_OK)
+		return err;
+
+	f = lsdn_filter_fw_init(
+		br->ctx->nlsock, br->bridge_if.ifindex, iface->mark,
+		LSDN_INGRESS_HANDLE, br->arp_reply_chain, ARP_MATCH_PRIO);
+	if (!f)
+		return LSDNE_NOMEM;
+	struct lsdn_pedit edit;
+	lsdn_pedit_init(&edit);
+	lsdn_pedit_set(&edit, ETH_DST_OFF, mac.bytes, LSDN_MAC_LEN);
+	lsdn_pedit_set(&edit, ARP_THA_OFF, mac.bytes, LSDN_MAC_LEN);
+	lsdn_pedit_set(&edit, ARP_TPA_OFF, ip.v4.bytes, LSDN_IPv4_LEN);
+	lsdn_fw_actions_start(f);
+	lsdn_action_pedit(f, 1, &edit);
+	lsdn_action_redir_egress_add(f, 2, iface->out_if->ifindex);
+	lsdn_fw_actions_end(f);
+	err = lsdn_filter_create(br->ctx->nlsock, f);
+	lsdn_filter_free(f);
+	if (err != LSDNE_OK)
+		return err;
+
+	iface->arp_requester = true;
+	return err;
+}
+
+static lsdn_err_t arp_remove_requester(struct lsdn_sbridge_if *iface)
+{
+	struct lsdn_sbridge *br = iface->bridge;
+	lsdn_err_t err = LSDNE_OK;
+	if (!iface->arp_requester || br->ctx->disable_decommit)
+		return err;
+	acc_inconsistent(&err, lsdn_filter_delete(
+		br->ctx->nlsock, br->bridge_if.ifindex, iface->mark,
+		LSDN_INGRESS_HANDLE, br->arp_src_chain, ARP_MATCH_PRIO));
+	acc_inconsistent(&err, lsdn_filter_delete(
+		br->ctx->nlsock, br->bridge_if.ifindex, iface->mark,
+		LSDN_INGRESS_HANDLE, br->arp_reply_chain, ARP_MATCH_PRIO));
+	return err;
+}
+
+/* Answer the requests for the IP address with the mac */
+static lsdn_err_t arp_add_target(struct lsdn_sbridge_mac *mac_entry, lsdn_ip_t ip)
+{
+	struct lsdn_sbridge *br = mac_entry->route->iface->bridge;
+	uint32_t handle;
+	if (!lsdn_idalloc_get(&br->arp_handles, &handle))
+		return LSDNE_NOMEM;
+
+	struct lsdn_filter *f = lsdn_filter_flower_init(
+		br->ctx->nlsock, br->bridge_if.ifindex, handle,
+		LSDN_INGRESS_HANDLE, br->arp_dst_chain, ARP_MATCH_PRIO);
+	if (!f) {
+		lsdn_idalloc_return(&br->arp_handles, handle);
+		return LSDNE_NOMEM;
+	}
+	lsdn_flower_set_eth_type(f, htons(ETH_P_ARP));
+	lsdn_flower_set_arp_op(f, ARPOP_REQUEST);
+	lsdn_flower_set_arp_tip(f, ip.v4.chr, lsdn_single_ipv4_mask.v4.chr);
+	struct lsdn_pedit edit;
+	uint16_t op = htons(ARPOP_REPLY);
+	lsdn_pedit_init(&edit);
+	lsdn_pedit_set(&edit, ETH_SRC_OFF, mac_entry->mac.bytes, LSDN_MAC_LEN);
+	lsdn_pedit_set(&edit, ARP_OP_OFF, &op, sizeof(op));
+	lsdn_pedit_set(&edit, ARP_SHA_OFF, mac_entry->mac.bytes, LSDN_MAC_LEN);
+	lsdn_pedit_set(&edit, ARP_SPA_OFF, ip.v4.bytes, LSDN_IPv4_LEN);
+	lsdn_flower_actions_start(f);
+	lsdn_action_pedit(f, 1, &edit);
+	lsdn_action_goto_chain(f, 2, br->arp_reply_chain);
+	lsdn_flower_actions_end(f);
+	lsdn_err_t err = lsdn_filter_create(br->ctx->nlsock, f);
+	lsdn_filter_free(f);
 	if (err != LSDNE_OK) {
-		free (bra);
+		lsdn_idalloc_return(&br->arp_handles, handle);
 		return err;
 	}
+	mac_entry->arp_handle = handle;
+	return err;
+}
+
+static lsdn_err_t arp_remove_target(struct lsdn_sbridge_mac *mac_entry)
+{
+	struct lsdn_sbridge *br = mac_entry->route->iface->bridge;
+	lsdn_err_t err = LSDNE_OK;
+	if (!mac_entry->arp_handle)
+		return err;
+	if (!br->ctx->disable_decommit) {
+		acc_inconsistent(&err, lsdn_filter_delete(
+			br->ctx->nlsock, br->bridge_if.ifindex, mac_entry->arp_handle,
+			LSDN_INGRESS_HANDLE, br->arp_dst_chain, ARP_MATCH_PRIO));
+	}
+	lsdn_idalloc_return(&br->arp_handles, mac_entry->arp_handle);
+	mac_entry->arp_handle = 0;
+	return err;
+}
+/** @} */
+
+/** @name BPF switch.
+ * Unicast switching by a BPF program on the bridge interface, see lsdn_sbridge. */
+/** @{ */
+/* Before the unicast and broadcast filters of bridge_ruleset_main */
+#define BPF_SWITCH_PRIO (LSDN_DEFAULT_PRIORITY - 1)
+#define BPF_SWITCH_HANDLE 1
+/* The map entries are allocated on demand, this is only a limit */
+#define BPF_SWITCH_ENTRIES 65536
+#define BPF_SWITCH_MAX_INSNS 64
+/* Size of struct bpf_tunnel_key without the flow label (and the newer fields), the kernel
+ * accepts it since the flow label was introduced */
+#define BPF_TUNNEL_KEY_SIZE offsetof(struct bpf_tunnel_key, tunnel_label)
+
+/* Key of the switch map, the MAC address padded with zeroes */
+struct bpf_switch_key {
+	uint8_t mac[LSDN_MAC_LEN];
+	uint8_t pad[2];
+};
+
+/* Value of the switch map, where the packets for the MAC address go */
+struct bpf_switch_dest {
+	uint32_t ifindex;
+	/* Set the tunnel metadata before sending the packet */
+	uint32_t tunnel;
+	/* Flags of bpf_skb_set_tunnel_key (BPF_F_TUNINFO_IPV6) */
+	uint32_t tunnel_flags;
+	uint32_t vni;
+	/* IPv4 address in host order or IPv6 address, like in struct bpf_tunnel_key */
+	uint32_t remote[4];
+};
+
+/* Write the switch program:
+ *
+ *     if (load_bytes(skb, 0, &key, 6) || key.mac[0] & 1)
+ *         return TC_ACT_UNSPEC;
+ *     dest = map_lookup_elem(map, &key);
+ *     if (!dest)
+ *         return TC_ACT_UNSPEC;
+ *     if (dest->tunnel && skb_set_tunnel_key(skb, {dest->vni, dest->remote}, dest->tunnel_flags))
+ *         return TC_ACT_UNSPEC;
+ *     return redirect(dest->ifindex, 0);
+ *
+ * Broadcasts and unknown destinations continue to the filters after the program. */
+static size_t bpf_switch_prog(struct bpf_insn *p, int map_fd)
+{
+	const int16_t key = -(int16_t) sizeof(struct bpf_switch_key);
+	const int16_t tkey = key - (int16_t) (BPF_TUNNEL_KEY_SIZE + 7) / 8 * 8;
+	size_t to_pass[4];
+	size_t pass_count = 0;
+	size_t to_redirect;
+	size_t n = 0;
+
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_6, BPF_REG_1);
+	p[n++] = LSDN_BPF_ST_MEM(BPF_DW, BPF_REG_10, key, 0);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_1, BPF_REG_6);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_2, 0);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_3, BPF_REG_10);
+	p[n++] = LSDN_BPF_ADD64_IMM(BPF_REG_3, key);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_4, LSDN_MAC_LEN);
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_skb_load_bytes);
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0);
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_10, key);
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JSET, BPF_REG_1, 1, 0);
+
+	n += lsdn_bpf_ld_map_fd(&p[n], BPF_REG_1, map_fd);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_2, BPF_REG_10);
+	p[n++] = LSDN_BPF_ADD64_IMM(BPF_REG_2, key);
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_map_lookup_elem);
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_7, BPF_REG_0);
+
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_7, offsetof(struct bpf_switch_dest, tunnel));
+	to_redirect = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 0);
+	for (int16_t off = 0; off < (int16_t) BPF_TUNNEL_KEY_SIZE; off += 8)
+		p[n++] = LSDN_BPF_ST_MEM(BPF_DW, BPF_REG_10, tkey + off, 0);
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_7, offsetof(struct bpf_switch_dest, vni));
+	p[n++] = LSDN_BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1,
+		tkey + (int16_t) offsetof(struct bpf_tunnel_key, tunnel_id));
+	for (int16_t i = 0; i < 4; i++) {
+		p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_7,
+			offsetof(struct bpf_switch_dest, remote) + 4 * i);
+		p[n++] = LSDN_BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1,
+			tkey + (int16_t) offsetof(struct bpf_tunnel_key, remote_ipv6) + 4 * i);
+	}
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_1, BPF_REG_6);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_2, BPF_REG_10);
+	p[n++] = LSDN_BPF_ADD64_IMM(BPF_REG_2, tkey);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_3, BPF_TUNNEL_KEY_SIZE);
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_4, BPF_REG_7,
+		offsetof(struct bpf_switch_dest, tunnel_flags));
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_skb_set_tunnel_key);
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0);
+
+	lsdn_bpf_patch_jump(p, to_redirect, n);
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_7, offsetof(struct bpf_switch_dest, ifindex));
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_2, 0);
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_redirect);
+	p[n++] = LSDN_BPF_EXIT();
+
+	for (size_t i = 0; i < pass_count; i++)
+		lsdn_bpf_patch_jump(p, to_pass[i], n);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_0, TC_ACT_UNSPEC);
+	p[n++] = LSDN_BPF_EXIT();
+
+	assert(n <= BPF_SWITCH_MAX_INSNS);
+	return n;
+}
+
+/* Create the map and attach the program to the bridge interface */
+static lsdn_err_t bpf_switch_init(struct lsdn_sbridge *br)
+{
+	struct lsdn_nl *sock = br->ctx->nlsock;
+	struct bpf_insn prog[BPF_SWITCH_MAX_INSNS];
+	lsdn_err_t err = lsdn_bpf_map_create(sock,
+		sizeof(struct bpf_switch_key), sizeof(struct bpf_switch_dest),
+		BPF_SWITCH_ENTRIES, &br->bpf_map);
+	if (err != LSDNE_OK)
+		return err;
+	size_t count = bpf_switch_prog(prog, br->bpf_map);
+	err = lsdn_bpf_prog_load(sock, prog, count, &br->bpf_prog);
+	if (err != LSDNE_OK)
+		goto cleanup_map;
+
+	err = LSDNE_NOMEM;
+	struct lsdn_filter *f = lsdn_filter_bpf_init(sock, br->bridge_if.ifindex,
+		BPF_SWITCH_HANDLE, LSDN_INGRESS_HANDLE, LSDN_DEFAULT_CHAIN, BPF_SWITCH_PRIO);
+	if (!f)
+		goto cleanup_prog;
+	lsdn_bpf_set_prog(f, br->bpf_prog, "lsdn_switch");
+	err = lsdn_filter_create(sock, f);
+	lsdn_filter_free(f);
+	if (err != LSDNE_OK)
+		goto cleanup_prog;
+	br->bpf = true;
+	return err;
+
+	cleanup_prog:
+	lsdn_bpf_close(sock, br->bpf_prog);
+	cleanup_map:
+	lsdn_bpf_close(sock, br->bpf_map);
+	return err;
+}
+
+/* Close our descriptors, the filter keeps the program and the map alive until it is removed
+ * with the bridge interface */
+static void bpf_switch_free(struct lsdn_sbridge *br)
+{
+	if (!br->bpf)
+		return;
+	lsdn_bpf_close(br->ctx->nlsock, br->bpf_prog);
+	lsdn_bpf_close(br->ctx->nlsock, br->bpf_map);
+	br->bpf = false;
+}
+
+static void bpf_switch_key(struct lsdn_sbridge_mac *mac, struct bpf_switch_key *key)
+{
+	bzero(key, sizeof(*key));
+	memcpy(key->mac, mac->mac.bytes, LSDN_MAC_LEN);
+}
+
+static lsdn_err_t bpf_switch_add(struct lsdn_sbridge_mac *mac)
+{
+	struct lsdn_sbridge_route *route = mac->route;
+	struct lsdn_sbridge *br = route->iface->bridge;
+	struct bpf_switch_key key;
+	struct bpf_switch_dest dest;
+	bpf_switch_key(mac, &key);
+	bzero(&dest, sizeof(dest));
+	dest.ifindex = route->iface->out_if->ifindex;
+	if (route->tunnel_action.fn) {
+		const lsdn_ip_t *ip = route->tunnel_dst;
+		dest.tunnel = 1;
+		dest.vni = route->tunnel_vni;
+		if (ip->v == LSDN_IPv4) {
+			dest.remote[0] = lsdn_ip4_u32(&ip->v4);
+		} else {
+			dest.tunnel_flags = BPF_F_TUNINFO_IPV6;
+			memcpy(dest.remote, ip->v6.bytes, sizeof(ip->v6.bytes));
+		}
+	}
+	return lsdn_bpf_map_update(br->ctx->nlsock, br->bpf_map, &key, &dest);
+}
+
+static lsdn_err_t bpf_switch_remove(struct lsdn_sbridge_mac *mac)
+{
+	struct lsdn_sbridge *br = mac->route->iface->bridge;
+	struct bpf_switch_key key;
+	if (br->ctx->disable_decommit)
+		return LSDNE_OK;
+	bpf_switch_key(mac, &key);
+	return lsdn_bpf_map_delete(br->ctx->nlsock, br->bpf_map, &key);
+}
+/** @} */
+
+/** @name Neighbor discovery responder.
+ * The IPv6 counterpart of the ARP responder, a BPF program in its source chain, see
+ * lsdn_sbridge. */
+/** @{ */
+/* Before the filters of the ARP responder */
+#define ND_PRIO 1
+#define ND_HANDLE 1
+#define ND_ENTRIES 65536
+#define ND_MAX_INSNS 160
+/* A neighbor solicitation with just the source link-layer address option, as sent by Linux and
+ * most other systems. Other solicitations are flooded. */
+#define NS_LEN 86
+#define NS_ICMP6_LEN 32
+/* Offsets of the fields from the start of the frame */
+#define NS_ETH_DST_OFF 0
+#define NS_ETH_SRC_OFF 6
+#define NS_ETH_TYPE_OFF 12
+#define NS_IP6_PLEN_OFF 18
+#define NS_IP6_NEXT_OFF 20
+#define NS_IP6_HLIM_OFF 21
+#define NS_IP6_SRC_OFF 22
+#define NS_IP6_DST_OFF 38
+#define NS_TYPE_OFF 54
+#define NS_CODE_OFF 55
+#define NS_CSUM_OFF 56
+#define NS_FLAGS_OFF 58
+#define NS_TARGET_OFF 62
+#define NS_OPT_TYPE_OFF 78
+#define NS_OPT_LEN_OFF 79
+#define NS_OPT_MAC_OFF 80
+
+/* Value of the requester map, keyed by the mark of the sbridge_if */
+struct nd_requester {
+	uint32_t ifindex;
+	uint8_t mac[LSDN_MAC_LEN];
+	uint8_t pad[2];
+	uint8_t ip[LSDN_IPv6_LEN];
+};
+
+/* Value of the target map, keyed by the IPv6 address */
+struct nd_target {
+	uint8_t mac[LSDN_MAC_LEN];
+	uint8_t pad[2];
+};
+
+/* Write the responder program:
+ *
+ *     if (skb->len != NS_LEN || load_bytes(skb, 0, &p, NS_LEN) || !is_solicitation(&p))
+ *         return TC_ACT_UNSPEC;
+ *     req = map_lookup_elem(requesters, &skb->mark);
+ *     if (!req || p.eth_src != req->mac || p.ip6_src != req->ip)
+ *         return TC_ACT_UNSPEC;
+ *     target = map_lookup_elem(targets, &p.target);
+ *     if (!target)
+ *         return TC_ACT_UNSPEC;
+ *     p.eth_dst = p.eth_src;
+ *     p.eth_src = target->mac;
+ *     p.ip6_dst = p.ip6_src;
+ *     p.ip6_src = p.target;
+ *     p.type = ND_NEIGHBOR_ADVERT;
+ *     p.flags = ND_NA_FLAG_SOLICITED | ND_NA_FLAG_OVERRIDE;
+ *     p.option = {ND_OPT_TARGET_LINKADDR, target->mac};
+ *     p.csum = fold(csum_diff(NULL, 0, &p.ip6_src, ..., rest of the pseudo header));
+ *     if (store_bytes(skb, 0, &p, NS_LEN, 0))
+ *         return TC_ACT_UNSPEC;
+ *     return redirect(req->ifindex, 0);
+ *
+ * The packet is copied to the stack, where all the accesses must be aligned. */
+static size_t nd_prog(struct bpf_insn *p, int requesters_fd, int targets_fd)
+{
+	/* The stack is 8-byte aligned, so the addresses at odd multiples of 2 in the packet are
+	 * 4-byte aligned below the mark */
+	const int16_t mark = -4;
+	const int16_t pkt = mark - NS_LEN;
+	/* The payload length and next header of the pseudo header, as in memory */
+	const int32_t pseudo_rest = htonl(NS_ICMP6_LEN) + htonl(IPPROTO_ICMPV6);
+	const struct {
+		uint8_t size;
+		int16_t off;
+		int32_t value;
+	} checks[] = {
+		{BPF_H, NS_ETH_TYPE_OFF, htons(ETH_P_IPV6)},
+		{BPF_H, NS_IP6_PLEN_OFF, htons(NS_ICMP6_LEN)},
+		{BPF_B, NS_IP6_NEXT_OFF, IPPROTO_ICMPV6},
+		{BPF_B, NS_IP6_HLIM_OFF, 255},
+		{BPF_B, NS_TYPE_OFF, ND_NEIGHBOR_SOLICIT},
+		{BPF_B, NS_CODE_OFF, 0},
+		{BPF_B, NS_OPT_TYPE_OFF, ND_OPT_SOURCE_LINKADDR},
+		{BPF_B, NS_OPT_LEN_OFF, 1}
+	};
+	size_t to_pass[32];
+	size_t pass_count = 0;
+	size_t n = 0;
+
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_6, BPF_REG_1);
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct __sk_buff, len));
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JNE, BPF_REG_1, NS_LEN, 0);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_1, BPF_REG_6);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_2, 0);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_3, BPF_REG_10);
+	p[n++] = LSDN_BPF_ADD64_IMM(BPF_REG_3, pkt);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_4, NS_LEN);
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_skb_load_bytes);
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0);
+	for (size_t i = 0; i < sizeof(checks) / sizeof(*checks); i++) {
+		p[n++] = LSDN_BPF_LDX_MEM(checks[i].size, BPF_REG_1, BPF_REG_10, pkt + checks[i].off);
+		to_pass[pass_count++] = n;
+		p[n++] = LSDN_BPF_JMP_IMM(BPF_JNE, BPF_REG_1, checks[i].value, 0);
+	}
+
+	/* Only the requests of the local virts with their own addresses are answered */
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct __sk_buff, mark));
+	p[n++] = LSDN_BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1, mark);
+	n += lsdn_bpf_ld_map_fd(&p[n], BPF_REG_1, requesters_fd);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_2, BPF_REG_10);
+	p[n++] = LSDN_BPF_ADD64_IMM(BPF_REG_2, mark);
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_map_lookup_elem);
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0);
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_9, BPF_REG_0, offsetof(struct nd_requester, ifindex));
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_10, pkt + NS_ETH_SRC_OFF);
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_0, offsetof(struct nd_requester, mac));
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_REG(BPF_JNE, BPF_REG_1, BPF_REG_2, 0);
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_H, BPF_REG_1, BPF_REG_10, pkt + NS_ETH_SRC_OFF + 4);
+	p[n++] = LSDN_BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_0, offsetof(struct nd_requester, mac) + 4);
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_REG(BPF_JNE, BPF_REG_1, BPF_REG_2, 0);
+	for (int16_t i = 0; i < LSDN_IPv6_LEN; i += 4) {
+		p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_10, pkt + NS_IP6_SRC_OFF + i);
+		p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_0,
+			offsetof(struct nd_requester, ip) + i);
+		to_pass[pass_count++] = n;
+		p[n++] = LSDN_BPF_JMP_REG(BPF_JNE, BPF_REG_1, BPF_REG_2, 0);
+	}
+
+	n += lsdn_bpf_ld_map_fd(&p[n], BPF_REG_1, targets_fd);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_2, BPF_REG_10);
+	p[n++] = LSDN_BPF_ADD64_IMM(BPF_REG_2, pkt + NS_TARGET_OFF);
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_map_lookup_elem);
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_7, BPF_REG_0);
+
+	/* Turn the request into the advertisement */
+	for (int16_t i = 0; i < LSDN_MAC_LEN; i += 2) {
+		p[n++] = LSDN_BPF_LDX_MEM(BPF_H, BPF_REG_1, BPF_REG_10, pkt + NS_ETH_SRC_OFF + i);
+		p[n++] = LSDN_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_1, pkt + NS_ETH_DST_OFF + i);
+		p[n++] = LSDN_BPF_LDX_MEM(BPF_H, BPF_REG_1, BPF_REG_7, offsetof(struct nd_target, mac) + i);
+		p[n++] = LSDN_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_1, pkt + NS_ETH_SRC_OFF + i);
+		p[n++] = LSDN_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_1, pkt + NS_OPT_MAC_OFF + i);
+	}
+	for (int16_t i = 0; i < LSDN_IPv6_LEN; i += 4) {
+		p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_10, pkt + NS_IP6_SRC_OFF + i);
+		p[n++] = LSDN_BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1, pkt + NS_IP6_DST_OFF + i);
+		p[n++] = LSDN_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_10, pkt + NS_TARGET_OFF + i);
+		p[n++] = LSDN_BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_1, pkt + NS_IP6_SRC_OFF + i);
+	}
+	p[n++] = LSDN_BPF_ST_MEM(BPF_B, BPF_REG_10, pkt + NS_TYPE_OFF, ND_NEIGHBOR_ADVERT);
+	p[n++] = LSDN_BPF_ST_MEM(BPF_H, BPF_REG_10, pkt + NS_CSUM_OFF, 0);
+	p[n++] = LSDN_BPF_ST_MEM(BPF_W, BPF_REG_10, pkt + NS_FLAGS_OFF,
+		ND_NA_FLAG_SOLICITED | ND_NA_FLAG_OVERRIDE);
+	p[n++] = LSDN_BPF_ST_MEM(BPF_B, BPF_REG_10, pkt + NS_OPT_TYPE_OFF, ND_OPT_TARGET_LINKADDR);
+
+	/* The addresses and the ICMPv6 message are contiguous, the rest of the pseudo header is the
+	 * seed */
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_1, 0);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_2, 0);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_3, BPF_REG_10);
+	p[n++] = LSDN_BPF_ADD64_IMM(BPF_REG_3, pkt + NS_IP6_SRC_OFF);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_4, NS_LEN - NS_IP6_SRC_OFF);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_5, pseudo_rest);
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_csum_diff);
+	for (int i = 0; i < 2; i++) {
+		p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_1, BPF_REG_0);
+		p[n++] = LSDN_BPF_ALU64_IMM(BPF_RSH, BPF_REG_1, 16);
+		p[n++] = LSDN_BPF_ALU64_IMM(BPF_AND, BPF_REG_0, 0xffff);
+		p[n++] = LSDN_BPF_ALU64_REG(BPF_ADD, BPF_REG_0, BPF_REG_1);
+	}
+	p[n++] = LSDN_BPF_ALU64_IMM(BPF_XOR, BPF_REG_0, 0xffff);
+	p[n++] = LSDN_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_0, pkt + NS_CSUM_OFF);
+
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_1, BPF_REG_6);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_2, 0);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_3, BPF_REG_10);
+	p[n++] = LSDN_BPF_ADD64_IMM(BPF_REG_3, pkt);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_4, NS_LEN);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_5, 0);
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_skb_store_bytes);
+	to_pass[pass_count++] = n;
+	p[n++] = LSDN_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0);
+	p[n++] = LSDN_BPF_MOV64_REG(BPF_REG_1, BPF_REG_9);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_2, 0);
+	p[n++] = LSDN_BPF_CALL(BPF_FUNC_redirect);
+	p[n++] = LSDN_BPF_EXIT();
+
+	for (size_t i = 0; i < pass_count; i++)
+		lsdn_bpf_patch_jump(p, to_pass[i], n);
+	p[n++] = LSDN_BPF_MOV64_IMM(BPF_REG_0, TC_ACT_UNSPEC);
+	p[n++] = LSDN_BPF_EXIT();
+
+	assert(pass_count <= sizeof(to_pass) / sizeof(*to_pass));
+	assert(n <= ND_MAX_INSNS);
+	return n;
+}
+
+/* Create the maps and attach the program, on the first IPv6 address in the bridge */
+static lsdn_err_t nd_init(struct lsdn_sbridge *br)
+{
+	struct lsdn_nl *sock = br->ctx->nlsock;
+	struct bpf_insn prog[ND_MAX_INSNS];
+	if (br->nd)
+		return LSDNE_OK;
+	lsdn_err_t err = lsdn_bpf_map_create(sock,
+		sizeof(uint32_t), sizeof(struct nd_requester), ND_ENTRIES, &br->nd_requesters);
+	if (err != LSDNE_OK)
+		return err;
+	err = lsdn_bpf_map_create(sock,
+		LSDN_IPv6_LEN, sizeof(struct nd_target), ND_ENTRIES, &br->nd_targets);
+	if (err != LSDNE_OK)
+		goto cleanup_requesters;
+	size_t count = nd_prog(prog, br->nd_requesters, br->nd_targets);
+	err = lsdn_bpf_prog_load(sock, prog, count, &br->nd_prog);
+	if (err != LSDNE_OK)
+		goto cleanup_targets;
 
-	lsdn_clist_add(&to->cl_dest, &bra->clist);
-	lsdn_clist_add(&from->cl_owner, &bra->clist);
+	err = LSDNE_NOMEM;
+	struct lsdn_filter *f = lsdn_filter_bpf_init(sock, br->bridge_if.ifindex,
+		ND_HANDLE, LSDN_INGRESS_HANDLE, br->arp_src_chain, ND_PRIO);
+	if (!f)
+		goto cleanup_prog;
+	lsdn_bpf_set_prog(f, br->nd_prog, "lsdn_nd");
+	err = lsdn_filter_create(sock, f);
+	lsdn_filter_free(f);
+	if (err != LSDNE_OK)
+		goto cleanup_prog;
+	br->nd = true;
+	return err;
+
+	cleanup_prog:
+	lsdn_bpf_close(sock, br->nd_prog);
+	cleanup_targets:
+	lsdn_bpf_close(sock, br->nd_targets);
+	cleanup_requesters:
+	lsdn_bpf_close(sock, br->nd_requesters);
 	return err;
 }
 
+/* Close our descriptors, the filter keeps the program and the maps alive until it is removed
+ * with the bridge interface */
+static void nd_free(struct lsdn_sbridge *br)
+{
+	if (!br->nd)
+		return;
+	lsdn_bpf_close(br->ctx->nlsock, br->nd_prog);
+	lsdn_bpf_close(br->ctx->nlsock, br->nd_targets);
+	lsdn_bpf_close(br->ctx->nlsock, br->nd_requesters);
+	br->nd = false;
+}
+
+/* Answer the solicitations from the interface, if they come from the given mac and IP address */
+static lsdn_err_t nd_add_requester(struct lsdn_sbridge_if *iface, lsdn_mac_t mac, lsdn_ip_t ip)
+{
+	struct lsdn_sbridge *br = iface->bridge;
+	lsdn_err_t err = nd_init(br);
+	if (err != LSDNE_OK)
+		return err;
+	struct nd_requester req;
+	bzero(&req, sizeof(req));
+	req.ifindex = iface->out_if->ifindex;
+	memcpy(req.mac, mac.bytes, LSDN_MAC_LEN);
+	memcpy(req.ip, ip.v6.bytes, LSDN_IPv6_LEN);
+	err = lsdn_bpf_map_update(br->ctx->nlsock, br->nd_requesters, &iface->mark, &req);
+	if (err == LSDNE_OK)
+		iface->nd_requester = true;
+	return err;
+}
+
+static lsdn_err_t nd_remove_requester(struct lsdn_sbridge_if *iface)
+{
+	struct lsdn_sbridge *br = iface->bridge;
+	if (!iface->nd_requester)
+		return LSDNE_OK;
+	iface->nd_requester = false;
+	if (br->ctx->disable_decommit)
+		return LSDNE_OK;
+	return lsdn_bpf_map_delete(br->ctx->nlsock, br->nd_requesters, &iface->mark);
+}
+
+/* Answer the solicitations for the IP address with the mac */
+static lsdn_err_t nd_add_target(struct lsdn_sbridge_mac *mac_entry, lsdn_ip_t ip)
+{
+	struct lsdn_sbridge *br = mac_entry->route->iface->bridge;
+	lsdn_err_t err = nd_init(br);
+	if (err != LSDNE_OK)
+		return err;
+	struct nd_target target;
+	bzero(&target, sizeof(target));
+	memcpy(target.mac, mac_entry->mac.bytes, LSDN_MAC_LEN);
+	err = lsdn_bpf_map_update(br->ctx->nlsock, br->nd_targets, ip.v6.bytes, &target);
+	if (err == LSDNE_OK) {
+		mac_entry->nd_target = true;
+		mac_entry->nd_ip = ip.v6;
+	}
+	return err;
+}
+
+static lsdn_err_t nd_remove_target(struct lsdn_sbridge_mac *mac_entry)
+{
+	struct lsdn_sbridge *br = mac_entry->route->iface->bridge;
+	if (!mac_entry->nd_target)
+		return LSDNE_OK;
+	mac_entry->nd_target = false;
+	if (br->ctx->disable_decommit)
+		return LSDNE_OK;
+	return lsdn_bpf_map_delete(br->ctx->nlsock, br->nd_targets, mac_entry->nd_ip.bytes);
+}
+/** @} */
+
 /* Routing rule on the dummy bridging interface */
 struct br_forward_rule {
 	struct lsdn_clist_entry clist;
@@ -78,7 +858,7 @@ static void br_forward_mkaction(struct lsdn_filter *f, uint16_t order, void *use
 		mac->route->tunnel_action.fn(f, order, mac->route->tunnel_action.user);
 		order += mac->route->tunnel_action.actions_count;
 	}
-	lsdn_action_redir_egress_add(f, order, mac->route->iface->phys_if->iface->ifindex);
+	lsdn_action_redir_egress_add(f, order, mac->route->iface->out_if->ifindex);
 }
 
 /** Create a forwarding rule for a mac address */
@@ -103,6 +883,12 @@ static lsdn_err_t br_forward_make(struct lsdn_sbridge_mac *mac)
 	return err;
 }
 
+static void mkaction_goto_arp(struct lsdn_filter *filter, uint16_t order, void *user)
+{
+	struct lsdn_sbridge *br = user;
+	lsdn_action_goto_chain(filter, order, br->arp_src_chain);
+}
+
 lsdn_err_t lsdn_sbridge_init(struct lsdn_context *ctx, struct lsdn_sbridge *br)
 {
 	struct lsdn_if sbridge_if;
@@ -125,19 +911,57 @@ lsdn_err_t lsdn_sbridge_init(struct lsdn_context *ctx, struct lsdn_sbridge *br)
 	br->ctx = ctx;
 	lsdn_ruleset_init(
 		&br->bridge_ruleset_main, ctx, &br->bridge_if,
-		LSDN_INGRESS_HANDLE, LSDN_DEFAULT_CHAIN, LSDN_DEFAULT_PRIORITY, 1);
+		LSDN_INGRESS_HANDLE, LSDN_DEFAULT_CHAIN, LSDN_DEFAULT_PRIORITY, 2);
+	lsdn_idalloc_init(&br->br_chain_ids, 1, 0xFFFF);
+	lsdn_idalloc_init(&br->if_marks, 1, UINT32_MAX);
+	lsdn_idalloc_init(&br->arp_handles, 1, UINT32_MAX);
+	lsdn_list_init(&br->bcast_list);
+	lsdn_list_init(&br->if_list);
+	br->block.members = 0;
+
+	err = LSDNE_NOMEM;
 	prio = br->bridge_ruleset =
 			lsdn_ruleset_define_prio(&br->bridge_ruleset_main, 0);
 	if (!prio)
 		goto cleanup_ruleset;
-
 	prio->targets[0] = LSDN_MATCH_DST_MAC;
 	prio->masks[0].mac = lsdn_single_mac_mask;
-	lsdn_list_init(&br->if_list);
+
+	/* All broadcasts go to the replication */
+	prio = br->bcast_prio = lsdn_ruleset_define_prio(&br->bridge_ruleset_main, 1);
+	if (!prio)
+		goto cleanup_ruleset;
+	prio->targets[0] = LSDN_MATCH_DST_MAC;
+	prio->masks[0].mac = lsdn_multicast_mac_mask;
+	if (!lsdn_idalloc_get(&br->br_chain_ids, &br->bcast_head_chain))
+		goto cleanup_ruleset;
+	err = bcast_flush_head(br);
+	if (err != LSDNE_OK)
+		goto cleanup_ruleset;
+	err = arp_init(br);
+	if (err != LSDNE_OK)
+		goto cleanup_ruleset;
+	struct lsdn_rule *bcast = &br->rule_bcast;
+	bcast->subprio = 0;
+	bcast->matches[0].mac = lsdn_broadcast_mac;
+	lsdn_action_init(&bcast->action, 1, mkaction_goto_arp, br);
+	err = lsdn_ruleset_add(br->bcast_prio, bcast);
+	if (err != LSDNE_OK)
+		goto cleanup_ruleset;
+	br->nd = false;
+	br->bpf = false;
+	if (ctx->bpf_switching) {
+		err = bpf_switch_init(br);
+		if (err != LSDNE_OK)
+			goto cleanup_ruleset;
+	}
 
 	return err;
 	cleanup_ruleset:
 	lsdn_ruleset_free(&br->bridge_ruleset_main);
+	lsdn_idalloc_free(&br->br_chain_ids);
+	lsdn_idalloc_free(&br->if_marks);
+	lsdn_idalloc_free(&br->arp_handles);
 	cleanup_if:
 	acc_inconsistent(&err, lsdn_link_delete(ctx->nlsock, &sbridge_if));
 	return err;
@@ -146,19 +970,27 @@ lsdn_err_t lsdn_sbridge_init(struct lsdn_context *ctx, struct lsdn_sbridge *br)
 lsdn_err_t lsdn_sbridge_free(struct lsdn_sbridge *br)
 {
 	assert(lsdn_is_list_empty(&br->if_list));
+	assert(br->block.members == 0);
 	lsdn_err_t err = LSDNE_OK;
+	acc_inconsistent(&err, lsdn_ruleset_remove(&br->rule_bcast));
 	if (!br->ctx->disable_decommit) {
 		acc_inconsistent(&err, lsdn_link_delete(br->ctx->nlsock, &br->bridge_if));
 	}
+	bpf_switch_free(br);
+	nd_free(br);
 	lsdn_ruleset_free(&br->bridge_ruleset_main);
+	lsdn_idalloc_free(&br->br_chain_ids);
+	lsdn_idalloc_free(&br->if_marks);
+	lsdn_idalloc_free(&br->arp_handles);
 	lsdn_if_free(&br->bridge_if);
 	return err;
 }
 
-static void mkaction_goto_br_chain(struct lsdn_filter *filter, uint16_t order, void *user)
+static void mkaction_mark_br(struct lsdn_filter *filter, uint16_t order, void *user)
 {
 	struct lsdn_sbridge_if *iface = user;
-	lsdn_action_goto_chain(filter, order, iface->broadcast.chain);
+	lsdn_action_skbmark(filter, order++, iface->mark);
+	lsdn_action_redir_ingress_add(filter, order, iface->bridge->bridge_if.ifindex);
 }
 
 static void mkaction_goto_switch(struct lsdn_filter *filter, uint16_t order, void *user)
@@ -172,19 +1004,19 @@ lsdn_err_t lsdn_sbridge_add_if(struct lsdn_sbridge *br, struct lsdn_sbridge_if *
 	lsdn_err_t err;
 	struct lsdn_rule* fallback = &iface->rule_fallback;
 	lsdn_list_init(&iface->route_list);
-	lsdn_clist_init(&iface->cl_owner, CL_OWNER);
 	iface->bridge = br;
+	iface->arp_requester = false;
+	iface->nd_requester = false;
 
-	/* create the broadcast chain */
-	uint32_t br_handle;
-	if(!lsdn_idalloc_get(&iface->phys_if->br_chain_ids, &br_handle))
+	/* the broadcasts are told apart by the mark on the bridge */
+	if(!lsdn_idalloc_get(&br->if_marks, &iface->mark))
 		return LSDNE_NOMEM;
-	lsdn_broadcast_init(&iface->broadcast, br->ctx, iface->phys_if->iface, br_handle);
 
 	/* check that the ruleset is correctly setup by the caller, at least the targets */
 	assert(iface->phys_if->rules_match_mac->targets[0] == LSDN_MATCH_DST_MAC);
 	assert(iface->phys_if->rules_match_mac->targets[1] == iface->additional_match);
-	assert(iface->phys_if->rules_fallback->targets[0] == iface->additional_match);
+	assert(iface->phys_if->shared
+		|| iface->phys_if->rules_fallback->targets[0] == iface->additional_match);
 	assert(iface->phys_if->rules_fallback->targets[1] == LSDN_MATCH_NONE);
 
 	/* setup basic broadcast/non-broadcast classification */
@@ -192,38 +1024,29 @@ lsdn_err_t lsdn_sbridge_add_if(struct lsdn_sbridge *br, struct lsdn_sbridge_if *
 	match_mac->subprio = LSDN_SBRIDGE_IF_SUBPRIO;
 	match_mac->matches[0].mac = lsdn_broadcast_mac;
 	match_mac->matches[1] = iface->additional_matchdata;
-	lsdn_action_init(&match_mac->action, 1, mkaction_goto_br_chain, iface);
+	lsdn_action_init(&match_mac->action, 2, mkaction_mark_br, iface);
 	err = lsdn_ruleset_add(iface->phys_if->rules_match_mac, match_mac);
 	if (err != LSDNE_OK)
 		goto cleanup_idalloc;
 
-	fallback->subprio = LSDN_SBRIDGE_IF_SUBPRIO;
-	fallback->matches[0] = iface->additional_matchdata;
-	lsdn_action_init(&fallback->action, 1, mkaction_goto_switch, iface);
-	lsdn_ruleset_add(iface->phys_if->rules_fallback, fallback);
-	if (err != LSDNE_OK)
-		goto cleanup_match;
-
-	/* pull broadcast rules */
-	lsdn_foreach(br->if_list, if_entry, struct lsdn_sbridge_if, other_if) {
-		lsdn_foreach(other_if->route_list, route_entry, struct lsdn_sbridge_route, route) {
-			err = if_br_make(iface, route);
-			if (err != LSDNE_OK)
-				goto cleanup_clist;
-		}
+	/* a shared phys_if has a common fallback rule */
+	if (!iface->phys_if->shared) {
+		fallback->subprio = LSDN_SBRIDGE_IF_SUBPRIO;
+		fallback->matches[0] = iface->additional_matchdata;
+		lsdn_action_init(&fallback->action, 1, mkaction_goto_switch, iface);
+		err = lsdn_ruleset_add(iface->phys_if->rules_fallback, fallback);
+		if (err != LSDNE_OK)
+			goto cleanup_match;
 	}
 
 	lsdn_list_init_add(&br->if_list, &iface->if_entry);
 
 	return err;
 
-	cleanup_clist:
-	acc_inconsistent(&err, lsdn_ruleset_remove(fallback));
-	acc_inconsistent(&err, lsdn_clist_flush(&iface->cl_owner));
 	cleanup_match:
 	acc_inconsistent(&err, lsdn_ruleset_remove(match_mac));
 	cleanup_idalloc:
-	lsdn_idalloc_return(&iface->phys_if->br_chain_ids, br_handle);
+	lsdn_idalloc_return(&br->if_marks, iface->mark);
 	return err;
 }
 
@@ -231,11 +1054,12 @@ lsdn_err_t lsdn_sbridge_remove_if(struct lsdn_sbridge_if *iface)
 {
 	assert(lsdn_is_list_empty(&iface->route_list));
 	lsdn_err_t err = LSDNE_OK;
-	acc_inconsistent(&err, lsdn_clist_flush(&iface->cl_owner));
+	acc_inconsistent(&err, arp_remove_requester(iface));
+	acc_inconsistent(&err, nd_remove_requester(iface));
 	acc_inconsistent(&err, lsdn_ruleset_remove(&iface->rule_match_br));
-	acc_inconsistent(&err, lsdn_ruleset_remove(&iface->rule_fallback));
-	lsdn_idalloc_return(&iface->phys_if->br_chain_ids, iface->broadcast.chain);
-	lsdn_broadcast_free(&iface->broadcast);
+	if (!iface->phys_if->shared)
+		acc_inconsistent(&err, lsdn_ruleset_remove(&iface->rule_fallback));
+	lsdn_idalloc_return(&iface->bridge->if_marks, iface->mark);
 
 	lsdn_list_remove(&iface->if_entry);
 	return err;
@@ -243,25 +1067,15 @@ lsdn_err_t lsdn_sbridge_remove_if(struct lsdn_sbridge_if *iface)
 
 lsdn_err_t lsdn_sbridge_add_route(struct lsdn_sbridge_if *iface, struct lsdn_sbridge_route *route)
 {
-	lsdn_err_t err = LSDNE_OK;
 	lsdn_list_init(&route->mac_list);
-	lsdn_clist_init(&route->cl_dest, CL_DEST);
 	route->iface = iface;
 
-	/* push broadcast rules */
-	lsdn_foreach(iface->bridge->if_list, if_entry, struct lsdn_sbridge_if, other_if) {
-		if (other_if == iface)
-			continue;
-		err = if_br_make(other_if, route);
-		if (err != LSDNE_OK)
-			goto cleanup;
-	}
+	lsdn_err_t err = bcast_add(route);
+	if (err != LSDNE_OK)
+		return err;
 
 	lsdn_list_init_add(&iface->route_list, &route->route_entry);
 	return err;
-
-	cleanup:
-	return lsdn_clist_flush(&route->cl_dest);
 }
 
 lsdn_err_t lsdn_sbridge_add_route_default(struct lsdn_sbridge_if *iface, struct lsdn_sbridge_route *route)
@@ -275,30 +1089,46 @@ lsdn_err_t lsdn_sbridge_add_route_default(struct lsdn_sbridge_if *iface, struct
 lsdn_err_t lsdn_sbridge_remove_route(struct lsdn_sbridge_route *route)
 {
 	assert(lsdn_is_list_empty(&route->mac_list));
-	lsdn_err_t err = lsdn_clist_flush(&route->cl_dest);
+	lsdn_err_t err = bcast_remove(route);
 	lsdn_list_remove(&route->route_entry);
 	return err;
 }
 
 lsdn_err_t lsdn_sbridge_add_mac(
-	struct lsdn_sbridge_route* route, struct lsdn_sbridge_mac *mac_entry, lsdn_mac_t mac)
+	struct lsdn_sbridge_route* route, struct lsdn_sbridge_mac *mac_entry, lsdn_mac_t mac,
+	const lsdn_ip_t *ip)
 {
 	lsdn_err_t err = LSDNE_OK;
 	mac_entry->route = route;
 	mac_entry->mac = mac;
+	mac_entry->arp_handle = 0;
+	mac_entry->nd_target = false;
 
 	lsdn_clist_init(&mac_entry->cl_dest, CL_DEST);
 
 	/* push forwarding rule */
-	err = br_forward_make(mac_entry);
+	if (route->iface->bridge->bpf)
+		err = bpf_switch_add(mac_entry);
+	else
+		err = br_forward_make(mac_entry);
 	lsdn_list_init_add(&route->mac_list, &mac_entry->mac_entry);
+	if (err == LSDNE_OK && ip && ip->v == LSDN_IPv4)
+		err = arp_add_target(mac_entry, *ip);
+	if (err == LSDNE_OK && ip && ip->v == LSDN_IPv6)
+		err = nd_add_target(mac_entry, *ip);
 	return err;
 }
 
 lsdn_err_t lsdn_sbridge_remove_mac(struct lsdn_sbridge_mac *mac)
 {
+	lsdn_err_t err = LSDNE_OK;
+	acc_inconsistent(&err, arp_remove_target(mac));
+	acc_inconsistent(&err, nd_remove_target(mac));
+	if (mac->route->iface->bridge->bpf)
+		acc_inconsistent(&err, bpf_switch_remove(mac));
 	lsdn_list_remove(&mac->mac_entry);
-	return lsdn_clist_flush(&mac->cl_dest);
+	acc_inconsistent(&err, lsdn_clist_flush(&mac->cl_dest));
+	return err;
 }
 
 lsdn_err_t lsdn_sbridge_phys_if_init(
@@ -308,7 +1138,7 @@ lsdn_err_t lsdn_sbridge_phys_if_init(
 {
 	lsdn_err_t err = LSDNE_OK;
 	sbridge_if->iface = iface;
-	lsdn_idalloc_init(&sbridge_if->br_chain_ids, 1, 0xFFFF);
+	sbridge_if->shared = false;
 
 	// TODO: different structure for the matches, maybe vid first?
 
@@ -357,7 +1187,7 @@ lsdn_err_t lsdn_sbridge_phys_if_init(
 
 lsdn_err_t lsdn_sbridge_phys_if_free(struct lsdn_sbridge_phys_if *iface)
 {
-	lsdn_idalloc_free(&iface->br_chain_ids);
+	LSDN_UNUSED(iface);
 	return LSDNE_OK;
 }
 
@@ -365,56 +1195,232 @@ lsdn_err_t lsdn_sbridge_phys_if_free(struct lsdn_sbridge_phys_if *iface)
 #define MATCH_PRIORITY LSDN_DEFAULT_PRIORITY
 #define FALLBACK_PRIORITY (LSDN_DEFAULT_PRIORITY+1)
 
-lsdn_err_t lsdn_sbridge_add_virt(struct lsdn_sbridge *br, struct lsdn_virt *virt)
+static void mkaction_block_switch(struct lsdn_filter *filter, uint16_t order, void *user)
+{
+	struct lsdn_sbridge *br = user;
+	lsdn_action_redir_ingress_add(filter, order, br->bridge_if.ifindex);
+}
+
+/* Allocate the block with its rules when the first member joins. The kernel creates the block
+ * itself only when the first qdisc is bound to it. */
+static lsdn_err_t block_init(struct lsdn_sbridge *br)
+{
+	struct lsdn_context *ctx = br->ctx;
+	struct lsdn_sbridge_block *block = &br->block;
+	lsdn_err_t err = LSDNE_OK;
+	if (!lsdn_idalloc_get(&ctx->block_ids, &block->index))
+		return LSDNE_NOMEM;
+
+	char name[IF_NAMESIZE];
+	snprintf(name, sizeof(name), "block:%x", block->index);
+	lsdn_if_init(&block->iface);
+	err = lsdn_if_set_name(&block->iface, name);
+	if (err != LSDNE_OK)
+		goto cleanup_index;
+	block->iface.ifindex = LSDN_BLOCK_IFINDEX;
+	lsdn_ruleset_init(
+		&block->ruleset, ctx, &block->iface,
+		block->index, LSDN_DEFAULT_CHAIN, 1, UINT32_MAX);
+
+	struct lsdn_sbridge_phys_if *phys_if = &block->phys_if;
+	phys_if->iface = &block->iface;
+	phys_if->shared = true;
+	phys_if->rules_source = NULL;
+	err = LSDNE_NOMEM;
+	struct lsdn_ruleset_prio *prio_match = phys_if->rules_match_mac =
+		lsdn_ruleset_define_prio(&block->ruleset, LSDN_IF_PRIO_MATCH);
+	if (!prio_match)
+		goto cleanup_ruleset;
+	prio_match->targets[0] = LSDN_MATCH_DST_MAC;
+	prio_match->masks[0].mac = lsdn_multicast_mac_mask;
+	prio_match->targets[1] = LSDN_MATCH_INDEV;
+	phys_if->rules_fallback = lsdn_ruleset_define_prio(&block->ruleset, LSDN_IF_PRIO_FALLBACK);
+	if (!phys_if->rules_fallback)
+		goto cleanup_ruleset;
+
+	struct lsdn_rule *fallback = &block->rule_fallback;
+	fallback->subprio = LSDN_SBRIDGE_IF_SUBPRIO;
+	bzero(fallback->matches, sizeof(fallback->matches));
+	lsdn_action_init(&fallback->action, 1, mkaction_block_switch, br);
+	err = lsdn_ruleset_add(phys_if->rules_fallback, fallback);
+	if (err != LSDNE_OK)
+		goto cleanup_ruleset;
+	return LSDNE_OK;
+
+	cleanup_ruleset:
+	lsdn_ruleset_free(&block->ruleset);
+	lsdn_if_free(&block->iface);
+	cleanup_index:
+	lsdn_idalloc_return(&ctx->block_ids, block->index);
+	return err;
+}
+
+/* Free the block after its last member left and its qdisc was deleted, taking the filters with
+ * it. Nothing is sent to the kernel. */
+static void block_free(struct lsdn_sbridge *br)
+{
+	struct lsdn_sbridge_block *block = &br->block;
+	lsdn_ruleset_free(&block->ruleset);
+	lsdn_if_free(&block->iface);
+	lsdn_idalloc_return(&br->ctx->block_ids, block->index);
+}
+
+/* Local virts without their own ingress rules share the block, see lsdn_context_set_shared_blocks.
+ * Only the rules on the virt's egress (our ingress) are in the block, the rules on the virt's
+ * ingress stay on its clsact qdisc. */
+static lsdn_err_t add_virt_to_block(struct lsdn_sbridge *br, struct lsdn_virt *virt)
+{
+	lsdn_err_t err = LSDNE_OK;
+	struct lsdn_context *ctx = virt->network->ctx;
+	struct lsdn_sbridge_block *block = &br->block;
+	if (block->members == 0) {
+		err = block_init(br);
+		if (err != LSDNE_OK)
+			return err;
+	}
+
+	err = lsdn_qdisc_clsact_create_block(
+		ctx->nlsock, virt->committed_if.ifindex, block->index, ctx->overwrite);
+	if (err != LSDNE_OK)
+		goto cleanup_block;
+	lsdn_ruleset_init(
+		&virt->rules_out, ctx, &virt->committed_if,
+		LSDN_CLSACT_EGRESS_PARENT, LSDN_DEFAULT_CHAIN, 1, UINT32_MAX);
+
+	err = lsdn_link_set(ctx->nlsock, virt->committed_if.ifindex, true);
+	if (err != LSDNE_OK)
+		goto cleanup_qdisc;
+
+	struct lsdn_sbridge_if *iface = &virt->sbridge_if;
+	iface->phys_if = &block->phys_if;
+	iface->out_if = &virt->committed_if;
+	iface->additional_match = LSDN_MATCH_INDEV;
+	bzero(iface->additional_matchdata.indev, sizeof(iface->additional_matchdata.indev));
+	strncpy(iface->additional_matchdata.indev, virt->committed_if.ifname,
+		sizeof(iface->additional_matchdata.indev) - 1);
+	block->members++;
+	virt->shared_block = true;
+	return err;
+
+	cleanup_qdisc:
+	acc_inconsistent(&err, lsdn_cleanup_rulesets(ctx, &virt->committed_if, NULL, &virt->rules_out));
+	cleanup_block:
+	if (block->members == 0) {
+		acc_inconsistent(&err, lsdn_ruleset_remove(&block->rule_fallback));
+		block_free(br);
+	}
+	return err;
+}
+
+static lsdn_err_t remove_virt_from_block(struct lsdn_sbridge *br, struct lsdn_virt *virt)
+{
+	lsdn_err_t err = LSDNE_OK;
+	struct lsdn_context *ctx = virt->network->ctx;
+	struct lsdn_sbridge_block *block = &br->block;
+	bool last = --block->members == 0;
+	virt->shared_block = false;
+	/* The block goes away with the last qdisc bound to it */
+	if (last)
+		acc_inconsistent(&err, lsdn_ruleset_remove(&block->rule_fallback));
+	acc_inconsistent(&err, lsdn_cleanup_rulesets(ctx, &virt->committed_if, NULL, &virt->rules_out));
+	if (last)
+		block_free(br);
+	return err;
+}
+
+/* Prepare the rulesets and the phys_if for the virt, on its own qdisc. */
+static lsdn_err_t add_virt_private(struct lsdn_virt *virt)
 {
 	lsdn_err_t err;
 	struct lsdn_context *ctx = virt->network->ctx;
 	err = lsdn_prepare_rulesets(ctx, &virt->committed_if, &virt->rules_in, &virt->rules_out);
 	if (err != LSDNE_OK)
-		goto end;
+		return err;
 
 	err = lsdn_sbridge_phys_if_init(ctx, &virt->sbridge_phys_if, &virt->committed_if, false, &virt->rules_in);
-	if (err != LSDNE_OK)
-		goto cleanup_rulesets;
+	if (err != LSDNE_OK) {
+		acc_inconsistent(&err, lsdn_cleanup_rulesets(
+			ctx, &virt->committed_if, &virt->rules_in, &virt->rules_out));
+		return err;
+	}
 
 	struct lsdn_sbridge_if *iface = &virt->sbridge_if;
 	iface->phys_if = &virt->sbridge_phys_if;
+	iface->out_if = &virt->committed_if;
 	iface->additional_match = LSDN_MATCH_NONE;
+	virt->shared_block = false;
+	return err;
+}
+
+static lsdn_err_t remove_virt_private(struct lsdn_virt *virt)
+{
+	lsdn_err_t err = LSDNE_OK;
+	acc_inconsistent(&err, lsdn_sbridge_phys_if_free(&virt->sbridge_phys_if));
+	acc_inconsistent(&err, lsdn_cleanup_rulesets(
+		virt->network->ctx, &virt->committed_if, &virt->rules_in, &virt->rules_out));
+	return err;
+}
+
+static lsdn_err_t remove_virt_rulesets(struct lsdn_sbridge *br, struct lsdn_virt *virt)
+{
+	if (virt->shared_block)
+		return remove_virt_from_block(br, virt);
+	else
+		return remove_virt_private(virt);
+}
+
+lsdn_err_t lsdn_sbridge_add_virt(struct lsdn_sbridge *br, struct lsdn_virt *virt)
+{
+	lsdn_err_t err;
+	struct lsdn_context *ctx = virt->network->ctx;
+	if (ctx->shared_blocks && !lsdn_virt_has_ingress_rules(virt))
+		err = add_virt_to_block(br, virt);
+	else
+		err = add_virt_private(virt);
+	if (err != LSDNE_OK)
+		goto end;
+
+	struct lsdn_sbridge_if *iface = &virt->sbridge_if;
 	err = lsdn_sbridge_add_if(br, iface);
 	if (err != LSDNE_OK)
-		goto cleanup_phys_if;
+		goto cleanup_rulesets;
 
 	struct lsdn_sbridge_route *route = &virt->sbridge_route;
 	err = lsdn_sbridge_add_route_default(iface, route);
 	if (err != LSDNE_OK)
 		goto cleanup_sbridge_if;
 
-	err = lsdn_sbridge_add_mac(route, &virt->sbridge_mac, *virt->attr_mac);
+	err = lsdn_sbridge_add_mac(route, &virt->sbridge_mac, *virt->attr_mac, virt->attr_ip);
 	if (err != LSDNE_OK)
 		goto cleanup_sbridge_route;
 
+	if (virt->attr_ip && virt->attr_ip->v == LSDN_IPv4)
+		err = arp_add_requester(iface, *virt->attr_mac, *virt->attr_ip);
+	else if (virt->attr_ip)
+		err = nd_add_requester(iface, *virt->attr_mac, *virt->attr_ip);
+	if (err != LSDNE_OK)
+		goto cleanup_sbridge_mac;
+
 	return err;
+	cleanup_sbridge_mac:
+	acc_inconsistent(&err, lsdn_sbridge_remove_mac(&virt->sbridge_mac));
 	cleanup_sbridge_route:
 	acc_inconsistent(&err, lsdn_sbridge_remove_route(route));
 	cleanup_sbridge_if:
 	acc_inconsistent(&err, lsdn_sbridge_remove_if(iface));
-	cleanup_phys_if:
-	acc_inconsistent(&err, lsdn_sbridge_phys_if_free(&virt->sbridge_phys_if));
 	cleanup_rulesets:
-	acc_inconsistent(&err, lsdn_cleanup_rulesets(ctx, &virt->committed_if, &virt->rules_in, &virt->rules_out));
+	acc_inconsistent(&err, remove_virt_rulesets(br, virt));
 	end:
 	return err;
 }
 lsdn_err_t lsdn_sbridge_remove_virt(struct lsdn_virt *virt)
 {
 	lsdn_err_t err = LSDNE_OK;
+	struct lsdn_sbridge *br = virt->sbridge_if.bridge;
 	acc_inconsistent(&err, lsdn_sbridge_remove_mac(&virt->sbridge_mac));
 	acc_inconsistent(&err, lsdn_sbridge_remove_route(&virt->sbridge_route));
 	acc_inconsistent(&err, lsdn_sbridge_remove_if(&virt->sbridge_if));
-	acc_inconsistent(&err, lsdn_sbridge_phys_if_free(&virt->sbridge_phys_if));
-	// TODO: also remove the qdiscs
-	lsdn_ruleset_free(&virt->rules_in);
-	lsdn_ruleset_free(&virt->rules_out);
+	acc_inconsistent(&err, remove_virt_rulesets(br, virt));
 	return err;
 }
 
@@ -424,6 +1430,7 @@ lsdn_err_t lsdn_sbridge_add_stunnel(
 	struct lsdn_sbridge_phys_if *phys_if, struct lsdn_net *net)
 {
 	iface->phys_if = phys_if;
+	iface->out_if = phys_if->iface;
 	iface->additional_match = LSDN_MATCH_ENC_KEY_ID;
 	iface->additional_matchdata.enc_key_id = net->vnet_id;
 	return lsdn_sbridge_add_if(br, iface);
@@ -5,8 +5,7 @@
 static uint16_t vxlan_port = 4789;
 static uint16_t geneve_port = 6081;
 
-struct lsdn_settings *settings_from_env(struct lsdn_context *ctx) {
-	const char *nettype = getenv("LSCTL_NETTYPE");
+static struct lsdn_settings *new_settings(struct lsdn_context *ctx, const char *nettype) {
 	if (!nettype) {
 		fprintf(stderr, "no LSCTL_NETTYPE\n");
 		abort();
@@ -28,5 +27,34 @@ struct lsdn_settings *settings_from_env(struct lsdn_context *ctx) {
 		fprintf(stderr, "Unknown nettype: %s\n", nettype);
 		abort();
 	}
+}
 
+/* Tunnel options for throughput, each different from the kernel default for an IPv4 underlay:
+ * outer UDP checksums (off by default for VXLAN), which the receiver can validate in hardware
+ * and then aggregate the packets by GRO, the DF flag copied from the inner packets (unset by
+ * default) and a longer queue (1000 packets by default) */
+static const struct lsdn_tunnel_opts tuned_tunnel_opts = {
+	.udp_csum = LSDN_TUNNEL_FLAG_ON,
+	.df = LSDN_TUNNEL_DF_INHERIT,
+	.txqueuelen = 10000
+};
+
+struct lsdn_settings *settings_from_env(struct lsdn_context *ctx) {
+	const char *nettype = getenv("LSCTL_NETTYPE");
+	if (getenv("LSCTL_CLSACT"))
+		lsdn_context_set_clsact(ctx, true);
+	if (getenv("LSCTL_VERSIONED_RULES"))
+		lsdn_context_set_versioned_rules(ctx, true);
+	if (getenv("LSCTL_SHARED_BLOCKS"))
+		lsdn_context_set_shared_blocks(ctx, true);
+	if (getenv("LSCTL_BPF_SWITCHING"))
+		lsdn_context_set_bpf_switching(ctx, true);
+	if (getenv("LSCTL_VLAN_BRIDGE"))
+		lsdn_context_set_vlan_bridge(ctx, true);
+	if (getenv("LSCTL_COMMIT_WORKERS"))
+		lsdn_context_set_commit_workers(ctx, atoi(getenv("LSCTL_COMMIT_WORKERS")));
+	struct lsdn_settings *s = new_settings(ctx, nettype);
+	if (getenv("LSCTL_TUNNEL_OPTS"))
+		lsdn_settings_set_tunnel_opts(s, &tuned_tunnel_opts);
+	return s;
 }
@@ -0,0 +1,23 @@
+# Commit benchmark, run with any of the network type parts.
+# The number of virts can be set using BENCH_VIRTS (default 500). Prints the timings without
+# and with the filter buffer pool side by side.
+PHYS_LIST="a"
+bench_virts=${BENCH_VIRTS:-500}
+
+function prepare(){
+	mk_testnet net
+	mk_phys net a ip 172.16.0.1/24
+	# one spare interface for the virt added by the benchmark
+	for i in `seq $((bench_virts + 1))`; do
+		in_phys a ip link add "v$i" type dummy
+		in_phys a ip link set "v$i" up
+	done
+}
+
+function connect(){
+	pass in_phys a ${TEST_RUNNER:-} ./test_bench $bench_virts
+}
+
+function test(){
+	true
+}
@@ -0,0 +1 @@
+export LSCTL_BPF_SWITCHING=1
@@ -0,0 +1 @@
+export LSCTL_CLSACT=1
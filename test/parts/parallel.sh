@@ -0,0 +1 @@
+export LSCTL_COMMIT_WORKERS=4
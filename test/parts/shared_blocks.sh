@@ -0,0 +1 @@
+export LSCTL_SHARED_BLOCKS=1
@@ -0,0 +1,33 @@
+# Throughput benchmark, run with a network type part and cbasic.
+# Measures TCP throughput between virts on two physes with the default tunnel options, then
+# commits the network again with the tuned options (see tunnel_opts.sh), measures again and
+# prints both results side by side. The length of each measurement can be set using BENCH_TIME
+# (default 10 seconds).
+source "parts/basic_common.sh"
+
+# Prints the throughput in Mbit/s, netperf -P 0 leaves only the result line
+function measure(){
+	in_virt a 1 netperf -H 192.168.99.4 -t TCP_STREAM -l ${BENCH_TIME:-10} -P 0 | awk '{print $NF}'
+}
+
+function test(){
+	# netperf is optional in the test rootfs
+	if ! which netperf > /dev/null 2>&1; then
+		echo "netperf is not available, skipping the measurement" >&2
+		return
+	fi
+	in_virt b 1 netserver
+
+	(unset LSCTL_TUNNEL_OPTS; connect)
+	local baseline=$(measure)
+	(export LSCTL_TUNNEL_OPTS=1; connect)
+	local tuned=$(measure)
+	pkill -x netserver || true
+	if [ -z "$baseline" ] || [ -z "$tuned" ]; then
+		echo "netperf has not reported the throughput"
+		test_error
+	fi
+
+	printf "%-20s %12s %12s\n" "Mbit/s" "baseline" "tuned"
+	printf "%-20s %12s %12s\n" "TCP_STREAM" "$baseline" "$tuned"
+}
@@ -0,0 +1 @@
+export LSCTL_TUNNEL_OPTS=1
@@ -0,0 +1 @@
+export LSCTL_VERSIONED_RULES=1
@@ -0,0 +1 @@
+export LSCTL_VLAN_BRIDGE=1
@@ -0,0 +1,176 @@
+#include <lsdn.h>
+#include "../netmodel/private/mock.h"
+#include "../netmodel/private/lsdn.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "common.h"
+
+/* Commit benchmark.
+ *
+ * Builds a network with a single local phys and a given number of virts (connected to
+ * interfaces v1 ... vN), plus the same number of virts on a remote phys. Then measures the
+ * initial commit, commits after small changes (which should not depend on the number of virts)
+ * and the final teardown. Interface vN+1 must exist too.
+ *
+ * With the `mock` argument, the commits go to an emulated kernel (and the interfaces are created
+ * there), so the benchmark can run without root privileges. It can be followed by the number of
+ * networks the virts are spread over, to measure the parallel commit (see LSCTL_COMMIT_WORKERS).
+ *
+ * Everything is measured twice, first without reusing the netlink buffers of the filters (the
+ * baseline) and then with the filter pool, and the timings are printed side by side.
+ */
+
+/* Measured phases, in the order they are run */
+enum phase {
+	PHASE_COMMIT, PHASE_NO_CHANGE, PHASE_CHANGED_VIRT, PHASE_NEW_VIRT, PHASE_CLEANUP, PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+	[PHASE_COMMIT] = "commit (all virts)",
+	[PHASE_NO_CHANGE] = "commit (no change)",
+	[PHASE_CHANGED_VIRT] = "commit (1 changed virt)",
+	[PHASE_NEW_VIRT] = "commit (1 new virt)",
+	[PHASE_CLEANUP] = "cleanup"
+};
+
+static struct lsdn_context *ctx;
+static struct lsdn_settings *settings;
+static struct lsdn_net **nets;
+static struct lsdn_phys *local, *remote;
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static lsdn_mac_t mk_mac(unsigned int i, uint8_t phys)
+{
+	return LSDN_MK_MAC(0x00, phys, 0x00, (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+}
+
+static void print_stats(void)
+{
+	const struct lsdn_commit_stats *s = lsdn_context_get_commit_stats(ctx);
+	printf("  validate %.1f ms, decommit %.1f ms, commit %.1f ms, ack %.1f ms\n",
+		s->validate_us / 1000.0, s->decommit_us / 1000.0,
+		s->commit_us / 1000.0, s->ack_us / 1000.0);
+	printf("  netlink: %zu link, %zu qdisc, %zu filter, %zu fdb, %zu action, %zu bytes, %zu errors\n",
+		s->nl.link_msgs, s->nl.qdisc_msgs, s->nl.filter_msgs, s->nl.fdb_msgs,
+		s->nl.action_msgs, s->nl.bytes, s->nl.errors);
+}
+
+/* Build the model and measure its commits, with or without the filter pool */
+static void run(bool mock, bool pool, unsigned int count, unsigned int net_count,
+	double times[PHASE_COUNT])
+{
+	char ifname[32];
+	double start;
+
+	ctx = lsdn_context_new("ls");
+	lsdn_context_abort_on_nomem(ctx);
+	if (mock) {
+		lsdn_context_use_mock_kernel(ctx);
+		lsdn_context_mock_add_link(ctx, "out");
+		for (unsigned int i = 1; i <= count + 1; i++) {
+			snprintf(ifname, sizeof(ifname), "v%u", i);
+			lsdn_context_mock_add_link(ctx, ifname);
+		}
+	}
+	lsdn_context_set_filter_pool(ctx, pool);
+	settings = settings_from_env(ctx);
+
+	local = lsdn_phys_new(ctx);
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_set_ip(local, LSDN_MK_IPV4(172, 16, 0, 1));
+	lsdn_phys_claim_local(local);
+
+	remote = lsdn_phys_new(ctx);
+	lsdn_phys_set_iface(remote, "out");
+	lsdn_phys_set_ip(remote, LSDN_MK_IPV4(172, 16, 0, 2));
+
+	nets = malloc(net_count * sizeof(*nets));
+	assert(nets);
+	for (unsigned int i = 0; i < net_count; i++) {
+		nets[i] = lsdn_net_new(settings, i + 1);
+		lsdn_phys_attach(local, nets[i]);
+		lsdn_phys_attach(remote, nets[i]);
+	}
+
+	struct lsdn_virt *first = NULL;
+	for (unsigned int i = 1; i <= count; i++) {
+		struct lsdn_net *net = nets[i % net_count];
+		struct lsdn_virt *v = lsdn_virt_new(net);
+		snprintf(ifname, sizeof(ifname), "v%u", i);
+		lsdn_virt_connect(v, local, ifname);
+		lsdn_virt_set_mac(v, mk_mac(i, 0xa));
+		if (!first)
+			first = v;
+
+		v = lsdn_virt_new(net);
+		lsdn_virt_connect(v, remote, ifname);
+		lsdn_virt_set_mac(v, mk_mac(i, 0xb));
+	}
+
+	printf("filter pool %s\n", pool ? "on" : "off");
+	start = now_ms();
+	lsdn_err_t err = lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL);
+	times[PHASE_COMMIT] = now_ms() - start;
+	printf("commit (%u virts): %.1f ms\n", count, times[PHASE_COMMIT]);
+	assert(err == LSDNE_OK);
+	print_stats();
+
+	start = now_ms();
+	err = lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL);
+	times[PHASE_NO_CHANGE] = now_ms() - start;
+	printf("commit (no change): %.1f ms\n", times[PHASE_NO_CHANGE]);
+	assert(err == LSDNE_OK);
+	print_stats();
+
+	lsdn_virt_set_mac(first, mk_mac(0, 0xc));
+	start = now_ms();
+	err = lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL);
+	times[PHASE_CHANGED_VIRT] = now_ms() - start;
+	printf("commit (1 changed virt): %.1f ms\n", times[PHASE_CHANGED_VIRT]);
+	assert(err == LSDNE_OK);
+	print_stats();
+
+	struct lsdn_virt *added = lsdn_virt_new(nets[0]);
+	snprintf(ifname, sizeof(ifname), "v%u", count + 1);
+	lsdn_virt_connect(added, local, ifname);
+	lsdn_virt_set_mac(added, mk_mac(count + 1, 0xa));
+	start = now_ms();
+	err = lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL);
+	times[PHASE_NEW_VIRT] = now_ms() - start;
+	printf("commit (1 new virt): %.1f ms\n", times[PHASE_NEW_VIRT]);
+	assert(err == LSDNE_OK);
+	print_stats();
+
+	start = now_ms();
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	times[PHASE_CLEANUP] = now_ms() - start;
+	printf("cleanup: %.1f ms\n", times[PHASE_CLEANUP]);
+	free(nets);
+}
+
+int main(int argc, const char* argv[])
+{
+	assert(argc >= 2 && argc <= 4);
+	assert(argc == 2 || strcmp(argv[2], "mock") == 0);
+	unsigned int count = strtoul(argv[1], NULL, 10);
+	unsigned int net_count = argc == 4 ? strtoul(argv[3], NULL, 10) : 1;
+	assert(net_count > 0);
+	double baseline[PHASE_COUNT], pooled[PHASE_COUNT];
+
+	run(argc >= 3, false, count, net_count, baseline);
+	run(argc >= 3, true, count, net_count, pooled);
+
+	printf("\n%-24s %12s %12s\n", "", "baseline", "filter pool");
+	for (int i = 0; i < PHASE_COUNT; i++)
+		printf("%-24s %9.1f ms %9.1f ms\n", phase_names[i], baseline[i], pooled[i]);
+	return 0;
+}
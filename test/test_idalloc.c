@@ -0,0 +1,77 @@
+#include "../netmodel/private/idalloc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_ID 1
+#define MAX_ID 0xFFFF
+#define CHURN_ROUNDS 1000000
+
+static bool used[MAX_ID];
+
+/* Checks that the allocated ID is the lowest free one. */
+static uint32_t get_lowest(struct lsdn_idalloc *alloc, uint32_t *lowest_free)
+{
+	uint32_t id;
+	if (!lsdn_idalloc_get(alloc, &id))
+		abort();
+	if (id < MIN_ID || id >= MAX_ID || used[id])
+		abort();
+	while (used[*lowest_free])
+		(*lowest_free)++;
+	if (id != *lowest_free)
+		abort();
+	used[id] = true;
+	return id;
+}
+
+static void put(struct lsdn_idalloc *alloc, uint32_t id, uint32_t *lowest_free)
+{
+	used[id] = false;
+	lsdn_idalloc_return(alloc, id);
+	if (id < *lowest_free)
+		*lowest_free = id;
+}
+
+int main()
+{
+	struct lsdn_idalloc alloc;
+	uint32_t lowest_free = MIN_ID;
+	uint32_t id;
+	size_t count = 0;
+
+	/* Exhaust the whole range */
+	lsdn_idalloc_init(&alloc, MIN_ID, MAX_ID);
+	for (uint32_t i = MIN_ID; i < MAX_ID; i++)
+		get_lowest(&alloc, &lowest_free);
+	if (lsdn_idalloc_get(&alloc, &id))
+		abort();
+
+	/* Everything returned must be reusable again */
+	for (long i = MAX_ID - 1; i >= MIN_ID; i -= 3)
+		put(&alloc, i, &lowest_free);
+	for (long i = MAX_ID - 1; i >= MIN_ID; i -= 3)
+		get_lowest(&alloc, &lowest_free);
+	if (lsdn_idalloc_get(&alloc, &id))
+		abort();
+	lsdn_idalloc_free(&alloc);
+
+	/* Random churn, as by VMs coming and going */
+	memset(used, 0, sizeof(used));
+	lowest_free = MIN_ID;
+	lsdn_idalloc_init(&alloc, MIN_ID, MAX_ID);
+	srand(42);
+	for (size_t r = 0; r < CHURN_ROUNDS; r++) {
+		if (count < MAX_ID - MIN_ID && (count == 0 || rand() % 2)) {
+			get_lowest(&alloc, &lowest_free);
+			count++;
+		} else {
+			do {
+				id = MIN_ID + rand() % (MAX_ID - MIN_ID);
+			} while (!used[id]);
+			put(&alloc, id, &lowest_free);
+			count--;
+		}
+	}
+	lsdn_idalloc_free(&alloc);
+	return 0;
+}
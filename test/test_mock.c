@@ -0,0 +1,1375 @@
+#include <lsdn.h>
+#include "../netmodel/private/mock.h"
+#include "../netmodel/private/lsdn.h"
+#include <rules.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/* Commits the networks to the emulated kernel and checks the kernel objects it ends up with.
+ * The scenarios are described at their functions. */
+
+#define NETS 4
+
+/* Unlike assert, the check is not compiled out with NDEBUG. */
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			abort(); \
+		} \
+	} while (0)
+
+static void ignore_problem(const struct lsdn_problem *problem, void *user)
+{
+	(void) problem;
+	(*(unsigned int *) user)++;
+}
+
+/* The tunnels use the default UDP port of their type moved by `port_offset` */
+static struct lsdn_settings *make_port_settings(
+	struct lsdn_context *ctx, const char *type, uint16_t port_offset)
+{
+	if (!strcmp(type, "vlan"))
+		return lsdn_settings_new_vlan(ctx);
+	else if (!strcmp(type, "vxlan/e2e"))
+		return lsdn_settings_new_vxlan_e2e(ctx, 4789 + port_offset);
+	else if (!strcmp(type, "vxlan/static"))
+		return lsdn_settings_new_vxlan_static(ctx, 4789 + port_offset);
+	else if (!strcmp(type, "vxlan/mcast"))
+		return lsdn_settings_new_vxlan_mcast(
+			ctx, LSDN_MK_IPV4(239, 239, 239, 239), 4789 + port_offset);
+	else if (!strcmp(type, "geneve"))
+		return lsdn_settings_new_geneve(ctx, 6081 + port_offset);
+	else if (!strcmp(type, "geneve/e2e"))
+		return lsdn_settings_new_geneve_e2e(ctx, 6081 + port_offset);
+	else
+		return lsdn_settings_new_direct(ctx);
+}
+
+static struct lsdn_settings *make_settings(struct lsdn_context *ctx, const char *type)
+{
+	return make_port_settings(ctx, type, 0);
+}
+
+/* Commits a small network and checks that the kernel objects are created and then removed
+ * again when the network is freed */
+static void run(const char *type)
+{
+	struct lsdn_mock_state state;
+	unsigned int problems = 0;
+	lsdn_err_t err;
+
+	printf("%s\n", type);
+	struct lsdn_context *ctx = lsdn_context_new("ls");
+	lsdn_context_abort_on_nomem(ctx);
+	err = lsdn_context_use_mock_kernel(ctx);
+	CHECK(err == LSDNE_OK);
+	lsdn_context_mock_add_link(ctx, "out");
+	lsdn_context_mock_add_link(ctx, "v1");
+	lsdn_context_mock_add_link(ctx, "v2");
+	err = lsdn_context_mock_add_link(ctx, "v2");
+	CHECK(err == LSDNE_DUPLICATE);
+
+	struct lsdn_settings *settings = make_settings(ctx, type);
+	struct lsdn_net *net = lsdn_net_new(settings, 1);
+
+	struct lsdn_phys *local = lsdn_phys_new(ctx);
+	lsdn_phys_attach(local, net);
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_set_ip(local, LSDN_MK_IPV4(172, 16, 0, 1));
+	lsdn_phys_claim_local(local);
+
+	struct lsdn_virt *v1 = lsdn_virt_new(net);
+	lsdn_virt_connect(v1, local, "v1");
+	lsdn_virt_set_mac(v1, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa1));
+
+	/* The interface does not exist in the emulated kernel */
+	struct lsdn_virt *v2 = lsdn_virt_new(net);
+	lsdn_virt_connect(v2, local, "missing");
+	lsdn_virt_set_mac(v2, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa2));
+	err = lsdn_validate(ctx, ignore_problem, &problems);
+	CHECK(err == LSDNE_VALIDATE && problems > 0);
+	lsdn_virt_connect(v2, local, "v2");
+
+	struct lsdn_phys *remote = NULL;
+	if (strcmp(type, "direct")) {
+		remote = lsdn_phys_new(ctx);
+		lsdn_phys_attach(remote, net);
+		lsdn_phys_set_iface(remote, "out");
+		lsdn_phys_set_ip(remote, LSDN_MK_IPV4(172, 16, 0, 2));
+		struct lsdn_virt *v3 = lsdn_virt_new(net);
+		lsdn_virt_connect(v3, remote, "v1");
+		lsdn_virt_set_mac(v3, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa3));
+	}
+
+	err = lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL);
+	CHECK(err == LSDNE_OK);
+	CHECK(lsdn_context_get_commit_stats(ctx)->nl.errors == 0);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.links > 3);
+	printf("  %zu links, %zu qdiscs, %zu filters, %zu fdb entries\n",
+		state.links, state.qdiscs, state.filters, state.fdb_entries);
+
+	/* Nothing has changed, so nothing should be sent */
+	err = lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL);
+	CHECK(err == LSDNE_OK);
+	CHECK(lsdn_context_get_commit_stats(ctx)->nl.filter_msgs == 0);
+
+	lsdn_phys_free(local);
+	if (remote)
+		lsdn_phys_free(remote);
+	lsdn_settings_free(settings);
+	err = lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL);
+	CHECK(err == LSDNE_OK);
+	CHECK(lsdn_context_get_commit_stats(ctx)->nl.errors == 0);
+
+	/* Only the pre-created interfaces are left */
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.links == 3);
+	CHECK(state.qdiscs == 0);
+	CHECK(state.chains == 0);
+	CHECK(state.filters == 0);
+	CHECK(state.fdb_entries == 0);
+	CHECK(state.actions == 0);
+
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+}
+
+static void commit_ok(struct lsdn_context *ctx)
+{
+	lsdn_err_t err = lsdn_commit(ctx, lsdn_problem_stderr_handler, NULL);
+	CHECK(err == LSDNE_OK);
+	CHECK(lsdn_context_get_commit_stats(ctx)->nl.errors == 0);
+}
+
+static void run_nets(
+	const char *type, unsigned int workers, bool vlan_bridge, struct lsdn_mock_state *states)
+{
+	char ifname[32];
+	struct lsdn_context *ctx = lsdn_context_new("ls");
+	lsdn_context_abort_on_nomem(ctx);
+	lsdn_context_use_mock_kernel(ctx);
+	lsdn_context_set_commit_workers(ctx, workers);
+	lsdn_context_set_vlan_bridge(ctx, vlan_bridge);
+	lsdn_context_mock_add_link(ctx, "out");
+	for (unsigned int i = 0; i < 2 * NETS; i++) {
+		snprintf(ifname, sizeof(ifname), "v%u", i);
+		lsdn_context_mock_add_link(ctx, ifname);
+	}
+
+	struct lsdn_settings *settings = make_settings(ctx, type);
+	struct lsdn_phys *local = lsdn_phys_new(ctx);
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_set_ip(local, LSDN_MK_IPV4(172, 16, 0, 1));
+	lsdn_phys_claim_local(local);
+	struct lsdn_phys *remote = lsdn_phys_new(ctx);
+	lsdn_phys_set_iface(remote, "out");
+	lsdn_phys_set_ip(remote, LSDN_MK_IPV4(172, 16, 0, 2));
+
+	struct lsdn_net *nets[NETS];
+	for (unsigned int i = 0; i < NETS; i++) {
+		nets[i] = lsdn_net_new(settings, i + 1);
+		lsdn_phys_attach(local, nets[i]);
+		lsdn_phys_attach(remote, nets[i]);
+		struct lsdn_virt *v = lsdn_virt_new(nets[i]);
+		snprintf(ifname, sizeof(ifname), "v%u", i);
+		lsdn_virt_connect(v, local, ifname);
+		lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, i, 0xa1));
+		v = lsdn_virt_new(nets[i]);
+		lsdn_virt_connect(v, remote, ifname);
+		lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, i, 0xb1));
+	}
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &states[0]);
+
+	/* New virts in committed networks */
+	for (unsigned int i = 0; i < NETS; i++) {
+		struct lsdn_virt *v = lsdn_virt_new(nets[i]);
+		snprintf(ifname, sizeof(ifname), "v%u", NETS + i);
+		lsdn_virt_connect(v, local, ifname);
+		lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, i, 0xa2));
+		v = lsdn_virt_new(nets[i]);
+		lsdn_virt_connect(v, remote, ifname);
+		lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, i, 0xb2));
+	}
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &states[1]);
+
+	lsdn_phys_free(local);
+	lsdn_phys_free(remote);
+	lsdn_settings_free(settings);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &states[2]);
+	CHECK(states[2].links == 1 + 2 * NETS);
+	CHECK(states[2].qdiscs == 0);
+	CHECK(states[2].filters == 0);
+	CHECK(states[2].actions == 0);
+	CHECK(states[2].vlans == 0);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+}
+
+/* Commits several networks with and without commit workers, the result must be the same */
+static void run_parallel(const char *type)
+{
+	struct lsdn_mock_state seq[3], par[3];
+	printf("%s, %d networks\n", type, NETS);
+	run_nets(type, 0, false, seq);
+	run_nets(type, 3, false, par);
+	CHECK(memcmp(seq, par, sizeof(seq)) == 0);
+}
+
+static struct lsdn_context *new_context(void)
+{
+	struct lsdn_context *ctx = lsdn_context_new("ls");
+	lsdn_context_abort_on_nomem(ctx);
+	return ctx;
+}
+
+static void add_links(struct lsdn_context *ctx)
+{
+	lsdn_context_use_mock_kernel(ctx);
+	lsdn_context_mock_add_link(ctx, "out");
+	lsdn_context_mock_add_link(ctx, "v1");
+	lsdn_context_mock_add_link(ctx, "v2");
+}
+
+/* A network with two local virts and one or two remote virts, returns the first local virt */
+static struct lsdn_virt *build_model(struct lsdn_context *ctx, const char *type, bool second_remote)
+{
+	struct lsdn_settings *settings = make_settings(ctx, type);
+	struct lsdn_net *net = lsdn_net_new(settings, 1);
+
+	struct lsdn_phys *local = lsdn_phys_new(ctx);
+	lsdn_phys_set_name(local, "local");
+	lsdn_phys_attach(local, net);
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_set_ip(local, LSDN_MK_IPV4(172, 16, 0, 1));
+	lsdn_phys_claim_local(local);
+	struct lsdn_virt *first = lsdn_virt_new(net);
+	lsdn_virt_connect(first, local, "v1");
+	lsdn_virt_set_mac(first, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa1));
+	struct lsdn_virt *v = lsdn_virt_new(net);
+	lsdn_virt_connect(v, local, "v2");
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa2));
+
+	if (!strcmp(type, "direct"))
+		return first;
+	struct lsdn_phys *remote = lsdn_phys_new(ctx);
+	lsdn_phys_attach(remote, net);
+	lsdn_phys_set_iface(remote, "out");
+	lsdn_phys_set_ip(remote, LSDN_MK_IPV4(172, 16, 0, 2));
+	v = lsdn_virt_new(net);
+	lsdn_virt_connect(v, remote, "v1");
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa3));
+	if (second_remote) {
+		v = lsdn_virt_new(net);
+		lsdn_virt_connect(v, remote, "v2");
+		lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa4));
+	}
+	return first;
+}
+
+/* Free the context without removing anything from the kernel, like a crashed application */
+static struct lsdn_context *restart(struct lsdn_context *old)
+{
+	struct lsdn_context *ctx = new_context();
+	lsdn_context_share_mock_kernel(ctx, old);
+	lsdn_context_free(old);
+	return ctx;
+}
+
+/* State after committing the model to a new kernel */
+static void fresh_state(const char *type, struct lsdn_mock_state *state)
+{
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	build_model(ctx, type, false);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, state);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+}
+
+static void check_same_objects(const struct lsdn_mock_state *a, const struct lsdn_mock_state *b)
+{
+	CHECK(a->links == b->links);
+	CHECK(a->qdiscs == b->qdiscs);
+	CHECK(a->classes == b->classes);
+	CHECK(a->chains == b->chains);
+	CHECK(a->filters == b->filters);
+	CHECK(a->fdb_entries == b->fdb_entries);
+	CHECK(a->vlans == b->vlans);
+	CHECK(a->vlan_tunnels == b->vlan_tunnels);
+	CHECK(a->bpf_maps == b->bpf_maps);
+	CHECK(a->bpf_progs == b->bpf_progs);
+	CHECK(a->bpf_map_entries == b->bpf_map_entries);
+	CHECK(a->actions == b->actions);
+}
+
+/* Builds the model of the application, the same one before and after a restart */
+typedef void (*build_fn)(struct lsdn_context *ctx, const char *type, const void *user);
+
+/* The model of build_model, user points to its second_remote flag */
+static void build_plain(struct lsdn_context *ctx, const char *type, const void *user)
+{
+	build_model(ctx, type, *(const bool *) user);
+}
+
+/* Start the application on a new kernel and commit its model */
+static struct lsdn_context *start(
+	const char *type, build_fn build, const void *user, struct lsdn_mock_state *state)
+{
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	build(ctx, type, user);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, state);
+	return ctx;
+}
+
+/* Restart the application, let it build its model again and reconcile the kernel with it */
+static struct lsdn_context *restart_reconcile(
+	struct lsdn_context *ctx, const char *type, build_fn build, const void *user,
+	struct lsdn_mock_state *state)
+{
+	ctx = restart(ctx);
+	build(ctx, type, user);
+	lsdn_context_set_reconcile(ctx, true);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, state);
+	return ctx;
+}
+
+/* Restarts the application on the same kernel in reconcile mode, the kernel objects are adopted
+ * and the stale ones removed */
+static void run_reconcile(const char *type)
+{
+	struct lsdn_mock_state before, after, fresh;
+	const bool one_remote = false, two_remotes = true;
+	printf("%s, reconcile\n", type);
+	struct lsdn_context *ctx = start(type, build_plain, &two_remotes, &before);
+
+	/* The same model, everything is adopted and nothing is created again. The first commit
+	 * fails validation, the kernel is not touched and the next commit still reconciles. */
+	ctx = restart(ctx);
+	struct lsdn_virt *first = build_model(ctx, type, true);
+	lsdn_context_set_reconcile(ctx, true);
+	lsdn_virt_set_mac(first, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa2));
+	unsigned int problems = 0;
+	CHECK(lsdn_commit(ctx, ignore_problem, &problems) == LSDNE_VALIDATE);
+	CHECK(lsdn_context_get_reconcile(ctx));
+	lsdn_virt_set_mac(first, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa1));
+	commit_ok(ctx);
+	CHECK(!lsdn_context_get_reconcile(ctx));
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(after.links_created == before.links_created);
+	CHECK(after.qdiscs_created == before.qdiscs_created);
+	CHECK(after.filters_created == before.filters_created);
+	CHECK(memcmp(&before, &after, sizeof(before)) == 0);
+
+	/* A remote virt was removed while the application was down */
+	ctx = restart_reconcile(ctx, type, build_plain, &one_remote, &after);
+	fresh_state(type, &fresh);
+	check_same_objects(&after, &fresh);
+
+	/* And then the network type was changed, the interfaces can not be adopted */
+	const char *other_type = strcmp(type, "geneve") ? "geneve" : "vlan";
+	ctx = restart_reconcile(ctx, other_type, build_plain, &one_remote, &after);
+	fresh_state(other_type, &fresh);
+	check_same_objects(&after, &fresh);
+
+	/* The adopted objects are owned by the new context and removed with it */
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &after);
+	CHECK(after.links == 3);
+	CHECK(after.qdiscs == 0);
+	CHECK(after.filters == 0);
+	CHECK(after.fdb_entries == 0);
+	CHECK(after.actions == 0);
+	lsdn_context_free(watch);
+}
+
+/* Plans a commit, the kernel is not changed and the plan matches the real commit */
+static void run_plan(const char *type)
+{
+	struct lsdn_mock_state before, after;
+	struct lsdn_plan *plan;
+	printf("%s, plan\n", type);
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	build_model(ctx, type, true);
+	lsdn_context_mock_get_state(ctx, &before);
+
+	lsdn_err_t err = lsdn_commit_plan(ctx, lsdn_problem_stderr_handler, NULL, &plan);
+	CHECK(err == LSDNE_OK);
+	CHECK(plan->result == LSDNE_OK && plan->problem_count == 0);
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(memcmp(&before, &after, sizeof(before)) == 0);
+
+	size_t counts[LSDN_PLAN_COUNT] = {0};
+	for (size_t i = 0; i < plan->count; i++)
+		counts[plan->ops[i].type]++;
+	CHECK(counts[LSDN_PLAN_OTHER] == 0);
+	if (counts[LSDN_PLAN_LINK_CREATE] > 0)
+		CHECK(plan->ops[0].ifindex == LSDN_PLAN_FIRST_IFINDEX);
+
+	/* The model was not changed by the plan, the commit does exactly the same */
+	commit_ok(ctx);
+	const struct lsdn_commit_stats *stats = lsdn_context_get_commit_stats(ctx);
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(after.links_created - before.links_created == counts[LSDN_PLAN_LINK_CREATE]);
+	CHECK(after.fdb_entries == counts[LSDN_PLAN_FDB_ADD]);
+	CHECK(after.actions == counts[LSDN_PLAN_ACTION_CREATE]);
+	CHECK(plan->stats.qdisc_msgs == stats->nl.qdisc_msgs);
+	CHECK(plan->stats.filter_msgs == stats->nl.filter_msgs);
+	CHECK(plan->stats.fdb_msgs == stats->nl.fdb_msgs);
+	CHECK(plan->stats.action_msgs == stats->nl.action_msgs);
+	lsdn_plan_free(plan);
+
+	/* Nothing left to do */
+	err = lsdn_commit_plan(ctx, lsdn_problem_stderr_handler, NULL, &plan);
+	CHECK(err == LSDNE_OK);
+	CHECK(plan->count == 0);
+	lsdn_plan_free(plan);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+}
+
+/* Changes the rules of a virt with versioned rules, the old version is removed */
+static void run_versioned(const char *type)
+{
+	struct lsdn_mock_state before, after;
+	printf("%s, versioned rules\n", type);
+	struct lsdn_context *ctx = new_context();
+	lsdn_context_set_versioned_rules(ctx, true);
+	add_links(ctx);
+	struct lsdn_virt *v = build_model(ctx, type, true);
+	struct lsdn_vr *vr = lsdn_vr_new(v, 10, LSDN_IN, &LSDN_VR_DROP);
+	lsdn_vr_add_src_ip(vr, LSDN_MK_IPV4(10, 0, 0, 1));
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &before);
+
+	/* A new version is built next to the active one, and the old one is flushed after the
+	 * switch, leaving the same number of chains */
+	vr = lsdn_vr_new(v, 11, LSDN_IN, &LSDN_VR_DROP);
+	lsdn_vr_add_src_ip(vr, LSDN_MK_IPV4(10, 0, 0, 2));
+	commit_ok(ctx);
+	const struct lsdn_commit_stats *stats = lsdn_context_get_commit_stats(ctx);
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(after.chains == before.chains);
+	CHECK(after.filters == before.filters + 1);
+	/* Both rules, the jump to them and the flush of the old chain */
+	CHECK(stats->nl.filter_msgs >= 4);
+
+	/* And back again, to the original chain */
+	lsdn_vr_free(vr);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &after);
+	check_same_objects(&before, &after);
+
+	commit_ok(ctx);
+	CHECK(lsdn_context_get_commit_stats(ctx)->nl.filter_msgs == 0);
+
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &after);
+	CHECK(after.chains == 0);
+	CHECK(after.filters == 0);
+	lsdn_context_free(watch);
+}
+
+static void count_calls(void *user)
+{
+	(*(size_t *) user)++;
+}
+
+static void count_batch_err(lsdn_err_t err, void *user)
+{
+	CHECK(err == LSDNE_NETLINK);
+	(*(size_t *) user)++;
+}
+
+static void queue_drop_filter(struct lsdn_nl *sock, unsigned int ifindex, uint32_t handle)
+{
+	struct lsdn_filter *f = lsdn_filter_flower_init(
+		sock, ifindex, handle, LSDN_INGRESS_HANDLE, LSDN_DEFAULT_CHAIN, 1);
+	CHECK(f);
+	lsdn_flower_actions_start(f);
+	lsdn_action_drop(f, 1);
+	lsdn_flower_actions_end(f);
+	/* Queued, the result is only known when the batch is flushed */
+	CHECK(lsdn_filter_create(sock, f) == LSDNE_OK);
+	lsdn_filter_free(f);
+}
+
+/* The batched filters are sent together and each error is reported to the owner of its request,
+ * the requests after a failed one are still processed */
+static void run_batch(void)
+{
+	struct lsdn_mock_state state;
+	size_t calls = 0, errors_a = 0, errors_b = 0;
+	printf("batched requests\n");
+	struct lsdn_context *ctx = new_context();
+	lsdn_context_use_mock_kernel(ctx);
+	lsdn_context_mock_add_link(ctx, "w1");
+	lsdn_context_mock_add_link(ctx, "w2");
+	/* Connects the context to the kernel */
+	commit_ok(ctx);
+	struct lsdn_nl *sock = ctx->nlsock;
+	struct lsdn_if w1, w2;
+	lsdn_if_init(&w1);
+	lsdn_if_init(&w2);
+	CHECK(lsdn_if_set_name(&w1, "w1") == LSDNE_OK);
+	CHECK(lsdn_if_set_name(&w2, "w2") == LSDNE_OK);
+	CHECK(lsdn_if_resolve(sock, &w1) == LSDNE_OK);
+	CHECK(lsdn_if_resolve(sock, &w2) == LSDNE_OK);
+	/* Only w1 can have filters */
+	CHECK(lsdn_qdisc_ingress_create(sock, w1.ifindex, false) == LSDNE_OK);
+
+	struct lsdn_nl_io_hooks hooks = { count_calls, NULL, &calls };
+	lsdn_nl_set_io_hooks(sock, hooks);
+	struct lsdn_nl_owner a = { count_batch_err, &errors_a };
+	struct lsdn_nl_owner b = { count_batch_err, &errors_b };
+	lsdn_nl_batch_begin(sock);
+	lsdn_nl_set_owner(sock, a);
+	for (uint32_t handle = 1; handle <= 10; handle++)
+		queue_drop_filter(sock, w1.ifindex, handle);
+	lsdn_nl_set_owner(sock, b);
+	queue_drop_filter(sock, w2.ifindex, 1);
+	lsdn_nl_set_owner(sock, a);
+	queue_drop_filter(sock, w1.ifindex, 11);
+	CHECK(calls == 0);
+	CHECK(lsdn_nl_batch_end(sock) == LSDNE_OK);
+	/* One send and one receive for all the ACKs */
+	CHECK(calls == 2);
+	CHECK(errors_a == 0);
+	CHECK(errors_b == 1);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.filters == 11);
+
+	/* A failure without an owner fails the whole batch */
+	lsdn_nl_batch_begin(sock);
+	queue_drop_filter(sock, w2.ifindex, 1);
+	CHECK(lsdn_nl_batch_end(sock) == LSDNE_NETLINK);
+	CHECK(errors_b == 1);
+
+	lsdn_nl_set_io_hooks(sock, (struct lsdn_nl_io_hooks) { NULL, NULL, NULL });
+	lsdn_if_free(&w1);
+	lsdn_if_free(&w2);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+}
+
+static void mkaction_drop(struct lsdn_filter *filter, uint16_t order, void *user)
+{
+	(void) user;
+	lsdn_action_drop(filter, order);
+}
+
+static void init_drop_rule(struct lsdn_rule *rule, uint8_t mac, uint32_t subprio)
+{
+	memset(rule, 0, sizeof(*rule));
+	rule->matches[0].mac = LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, mac);
+	rule->subprio = subprio;
+	lsdn_action_init(&rule->action, 1, mkaction_drop, NULL);
+}
+
+/* The flower filters of a ruleset are sent at the end of the commit, once for all the rules
+ * merged into them, and not at all if their rules are gone by then */
+static void run_deferred_filters(void)
+{
+	struct lsdn_mock_state state;
+	printf("deferred filters\n");
+	struct lsdn_context *ctx = new_context();
+	lsdn_context_use_mock_kernel(ctx);
+	lsdn_context_mock_add_link(ctx, "w1");
+	/* Connects the context to the kernel */
+	commit_ok(ctx);
+	struct lsdn_if iface;
+	lsdn_if_init(&iface);
+	CHECK(lsdn_if_set_name(&iface, "w1") == LSDNE_OK);
+	CHECK(lsdn_if_resolve(ctx->nlsock, &iface) == LSDNE_OK);
+	CHECK(lsdn_qdisc_ingress_create(ctx->nlsock, iface.ifindex, false) == LSDNE_OK);
+
+	struct lsdn_ruleset rs;
+	lsdn_ruleset_init(&rs, ctx, &iface, LSDN_INGRESS_HANDLE, LSDN_DEFAULT_CHAIN, 1, 1);
+	struct lsdn_ruleset_prio *prio = lsdn_ruleset_define_prio(&rs, 0);
+	CHECK(prio);
+	prio->targets[0] = LSDN_MATCH_DST_MAC;
+	prio->masks[0].mac = lsdn_single_mac_mask;
+
+	struct lsdn_rule a, b, c;
+	init_drop_rule(&a, 0xa1, 0);
+	init_drop_rule(&b, 0xa1, 1);
+	CHECK(lsdn_ruleset_add(prio, &a) == LSDNE_OK);
+	CHECK(lsdn_ruleset_add(prio, &b) == LSDNE_OK);
+	commit_ok(ctx);
+	CHECK(lsdn_context_get_commit_stats(ctx)->nl.filter_msgs == 1);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.filters == 1);
+
+	init_drop_rule(&c, 0xa2, 0);
+	CHECK(lsdn_ruleset_add(prio, &c) == LSDNE_OK);
+	CHECK(lsdn_ruleset_remove(&c) == LSDNE_OK);
+	commit_ok(ctx);
+	CHECK(lsdn_context_get_commit_stats(ctx)->nl.filter_msgs == 0);
+
+	/* Both changes of the shared filter are a single replace */
+	CHECK(lsdn_ruleset_remove(&b) == LSDNE_OK);
+	init_drop_rule(&b, 0xa1, 2);
+	CHECK(lsdn_ruleset_add(prio, &b) == LSDNE_OK);
+	commit_ok(ctx);
+	CHECK(lsdn_context_get_commit_stats(ctx)->nl.filter_msgs == 1);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.filters == 1);
+
+	CHECK(lsdn_ruleset_remove(&a) == LSDNE_OK);
+	CHECK(lsdn_ruleset_remove(&b) == LSDNE_OK);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.filters == 0);
+	lsdn_ruleset_free(&rs);
+	lsdn_if_free(&iface);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+}
+
+/* The static bridge networks share a block, another context gets a block of its own and a virt
+ * with its own rules is moved out of the block */
+static void run_blocks(const char *type)
+{
+	struct lsdn_mock_state fresh, shared, after;
+	printf("%s, shared blocks\n", type);
+	fresh_state(type, &fresh);
+
+	struct lsdn_context *ctx = new_context();
+	lsdn_context_set_shared_blocks(ctx, true);
+	add_links(ctx);
+	struct lsdn_virt *v = build_model(ctx, type, false);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &shared);
+	/* The fallback rule is only once in the block */
+	CHECK(shared.filters < fresh.filters);
+
+	/* Another application in the same namespace binds its virts to a block of its own, removing
+	 * it leaves our block alone */
+	struct lsdn_context *other = lsdn_context_new("other");
+	lsdn_context_abort_on_nomem(other);
+	lsdn_context_set_shared_blocks(other, true);
+	lsdn_context_share_mock_kernel(other, ctx);
+	lsdn_context_mock_add_link(ctx, "w1");
+	/* Its metadata tunnel can not receive on our port */
+	struct lsdn_net *net = lsdn_net_new(make_port_settings(other, type, 1), 2);
+	struct lsdn_phys *local = lsdn_phys_new(other);
+	lsdn_phys_attach(local, net);
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_set_ip(local, LSDN_MK_IPV4(172, 16, 0, 1));
+	lsdn_phys_claim_local(local);
+	struct lsdn_virt *w = lsdn_virt_new(net);
+	lsdn_virt_connect(w, local, "w1");
+	lsdn_virt_set_mac(w, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xb1));
+	commit_ok(other);
+	lsdn_context_cleanup(other, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(after.filters == shared.filters);
+
+	/* The virt can not have outbound rules in the block */
+	struct lsdn_vr *vr = lsdn_vr_new(v, 10, LSDN_OUT, &LSDN_VR_DROP);
+	lsdn_vr_add_src_ip(vr, LSDN_MK_IPV4(10, 0, 0, 1));
+	commit_ok(ctx);
+	CHECK(lsdn_context_get_commit_stats(ctx)->ops.remove_virt == 1);
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(after.filters > shared.filters);
+
+	commit_ok(ctx);
+	CHECK(lsdn_context_get_commit_stats(ctx)->nl.filter_msgs == 0);
+
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &after);
+	CHECK(after.qdiscs == 0);
+	CHECK(after.chains == 0);
+	CHECK(after.filters == 0);
+	lsdn_context_free(watch);
+}
+
+/* Adds a local virt connected to the interface b<i> */
+static struct lsdn_virt *add_local_virt(struct lsdn_context *ctx, struct lsdn_net *net, size_t i)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "b%zu", i);
+	lsdn_context_mock_add_link(ctx, name);
+	struct lsdn_virt *v = lsdn_virt_new(net);
+	lsdn_virt_connect(v, lsdn_phys_by_name(ctx, "local"), name);
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x01, i));
+	return v;
+}
+
+/* Filter requests needed to add one more local virt to a network with the given number of them */
+static size_t add_virt_msgs(const char *type, size_t virts)
+{
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	struct lsdn_net *net = lsdn_virt_get_net(build_model(ctx, type, true));
+	for (size_t i = 0; i < virts; i++)
+		add_local_virt(ctx, net, i);
+	commit_ok(ctx);
+	add_local_virt(ctx, net, virts);
+	commit_ok(ctx);
+	size_t msgs = lsdn_context_get_commit_stats(ctx)->nl.filter_msgs;
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	return msgs;
+}
+
+/* Adding a virt costs the same number of filter requests regardless of the network size */
+static void run_broadcast(const char *type)
+{
+	printf("%s, broadcast\n", type);
+	CHECK(add_virt_msgs(type, 2) == add_virt_msgs(type, 8));
+}
+
+static size_t filters(struct lsdn_context *ctx)
+{
+	struct lsdn_mock_state state;
+	lsdn_context_mock_get_state(ctx, &state);
+	return state.filters;
+}
+
+/* The ARP and neighbor discovery responders of the static bridge follow the virt addresses */
+static void run_arp(const char *type)
+{
+	printf("%s, arp\n", type);
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	struct lsdn_net *net = lsdn_virt_get_net(build_model(ctx, type, true));
+	struct lsdn_virt *a = add_local_virt(ctx, net, 0);
+	struct lsdn_virt *b = add_local_virt(ctx, net, 1);
+	commit_ok(ctx);
+	size_t without_ip = filters(ctx);
+
+	/* Each virt answers for itself and gets the answers (source and reply filters) */
+	lsdn_virt_set_ip(a, LSDN_MK_IPV4(10, 0, 0, 1));
+	lsdn_virt_set_ip(b, LSDN_MK_IPV4(10, 0, 0, 2));
+	commit_ok(ctx);
+	CHECK(filters(ctx) == without_ip + 6);
+
+	unsigned int problems = 0;
+	lsdn_virt_set_ip(a, LSDN_MK_IPV4(10, 0, 0, 3));
+	lsdn_virt_set_ip(b, LSDN_MK_IPV4(10, 0, 0, 3));
+	CHECK(lsdn_validate(ctx, ignore_problem, &problems) == LSDNE_VALIDATE && problems > 0);
+	lsdn_virt_clear_ip(b);
+	commit_ok(ctx);
+	CHECK(filters(ctx) == without_ip + 3);
+
+	/* The neighbor solicitations are answered by a single program, each virt is an entry in its
+	 * requester and target maps */
+	struct lsdn_mock_state state;
+	lsdn_virt_set_ip(a, LSDN_MK_IPV6(0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1));
+	lsdn_virt_set_ip(b, LSDN_MK_IPV6(0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2));
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.filters == without_ip + 1);
+	CHECK(state.bpf_maps == 2 && state.bpf_progs == 1);
+	CHECK(state.bpf_map_entries == 4);
+
+	lsdn_virt_clear_ip(b);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.filters == without_ip + 1);
+	CHECK(state.bpf_map_entries == 2);
+
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &state);
+	CHECK(state.filters == 0);
+	CHECK(state.bpf_maps == 0 && state.bpf_progs == 0);
+	lsdn_context_free(watch);
+}
+
+/* With BPF switching, the remote virts of the static bridge are only map entries */
+static void run_bpf(const char *type)
+{
+	struct lsdn_mock_state state, after;
+	struct lsdn_plan *plan;
+	printf("%s, bpf switching\n", type);
+
+	struct lsdn_context *ctx = new_context();
+	lsdn_context_set_bpf_switching(ctx, true);
+	add_links(ctx);
+	struct lsdn_net *net = lsdn_virt_get_net(build_model(ctx, type, false));
+	struct lsdn_phys *remotes[2];
+	for (size_t i = 0; i < 2; i++) {
+		remotes[i] = lsdn_phys_new(ctx);
+		lsdn_phys_attach(remotes[i], net);
+		lsdn_phys_set_iface(remotes[i], "out");
+		lsdn_phys_set_ip(remotes[i], LSDN_MK_IPV4(172, 16, 1, i));
+	}
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	/* The program replaces the filters of the three virts */
+	CHECK(state.bpf_maps == 1 && state.bpf_progs == 1);
+	CHECK(state.bpf_map_entries == 3);
+
+	/* A new remote virt is a single map update, also in the plan */
+	struct lsdn_virt *v = lsdn_virt_new(net);
+	lsdn_virt_connect(v, remotes[0], "v1");
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xb1));
+	lsdn_err_t err = lsdn_commit_plan(ctx, lsdn_problem_stderr_handler, NULL, &plan);
+	CHECK(err == LSDNE_OK);
+	CHECK(plan->count == 1 && plan->ops[0].type == LSDN_PLAN_BPF_UPDATE);
+	CHECK(plan->stats.bpf_calls == 1);
+	lsdn_plan_free(plan);
+	commit_ok(ctx);
+	const struct lsdn_commit_stats *stats = lsdn_context_get_commit_stats(ctx);
+	CHECK(stats->nl.filter_msgs == 0 && stats->nl.bpf_calls == 1);
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(after.bpf_map_entries == 4 && after.filters == state.filters);
+
+	/* Migration to another remote phys */
+	lsdn_virt_connect(v, remotes[1], "v1");
+	commit_ok(ctx);
+	CHECK(stats->nl.filter_msgs == 0 && stats->nl.bpf_calls == 2);
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(after.bpf_map_entries == 4);
+
+	lsdn_virt_free(v);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(after.bpf_map_entries == 3);
+
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &after);
+	CHECK(after.filters == 0);
+	CHECK(after.bpf_maps == 0 && after.bpf_progs == 0);
+	lsdn_context_free(watch);
+}
+
+/* The learning end-to-end networks have a forwarding entry for each remote virt with a MAC */
+static void run_e2e_fdb(const char *type)
+{
+	struct lsdn_mock_state state;
+	printf("%s, remote virt fdb\n", type);
+	/* VXLAN also has a default entry for each remote phys, for broadcasts */
+	size_t defaults = strcmp(type, "vxlan/e2e") ? 0 : 1;
+
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	struct lsdn_net *net = lsdn_virt_get_net(build_model(ctx, type, true));
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.fdb_entries == defaults + 2);
+
+	/* Without a MAC address, the virt is learned */
+	struct lsdn_phys *remotes[2];
+	for (size_t i = 0; i < 2; i++) {
+		remotes[i] = lsdn_phys_new(ctx);
+		lsdn_phys_attach(remotes[i], net);
+		lsdn_phys_set_iface(remotes[i], "out");
+		lsdn_phys_set_ip(remotes[i], LSDN_MK_IPV4(172, 16, 1, i));
+	}
+	struct lsdn_virt *v = lsdn_virt_new(net);
+	lsdn_virt_connect(v, remotes[0], "v1");
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.fdb_entries == 3 * defaults + 2);
+
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xb1));
+	commit_ok(ctx);
+	const struct lsdn_commit_stats *stats = lsdn_context_get_commit_stats(ctx);
+	CHECK(stats->nl.fdb_msgs == 1);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.fdb_entries == 3 * defaults + 3);
+
+	/* Migration moves the entry */
+	lsdn_virt_connect(v, remotes[1], "v1");
+	commit_ok(ctx);
+	CHECK(stats->nl.fdb_msgs == 2);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.fdb_entries == 3 * defaults + 3);
+
+	lsdn_virt_free(v);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.fdb_entries == 3 * defaults + 2);
+
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &state);
+	CHECK(state.fdb_entries == 0);
+	lsdn_context_free(watch);
+}
+
+/* The metadata tunnels share one tunnel key action per remote phys and the virts one policer
+ * per direction */
+static void run_shared_actions(const char *type)
+{
+	struct lsdn_mock_state state;
+	char ifname[32];
+	printf("%s, shared actions\n", type);
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	struct lsdn_virt *first = build_model(ctx, type, false);
+	struct lsdn_net *net = lsdn_virt_get_net(first);
+	commit_ok(ctx);
+	const struct lsdn_commit_stats *stats = lsdn_context_get_commit_stats(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == 1);
+
+	/* All the virts behind a new remote phys share its single tunnel key */
+	struct lsdn_phys *far = lsdn_phys_new(ctx);
+	lsdn_phys_attach(far, net);
+	lsdn_phys_set_iface(far, "out");
+	lsdn_phys_set_ip(far, LSDN_MK_IPV4(172, 16, 0, 3));
+	for (uint8_t i = 0; i < 8; i++) {
+		struct lsdn_virt *v = lsdn_virt_new(net);
+		snprintf(ifname, sizeof(ifname), "v%u", i);
+		lsdn_virt_connect(v, far, ifname);
+		lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x01, i));
+	}
+	commit_ok(ctx);
+	CHECK(stats->nl.action_msgs == 1);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == 2);
+
+	/* A policer for each direction */
+	lsdn_qos_rate_t rate = {1000000, 10000, 0};
+	lsdn_virt_set_rate_in(first, rate);
+	lsdn_virt_set_rate_out(first, rate);
+	commit_ok(ctx);
+	CHECK(stats->nl.action_msgs == 2);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == 4);
+
+	/* The actions are only deleted once no filter uses them */
+	lsdn_virt_clear_rate_in(first);
+	lsdn_virt_clear_rate_out(first);
+	lsdn_phys_free(far);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == 1);
+
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &state);
+	CHECK(state.actions == 0);
+	lsdn_context_free(watch);
+}
+
+/* The model of build_model with one remote virt, the first virt limited to the rate in user */
+static void build_rate_in(struct lsdn_context *ctx, const char *type, const void *user)
+{
+	struct lsdn_virt *first = build_model(ctx, type, false);
+	lsdn_virt_set_rate_in(first, *(const lsdn_qos_rate_t *) user);
+}
+
+/* The actions of two contexts in the same kernel do not collide, even when one reconciles */
+static void run_action_ranges(const char *type)
+{
+	struct lsdn_mock_state state;
+	lsdn_qos_rate_t rate = {1000000, 10000, 0};
+	printf("%s, action ranges\n", type);
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	lsdn_context_mock_add_link(ctx, "w1");
+	lsdn_context_mock_add_link(ctx, "w2");
+	build_rate_in(ctx, type, &rate);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	size_t base = state.actions;
+
+	/* Another application in the same namespace, its policer does not replace ours */
+	struct lsdn_context *other = lsdn_context_new("other");
+	lsdn_context_abort_on_nomem(other);
+	lsdn_context_share_mock_kernel(other, ctx);
+	/* Its metadata tunnel can not receive on our port */
+	struct lsdn_net *net = lsdn_net_new(make_port_settings(other, type, 1), 2);
+	struct lsdn_phys *local = lsdn_phys_new(other);
+	lsdn_phys_attach(local, net);
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_set_ip(local, LSDN_MK_IPV4(172, 16, 0, 1));
+	lsdn_phys_claim_local(local);
+	struct lsdn_virt *v = lsdn_virt_new(net);
+	lsdn_virt_connect(v, local, "w1");
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xb1));
+	lsdn_virt_set_rate_in(v, rate);
+	commit_ok(other);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == base + 1);
+
+	/* Reconciling after a restart keeps the actions of the other application */
+	ctx = restart_reconcile(ctx, type, build_rate_in, &rate, &state);
+	CHECK(state.actions == base + 1);
+
+	/* A context with the same range (here the same name) fails instead of replacing them */
+	struct lsdn_context *twin = lsdn_context_new("ls");
+	lsdn_context_abort_on_nomem(twin);
+	lsdn_context_share_mock_kernel(twin, ctx);
+	net = lsdn_net_new(lsdn_settings_new_direct(twin), 3);
+	local = lsdn_phys_new(twin);
+	lsdn_phys_attach(local, net);
+	lsdn_phys_set_iface(local, "out");
+	lsdn_phys_claim_local(local);
+	v = lsdn_virt_new(net);
+	lsdn_virt_connect(v, local, "w2");
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xb2));
+	lsdn_virt_set_rate_in(v, rate);
+	unsigned int problems = 0;
+	CHECK(lsdn_commit(twin, ignore_problem, &problems) != LSDNE_OK);
+	CHECK(lsdn_context_get_commit_stats(twin)->nl.errors > 0);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == base + 1);
+	/* Without the policer, the twin commits and cleans up, leaving our policer alone */
+	lsdn_virt_clear_rate_in(v);
+	commit_ok(twin);
+	lsdn_context_cleanup(twin, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == base + 1);
+
+	lsdn_context_cleanup(other, lsdn_problem_stderr_handler, NULL);
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &state);
+	CHECK(state.actions == 0);
+	lsdn_context_free(watch);
+}
+
+/* The aggregate rate of a network or a phys is a single policer for all its virts, replaced
+ * in place when the rate changes */
+static void run_aggregate_rates(const char *type)
+{
+	struct lsdn_mock_state state;
+	unsigned int problems = 0;
+	printf("%s, aggregate rates\n", type);
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	struct lsdn_virt *first = build_model(ctx, type, false);
+	struct lsdn_net *net = lsdn_virt_get_net(first);
+	struct lsdn_phys *local = lsdn_phys_by_name(ctx, "local");
+	for (size_t i = 0; i < 4; i++)
+		add_local_virt(ctx, net, i);
+	commit_ok(ctx);
+	const struct lsdn_commit_stats *stats = lsdn_context_get_commit_stats(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	size_t base = state.actions;
+
+	/* All the local virts share one policer */
+	lsdn_qos_rate_t rate = {1000000, 10000, 0};
+	lsdn_net_set_rate_in(net, rate);
+	commit_ok(ctx);
+	CHECK(stats->nl.action_msgs == 1);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == base + 1);
+
+	/* Changing the rate only replaces the policer */
+	rate.avg_rate = 2000000;
+	lsdn_net_set_rate_in(net, rate);
+	commit_ok(ctx);
+	CHECK(stats->nl.action_msgs == 1);
+	CHECK(stats->nl.filter_msgs == 0);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == base + 1);
+
+	/* The phys and the virt's own rates are chained after it */
+	lsdn_phys_set_rate_out(local, rate);
+	lsdn_virt_set_rate_in(first, rate);
+	commit_ok(ctx);
+	CHECK(stats->nl.action_msgs == 2);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == base + 3);
+
+	/* An invalid rate is reported on the network */
+	lsdn_qos_rate_t bad_rate = {0, 10000, 0};
+	lsdn_net_set_rate_out(net, bad_rate);
+	CHECK(lsdn_commit(ctx, ignore_problem, &problems) == LSDNE_VALIDATE);
+	CHECK(problems == 1);
+	lsdn_net_clear_rate_out(net);
+
+	lsdn_net_clear_rate_in(net);
+	lsdn_phys_clear_rate_out(local);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.actions == base + 1);
+
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &state);
+	CHECK(state.actions == 0);
+	lsdn_context_free(watch);
+}
+
+/* A virt in the shaping mode gets a shaper qdisc instead of a policer, set either on the virt
+ * or on the network settings */
+static void run_shaping(const char *type, bool clsact)
+{
+	struct lsdn_mock_state state;
+	printf("%s, shaping%s\n", type, clsact ? ", clsact" : "");
+	struct lsdn_context *ctx = new_context();
+	lsdn_context_set_clsact(ctx, clsact);
+	add_links(ctx);
+	struct lsdn_virt *first = build_model(ctx, type, false);
+	struct lsdn_settings *settings = lsdn_net_get_settings(lsdn_virt_get_net(first));
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	size_t base_qdiscs = state.qdiscs;
+	size_t base_actions = state.actions;
+	CHECK(state.classes == 0);
+
+	/* The shaper is a HTB qdisc with a single class and a fq_codel leaf, no policer */
+	lsdn_qos_rate_t rate = {1000000, 10000, 0};
+	lsdn_virt_set_rate_in(first, rate);
+	lsdn_virt_set_qos_mode(first, LSDN_QOS_SHAPE);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.qdiscs == base_qdiscs + 2);
+	CHECK(state.classes == 1);
+	CHECK(state.actions == base_actions);
+
+	/* Switching to policing removes the shaper */
+	lsdn_virt_set_qos_mode(first, LSDN_QOS_POLICE);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.qdiscs == base_qdiscs);
+	CHECK(state.classes == 0);
+	CHECK(state.actions == base_actions + 1);
+
+	/* The virts in the default mode follow the settings */
+	lsdn_virt_set_qos_mode(first, LSDN_QOS_DEFAULT);
+	lsdn_settings_set_qos_mode(settings, LSDN_QOS_SHAPE);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.qdiscs == base_qdiscs + 2);
+	CHECK(state.classes == 1);
+	CHECK(state.actions == base_actions);
+
+	/* Changing the rate replaces the shaper */
+	rate.avg_rate = 2000000;
+	lsdn_virt_set_rate_in(first, rate);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.qdiscs == base_qdiscs + 2);
+	CHECK(state.classes == 1);
+
+	lsdn_virt_clear_rate_in(first);
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &state);
+	CHECK(state.qdiscs == base_qdiscs);
+	CHECK(state.classes == 0);
+
+	lsdn_virt_set_rate_in(first, rate);
+	commit_ok(ctx);
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &state);
+	CHECK(state.qdiscs == 0);
+	CHECK(state.classes == 0);
+	lsdn_context_free(watch);
+}
+
+/* The model of build_model with two remote virts on the VLAN bridge */
+static void build_vlan_bridge(struct lsdn_context *ctx, const char *type, const void *user)
+{
+	LSDN_UNUSED(user);
+	lsdn_context_set_vlan_bridge(ctx, true);
+	build_model(ctx, type, true);
+}
+
+/* The learning VXLAN networks share a single VLAN-aware bridge and tunnel */
+static void run_vlan_bridge(const char *type)
+{
+	struct lsdn_mock_state classic[3], shared[3], par[3], before, after;
+	printf("%s, %d networks, VLAN bridge\n", type, NETS);
+	run_nets(type, 0, false, classic);
+	run_nets(type, 0, true, shared);
+	/* A bridge and a tunnel for all the networks, instead of a pair for each */
+	CHECK(classic[0].links == 1 + 2 * NETS + 2 * NETS);
+	CHECK(shared[0].links == 1 + 2 * NETS + 2);
+	CHECK(classic[0].vlans == 0);
+	/* The tunnel port and the two local virts of each network are in its VLAN */
+	CHECK(shared[1].vlans == 3 * NETS);
+	CHECK(shared[1].vlan_tunnels == NETS);
+	/* The multicast networks point their VNI to the group */
+	size_t flood = strcmp(type, "vxlan/mcast") ? 0 : NETS;
+	CHECK(shared[1].fdb_entries == classic[1].fdb_entries + flood);
+	run_nets(type, 3, true, par);
+	CHECK(memcmp(shared, par, sizeof(shared)) == 0);
+
+	/* The bridge, the tunnel and the VLANs are adopted after a restart */
+	struct lsdn_context *ctx = start(type, build_vlan_bridge, NULL, &before);
+	ctx = restart_reconcile(ctx, type, build_vlan_bridge, NULL, &after);
+	check_same_objects(&before, &after);
+
+	/* Other settings on the same port use the same tunnel, the kernel has only one for a port */
+	struct lsdn_phys *local = lsdn_phys_by_name(ctx, "local");
+	lsdn_context_mock_add_link(ctx, "w1");
+	struct lsdn_net *net = lsdn_net_new(make_settings(ctx, type), 2);
+	lsdn_phys_attach(local, net);
+	struct lsdn_virt *v = lsdn_virt_new(net);
+	lsdn_virt_connect(v, local, "w1");
+	lsdn_virt_set_mac(v, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xb1));
+	commit_ok(ctx);
+	lsdn_context_mock_get_state(ctx, &after);
+	CHECK(after.links == before.links + 1);
+	CHECK(after.vlan_tunnels == before.vlan_tunnels + 1);
+
+	/* Settings of the other learning type can not share it, the new network conflicts with both */
+	struct lsdn_settings *other = make_settings(
+		ctx, strcmp(type, "vxlan/mcast") ? "vxlan/mcast" : "vxlan/e2e");
+	net = lsdn_net_new(other, 3);
+	lsdn_phys_attach(local, net);
+	unsigned int problems = 0;
+	CHECK(lsdn_validate(ctx, ignore_problem, &problems) == LSDNE_VALIDATE);
+	CHECK(problems == 4);
+	lsdn_settings_free(other);
+	commit_ok(ctx);
+
+	struct lsdn_context *watch = new_context();
+	lsdn_context_share_mock_kernel(watch, ctx);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+	lsdn_context_mock_get_state(watch, &after);
+	CHECK(after.links == 4);
+	CHECK(after.fdb_entries == 0);
+	CHECK(after.vlans == 0);
+	lsdn_context_free(watch);
+}
+
+/* The model of build_model with two remote virts, its tunnels tuned by the options in user */
+static void build_tunnel_opts(struct lsdn_context *ctx, const char *type, const void *user)
+{
+	struct lsdn_virt *first = build_model(ctx, type, true);
+	lsdn_settings_set_tunnel_opts(lsdn_net_get_settings(lsdn_virt_get_net(first)), user);
+}
+
+/* The tunnels with the same options are adopted after a restart, those with different ones
+ * replaced */
+static void run_tunnel_opts(const char *type)
+{
+	struct lsdn_mock_state before, after;
+	struct lsdn_tunnel_opts opts = {
+		.udp_csum = LSDN_TUNNEL_FLAG_OFF,
+		.ttl = 64,
+		.df = LSDN_TUNNEL_DF_SET,
+		.txqueuelen = 10000,
+		.gso_max_size = 65536
+	};
+	printf("%s, tunnel options\n", type);
+	struct lsdn_context *ctx = start(type, build_tunnel_opts, &opts, &before);
+
+	/* The same options, the tunnel is adopted */
+	ctx = restart_reconcile(ctx, type, build_tunnel_opts, &opts, &after);
+	check_same_objects(&before, &after);
+
+	/* The generic link attributes are not compared */
+	opts.txqueuelen = 500;
+	ctx = restart_reconcile(ctx, type, build_tunnel_opts, &opts, &after);
+	CHECK(after.links_created == before.links_created);
+
+	/* A different TTL replaces the tunnel */
+	opts.ttl = 32;
+	ctx = restart_reconcile(ctx, type, build_tunnel_opts, &opts, &after);
+	CHECK(after.links == before.links);
+	CHECK(after.links_created > before.links_created);
+
+	/* So does the DF flag set back to the default */
+	before = after;
+	opts.df = LSDN_TUNNEL_DF_DEFAULT;
+	ctx = restart_reconcile(ctx, type, build_tunnel_opts, &opts, &after);
+	CHECK(after.links == before.links);
+	CHECK(after.links_created > before.links_created);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+}
+
+static void count_problem(const struct lsdn_problem *problem, void *user)
+{
+	LSDN_UNUSED(problem);
+	(*(size_t *) user)++;
+}
+
+/* A new virt with the MAC address of a committed one is reported from both sides */
+static void run_duplicate_mac(const char *type)
+{
+	size_t problems = 0;
+	printf("%s, duplicate MAC\n", type);
+	struct lsdn_context *ctx = new_context();
+	add_links(ctx);
+	lsdn_context_mock_add_link(ctx, "v3");
+	struct lsdn_virt *first = build_model(ctx, type, false);
+	commit_ok(ctx);
+
+	/* Only the new virt is changed, but both of them are reported */
+	struct lsdn_net *net = lsdn_virt_get_net(first);
+	struct lsdn_virt *dup = lsdn_virt_new(net);
+	lsdn_virt_connect(dup, lsdn_phys_by_name(ctx, "local"), "v3");
+	lsdn_virt_set_mac(dup, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa1));
+	CHECK(lsdn_validate(ctx, count_problem, &problems) == LSDNE_VALIDATE);
+	CHECK(problems == 2);
+
+	problems = 0;
+	lsdn_virt_set_mac(dup, LSDN_MK_MAC(0x00, 0x00, 0x00, 0x00, 0x00, 0xa5));
+	CHECK(lsdn_validate(ctx, count_problem, &problems) == LSDNE_OK);
+	CHECK(problems == 0);
+	lsdn_context_cleanup(ctx, lsdn_problem_stderr_handler, NULL);
+}
+
+int main(int argc, const char* argv[])
+{
+	CHECK(argc == 1);
+	const char *types[] = {
+		"vlan", "vxlan/e2e", "vxlan/static", "vxlan/mcast", "geneve", "geneve/e2e", "direct"
+	};
+	for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++)
+		run(types[i]);
+	/* The direct network type does not support multiple networks */
+	for (size_t i = 0; i < sizeof(types) / sizeof(*types) - 1; i++)
+		run_parallel(types[i]);
+	for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++)
+		run_reconcile(types[i]);
+	for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++)
+		run_plan(types[i]);
+	for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++)
+		run_versioned(types[i]);
+	run_batch();
+	run_deferred_filters();
+	/* Only the static bridge networks share blocks */
+	run_blocks("vxlan/static");
+	run_blocks("geneve");
+	for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++)
+		run_broadcast(types[i]);
+	/* Only the static bridge networks answer ARP */
+	run_arp("vxlan/static");
+	run_arp("geneve");
+	run_bpf("vxlan/static");
+	run_bpf("geneve");
+	run_e2e_fdb("vxlan/e2e");
+	run_e2e_fdb("geneve/e2e");
+	/* Only the metadata tunnels have tunnel keys */
+	run_shared_actions("vxlan/static");
+	run_shared_actions("geneve");
+	run_shared_actions("geneve/e2e");
+	run_action_ranges("vlan");
+	run_action_ranges("vxlan/static");
+	run_aggregate_rates("vlan");
+	run_aggregate_rates("vxlan/static");
+	run_shaping("vlan", false);
+	run_shaping("vlan", true);
+	run_shaping("vxlan/static", false);
+	run_shaping("vxlan/static", true);
+	/* Only the learning VXLAN networks share the VLAN-aware bridge */
+	run_vlan_bridge("vxlan/e2e");
+	run_vlan_bridge("vxlan/mcast");
+	/* The other network types have no tunnel interfaces */
+	run_tunnel_opts("vxlan/e2e");
+	run_tunnel_opts("vxlan/static");
+	run_tunnel_opts("vxlan/mcast");
+	run_tunnel_opts("geneve");
+	run_tunnel_opts("geneve/e2e");
+	run_duplicate_mac("vxlan/static");
+	return 0;
+}